@@ -0,0 +1,579 @@
+/**
+ * @file src/crlindex.cc
+ * Revoked certs from CRLs, compiled into a shared lookup table
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<stdint.h>
+#include<string.h>
+#include<ctype.h>
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<dirent.h>
+#include<sys/stat.h>
+
+#include<algorithm>
+#include<map>
+
+#include<openssl/err.h>
+#include<openssl/pem.h>
+#include<openssl/sha.h>
+
+#include"crlindex.h"
+#include"errbase.h"
+
+/** Bytes of SHA-256 kept as a key. */
+static const size_t KEY_LEN = 16;
+
+static const char MAGIC[8] = { 't', 'l', 's', 's', 'h', 'c', 'r', 'l' };
+
+/** Layout of the shared memory segment: the header, 'issuers' Issuer
+ * structs, then a hash table of 'buckets' Entry structs. */
+struct CRLIndex::Header {
+        char magic[8];
+        uint32_t issuers;
+        uint32_t buckets;     // power of two, at least one always free
+        uint64_t entries;
+};
+
+/** One CA that has a CRL. Keyed by hash of its DER encoded name. */
+struct CRLIndex::Issuer {
+        unsigned char name[KEY_LEN];
+        int64_t last_update;
+        int64_t next_update;  // 0 if the CRL doesn't say
+};
+
+/** One revoked cert. Keyed by hash of DER encoded issuer name and
+ * serial. The last bit is always set, so all zeroes is a free bucket. */
+struct CRLIndex::Entry {
+        unsigned char key[KEY_LEN];
+};
+
+namespace {
+/** CRLs read from file, freed when done. */
+struct CRLList {
+        std::vector<std::pair<std::string, X509_CRL*> > crls;
+        ~CRLList()
+        {
+                for (size_t c = 0; c < crls.size(); c++) {
+                        X509_CRL_free(crls[c].second);
+                }
+        }
+};
+
+/**
+ *
+ */
+std::string
+name_der(X509_NAME *name)
+{
+        unsigned char *buf = NULL;
+        int len = i2d_X509_NAME(name, &buf);
+        if (len <= 0) {
+                THROW(Err::ErrBase, "i2d_X509_NAME() failed");
+        }
+        std::string ret((char*)buf, len);
+        OPENSSL_free(buf);
+        return ret;
+}
+
+/**
+ *
+ */
+std::string
+serial_der(const ASN1_INTEGER *serial)
+{
+        unsigned char *buf = NULL;
+        int len = i2d_ASN1_INTEGER(const_cast<ASN1_INTEGER*>(serial), &buf);
+        if (len <= 0) {
+                THROW(Err::ErrBase, "i2d_ASN1_INTEGER() failed");
+        }
+        std::string ret((char*)buf, len);
+        OPENSSL_free(buf);
+        return ret;
+}
+
+/**
+ * Truncated SHA-256 of a and b. Both are DER, so there's no ambiguity
+ * in where one ends.
+ */
+void
+make_key(const std::string &a, const std::string &b, unsigned char *key)
+{
+        const std::string data(a + b);
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char*)data.data(), data.size(), md);
+        memcpy(key, md, KEY_LEN);
+        key[KEY_LEN - 1] |= 1;
+}
+
+/**
+ * @return  Seconds since the epoch, or 0 for NULL
+ */
+int64_t
+asn1_time(const ASN1_TIME *t, const std::string &what)
+{
+        if (!t) {
+                return 0;
+        }
+        ASN1_TIME *epoch = ASN1_TIME_set(NULL, 0);
+        int day, sec;
+        int ok = ASN1_TIME_diff(&day, &sec, epoch, t);
+        ASN1_TIME_free(epoch);
+        if (!ok) {
+                THROW(Err::ErrBase, "Bad time in CRL " + what);
+        }
+        return (int64_t)day * 86400 + sec;
+}
+
+/**
+ * OpenSSL hashed directory name for a CRL: 8 hex digits, ".r", digits.
+ */
+bool
+is_crl_name(const char *name)
+{
+        int c;
+        for (c = 0; c < 8; c++) {
+                if (!isxdigit((unsigned char)name[c])) {
+                        return false;
+                }
+        }
+        if (strncmp(name + 8, ".r", 2) || !name[10]) {
+                return false;
+        }
+        for (c = 10; name[c]; c++) {
+                if (!isdigit((unsigned char)name[c])) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Read all CRLs in a file, PEM or DER.
+ */
+void
+read_crls(const std::string &path, CRLList *out)
+{
+        BIO *bio = BIO_new_file(path.c_str(), "r");
+        if (!bio) {
+                THROW(Err::ErrBase, "Can't open CRL " + path);
+        }
+        size_t before = out->crls.size();
+        X509_CRL *crl;
+        while ((crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL))) {
+                out->crls.push_back(std::make_pair(path, crl));
+        }
+        if (out->crls.size() == before) {
+                if (!BIO_reset(bio)
+                    && (crl = d2i_X509_CRL_bio(bio, NULL))) {
+                        out->crls.push_back(std::make_pair(path, crl));
+                }
+        }
+        BIO_free(bio);
+        ERR_clear_error();
+        if (out->crls.size() == before) {
+                THROW(Err::ErrBase, "No CRL in " + path);
+        }
+}
+
+/**
+ * True if one of the CA certs with the CRL's issuer name signed it.
+ */
+bool
+verify_crl(X509_STORE *store, X509_CRL *crl)
+{
+        bool ok = false;
+        X509_STORE_CTX *sctx = X509_STORE_CTX_new();
+        if (!sctx) {
+                return false;
+        }
+        if (X509_STORE_CTX_init(sctx, store, NULL, NULL)) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                STACK_OF(X509) *certs =
+                        X509_STORE_CTX_get1_certs(sctx,
+                                                  X509_CRL_get_issuer(crl));
+#else
+                STACK_OF(X509) *certs =
+                        X509_STORE_get1_certs(sctx, X509_CRL_get_issuer(crl));
+#endif
+                for (int c = 0; certs && !ok && c < sk_X509_num(certs); c++) {
+                        EVP_PKEY *pkey = X509_get_pubkey(sk_X509_value(certs,
+                                                                      c));
+                        ok = pkey && 1 == X509_CRL_verify(crl, pkey);
+                        EVP_PKEY_free(pkey);
+                }
+                sk_X509_pop_free(certs, X509_free);
+        }
+        X509_STORE_CTX_free(sctx);
+        ERR_clear_error();
+        return ok;
+}
+} // namespace
+
+/**
+ *
+ */
+CRLIndex::CRLIndex()
+        :shm_(NULL)
+{
+}
+
+/**
+ *
+ */
+CRLIndex::~CRLIndex()
+{
+        detach();
+}
+
+/**
+ * Parse the CRLs and build a new table. If that fails the old table,
+ * if any, is kept.
+ *
+ * @param[in] crl     CRL file, or hashed directory of CRLs
+ * @param[in] cafile  File with the CA certs that sign CRLs, or ""
+ * @param[in] capath  Hashed directory of such CA certs, or ""
+ */
+void
+CRLIndex::create(const std::string &crl, const std::string &cafile,
+                 const std::string &capath)
+{
+        std::vector<Source> sources;
+        CRLList crls;
+        struct stat st;
+
+        if (stat(crl.c_str(), &st)) {
+                THROW(Err::ErrSys, "stat(" + crl + ")");
+        }
+        Source src;
+        src.path = crl;
+        src.mtime = st.st_mtime;
+        sources.push_back(src);
+        if (!S_ISDIR(st.st_mode)) {
+                read_crls(crl, &crls);
+        } else {
+                DIR *dir = opendir(crl.c_str());
+                if (!dir) {
+                        THROW(Err::ErrSys, "opendir(" + crl + ")");
+                }
+                std::vector<std::string> names;
+                struct dirent *ent;
+                while ((ent = readdir(dir))) {
+                        if (is_crl_name(ent->d_name)) {
+                                names.push_back(ent->d_name);
+                        }
+                }
+                closedir(dir);
+                std::sort(names.begin(), names.end());
+                for (size_t c = 0; c < names.size(); c++) {
+                        src.path = crl + "/" + names[c];
+                        if (stat(src.path.c_str(), &st)) {
+                                THROW(Err::ErrSys, "stat(" + src.path + ")");
+                        }
+                        src.mtime = st.st_mtime;
+                        sources.push_back(src);
+                        read_crls(src.path, &crls);
+                }
+                if (crls.crls.empty()) {
+                        THROW(Err::ErrBase, "No CRLs in " + crl);
+                }
+        }
+
+        // check signatures
+        X509_STORE *store = X509_STORE_new();
+        if (!store) {
+                THROW(Err::ErrBase, "X509_STORE_new() failed");
+        }
+        if (!X509_STORE_load_locations(store,
+                                       cafile.empty() ? NULL : cafile.c_str(),
+                                       capath.empty() ? NULL : capath.c_str())) {
+                X509_STORE_free(store);
+                ERR_clear_error();
+                THROW(Err::ErrBase, "Can't load CA certs for checking CRLs");
+        }
+        for (size_t c = 0; c < crls.crls.size(); c++) {
+                if (!verify_crl(store, crls.crls[c].second)) {
+                        X509_STORE_free(store);
+                        THROW(Err::ErrBase, "CRL in " + crls.crls[c].first
+                              + " is not signed by any of the CA certs");
+                }
+        }
+        X509_STORE_free(store);
+
+        // collect issuers and revoked serials
+        typedef std::map<std::string, Issuer> issuers_t;
+        issuers_t issuers;
+        std::vector<Entry> entries;
+        for (size_t c = 0; c < crls.crls.size(); c++) {
+                const std::string &path(crls.crls[c].first);
+                X509_CRL *x = crls.crls[c].second;
+                const std::string issuer(name_der(X509_CRL_get_issuer(x)));
+                Issuer is;
+                make_key(issuer, "", is.name);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                is.last_update = asn1_time(X509_CRL_get0_lastUpdate(x), path);
+                is.next_update = asn1_time(X509_CRL_get0_nextUpdate(x), path);
+#else
+                is.last_update = asn1_time(X509_CRL_get_lastUpdate(x), path);
+                is.next_update = asn1_time(X509_CRL_get_nextUpdate(x), path);
+#endif
+                // with more than one CRL from a CA, the newest one says
+                // how long they're valid. Serials from all are revoked.
+                issuers_t::iterator itr = issuers.find(issuer);
+                if (itr == issuers.end()
+                    || itr->second.last_update < is.last_update) {
+                        issuers[issuer] = is;
+                }
+
+                STACK_OF(X509_REVOKED) *revoked = X509_CRL_get_REVOKED(x);
+                for (int r = 0; r < sk_X509_REVOKED_num(revoked); r++) {
+                        X509_REVOKED *rev = sk_X509_REVOKED_value(revoked, r);
+                        Entry e;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                        make_key(issuer,
+                                 serial_der(X509_REVOKED_get0_serialNumber(rev)),
+                                 e.key);
+#else
+                        make_key(issuer, serial_der(rev->serialNumber), e.key);
+#endif
+                        entries.push_back(e);
+                }
+        }
+
+        // lay out segment
+        uint32_t buckets = 16;
+        while (buckets < 2 * entries.size() + 1) {
+                buckets *= 2;
+        }
+        const size_t size = sizeof(Header)
+                + issuers.size() * sizeof(Issuer)
+                + buckets * sizeof(Entry);
+        SharedSegment seg;
+        Header *hdr = (Header*)seg.create("tlsshd-crl", size);
+        memcpy(hdr->magic, MAGIC, sizeof(MAGIC));
+        hdr->issuers = issuers.size();
+        hdr->buckets = buckets;
+        Issuer *is = (Issuer*)(hdr + 1);
+        for (issuers_t::const_iterator itr = issuers.begin();
+             itr != issuers.end();
+             ++itr) {
+                *is++ = itr->second;
+        }
+        Entry *table = (Entry*)is;
+        for (size_t c = 0; c < entries.size(); c++) {
+                uint64_t h;
+                memcpy(&h, entries[c].key, sizeof(h));
+                for (h &= buckets - 1; ; h = (h + 1) & (buckets - 1)) {
+                        if (!memcmp(table[h].key, entries[c].key, KEY_LEN)) {
+                                break;  // on more than one CRL
+                        }
+                        if (!table[h].key[KEY_LEN - 1]) {
+                                table[h] = entries[c];
+                                hdr->entries++;
+                                break;
+                        }
+                }
+        }
+        seg.protect();
+
+        detach();
+        seg_.swap(seg);
+        shm_ = hdr;
+        crl_ = crl;
+        cafile_ = cafile;
+        capath_ = capath;
+        sources_.swap(sources);
+}
+
+/**
+ * Rebuild the table if the CRL file, the CRL directory or any CRL in
+ * it has changed since create(). If that fails the old table is kept.
+ *
+ * @return  true if rebuilt
+ */
+bool
+CRLIndex::refresh()
+{
+        if (crl_.empty()) {
+                return false;
+        }
+        bool changed = false;
+        for (size_t c = 0; !changed && c < sources_.size(); c++) {
+                struct stat st;
+                changed = stat(sources_[c].path.c_str(), &st)
+                        || st.st_mtime != sources_[c].mtime;
+        }
+        if (!changed) {
+                return false;
+        }
+        // copies, as create() starts by clearing the members
+        const std::string crl(crl_), cafile(cafile_), capath(capath_);
+        create(crl, cafile, capath);
+        return true;
+}
+
+/**
+ * Map a table built by create() in another process. It can't be
+ * refresh()ed.
+ *
+ * @param[in] fd  From get_fd() of the creator. Taken over.
+ */
+void
+CRLIndex::attach(int fd)
+{
+        detach();
+        shm_ = (Header*)seg_.attach(fd, sizeof(Header), false);
+        if (memcmp(shm_->magic, MAGIC, sizeof(MAGIC))
+            || !shm_->buckets
+            || (shm_->buckets & (shm_->buckets - 1))
+            || seg_.size() < sizeof(Header)
+            + (size_t)shm_->issuers * sizeof(Issuer)
+            + (size_t)shm_->buckets * sizeof(Entry)) {
+                detach();
+                THROW(Err::ErrBase, "CRL segment is broken");
+        }
+}
+
+/**
+ * Unmap and close.
+ */
+void
+CRLIndex::detach()
+{
+        seg_.detach();
+        shm_ = NULL;
+        crl_.clear();
+        sources_.clear();
+}
+
+/**
+ * Swap tables (and file names) with another CRLIndex. For building a
+ * new one on the side and then replacing the one in use.
+ */
+void
+CRLIndex::swap(CRLIndex &other)
+{
+        seg_.swap(other.seg_);
+        std::swap(shm_, other.shm_);
+        crl_.swap(other.crl_);
+        cafile_.swap(other.cafile_);
+        capath_.swap(other.capath_);
+        sources_.swap(other.sources_);
+}
+
+/**
+ * @return  Number of revoked certs
+ */
+unsigned long
+CRLIndex::size() const
+{
+        return shm_ ? (unsigned long)shm_->entries : 0;
+}
+
+/**
+ * @return  Number of CAs with a CRL
+ */
+unsigned
+CRLIndex::issuers() const
+{
+        return shm_ ? shm_->issuers : 0;
+}
+
+/**
+ *
+ */
+const CRLIndex::Issuer *
+CRLIndex::find_issuer(const std::string &name) const
+{
+        unsigned char key[KEY_LEN];
+        make_key(name, "", key);
+        const Issuer *is = (const Issuer*)(shm_ + 1);
+        for (uint32_t c = 0; c < shm_->issuers; c++) {
+                if (!memcmp(is[c].name, key, KEY_LEN)) {
+                        return &is[c];
+                }
+        }
+        return NULL;
+}
+
+/**
+ *
+ */
+const CRLIndex::Entry *
+CRLIndex::find(const Entry &key) const
+{
+        const Entry *table = (const Entry*)((const Issuer*)(shm_ + 1)
+                                            + shm_->issuers);
+        const uint32_t mask = shm_->buckets - 1;
+        uint64_t h;
+        memcpy(&h, key.key, sizeof(h));
+        for (h &= mask; table[h].key[KEY_LEN - 1]; h = (h + 1) & mask) {
+                if (!memcmp(table[h].key, key.key, KEY_LEN)) {
+                        return &table[h];
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Check one cert against the CRL of the CA that issued it.
+ *
+ * @param[in] cert  Cert to check
+ * @param[in] now   Current time
+ *
+ * @return X509_V_OK, or why not: X509_V_ERR_CERT_REVOKED,
+ *         X509_V_ERR_UNABLE_TO_GET_CRL (no CRL from that CA),
+ *         X509_V_ERR_CRL_NOT_YET_VALID or X509_V_ERR_CRL_HAS_EXPIRED
+ */
+int
+CRLIndex::check(X509 *cert, time_t now) const
+{
+        if (!shm_) {
+                return X509_V_ERR_UNABLE_TO_GET_CRL;
+        }
+        const std::string issuer(name_der(X509_get_issuer_name(cert)));
+        const Issuer *is = find_issuer(issuer);
+        if (!is) {
+                return X509_V_ERR_UNABLE_TO_GET_CRL;
+        }
+        if (now < is->last_update) {
+                return X509_V_ERR_CRL_NOT_YET_VALID;
+        }
+        if (is->next_update && now > is->next_update) {
+                return X509_V_ERR_CRL_HAS_EXPIRED;
+        }
+        Entry e;
+        make_key(issuer, serial_der(X509_get_serialNumber(cert)), e.key);
+        if (find(e)) {
+                return X509_V_ERR_CERT_REVOKED;
+        }
+        return X509_V_OK;
+}
+
+/**
+ * When the CRL that check() uses for a cert runs out.
+ *
+ * @param[in] cert  Cert that would be checked
+ *
+ * @return nextUpdate of the issuer's CRL, 0 if that doesn't say or
+ *         there's no CRL from that CA
+ */
+time_t
+CRLIndex::next_update(X509 *cert) const
+{
+        if (!shm_) {
+                return 0;
+        }
+        const Issuer *is = find_issuer(name_der(X509_get_issuer_name(cert)));
+        return is ? (time_t)is->next_update : 0;
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
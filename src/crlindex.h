@@ -0,0 +1,92 @@
+// -*- c++ -*-
+/**
+ * @file src/crlindex.h
+ * Revoked certs from CRLs, compiled into a shared lookup table
+ */
+#ifndef __INCLUDE_CRLINDEX_H__
+#define __INCLUDE_CRLINDEX_H__
+
+#include<time.h>
+
+#include<string>
+#include<vector>
+
+#include<openssl/x509.h>
+
+#include"sharedsegment.h"
+
+/**
+ * CRLs parsed once and compiled into a hash table of revoked
+ * (issuer, serial) pairs.
+ *
+ * A CRL with tens of thousands of entries takes a while to parse, so
+ * the listener does that once and every sslproc just looks the peer
+ * cert up. The table lives in one read-only shared memory segment,
+ * inherited by fork()ed children. If it's backed by an fd it can also
+ * be attach()ed by a process that was exec()ed instead.
+ *
+ * The CRL can be a file with one or more CRLs (PEM or DER), or a
+ * hashed directory like the one used for CA certs, where the CRLs are
+ * in files called <hash>.r0, <hash>.r1 and so on. Each CRL must be
+ * signed by a cert from cafile or capath, or create() fails.
+ *
+ * refresh() rebuilds the table if any of the files has changed.
+ * Processes that already have a copy keep using it.
+ *
+ @code
+ CRLIndex crl;
+ crl.create("/etc/tlssh/ClientCRL.pem", "/etc/tlssh/ClientCA.crt", "");
+ ...
+ if (X509_V_OK != crl.check(cert, time(0))) {
+         ...
+ }
+ @endcode
+ */
+class CRLIndex {
+public:
+        CRLIndex();
+        ~CRLIndex();
+
+        void create(const std::string &crl, const std::string &cafile,
+                    const std::string &capath);
+        bool refresh();
+        void attach(int fd);
+        void detach();
+        void swap(CRLIndex &other);
+        bool valid() const { return shm_ != NULL; }
+        int get_fd() const { return seg_.get_fd(); }
+        unsigned long size() const;
+        unsigned issuers() const;
+
+        int check(X509 *cert, time_t now) const;
+        time_t next_update(X509 *cert) const;
+
+private:
+        struct Header;
+        struct Issuer;
+        struct Entry;
+        struct Source {
+                std::string path;
+                time_t mtime;
+        };
+
+        SharedSegment seg_;
+        Header *shm_;
+        std::string crl_;
+        std::string cafile_;
+        std::string capath_;
+        std::vector<Source> sources_;
+
+        const Issuer *find_issuer(const std::string &name) const;
+        const Entry *find(const Entry &key) const;
+
+        CRLIndex(const CRLIndex&);
+        CRLIndex &operator=(const CRLIndex&);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
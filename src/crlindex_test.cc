@@ -0,0 +1,205 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<utime.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+#include<sys/stat.h>
+
+#include<gtest/gtest.h>
+#include<openssl/pem.h>
+
+#include"crlindex.h"
+#include"errbase.h"
+
+namespace {
+X509*
+load_cert(const char *fn)
+{
+  FILE *f = fopen(fn, "r");
+  if (!f) {
+    return NULL;
+  }
+  X509 *x = PEM_read_X509(f, NULL, NULL, NULL);
+  fclose(f);
+  return x;
+}
+
+void
+copy_file(const std::string &from, const std::string &to)
+{
+  ASSERT_EQ(0, system(("cp " + from + " " + to).c_str()));
+}
+
+std::string
+hashed_name(X509 *x, const char *ext)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%08lx.%s",
+           X509_NAME_hash(X509_get_subject_name(x)), ext);
+  return buf;
+}
+}
+
+class CRLIndexTest: public ::testing::Test {
+protected:
+  X509 *ca_, *good_, *revoked_, *other_;
+  std::string dir_;
+
+  void SetUp()
+  {
+    ca_ = load_cert("src/testdata/crlca.crt");
+    good_ = load_cert("src/testdata/crlgood.crt");
+    revoked_ = load_cert("src/testdata/crlrevoked.crt");
+    other_ = load_cert("src/testdata/client.crt");
+    ASSERT_TRUE(ca_ && good_ && revoked_ && other_);
+    char tmpl[] = "/tmp/crlindex_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+    dir_ = tmpl;
+  }
+  void TearDown()
+  {
+    X509_free(ca_);
+    X509_free(good_);
+    X509_free(revoked_);
+    X509_free(other_);
+    system(("rm -rf " + dir_).c_str());
+  }
+};
+
+TEST_F(CRLIndexTest, Empty)
+{
+  CRLIndex crl;
+  EXPECT_FALSE(crl.valid());
+  EXPECT_EQ(X509_V_ERR_UNABLE_TO_GET_CRL, crl.check(good_, time(0)));
+  EXPECT_FALSE(crl.refresh());
+}
+
+TEST_F(CRLIndexTest, Check)
+{
+  const char *files[] = {
+    "src/testdata/crlca.crl",
+    "src/testdata/crlca.crl.der",
+    NULL,
+  };
+  for (int c = 0; files[c]; c++) {
+    CRLIndex crl;
+    crl.create(files[c], "src/testdata/crlca.crt", "");
+    ASSERT_TRUE(crl.valid()) << files[c];
+    EXPECT_EQ(1UL, crl.size());
+    EXPECT_EQ(1U, crl.issuers());
+    EXPECT_EQ(X509_V_OK, crl.check(good_, time(0)));
+    EXPECT_EQ(X509_V_ERR_CERT_REVOKED, crl.check(revoked_, time(0)));
+    EXPECT_EQ(X509_V_ERR_UNABLE_TO_GET_CRL, crl.check(other_, time(0)));
+
+    // CRL made now, and valid for 100 years
+    EXPECT_EQ(X509_V_ERR_CRL_NOT_YET_VALID, crl.check(good_, 1000000000));
+    EXPECT_EQ(X509_V_ERR_CRL_HAS_EXPIRED,
+              crl.check(good_, time(0) + 101LL * 365 * 86400));
+  }
+}
+
+TEST_F(CRLIndexTest, NextUpdate)
+{
+  CRLIndex crl;
+  EXPECT_EQ(0, crl.next_update(good_));
+  crl.create("src/testdata/crlca.crl", "src/testdata/crlca.crt", "");
+  const time_t next = crl.next_update(good_);
+  EXPECT_LT(time(0) + 99LL * 365 * 86400, next);
+  EXPECT_GT(time(0) + 101LL * 365 * 86400, next);
+  EXPECT_EQ(next, crl.next_update(revoked_));
+  EXPECT_EQ(0, crl.next_update(other_));
+}
+
+TEST_F(CRLIndexTest, BadSignature)
+{
+  CRLIndex crl;
+  EXPECT_THROW(crl.create("src/testdata/crlca.crl",
+                          "src/testdata/server.crt", ""),
+               Err::ErrBase);
+  EXPECT_FALSE(crl.valid());
+  EXPECT_THROW(crl.create("src/testdata/crlca.crt",
+                          "src/testdata/crlca.crt", ""),
+               Err::ErrBase);
+  EXPECT_THROW(crl.create(dir_ + "/nonexisting",
+                          "src/testdata/crlca.crt", ""),
+               Err::ErrBase);
+}
+
+TEST_F(CRLIndexTest, HashedDirs)
+{
+  const std::string capath(dir_ + "/ca"), crlpath(dir_ + "/crl");
+  ASSERT_EQ(0, mkdir(capath.c_str(), 0755));
+  ASSERT_EQ(0, mkdir(crlpath.c_str(), 0755));
+  copy_file("src/testdata/crlca.crt", capath + "/" + hashed_name(ca_, "0"));
+  copy_file("src/testdata/crlca.crl", crlpath + "/" + hashed_name(ca_, "r0"));
+  copy_file("src/testdata/crlca.crt", crlpath + "/not-a-crl");
+
+  CRLIndex crl;
+  crl.create(crlpath, "", capath);
+  EXPECT_EQ(X509_V_OK, crl.check(good_, time(0)));
+  EXPECT_EQ(X509_V_ERR_CERT_REVOKED, crl.check(revoked_, time(0)));
+
+  // directory without CRLs
+  EXPECT_THROW(crl.create(capath, "", capath), Err::ErrBase);
+  EXPECT_EQ(X509_V_ERR_CERT_REVOKED, crl.check(revoked_, time(0)));
+}
+
+TEST_F(CRLIndexTest, Refresh)
+{
+  const std::string fn(dir_ + "/crl.pem");
+  copy_file("src/testdata/crlca.crl", fn);
+
+  CRLIndex crl;
+  crl.create(fn, "src/testdata/crlca.crt", "");
+  EXPECT_FALSE(crl.refresh());
+
+  struct utimbuf tb;
+  tb.actime = tb.modtime = 1000000000;
+  ASSERT_EQ(0, utime(fn.c_str(), &tb));
+  EXPECT_TRUE(crl.refresh());
+  EXPECT_FALSE(crl.refresh());
+  EXPECT_EQ(X509_V_ERR_CERT_REVOKED, crl.check(revoked_, time(0)));
+
+  // half written file: old table is kept, and it's tried again
+  copy_file("/dev/null", fn);
+  EXPECT_THROW(crl.refresh(), Err::ErrBase);
+  EXPECT_EQ(X509_V_ERR_CERT_REVOKED, crl.check(revoked_, time(0)));
+  EXPECT_THROW(crl.refresh(), Err::ErrBase);
+}
+
+TEST_F(CRLIndexTest, Shared)
+{
+  CRLIndex crl;
+  crl.create("src/testdata/crlca.crl", "src/testdata/crlca.crt", "");
+
+  // fork()ed
+  pid_t pid = fork();
+  ASSERT_LE(0, pid);
+  if (!pid) {
+    _exit(crl.check(revoked_, time(0)) == X509_V_ERR_CERT_REVOKED ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, status);
+
+  // exec()ed
+  if (crl.get_fd() >= 0) {
+    CRLIndex attached;
+    attached.attach(dup(crl.get_fd()));
+    EXPECT_EQ(1UL, attached.size());
+    EXPECT_EQ(X509_V_OK, attached.check(good_, time(0)));
+    EXPECT_EQ(X509_V_ERR_CERT_REVOKED, attached.check(revoked_, time(0)));
+    EXPECT_FALSE(attached.refresh());
+  }
+
+  CRLIndex other;
+  other.swap(crl);
+  EXPECT_FALSE(crl.valid());
+  EXPECT_EQ(X509_V_ERR_CERT_REVOKED, other.check(revoked_, time(0)));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
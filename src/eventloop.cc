@@ -0,0 +1,415 @@
+/**
+ * @file src/eventloop.cc
+ * fd readiness, timers and signals in one wait
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<string.h>
+#include<unistd.h>
+
+#ifdef HAVE_EPOLL_CREATE1
+#include<sys/epoll.h>
+#endif
+
+#ifdef HAVE_SIGNALFD
+#include<sys/signalfd.h>
+#endif
+
+#include<monotonic_clock.h>
+
+#include"errbase.h"
+#include"eventloop.h"
+
+#ifndef HAVE_SIGNALFD
+namespace {
+/** Write end of the signal pipe. One per process, like signals. */
+int signal_pipe_w = -1;
+
+void
+signal_to_pipe(int sig)
+{
+        const int save = errno;
+        const unsigned char c = sig;
+        if (write(signal_pipe_w, &c, 1)) {
+                // full pipe: the signal is already waiting in it
+        }
+        errno = save;
+}
+}
+#endif
+
+/**
+ *
+ */
+EventLoop::EventLoop()
+        :stopped_(false),
+         now_(clock_get_dbl()),
+         wakeups_(0)
+{
+        sigemptyset(&signals_);
+        sigemptyset(&old_mask_);
+#ifdef HAVE_EPOLL_CREATE1
+        epoll_fd_.set(epoll_create1(EPOLL_CLOEXEC));
+        if (0 > epoll_fd_.get()) {
+                THROW(Err::ErrSys, "epoll_create1()");
+        }
+#endif
+}
+
+/**
+ * Puts back the signal mask, and the handlers of the signal pipe.
+ */
+EventLoop::~EventLoop()
+{
+#ifdef HAVE_SIGNALFD
+        if (!signal_handlers_.empty()) {
+                sigprocmask(SIG_SETMASK, &old_mask_, NULL);
+        }
+#else
+        for (std::map<int, struct sigaction>::iterator itr
+                     = old_actions_.begin();
+             itr != old_actions_.end();
+             ++itr) {
+                sigaction(itr->first, &itr->second, NULL);
+        }
+        if (signal_pipe_.valid()) {
+                close(signal_pipe_w);
+                signal_pipe_w = -1;
+        }
+#endif
+}
+
+/**
+ * Wait for fd from now on. What for is asked from h->wanted() before
+ * every wait.
+ *
+ * @param[in] fd  Must not already be added
+ * @param[in] h   Called for it, not owned
+ */
+void
+EventLoop::add_fd(int fd, Handler *h)
+{
+        Watch w;
+        w.handler = h;
+        w.events = 0;
+        watches_[fd] = w;
+}
+
+/**
+ * Stop waiting for fd. Call before closing it. Fine to call from a
+ * Handler, also for other fds that may be ready in the same wakeup.
+ */
+void
+EventLoop::remove_fd(int fd)
+{
+        watches_t::iterator itr = watches_.find(fd);
+        if (itr == watches_.end()) {
+                return;
+        }
+#ifdef HAVE_EPOLL_CREATE1
+        if (itr->second.events) {
+                epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, NULL);
+        }
+#endif
+        watches_.erase(itr);
+}
+
+/**
+ * Arm a timer, or move it. Ids are the caller's, shared by all
+ * handlers of the loop.
+ *
+ * @param[in] when  Deadline, from clock_get_dbl()
+ */
+void
+EventLoop::set_timer(TimerQueue::Id id, double when, Handler *h)
+{
+        timers_.set(id, when);
+        timer_handlers_[id] = h;
+}
+
+/**
+ *
+ */
+void
+EventLoop::cancel_timer(TimerQueue::Id id)
+{
+        timers_.cancel(id);
+        timer_handlers_.erase(id);
+}
+
+/**
+ * Call h->signalled() from the loop when sig arrives. The signal is
+ * blocked until the loop is destroyed, so do this after fork()ing
+ * anything that shouldn't inherit that.
+ *
+ * A SIGCHLD that's ignored (SIG_IGN) reaps the child before it can
+ * be waited for, so set it to SIG_DFL for the exit status.
+ */
+void
+EventLoop::add_signal(int sig, Handler *h)
+{
+        signal_handlers_[sig] = h;
+        sigaddset(&signals_, sig);
+#ifdef HAVE_SIGNALFD
+        sigset_t one;
+        sigemptyset(&one);
+        sigaddset(&one, sig);
+        if (sigprocmask(SIG_BLOCK, &one,
+                        signal_handlers_.size() == 1 ? &old_mask_ : NULL)) {
+                THROW(Err::ErrSys, "sigprocmask()");
+        }
+        const int fd = signalfd(signal_fd_.valid() ? signal_fd_.get() : -1,
+                                &signals_, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (0 > fd) {
+                THROW(Err::ErrSys, "signalfd()");
+        }
+        if (!signal_fd_.valid()) {
+                signal_fd_.set(fd);
+                add_fd(fd, NULL);
+        }
+#else
+        if (!signal_pipe_.valid()) {
+                int fds[2];
+                if (pipe(fds)) {
+                        THROW(Err::ErrSys, "pipe()");
+                }
+                for (int c = 0; c < 2; c++) {
+                        fcntl(fds[c], F_SETFL,
+                              fcntl(fds[c], F_GETFL) | O_NONBLOCK);
+                        fcntl(fds[c], F_SETFD, FD_CLOEXEC);
+                }
+                signal_pipe_.set(fds[0]);
+                signal_pipe_w = fds[1];
+                add_fd(fds[0], NULL);
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = signal_to_pipe;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        struct sigaction old;
+        if (sigaction(sig, &sa, &old)) {
+                THROW(Err::ErrSys, "sigaction()");
+        }
+        if (!old_actions_.count(sig)) {
+                old_actions_[sig] = old;
+        }
+#endif
+}
+
+/**
+ * Ask every handler what it wants and update the epoll set to match.
+ *
+ * @return  poll() timeout: 0 if a handler has PENDING data, else until
+ *          the next timer
+ */
+int
+EventLoop::prepare()
+{
+        pending_.clear();
+        for (watches_t::iterator itr = watches_.begin();
+             itr != watches_.end();
+             ++itr) {
+                int events = POLLIN;
+                if (itr->second.handler) {
+                        events = itr->second.handler->wanted(itr->first);
+                }
+                if (events & PENDING) {
+                        pending_.push_back(itr->first);
+                }
+                events &= POLLIN | POLLOUT;
+#ifdef HAVE_EPOLL_CREATE1
+                if (events == itr->second.events) {
+                        continue;
+                }
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = 0;
+                if (events & POLLIN) {
+                        ev.events |= EPOLLIN;
+                }
+                if (events & POLLOUT) {
+                        ev.events |= EPOLLOUT;
+                }
+                ev.data.fd = itr->first;
+                int op = EPOLL_CTL_MOD;
+                if (!events) {
+                        op = EPOLL_CTL_DEL;
+                } else if (!itr->second.events) {
+                        op = EPOLL_CTL_ADD;
+                }
+                if (epoll_ctl(epoll_fd_.get(), op, itr->first, &ev)) {
+                        THROW(Err::ErrSys, "epoll_ctl()");
+                }
+#endif
+                itr->second.events = events;
+        }
+        if (!pending_.empty()) {
+                return 0;
+        }
+        return timers_.timeout(now_);
+}
+
+/**
+ * @param[out] ready  fds and their poll() style revents
+ * @return            What epoll_wait() or poll() returned
+ */
+int
+EventLoop::wait(int timeout, std::vector<std::pair<int, int> > *ready)
+{
+        int n;
+#ifdef HAVE_EPOLL_CREATE1
+        struct epoll_event evs[16];
+        n = epoll_wait(epoll_fd_.get(), evs, sizeof(evs) / sizeof(evs[0]),
+                       timeout);
+        for (int c = 0; c < n; c++) {
+                const uint32_t e = evs[c].events;
+                const int fd = evs[c].data.fd;
+                ready->push_back(std::pair<int, int>(
+                        fd,
+                        ((e & EPOLLIN) ? POLLIN : 0)
+                        | ((e & EPOLLOUT) ? POLLOUT : 0)
+                        | ((e & EPOLLHUP) ? POLLHUP : 0)
+                        | ((e & EPOLLERR) ? POLLERR : 0)));
+        }
+#else
+        std::vector<struct pollfd> fds;
+        for (watches_t::iterator itr = watches_.begin();
+             itr != watches_.end();
+             ++itr) {
+                if (itr->second.events) {
+                        struct pollfd pfd;
+                        pfd.fd = itr->first;
+                        pfd.events = itr->second.events;
+                        pfd.revents = 0;
+                        fds.push_back(pfd);
+                }
+        }
+        n = poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout);
+        for (size_t c = 0; n > 0 && c < fds.size(); c++) {
+                if (fds[c].revents) {
+                        ready->push_back(std::make_pair(fds[c].fd,
+                                                        fds[c].revents));
+                }
+        }
+#endif
+        return n;
+}
+
+/**
+ * Call the handlers of the signals that have arrived.
+ */
+void
+EventLoop::read_signals()
+{
+        for (;;) {
+                int sig;
+#ifdef HAVE_SIGNALFD
+                struct signalfd_siginfo si;
+                if (sizeof(si) != read(signal_fd_.get(), &si, sizeof(si))) {
+                        return;
+                }
+                sig = si.ssi_signo;
+#else
+                unsigned char c;
+                if (1 != read(signal_pipe_.get(), &c, 1)) {
+                        return;
+                }
+                sig = c;
+#endif
+                std::map<int, Handler*>::iterator itr
+                        = signal_handlers_.find(sig);
+                if (itr != signal_handlers_.end()) {
+                        itr->second->signalled(sig);
+                }
+        }
+}
+
+/**
+ * Call the handler of fd, unless it was removed by an earlier one.
+ */
+void
+EventLoop::dispatch(int fd, int revents)
+{
+        watches_t::iterator itr = watches_.find(fd);
+        if (itr == watches_.end() || stopped_) {
+                return;
+        }
+        if (!itr->second.handler) {
+                read_signals();
+                return;
+        }
+        itr->second.handler->ready(fd, revents);
+}
+
+/**
+ * Wait once, until an fd is ready, a timer has expired or a signal has
+ * arrived, and call the handlers.
+ *
+ * @return  false once stop() has been called, by a handler or before
+ */
+bool
+EventLoop::run_once()
+{
+        if (stopped_) {
+                return false;
+        }
+        const int timeout = prepare();
+        std::vector<std::pair<int, int> > ready;
+        const int n = wait(timeout, &ready);
+        if (0 > n) {
+                if (errno != EINTR) {
+#ifdef HAVE_EPOLL_CREATE1
+                        THROW(Err::ErrSys, "epoll_wait()");
+#else
+                        THROW(Err::ErrSys, "poll()");
+#endif
+                }
+                return !stopped_;
+        }
+        now_ = clock_get_dbl();
+        wakeups_++;
+
+        // PENDING goes with whatever the kernel said about the same fd
+        for (std::vector<int>::iterator itr = pending_.begin();
+             itr != pending_.end();
+             ++itr) {
+                size_t c;
+                for (c = 0; c < ready.size(); c++) {
+                        if (ready[c].first == *itr) {
+                                ready[c].second |= PENDING;
+                                break;
+                        }
+                }
+                if (c == ready.size()) {
+                        ready.push_back(std::make_pair(*itr, (int)PENDING));
+                }
+        }
+        for (size_t c = 0; c < ready.size(); c++) {
+                dispatch(ready[c].first, ready[c].second);
+        }
+
+        TimerQueue::Id id;
+        while (!stopped_ && timers_.expired(now_, &id)) {
+                std::map<TimerQueue::Id, Handler*>::iterator itr
+                        = timer_handlers_.find(id);
+                if (itr == timer_handlers_.end()) {
+                        continue;
+                }
+                Handler *h = itr->second;
+                timer_handlers_.erase(itr);
+                h->expired(id);
+        }
+        return !stopped_;
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,135 @@
+// -*- c++ -*-
+/**
+ * @file src/eventloop.h
+ * fd readiness, timers and signals in one wait
+ */
+#ifndef __INCLUDE_EVENTLOOP_H__
+#define __INCLUDE_EVENTLOOP_H__
+
+#include<signal.h>
+
+#include<map>
+#include<vector>
+
+#include"fdwrap.h"
+#include"timerqueue.h"
+
+/**
+ * Event loop for the session processes.
+ *
+ * Waits in epoll_wait() where there is one, else in poll(), until an
+ * fd is ready, a timer expires or a signal arrives, and calls the
+ * Handler it belongs to.
+ *
+ * Before every wait each fd's Handler is asked what it wants, since
+ * that depends on how full its buffers are. The epoll set is only
+ * changed for the fds where the answer changed, and an fd that wants
+ * nothing isn't waited for at all (not even for POLLHUP). The wait is
+ * level-triggered: a Handler that stops reading because its buffer
+ * is full is called again once it wants more, without the fd first
+ * having to get new data.
+ *
+ * Data buffered in user space, like decrypted TLS records, is
+ * invisible to the kernel. A Handler with such data adds PENDING to
+ * what it wants, and is then called right away with PENDING set.
+ *
+ * Signals are blocked and read from a signalfd, or where there is
+ * none, from a pipe written by a signal handler. Either way the
+ * Handler runs from the loop, not from signal context.
+ *
+ @code
+ class Echo: public EventLoop::Handler {
+ public:
+         int wanted(int fd) { return POLLIN; }
+         void ready(int fd, int revents) { ... }
+         void expired(TimerQueue::Id id) { loop.stop(); }
+ };
+ Echo echo;
+ loop.add_fd(0, &echo);
+ loop.set_timer(0, loop.now() + 10, &echo);
+ while (loop.run_once()) {
+ }
+ @endcode
+ */
+class EventLoop {
+public:
+        /** Not a poll() event. Handler has data buffered in user space. */
+        enum { PENDING = 0x40000000 };
+
+        /**
+         * Gets the events. Only the calls for what it was added to are
+         * ever made.
+         */
+        class Handler {
+        public:
+                virtual ~Handler() {}
+
+                /** @return  POLLIN and/or POLLOUT (or PENDING) for fd */
+                virtual int wanted(int fd) { (void)fd; return 0; }
+                /** @param[in] revents  poll() style, and maybe PENDING */
+                virtual void ready(int fd, int revents)
+                {
+                        (void)fd;
+                        (void)revents;
+                }
+                virtual void expired(TimerQueue::Id id) { (void)id; }
+                virtual void signalled(int sig) { (void)sig; }
+        };
+
+        EventLoop();
+        ~EventLoop();
+
+        void add_fd(int fd, Handler *h);
+        void remove_fd(int fd);
+        void set_timer(TimerQueue::Id id, double when, Handler *h);
+        void cancel_timer(TimerQueue::Id id);
+        void add_signal(int sig, Handler *h);
+
+        bool run_once();
+        void stop() { stopped_ = true; }
+        bool stopped() const { return stopped_; }
+
+        /** clock_get_dbl() as of the last wakeup */
+        double now() const { return now_; }
+        /** Returns from the wait, not counting EINTR */
+        unsigned long wakeups() const { return wakeups_; }
+
+private:
+        struct Watch {
+                Handler *handler;
+                int events;     // in the epoll set, or 0 if not in it
+        };
+        typedef std::map<int, Watch> watches_t;
+        watches_t watches_;
+        std::vector<int> pending_;
+
+        TimerQueue timers_;
+        std::map<TimerQueue::Id, Handler*> timer_handlers_;
+
+        std::map<int, Handler*> signal_handlers_;
+        sigset_t signals_;
+        sigset_t old_mask_;
+        std::map<int, struct sigaction> old_actions_;
+        FDWrap signal_fd_;
+        FDWrap signal_pipe_;
+
+        FDWrap epoll_fd_;
+        bool stopped_;
+        double now_;
+        unsigned long wakeups_;
+
+        int prepare();
+        int wait(int timeout, std::vector<std::pair<int, int> > *ready);
+        void read_signals();
+        void dispatch(int fd, int revents);
+
+        EventLoop(const EventLoop&);
+        EventLoop &operator=(const EventLoop&);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,151 @@
+#include<poll.h>
+#include<signal.h>
+#include<unistd.h>
+
+#include<gtest/gtest.h>
+
+#include"eventloop.h"
+
+namespace {
+class Recorder: public EventLoop::Handler {
+public:
+  int want;
+  std::vector<int> fds, revents, timers, signals;
+  EventLoop *stop_loop;
+
+  Recorder(): want(POLLIN), stop_loop(NULL) {}
+  int wanted(int) { return want; }
+  void ready(int fd, int ev)
+  {
+    fds.push_back(fd);
+    revents.push_back(ev);
+    if (stop_loop) {
+      stop_loop->stop();
+    }
+  }
+  void expired(TimerQueue::Id id) { timers.push_back(id); }
+  void signalled(int sig) { signals.push_back(sig); }
+};
+
+class Pipe {
+public:
+  int r, w;
+  Pipe() { int fds[2]; EXPECT_EQ(0, pipe(fds)); r = fds[0]; w = fds[1]; }
+  ~Pipe() { close(r); close(w); }
+};
+}
+
+TEST(EventLoop, Readable)
+{
+  EventLoop loop;
+  Recorder rec;
+  Pipe p;
+  loop.add_fd(p.r, &rec);
+  loop.set_timer(1, loop.now() + 5, &rec);
+  EXPECT_EQ(1, write(p.w, "x", 1));
+  EXPECT_TRUE(loop.run_once());
+  ASSERT_EQ(1U, rec.fds.size());
+  EXPECT_EQ(p.r, rec.fds[0]);
+  EXPECT_TRUE(rec.revents[0] & POLLIN);
+  EXPECT_TRUE(rec.timers.empty());
+  EXPECT_EQ(1UL, loop.wakeups());
+
+  // level-triggered: still unread, so ready again
+  EXPECT_TRUE(loop.run_once());
+  EXPECT_EQ(2U, rec.fds.size());
+}
+
+TEST(EventLoop, NotWanted)
+{
+  EventLoop loop;
+  Recorder rec;
+  Pipe p;
+  loop.add_fd(p.r, &rec);
+  EXPECT_EQ(1, write(p.w, "x", 1));
+  rec.want = 0;
+  loop.set_timer(1, loop.now() + 0.05, &rec);
+  EXPECT_TRUE(loop.run_once());
+  EXPECT_TRUE(rec.fds.empty());
+  ASSERT_EQ(1U, rec.timers.size());
+
+  // wanted again, and readable without new data
+  rec.want = POLLIN;
+  EXPECT_TRUE(loop.run_once());
+  EXPECT_EQ(1U, rec.fds.size());
+}
+
+TEST(EventLoop, Pending)
+{
+  EventLoop loop;
+  Recorder rec;
+  Pipe p;
+  loop.add_fd(p.r, &rec);
+  rec.want = POLLIN | EventLoop::PENDING;
+  EXPECT_TRUE(loop.run_once());
+  ASSERT_EQ(1U, rec.fds.size());
+  EXPECT_EQ(EventLoop::PENDING, rec.revents[0]);
+}
+
+TEST(EventLoop, Timers)
+{
+  EventLoop loop;
+  Recorder rec;
+  loop.set_timer(2, loop.now() + 0.02, &rec);
+  loop.set_timer(1, loop.now() + 0.01, &rec);
+  loop.set_timer(3, loop.now() + 0.03, &rec);
+  loop.cancel_timer(3);
+  while (rec.timers.size() < 2) {
+    EXPECT_TRUE(loop.run_once());
+  }
+  EXPECT_EQ(1, rec.timers[0]);
+  EXPECT_EQ(2, rec.timers[1]);
+}
+
+TEST(EventLoop, RemoveAndStop)
+{
+  EventLoop loop;
+  Recorder rec;
+  Pipe p;
+  loop.add_fd(p.r, &rec);
+  loop.add_fd(p.w, &rec);
+  rec.want = POLLOUT;
+  rec.stop_loop = &loop;
+  EXPECT_FALSE(loop.run_once());
+  EXPECT_EQ(1U, rec.fds.size());
+  EXPECT_FALSE(loop.run_once());
+
+  EventLoop loop2;
+  loop2.add_fd(p.w, &rec);
+  loop2.remove_fd(p.w);
+  loop2.set_timer(1, loop2.now(), &rec);
+  rec.fds.clear();
+  EXPECT_TRUE(loop2.run_once());
+  EXPECT_TRUE(rec.fds.empty());
+}
+
+TEST(EventLoop, Signal)
+{
+  Recorder rec;
+  {
+    EventLoop loop;
+    loop.add_signal(SIGUSR1, &rec);
+    EXPECT_EQ(0, kill(getpid(), SIGUSR1));
+    while (rec.signals.empty()) {
+      EXPECT_TRUE(loop.run_once());
+    }
+    EXPECT_EQ(SIGUSR1, rec.signals[0]);
+  }
+
+  // not blocked or caught after the loop is gone
+  sigset_t mask;
+  sigprocmask(SIG_SETMASK, NULL, &mask);
+  EXPECT_FALSE(sigismember(&mask, SIGUSR1));
+  struct sigaction sa;
+  sigaction(SIGUSR1, NULL, &sa);
+  EXPECT_EQ(SIG_DFL, sa.sa_handler);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
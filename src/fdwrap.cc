@@ -2,14 +2,102 @@
  * \file src/fdwrap.cc
  * File descriptor wrapper
  */
-#include<vector>
 #include<string>
 
+#include<errno.h>
 #include<fcntl.h>
 #include<unistd.h>
 
 #include"fdwrap.h"
 
+/**
+ * Status for a read() or write() that returned < 0.
+ */
+static IOStatus
+errno_status()
+{
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_AGAIN;
+        }
+        return IO_ERROR;
+}
+
+/**
+ * read at most 'len' bytes into caller's buffer. Doesn't throw.
+ *
+ * @param[out] buf  Where to put it
+ * @param[in]  len  Size of buf
+ * @param[out] got  Bytes read. 0 unless IO_OK.
+ *
+ * @return IO_OK, IO_EOF, IO_AGAIN or IO_ERROR
+ */
+IOStatus
+FDWrap::read_into(char *buf, size_t len, size_t *got)
+{
+	ssize_t n;
+        *got = 0;
+        do {
+                n = ::read(fd, buf, len);
+        } while (n < 0 && errno == EINTR);
+	if (n < 0) {
+                return errno_status();
+	}
+	if (!n) {
+                return IO_EOF;
+	}
+        *got = n;
+        return IO_OK;
+}
+
+/**
+ * try to write from caller's buffer. Doesn't throw.
+ *
+ * @param[in]  buf   Data to write
+ * @param[in]  len   Bytes in buf
+ * @param[out] done  Bytes written. 0 unless IO_OK.
+ *
+ * @return IO_OK, IO_AGAIN or IO_ERROR
+ */
+IOStatus
+FDWrap::write_from(const char *buf, size_t len, size_t *done)
+{
+	ssize_t n;
+        *done = 0;
+        do {
+                n = ::write(fd, buf, len);
+        } while (n < 0 && errno == EINTR);
+	if (n < 0) {
+                return errno_status();
+	}
+        *done = n;
+        return IO_OK;
+}
+
+/**
+ * try to write several buffers with one writev(). Doesn't throw.
+ *
+ * @param[in]  iov     Buffers
+ * @param[in]  iovcnt  Number of buffers
+ * @param[out] done    Bytes written, counting from the first buffer.
+ *                     0 unless IO_OK.
+ *
+ * @return IO_OK, IO_AGAIN or IO_ERROR
+ */
+IOStatus
+FDWrap::writev_from(const struct iovec *iov, int iovcnt, size_t *done)
+{
+	ssize_t n;
+        *done = 0;
+        do {
+                n = ::writev(fd, iov, iovcnt);
+        } while (n < 0 && errno == EINTR);
+	if (n < 0) {
+                return errno_status();
+	}
+        *done = n;
+        return IO_OK;
+}
+
 /**
  * read at most 'm' bytes from fd
  *
@@ -22,16 +110,18 @@
 std::string
 FDWrap::read(size_t m)
 {
-	ssize_t n;
-	std::vector<char> buf(m);
-	n = ::read(fd, &buf[0], m);
-	if (n < 0) {
-		THROW(ErrBase, "read()");
-	}
-	if (!n) {
+	std::string buf(m, 0);
+        size_t n;
+        switch (read_into(&buf[0], m, &n)) {
+        case IO_OK:
+                break;
+        case IO_EOF:
 		THROW0(ErrEOF);
+        default:
+		THROW(ErrBase, "read()");
 	}
-	return std::string(&buf[0], &buf[n]);
+        buf.resize(n);
+	return buf;
 }
 
 /**
@@ -46,9 +136,8 @@ FDWrap::read(size_t m)
 size_t
 FDWrap::write(const std::string &data)
 {
-	ssize_t n;
-	n = ::write(fd, data.data(), data.length());
-	if (n < 0) {
+        size_t n;
+	if (IO_ERROR == write_from(data.data(), data.length(), &n)) {
 		THROW(ErrBase, "write()");
 	}
 	return n;
@@ -65,8 +154,11 @@ void
 FDWrap::full_write(const std::string &data)
 {
         size_t n;
-        for (n = 0; n < data.size();) {
-                n += write(data.substr(n));
+        for (size_t pos = 0; pos < data.size(); pos += n) {
+                if (IO_OK != write_from(data.data() + pos,
+                                        data.size() - pos, &n)) {
+                        THROW(ErrBase, "write()");
+                }
         }
 }
 
@@ -82,12 +174,30 @@ FDWrap::set_close_on_exec(bool onoff)
                 THROW(ErrBase, "fcntl(F_GETFD)");
         }
 
-        flags = ~FD_CLOEXEC | (onoff ? FD_CLOEXEC : 0);
+        flags = (flags & ~FD_CLOEXEC) | (onoff ? FD_CLOEXEC : 0);
         if (-1 == fcntl(fd, F_SETFD, flags)) {
                 THROW(ErrBase, "fcntl(F_SETFD)");
         }
 }
 
+/**
+ * set/unset O_NONBLOCK
+ */
+void
+FDWrap::set_nonblock(bool onoff)
+{
+        int flags;
+
+        if (-1 == (flags = fcntl(fd, F_GETFL))) {
+                THROW(ErrBase, "fcntl(F_GETFL)");
+        }
+
+        flags = (flags & ~O_NONBLOCK) | (onoff ? O_NONBLOCK : 0);
+        if (-1 == fcntl(fd, F_SETFL, flags)) {
+                THROW(ErrBase, "fcntl(F_SETFL)");
+        }
+}
+
 
 /* ---- Emacs Variables ----
  * Local Variables:
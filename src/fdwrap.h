@@ -7,11 +7,22 @@
 #define __INCLUDE_FDWRAP_H__
 
 #include<unistd.h>
+#include<sys/uio.h>
 #include<exception>
 #include<string>
 
 #include"errbase.h"
 
+/**
+ * Outcome of the I/O calls that don't throw, like FDWrap::read_into().
+ */
+enum IOStatus {
+        IO_OK,          ///< At least one byte was moved
+        IO_EOF,         ///< End of file, or peer closed. Only from reads.
+        IO_AGAIN,       ///< Would block. Try again when poll() says so.
+        IO_ERROR,       ///< Failed. errno says why.
+};
+
 /**
  * Wrap file descriptor in a class
  */
@@ -60,6 +71,7 @@ public:
 	}
 
         void set_close_on_exec(bool);
+        void set_nonblock(bool);
 
         /**
          * Exception base class
@@ -83,6 +95,11 @@ public:
 	size_t write(const std::string &);
 	void full_write(const std::string &);
 
+        IOStatus read_into(char *buf, size_t len, size_t *got);
+        IOStatus write_from(const char *buf, size_t len, size_t *done);
+        IOStatus writev_from(const struct iovec *iov, int iovcnt,
+                             size_t *done);
+
 private:
         // Disable copy and assign.
         FDWrap(const FDWrap&);
@@ -0,0 +1,263 @@
+/**
+ * @file src/peercache.cc
+ * Verified client certs, shared between processes
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<stddef.h>
+#include<stdint.h>
+#include<string.h>
+#include<pthread.h>
+
+#include<openssl/evp.h>
+
+#include"peercache.h"
+#include"errbase.h"
+
+/** SHA-256 */
+static const size_t FP_LEN = 32;
+
+/** Longest CN allowed by X.509 (ub-common-name). */
+static const size_t CN_LEN = 64;
+
+/** One verified cert. Only valid if the generation is current. */
+struct PeerCache::Slot {
+        uint32_t generation;
+        int64_t expire;
+        unsigned char fp[FP_LEN];
+        uint8_t cn_len;
+        uint8_t user_len;       // the domain starts after the dot
+        char cn[CN_LEN];
+};
+
+/** Layout of the shared memory segment. */
+struct PeerCache::Shared {
+        pthread_mutex_t lock;
+        uint32_t slots;
+        uint32_t generation;  // never 0, so a zeroed slot is never valid
+        Stats stats;
+        Slot slot[1];         // really 'slots' of them
+};
+
+/**
+ *
+ */
+PeerCache::PeerCache()
+        :shm_(NULL)
+{
+}
+
+/**
+ * Only unmaps. The segment lives on in other processes.
+ */
+PeerCache::~PeerCache()
+{
+        detach();
+}
+
+/**
+ * Set up a new shared segment.
+ *
+ * @param[in] slots  Number of cached certs. 0 disables the cache, and
+ *                   no segment is created.
+ */
+void
+PeerCache::create(unsigned slots)
+{
+        detach();
+        if (!slots) {
+                return;
+        }
+
+        SharedSegment seg;
+        Shared *shm = (Shared*)seg.create("tlsshd-peers",
+                                          offsetof(Shared, slot)
+                                          + slots * sizeof(Slot));
+        SharedSegment::init_mutex(&shm->lock);
+        shm->slots = slots;
+        shm->generation = 1;
+        seg_.swap(seg);
+        shm_ = shm;
+}
+
+/**
+ * Map a segment set up by create() in another process.
+ *
+ * @param[in] fd  From get_fd() of the creator. Taken over.
+ */
+void
+PeerCache::attach(int fd)
+{
+        detach();
+        shm_ = (Shared*)seg_.attach(fd, offsetof(Shared, slot), true);
+        if (seg_.size() < offsetof(Shared, slot)
+            + shm_->slots * sizeof(Slot)) {
+                detach();
+                THROW(Err::ErrBase, "peer cache segment too small");
+        }
+}
+
+/**
+ * Unmap and close.
+ */
+void
+PeerCache::detach()
+{
+        seg_.detach();
+        shm_ = NULL;
+}
+
+/**
+ * Take the lock. A process that died holding it has left at most one
+ * half written slot, and it was written with the fingerprint last.
+ */
+void
+PeerCache::lock() const
+{
+        SharedSegment::lock(&shm_->lock);
+}
+
+/**
+ *
+ */
+void
+PeerCache::unlock() const
+{
+        SharedSegment::unlock(&shm_->lock);
+}
+
+/**
+ * Slot for a fingerprint. Call with the lock held.
+ */
+PeerCache::Slot *
+PeerCache::slot(const std::string &fp) const
+{
+        // it's a hash already
+        uint32_t h;
+        memcpy(&h, fp.data(), sizeof(h));
+        return &shm_->slot[h % shm_->slots];
+}
+
+/**
+ * Cache key for a cert: SHA-256 of the whole DER encoded cert.
+ *
+ * @param[in] cert  Cert
+ * @return          Binary fingerprint, or empty string on error
+ */
+std::string
+PeerCache::fingerprint(X509 *cert)
+{
+        unsigned char buf[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        if (1 != X509_digest(cert, EVP_sha256(), buf, &len)
+            || len != FP_LEN) {
+                return "";
+        }
+        return std::string((char*)buf, len);
+}
+
+/**
+ * Find a verified cert.
+ *
+ * @param[in]  fp    From fingerprint()
+ * @param[in]  now   Current time
+ * @param[out] peer  What was found out when it was verified
+ * @return           true if found, not flushed and not expired
+ */
+bool
+PeerCache::lookup(const std::string &fp, time_t now, Peer *peer)
+{
+        bool found = false;
+
+        if (!shm_ || fp.size() != FP_LEN) {
+                return false;
+        }
+        lock();
+        const Slot *s = slot(fp);
+        if (s->generation == shm_->generation
+            && !memcmp(s->fp, fp.data(), FP_LEN)
+            && s->expire > now) {
+                peer->cn.assign(s->cn, s->cn_len);
+                peer->username.assign(s->cn, s->user_len);
+                peer->domain.assign(s->cn + s->user_len + 1,
+                                    s->cn_len - s->user_len - 1);
+                peer->expire = s->expire;
+                found = true;
+                shm_->stats.hits++;
+        } else {
+                shm_->stats.misses++;
+        }
+        unlock();
+        return found;
+}
+
+/**
+ * Remember a verified cert, replacing whatever was in its slot.
+ *
+ * @param[in] fp    From fingerprint()
+ * @param[in] peer  CN and its parts, which must be username.domain,
+ *                  and when to verify the cert again
+ * @return          false if caching is off or the peer doesn't fit
+ */
+bool
+PeerCache::store(const std::string &fp, const Peer &peer)
+{
+        if (!shm_ || fp.size() != FP_LEN
+            || peer.cn.size() > CN_LEN
+            || peer.cn != peer.username + "." + peer.domain) {
+                return false;
+        }
+        lock();
+        Slot *s = slot(fp);
+        s->generation = 0;
+        s->expire = peer.expire;
+        s->cn_len = peer.cn.size();
+        s->user_len = peer.username.size();
+        memcpy(s->cn, peer.cn.data(), peer.cn.size());
+        memcpy(s->fp, fp.data(), FP_LEN);
+        s->generation = shm_->generation;
+        shm_->stats.stores++;
+        unlock();
+        return true;
+}
+
+/**
+ * Forget all certs. Done by the listener when CAs or CRLs change.
+ */
+void
+PeerCache::flush()
+{
+        if (!shm_) {
+                return;
+        }
+        lock();
+        if (!++shm_->generation) {
+                shm_->generation = 1;
+        }
+        shm_->stats.flushes++;
+        unlock();
+}
+
+/**
+ *
+ */
+PeerCache::Stats
+PeerCache::stats() const
+{
+        Stats ret;
+        memset(&ret, 0, sizeof(ret));
+        if (shm_) {
+                lock();
+                ret = shm_->stats;
+                unlock();
+        }
+        return ret;
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
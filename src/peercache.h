@@ -0,0 +1,98 @@
+// -*- c++ -*-
+/**
+ * @file src/peercache.h
+ * Verified client certs, shared between processes
+ */
+#ifndef __INCLUDE_PEERCACHE_H__
+#define __INCLUDE_PEERCACHE_H__
+
+#include<time.h>
+
+#include<string>
+
+#include<openssl/x509.h>
+
+#include"sharedsegment.h"
+
+/**
+ * Client certs that have already been verified, keyed by fingerprint.
+ *
+ * The same few client certs log in over and over, and each login
+ * verifies the whole chain, checks the CRL and digs the CN out of the
+ * subject. This remembers the outcome: for a cert that was accepted
+ * it keeps the CN and its user and domain parts, until the cert or
+ * anything it was checked against (CA certs, CRLs) runs out.
+ *
+ * The cache lives in one shared memory segment created by the
+ * listener, with a fixed number of slots. A new entry just replaces
+ * whatever was in its slot. flush() forgets everything at once, and is
+ * called when the CAs or CRLs are reloaded.
+ *
+ * Access is serialised by a process shared mutex in the segment. If
+ * the segment is backed by an fd it can also be attach()ed by a
+ * process that was exec()ed instead of fork()ed.
+ *
+ @code
+ PeerCache cache;
+ cache.create(1024);
+ ...
+ PeerCache::Peer peer;
+ if (!cache.lookup(PeerCache::fingerprint(cert), time(0), &peer)) {
+         // verify, then cache.store(...)
+ }
+ @endcode
+ */
+class PeerCache {
+public:
+        /** What was found out about a verified cert. */
+        struct Peer {
+                std::string cn;
+                std::string username;   ///< CN up to the first dot
+                std::string domain;     ///< CN after the first dot
+                time_t expire;          ///< Recheck from then on
+        };
+
+        /** Counters since create(). */
+        struct Stats {
+                unsigned long hits;
+                unsigned long misses;
+                unsigned long stores;
+                unsigned long flushes;
+        };
+
+        PeerCache();
+        ~PeerCache();
+
+        void create(unsigned slots);
+        void attach(int fd);
+        void detach();
+        bool valid() const { return shm_ != NULL; }
+        int get_fd() const { return seg_.get_fd(); }
+
+        static std::string fingerprint(X509 *cert);
+        bool lookup(const std::string &fp, time_t now, Peer *peer);
+        bool store(const std::string &fp, const Peer &peer);
+        void flush();
+        Stats stats() const;
+
+private:
+        struct Shared;
+        struct Slot;
+
+        SharedSegment seg_;
+        Shared *shm_;
+
+        Slot *slot(const std::string &fp) const;
+        void lock() const;
+        void unlock() const;
+
+        PeerCache(const PeerCache&);
+        PeerCache &operator=(const PeerCache&);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,160 @@
+#include<stdio.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+#include<unistd.h>
+
+#include<gtest/gtest.h>
+#include<openssl/pem.h>
+
+#include"peercache.h"
+
+namespace {
+PeerCache::Peer
+make_peer(const std::string &user, const std::string &domain, time_t expire)
+{
+  PeerCache::Peer p;
+  p.cn = user + "." + domain;
+  p.username = user;
+  p.domain = domain;
+  p.expire = expire;
+  return p;
+}
+
+std::string
+fp(char c)
+{
+  return std::string(32, c);
+}
+}
+
+TEST(PeerCache, Disabled)
+{
+  PeerCache pc;
+  pc.create(0);
+  EXPECT_FALSE(pc.valid());
+  EXPECT_FALSE(pc.store(fp('a'), make_peer("u", "example.com", 200)));
+  PeerCache::Peer p;
+  EXPECT_FALSE(pc.lookup(fp('a'), 100, &p));
+  pc.flush();
+}
+
+TEST(PeerCache, StoreLookup)
+{
+  PeerCache pc;
+  pc.create(16);
+  ASSERT_TRUE(pc.valid());
+
+  PeerCache::Peer p;
+  EXPECT_FALSE(pc.lookup(fp('a'), 100, &p));
+  EXPECT_TRUE(pc.store(fp('a'), make_peer("alice", "users.example.com",
+                                          200)));
+  ASSERT_TRUE(pc.lookup(fp('a'), 100, &p));
+  EXPECT_EQ("alice.users.example.com", p.cn);
+  EXPECT_EQ("alice", p.username);
+  EXPECT_EQ("users.example.com", p.domain);
+  EXPECT_EQ(200, p.expire);
+
+  // expired
+  EXPECT_FALSE(pc.lookup(fp('a'), 200, &p));
+
+  // same slot, other cert
+  std::string other(fp('a'));
+  other[31] = 'b';
+  EXPECT_FALSE(pc.lookup(other, 100, &p));
+
+  PeerCache::Stats st(pc.stats());
+  EXPECT_EQ(1U, st.hits);
+  EXPECT_EQ(3U, st.misses);
+  EXPECT_EQ(1U, st.stores);
+}
+
+TEST(PeerCache, Flush)
+{
+  PeerCache pc;
+  pc.create(16);
+  PeerCache::Peer p;
+  EXPECT_TRUE(pc.store(fp('a'), make_peer("alice", "example.com", 200)));
+  EXPECT_TRUE(pc.store(fp('b'), make_peer("bob", "example.com", 200)));
+  pc.flush();
+  EXPECT_FALSE(pc.lookup(fp('a'), 100, &p));
+  EXPECT_FALSE(pc.lookup(fp('b'), 100, &p));
+
+  EXPECT_TRUE(pc.store(fp('a'), make_peer("alice", "example.com", 200)));
+  EXPECT_TRUE(pc.lookup(fp('a'), 100, &p));
+  EXPECT_EQ(1U, pc.stats().flushes);
+}
+
+TEST(PeerCache, Bad)
+{
+  PeerCache pc;
+  pc.create(16);
+  PeerCache::Peer p(make_peer("alice", "example.com", 200));
+  EXPECT_FALSE(pc.store("short", p));
+  EXPECT_FALSE(pc.store("", p));
+  EXPECT_FALSE(pc.lookup("", 100, &p));
+
+  p.username = "bob";
+  EXPECT_FALSE(pc.store(fp('a'), p));
+
+  EXPECT_FALSE(pc.store(fp('a'), make_peer(std::string(60, 'u'),
+                                           "example.com", 200)));
+}
+
+TEST(PeerCache, Fingerprint)
+{
+  FILE *f = fopen("src/testdata/client.crt", "r");
+  ASSERT_TRUE(f != NULL);
+  X509 *x = PEM_read_X509(f, NULL, NULL, NULL);
+  fclose(f);
+  ASSERT_TRUE(x != NULL);
+
+  const std::string a(PeerCache::fingerprint(x));
+  EXPECT_EQ(32U, a.size());
+  EXPECT_EQ(a, PeerCache::fingerprint(x));
+  X509_free(x);
+}
+
+TEST(PeerCache, SharedAcrossFork)
+{
+  PeerCache pc;
+  pc.create(16);
+
+  pid_t pid = fork();
+  ASSERT_LE(0, pid);
+  if (!pid) {
+    _exit(pc.store(fp('c'), make_peer("child", "example.com", 200))
+          ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, status);
+
+  PeerCache::Peer p;
+  EXPECT_TRUE(pc.lookup(fp('c'), 100, &p));
+  EXPECT_EQ("child", p.username);
+}
+
+TEST(PeerCache, Attach)
+{
+  PeerCache pc;
+  pc.create(16);
+  if (0 > pc.get_fd()) {
+    return;  // no memfd_create()
+  }
+  EXPECT_TRUE(pc.store(fp('a'), make_peer("alice", "example.com", 200)));
+
+  PeerCache other;
+  other.attach(dup(pc.get_fd()));
+  PeerCache::Peer p;
+  EXPECT_TRUE(other.lookup(fp('a'), 100, &p));
+  EXPECT_EQ("alice", p.username);
+
+  // flush from either side
+  other.flush();
+  EXPECT_FALSE(pc.lookup(fp('a'), 100, &p));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,267 @@
+/**
+ * @file src/ratelimit.cc
+ * Token buckets for rate limiting new connections
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<string.h>
+#include<stdio.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+
+#include"ratelimit.h"
+
+/**
+ * Create a full bucket.
+ *
+ * @param[in] rate   Tokens per second. 0 means unlimited.
+ * @param[in] burst  Max number of tokens. Less than 1 is treated as 1.
+ */
+TokenBucket::TokenBucket(double rate, double burst)
+        :rate_(rate),
+         burst_(burst < 1 ? 1 : burst),
+         tokens_(burst_),
+         last_(-1)
+{
+}
+
+/**
+ * Add the tokens earned since last call.
+ */
+void
+TokenBucket::refill(double now)
+{
+        if (last_ >= 0 && now > last_) {
+                tokens_ += (now - last_) * rate_;
+                if (tokens_ > burst_) {
+                        tokens_ = burst_;
+                }
+        }
+        if (now > last_) {
+                last_ = now;
+        }
+}
+
+/**
+ * Is there a token to take, without taking it?
+ */
+bool
+TokenBucket::available(double now)
+{
+        if (unlimited()) {
+                return true;
+        }
+        refill(now);
+        return tokens_ >= 1;
+}
+
+/**
+ * Take one token if there is one.
+ *
+ * @return true if a token was taken (action is allowed)
+ */
+bool
+TokenBucket::take(double now)
+{
+        if (!available(now)) {
+                return false;
+        }
+        if (!unlimited()) {
+                tokens_ -= 1;
+        }
+        return true;
+}
+
+/**
+ * Has the bucket filled up completely?
+ */
+bool
+TokenBucket::full(double now)
+{
+        if (unlimited()) {
+                return true;
+        }
+        refill(now);
+        return tokens_ >= burst_;
+}
+
+/**
+ * Seconds until there is a token to take. 0 if there's one now.
+ */
+double
+TokenBucket::wait_time(double now)
+{
+        if (available(now)) {
+                return 0;
+        }
+        return (1 - tokens_) / rate_;
+}
+
+/**
+ *
+ */
+SourceLimiter::SourceLimiter()
+        :rate_(0),
+         burst_(1),
+         prefix4_(32),
+         prefix6_(64),
+         max_sources_(10000),
+         last_prune_(0)
+{
+}
+
+/**
+ * Set the per-source budget. Forgets all sources.
+ *
+ * @param[in] rate         Connections per second per source. 0 disables.
+ * @param[in] burst        Connections allowed in a burst
+ * @param[in] prefix4      Prefix length IPv4 sources are grouped by
+ * @param[in] prefix6      Prefix length IPv6 sources are grouped by
+ * @param[in] max_sources  Max number of sources to keep track of
+ */
+void
+SourceLimiter::configure(double rate, double burst,
+                         unsigned prefix4, unsigned prefix6,
+                         size_t max_sources)
+{
+        rate_ = rate;
+        burst_ = burst;
+        prefix4_ = prefix4 > 32 ? 32 : prefix4;
+        prefix6_ = prefix6 > 128 ? 128 : prefix6;
+        max_sources_ = max_sources;
+        sources_.clear();
+}
+
+/**
+ * Charge a new connection to its source.
+ *
+ * If too many sources are tracked (after pruning) new ones are
+ * admitted without being tracked, so memory use is bounded.
+ *
+ * @param[in]  sa   Peer address
+ * @param[in]  now  Current time
+ * @param[out] key  If not NULL, set to the source prefix as text
+ * @return          Verdict
+ */
+SourceLimiter::Verdict
+SourceLimiter::admit(const struct sockaddr *sa, double now, std::string *key)
+{
+        if (rate_ <= 0) {
+                return ADMIT;
+        }
+
+        const std::string k(prefix(sa, prefix4_, prefix6_));
+        if (key) {
+                *key = k;
+        }
+
+        if (now - last_prune_ > 10) {
+                prune(now);
+        }
+
+        sources_t::iterator itr = sources_.find(k);
+        if (itr == sources_.end()) {
+                if (sources_.size() >= max_sources_) {
+                        prune(now);
+                        if (sources_.size() >= max_sources_) {
+                                return ADMIT;
+                        }
+                }
+                Source src;
+                src.bucket = TokenBucket(rate_, burst_);
+                src.rejected = 0;
+                itr = sources_.insert(std::make_pair(k, src)).first;
+        }
+
+        if (itr->second.bucket.take(now)) {
+                return ADMIT;
+        }
+        return itr->second.rejected++ ? REJECT : REJECT_FIRST;
+}
+
+/**
+ * Forget sources whose bucket has filled up again.
+ */
+void
+SourceLimiter::prune(double now)
+{
+        sources_t::iterator itr = sources_.begin();
+        while (itr != sources_.end()) {
+                if (itr->second.bucket.full(now)) {
+                        sources_.erase(itr++);
+                } else {
+                        ++itr;
+                }
+        }
+        last_prune_ = now;
+}
+
+/**
+ * Mask an address to a prefix and return it as text, e.g. "192.0.2.0/24".
+ *
+ * IPv4-mapped IPv6 addresses are treated as IPv4.
+ */
+std::string
+SourceLimiter::prefix(const struct sockaddr *sa,
+                      unsigned prefix4, unsigned prefix6)
+{
+        unsigned char addr[16];
+        char buf[INET6_ADDRSTRLEN + 8];
+        size_t len;
+        unsigned bits;
+        int af;
+
+        switch (sa->sa_family) {
+        case AF_INET:
+                af = AF_INET;
+                len = 4;
+                bits = prefix4;
+                memcpy(addr, &((const struct sockaddr_in*)sa)->sin_addr, len);
+                break;
+        case AF_INET6: {
+                const struct in6_addr *a6
+                        = &((const struct sockaddr_in6*)sa)->sin6_addr;
+                if (IN6_IS_ADDR_V4MAPPED(a6)) {
+                        af = AF_INET;
+                        len = 4;
+                        bits = prefix4;
+                        memcpy(addr, &a6->s6_addr[12], len);
+                } else {
+                        af = AF_INET6;
+                        len = 16;
+                        bits = prefix6;
+                        memcpy(addr, a6->s6_addr, len);
+                }
+                break;
+        }
+        default:
+                return "unknown";
+        }
+
+        if (bits > len * 8) {
+                bits = len * 8;
+        }
+        size_t c;
+        for (c = 0; c < len; c++) {
+                if (c * 8 >= bits) {
+                        addr[c] = 0;
+                } else if (c * 8 + 8 > bits) {
+                        addr[c] &= 0xff << (8 - (bits - c * 8));
+                }
+        }
+
+        if (!inet_ntop(af, addr, buf, sizeof(buf))) {
+                return "unknown";
+        }
+        snprintf(buf + strlen(buf), 8, "/%u", bits);
+        return buf;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
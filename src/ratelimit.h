@@ -0,0 +1,94 @@
+// -*- c++ -*-
+/**
+ * @file src/ratelimit.h
+ * Token buckets for rate limiting new connections
+ */
+#ifndef __INCLUDE_RATELIMIT_H__
+#define __INCLUDE_RATELIMIT_H__
+
+#include<sys/types.h>
+#include<sys/socket.h>
+
+#include<map>
+#include<string>
+
+/**
+ * Token bucket.
+ *
+ * Holds at most 'burst' tokens and gains 'rate' tokens per second. A
+ * rate of 0 means unlimited. The time is passed in by the caller so
+ * that any (monotonic) clock can be used.
+ *
+ @code
+ TokenBucket tb(10, 20);
+ if (tb.take(clock_get_dbl())) {
+     // allowed
+ }
+ @endcode
+ */
+class TokenBucket {
+        double rate_;
+        double burst_;
+        double tokens_;
+        double last_;
+public:
+        TokenBucket(double rate = 0, double burst = 1);
+
+        void refill(double now);
+        bool available(double now);
+        bool take(double now);
+        bool full(double now);
+        double wait_time(double now);
+
+        bool unlimited() const { return rate_ <= 0; }
+        double tokens() const { return tokens_; }
+};
+
+/**
+ * One token bucket per source address prefix.
+ *
+ * Addresses are grouped by prefix (e.g. /24 or /64) so that a client
+ * can't get around the limit by using many addresses from one network.
+ * Buckets that have filled up again carry no information and are pruned.
+ */
+class SourceLimiter {
+public:
+        /** Result of admit() */
+        enum Verdict {
+                ADMIT,         ///< Connection is within budget
+                REJECT_FIRST,  ///< First rejection for this source
+                REJECT         ///< Source was already over budget
+        };
+
+        SourceLimiter();
+        void configure(double rate, double burst,
+                       unsigned prefix4, unsigned prefix6,
+                       size_t max_sources = 10000);
+        Verdict admit(const struct sockaddr *sa, double now,
+                      std::string *key = NULL);
+        void prune(double now);
+        size_t size() const { return sources_.size(); }
+
+        static std::string prefix(const struct sockaddr *sa,
+                                  unsigned prefix4, unsigned prefix6);
+private:
+        struct Source {
+                TokenBucket bucket;
+                unsigned long rejected;
+        };
+        typedef std::map<std::string, Source> sources_t;
+        sources_t sources_;
+        double rate_;
+        double burst_;
+        unsigned prefix4_;
+        unsigned prefix6_;
+        size_t max_sources_;
+        double last_prune_;
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,134 @@
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<arpa/inet.h>
+#include<string.h>
+
+#include<gtest/gtest.h>
+
+#include"ratelimit.h"
+
+static struct sockaddr_storage
+make_addr(int af, const char *s)
+{
+  struct sockaddr_storage ss;
+  memset(&ss, 0, sizeof(ss));
+  ss.ss_family = af;
+  if (af == AF_INET) {
+    inet_pton(af, s, &((struct sockaddr_in*)&ss)->sin_addr);
+  } else {
+    inet_pton(af, s, &((struct sockaddr_in6*)&ss)->sin6_addr);
+  }
+  return ss;
+}
+
+TEST(TokenBucket, Unlimited)
+{
+  TokenBucket tb;
+  for (int c = 0; c < 1000; c++) {
+    EXPECT_TRUE(tb.take(1.0));
+  }
+  EXPECT_EQ(0, tb.wait_time(1.0));
+}
+
+TEST(TokenBucket, BurstThenRate)
+{
+  TokenBucket tb(2, 3);
+  EXPECT_TRUE(tb.take(10.0));
+  EXPECT_TRUE(tb.take(10.0));
+  EXPECT_TRUE(tb.take(10.0));
+  EXPECT_FALSE(tb.take(10.0));
+  EXPECT_DOUBLE_EQ(0.5, tb.wait_time(10.0));
+
+  EXPECT_TRUE(tb.take(10.5));
+  EXPECT_FALSE(tb.take(10.5));
+  EXPECT_FALSE(tb.full(10.5));
+  EXPECT_TRUE(tb.full(100.0));
+  EXPECT_DOUBLE_EQ(3, tb.tokens());
+}
+
+TEST(TokenBucket, ClockGoingBackwards)
+{
+  TokenBucket tb(1, 1);
+  EXPECT_TRUE(tb.take(10.0));
+  EXPECT_FALSE(tb.take(5.0));
+  EXPECT_FALSE(tb.take(10.5));
+  EXPECT_TRUE(tb.take(11.0));
+}
+
+TEST(SourceLimiter, Prefix)
+{
+  struct sockaddr_storage a;
+
+  a = make_addr(AF_INET, "192.0.2.77");
+  EXPECT_EQ("192.0.2.0/24",
+            SourceLimiter::prefix((struct sockaddr*)&a, 24, 64));
+  EXPECT_EQ("192.0.2.64/26",
+            SourceLimiter::prefix((struct sockaddr*)&a, 26, 64));
+  EXPECT_EQ("192.0.2.77/32",
+            SourceLimiter::prefix((struct sockaddr*)&a, 40, 64));
+
+  a = make_addr(AF_INET6, "2001:db8:1:2:3:4:5:6");
+  EXPECT_EQ("2001:db8:1:2::/64",
+            SourceLimiter::prefix((struct sockaddr*)&a, 24, 64));
+  EXPECT_EQ("2001:db8::/33",
+            SourceLimiter::prefix((struct sockaddr*)&a, 24, 33));
+
+  a = make_addr(AF_INET6, "::ffff:192.0.2.77");
+  EXPECT_EQ("192.0.2.0/24",
+            SourceLimiter::prefix((struct sockaddr*)&a, 24, 64));
+}
+
+TEST(SourceLimiter, Disabled)
+{
+  SourceLimiter sl;
+  struct sockaddr_storage a(make_addr(AF_INET, "192.0.2.1"));
+  for (int c = 0; c < 100; c++) {
+    EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&a, 1.0));
+  }
+  EXPECT_EQ(0U, sl.size());
+}
+
+TEST(SourceLimiter, PerPrefix)
+{
+  SourceLimiter sl;
+  sl.configure(1, 2, 24, 64);
+  struct sockaddr_storage a1(make_addr(AF_INET, "192.0.2.1"));
+  struct sockaddr_storage a2(make_addr(AF_INET, "192.0.2.2"));
+  struct sockaddr_storage b(make_addr(AF_INET, "198.51.100.1"));
+  std::string key;
+
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&a1, 1.0));
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&a2, 1.0));
+  EXPECT_EQ(SourceLimiter::REJECT_FIRST,
+            sl.admit((struct sockaddr*)&a1, 1.0, &key));
+  EXPECT_EQ("192.0.2.0/24", key);
+  EXPECT_EQ(SourceLimiter::REJECT, sl.admit((struct sockaddr*)&a2, 1.0));
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&b, 1.0));
+  EXPECT_EQ(2U, sl.size());
+
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&a1, 2.0));
+
+  sl.prune(100.0);
+  EXPECT_EQ(0U, sl.size());
+}
+
+TEST(SourceLimiter, MaxSources)
+{
+  SourceLimiter sl;
+  sl.configure(1, 1, 32, 64, 2);
+  struct sockaddr_storage a(make_addr(AF_INET, "192.0.2.1"));
+  struct sockaddr_storage b(make_addr(AF_INET, "192.0.2.2"));
+  struct sockaddr_storage c(make_addr(AF_INET, "192.0.2.3"));
+
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&a, 1.0));
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&b, 1.0));
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&c, 1.0));
+  EXPECT_EQ(SourceLimiter::ADMIT, sl.admit((struct sockaddr*)&c, 1.0));
+  EXPECT_EQ(2U, sl.size());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,115 @@
+/**
+ * @file src/ringbuffer.cc
+ * Fixed size byte queue
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<string.h>
+
+#include<algorithm>
+
+#include"ringbuffer.h"
+
+/** Smaller than this, and reads and writes get silly small. */
+static const size_t MIN_CAPACITY = 4096;
+
+/**
+ * @param[in] capacity  Rounded up to a power of two, at least 4096
+ */
+RingBuffer::RingBuffer(size_t capacity)
+        :mask_(0),
+         head_(0),
+         tail_(0)
+{
+        size_t cap = MIN_CAPACITY;
+        while (cap < capacity && cap * 2 > cap) {
+                cap *= 2;
+        }
+        buf_.resize(cap);
+        mask_ = cap - 1;
+}
+
+/**
+ * Oldest queued data.
+ *
+ * @param[out] len  Bytes at the returned pointer. 0 if empty. There
+ *                  may be more after consume()ing these.
+ */
+const char *
+RingBuffer::read_span(size_t *len) const
+{
+        const size_t pos = head_ & mask_;
+        *len = std::min(size(), capacity() - pos);
+        return &buf_[pos];
+}
+
+/**
+ * Drop the oldest data, usually because it's been written out.
+ *
+ * @param[in] n  Bytes to drop. At most size().
+ */
+void
+RingBuffer::consume(size_t n)
+{
+        head_ += std::min(n, size());
+        if (head_ == tail_) {
+                // start over at the beginning, for longer spans
+                clear();
+        }
+}
+
+/**
+ * Free space after the queued data.
+ *
+ * @param[out] len  Bytes that can be written at the returned pointer.
+ *                  0 if full. There may be more after commit().
+ */
+char *
+RingBuffer::write_span(size_t *len)
+{
+        const size_t pos = tail_ & mask_;
+        *len = std::min(space(), capacity() - pos);
+        return &buf_[pos];
+}
+
+/**
+ * Queue data written into write_span().
+ *
+ * @param[in] n  Bytes written there
+ */
+void
+RingBuffer::commit(size_t n)
+{
+        tail_ += std::min(n, space());
+}
+
+/**
+ * Copy data into the queue, as much as fits.
+ *
+ * @return  Bytes copied
+ */
+size_t
+RingBuffer::append(const char *data, size_t len)
+{
+        size_t done = 0;
+        while (done < len) {
+                size_t n;
+                char *p = write_span(&n);
+                if (!n) {
+                        break;
+                }
+                n = std::min(n, len - done);
+                memcpy(p, data + done, n);
+                commit(n);
+                done += n;
+        }
+        return done;
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,76 @@
+// -*- c++ -*-
+/**
+ * @file src/ringbuffer.h
+ * Fixed size byte queue
+ */
+#ifndef __INCLUDE_RINGBUFFER_H__
+#define __INCLUDE_RINGBUFFER_H__
+
+#include<stddef.h>
+
+#include<string>
+#include<vector>
+
+/**
+ * Byte queue of fixed capacity, a power of two.
+ *
+ * For the session data loops: data is read straight into the free
+ * space and written straight out of the queued data, so a partial
+ * write costs nothing and the memory per queue is bounded. When the
+ * queue is full, stop reading whatever fills it.
+ *
+ * Spans are contiguous, so the data or the space can come in two
+ * pieces when it wraps around the end. The span of queued data always
+ * starts at the oldest byte, and only grows until consume(), which is
+ * what a retried SSL_write() needs.
+ *
+ @code
+ RingBuffer q(65536);
+ size_t len, n;
+ char *p = q.write_span(&len);
+ if (len && IO_OK == fd.read_into(p, len, &n)) {
+         q.commit(n);
+ }
+ const char *d = q.read_span(&len);
+ if (len && IO_OK == sock.write_from(d, len, &n)) {
+         q.consume(n);
+ }
+ @endcode
+ */
+class RingBuffer {
+public:
+        explicit RingBuffer(size_t capacity);
+
+        size_t capacity() const { return mask_ + 1; }
+        size_t size() const { return tail_ - head_; }
+        size_t space() const { return capacity() - size(); }
+        bool empty() const { return head_ == tail_; }
+
+        const char *read_span(size_t *len) const;
+        void consume(size_t n);
+        char *write_span(size_t *len);
+        void commit(size_t n);
+
+        size_t append(const char *data, size_t len);
+        size_t append(const std::string &data)
+        {
+                return append(data.data(), data.size());
+        }
+        void clear() { head_ = tail_ = 0; }
+
+private:
+        std::vector<char> buf_;
+        size_t mask_;
+        size_t head_;           // bytes ever consumed
+        size_t tail_;           // bytes ever committed
+
+        RingBuffer(const RingBuffer&);
+        RingBuffer &operator=(const RingBuffer&);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
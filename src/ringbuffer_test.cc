@@ -0,0 +1,125 @@
+#include<string.h>
+
+#include<gtest/gtest.h>
+
+#include"ringbuffer.h"
+
+namespace {
+std::string
+take(RingBuffer &rb, size_t max)
+{
+  std::string ret;
+  while (ret.size() < max && !rb.empty()) {
+    size_t len;
+    const char *p = rb.read_span(&len);
+    len = std::min(len, max - ret.size());
+    ret.append(p, len);
+    rb.consume(len);
+  }
+  return ret;
+}
+}
+
+TEST(RingBuffer, Capacity)
+{
+  EXPECT_EQ(4096U, RingBuffer(0).capacity());
+  EXPECT_EQ(4096U, RingBuffer(4096).capacity());
+  EXPECT_EQ(8192U, RingBuffer(4097).capacity());
+  EXPECT_EQ(65536U, RingBuffer(50000).capacity());
+}
+
+TEST(RingBuffer, Empty)
+{
+  RingBuffer rb(4096);
+  size_t len = 1;
+  rb.read_span(&len);
+  EXPECT_EQ(0U, len);
+  EXPECT_TRUE(rb.empty());
+  EXPECT_EQ(4096U, rb.space());
+  rb.write_span(&len);
+  EXPECT_EQ(4096U, len);
+}
+
+TEST(RingBuffer, Full)
+{
+  RingBuffer rb(4096);
+  EXPECT_EQ(4096U, rb.append(std::string(5000, 'a')));
+  EXPECT_EQ(0U, rb.space());
+  EXPECT_EQ(0U, rb.append("b", 1));
+  size_t len = 1;
+  rb.write_span(&len);
+  EXPECT_EQ(0U, len);
+  EXPECT_EQ(std::string(4096, 'a'), take(rb, 5000));
+}
+
+TEST(RingBuffer, Wrap)
+{
+  RingBuffer rb(4096);
+  rb.append(std::string(3000, 'a'));
+  EXPECT_EQ(std::string(2000, 'a'), take(rb, 2000));
+
+  // 1096 bytes of space at the end, then 2000 at the start
+  size_t len;
+  char *w = rb.write_span(&len);
+  EXPECT_EQ(1096U, len);
+  memset(w, 'b', len);
+  rb.commit(len);
+  w = rb.write_span(&len);
+  EXPECT_EQ(2000U, len);
+  memset(w, 'c', 100);
+  rb.commit(100);
+  EXPECT_EQ(2196U, rb.size());
+
+  // data comes out in two pieces, in order
+  const char *r = rb.read_span(&len);
+  EXPECT_EQ(2096U, len);
+  EXPECT_EQ('a', r[0]);
+  EXPECT_EQ('b', r[len - 1]);
+  rb.consume(len);
+  r = rb.read_span(&len);
+  EXPECT_EQ(100U, len);
+  EXPECT_EQ(std::string(100, 'c'), std::string(r, len));
+}
+
+TEST(RingBuffer, SpanGrowsUntilConsumed)
+{
+  RingBuffer rb(4096);
+  rb.append("abc", 3);
+  size_t len1, len2;
+  const char *p1 = rb.read_span(&len1);
+  rb.append("def", 3);
+  const char *p2 = rb.read_span(&len2);
+  EXPECT_EQ(p1, p2);
+  EXPECT_EQ(3U, len1);
+  EXPECT_EQ(6U, len2);
+}
+
+TEST(RingBuffer, RestartWhenEmpty)
+{
+  RingBuffer rb(4096);
+  rb.append(std::string(4000, 'a'));
+  take(rb, 4000);
+  size_t len;
+  rb.write_span(&len);
+  EXPECT_EQ(4096U, len);
+}
+
+TEST(RingBuffer, Stream)
+{
+  RingBuffer rb(4096);
+  std::string in, out;
+  for (int c = 0; c < 200000; c++) {
+    in += (char)('a' + c % 26);
+  }
+  size_t pos = 0;
+  while (out.size() < in.size()) {
+    pos += rb.append(in.data() + pos, std::min((size_t)1000, in.size() - pos));
+    out += take(rb, 777);
+  }
+  EXPECT_EQ(in, out);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
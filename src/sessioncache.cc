@@ -0,0 +1,548 @@
+/**
+ * @file src/sessioncache.cc
+ * TLS session cache and ticket keys shared between processes
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<stddef.h>
+#include<stdint.h>
+#include<string.h>
+#include<pthread.h>
+
+#include<openssl/rand.h>
+#include<openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include<openssl/core_names.h>
+#include<openssl/params.h>
+#else
+#include<openssl/hmac.h>
+#endif
+
+#include"sessioncache.h"
+#include"errbase.h"
+
+/** Largest DER encoded session that fits in a slot. A session
+ * includes the client cert, so leave room for a big one. */
+static const size_t SLOT_DER = 4000;
+
+/** Session ticket key. */
+struct SessionCache::Key {
+        unsigned char name[16];
+        unsigned char hmac[32];
+        unsigned char aes[32];
+};
+
+/** One cached session. Free if idlen is 0. */
+struct SessionCache::Slot {
+        time_t expire;
+        unsigned char idlen;
+        unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+        uint16_t len;
+        unsigned char der[SLOT_DER];
+};
+
+/** Layout of the shared memory segment. */
+struct SessionCache::Shared {
+        pthread_mutex_t lock;
+        uint32_t slots;
+        uint32_t lifetime;
+        bool tickets;
+        bool single_use;
+        uint32_t key_lifetime;
+        time_t key_created;
+        bool have_previous;
+        Key keys[2];          // current, previous
+        Stats stats;
+        Slot slot[1];         // really 'slots' of them
+};
+
+SessionCache *SessionCache::installed_ = NULL;
+
+/**
+ *
+ */
+SessionCache::SessionCache()
+        :shm_(NULL),
+         lifetime_(300),
+         tickets_(false)
+{
+}
+
+/**
+ * Only unmaps. The segment lives on in other processes.
+ */
+SessionCache::~SessionCache()
+{
+        detach();
+}
+
+/**
+ * Set up a new shared segment.
+ *
+ * With neither cache slots nor tickets no segment is created, and
+ * install() turns resumption off.
+ *
+ * @param[in] slots         Number of cached sessions. 0 disables the cache.
+ * @param[in] lifetime      Seconds a session can be resumed
+ * @param[in] tickets       Use session tickets
+ * @param[in] key_lifetime  Seconds between ticket key rotations.
+ *                          0 means never.
+ * @param[in] single_use    A session can only be resumed once, which
+ *                          makes replayed TLS 1.3 early data fail.
+ *                          Stateless tickets can't be single use, so
+ *                          this turns them off. TLS 1.3 then hands out
+ *                          tickets that are just IDs into the cache.
+ */
+void
+SessionCache::create(unsigned slots, unsigned lifetime, bool tickets,
+                     unsigned key_lifetime, bool single_use)
+{
+        detach();
+        if (single_use) {
+                tickets = false;
+        }
+        lifetime_ = lifetime;
+        tickets_ = tickets;
+        if (!slots && !tickets) {
+                return;
+        }
+
+        SharedSegment seg;
+        Shared *shm = (Shared*)seg.create("tlsshd-sessions",
+                                          offsetof(Shared, slot)
+                                          + slots * sizeof(Slot));
+        SharedSegment::init_mutex(&shm->lock);
+        shm->slots = slots;
+        shm->lifetime = lifetime;
+        shm->tickets = tickets;
+        shm->single_use = single_use;
+        shm->key_lifetime = key_lifetime;
+        shm->key_created = time(0);
+        if (1 != RAND_bytes((unsigned char*)&shm->keys[0],
+                            sizeof(shm->keys[0]))) {
+                THROW(Err::ErrBase, "RAND_bytes() failed for ticket key");
+        }
+        seg_.swap(seg);
+        shm_ = shm;
+}
+
+/**
+ * Map a segment set up by create() in another process.
+ *
+ * @param[in] fd  From get_fd() of the creator. Taken over.
+ */
+void
+SessionCache::attach(int fd)
+{
+        detach();
+        shm_ = (Shared*)seg_.attach(fd, offsetof(Shared, slot), true);
+        if (seg_.size() < offsetof(Shared, slot)
+            + shm_->slots * sizeof(Slot)) {
+                detach();
+                THROW(Err::ErrBase, "session cache segment too small");
+        }
+        lifetime_ = shm_->lifetime;
+        tickets_ = shm_->tickets;
+}
+
+/**
+ * Unmap and close.
+ */
+void
+SessionCache::detach()
+{
+        seg_.detach();
+        shm_ = NULL;
+}
+
+/**
+ * Take the lock. A process that died holding it has left at most one
+ * half written slot, and a broken session fails to decode.
+ */
+void
+SessionCache::lock() const
+{
+        SharedSegment::lock(&shm_->lock);
+}
+
+/**
+ *
+ */
+void
+SessionCache::unlock() const
+{
+        SharedSegment::unlock(&shm_->lock);
+}
+
+/**
+ * Slot for a session ID. Call with the lock held.
+ */
+SessionCache::Slot *
+SessionCache::slot(const std::string &id) const
+{
+        // FNV-1a. Session IDs are random, this just spreads them out.
+        uint32_t h = 2166136261U;
+        std::string::const_iterator itr;
+        for (itr = id.begin(); itr != id.end(); ++itr) {
+                h = (h ^ (unsigned char)*itr) * 16777619U;
+        }
+        return &shm_->slot[h % shm_->slots];
+}
+
+/**
+ * Store a session, replacing whatever was in its slot.
+ *
+ * @param[in] id      Session ID
+ * @param[in] der     DER encoded session
+ * @param[in] expire  When it can no longer be resumed
+ * @return            false if caching is off or the session doesn't fit
+ */
+bool
+SessionCache::store(const std::string &id, const std::string &der,
+                    time_t expire)
+{
+        if (!shm_ || !shm_->slots
+            || id.empty() || id.size() > SSL_MAX_SSL_SESSION_ID_LENGTH
+            || der.size() > SLOT_DER) {
+                return false;
+        }
+        lock();
+        Slot *s = slot(id);
+        s->expire = expire;
+        s->idlen = id.size();
+        memcpy(s->id, id.data(), id.size());
+        s->len = der.size();
+        memcpy(s->der, der.data(), der.size());
+        shm_->stats.stores++;
+        unlock();
+        return true;
+}
+
+/**
+ * Find a session. If the cache was created single_use the session is
+ * also removed.
+ *
+ * @param[in]  id   Session ID
+ * @param[in]  now  Current time
+ * @param[out] der  DER encoded session
+ * @return          true if found and not expired
+ */
+bool
+SessionCache::lookup(const std::string &id, time_t now, std::string *der)
+{
+        bool found = false;
+
+        if (!shm_ || !shm_->slots || id.empty()) {
+                return false;
+        }
+        lock();
+        Slot *s = slot(id);
+        if (s->idlen == id.size()
+            && !memcmp(s->id, id.data(), id.size())
+            && s->expire > now) {
+                der->assign((char*)s->der, s->len);
+                found = true;
+                shm_->stats.hits++;
+                if (shm_->single_use) {
+                        s->idlen = 0;
+                }
+        } else {
+                shm_->stats.misses++;
+        }
+        unlock();
+        return found;
+}
+
+/**
+ * Forget a session.
+ */
+void
+SessionCache::remove(const std::string &id)
+{
+        if (!shm_ || !shm_->slots || id.empty()) {
+                return;
+        }
+        lock();
+        Slot *s = slot(id);
+        if (s->idlen == id.size() && !memcmp(s->id, id.data(), id.size())) {
+                s->idlen = 0;
+        }
+        unlock();
+}
+
+/**
+ * Replace the ticket key if it's old enough. The current key becomes
+ * the previous one, and tickets encrypted with it are still accepted
+ * (and renewed) until the next rotation. Done by the listener.
+ *
+ * @param[in] now  Current time
+ * @return         Seconds until the next rotation, or -1 if never.
+ */
+int
+SessionCache::rotate_keys(time_t now)
+{
+        if (!shm_ || !shm_->tickets || !shm_->key_lifetime) {
+                return -1;
+        }
+        lock();
+        if (now - shm_->key_created >= (time_t)shm_->key_lifetime) {
+                Key key;
+                if (1 == RAND_bytes((unsigned char*)&key, sizeof(key))) {
+                        shm_->keys[1] = shm_->keys[0];
+                        shm_->keys[0] = key;
+                        shm_->have_previous = true;
+                        shm_->key_created = now;
+                }
+                // else keep the old key and try again next time
+                memset(&key, 0, sizeof(key));
+        }
+        int left = shm_->key_created + shm_->key_lifetime - now;
+        unlock();
+        return left > 0 ? left : 1;
+}
+
+/**
+ *
+ */
+SessionCache::Stats
+SessionCache::stats() const
+{
+        Stats ret;
+        memset(&ret, 0, sizeof(ret));
+        if (shm_) {
+                lock();
+                ret = shm_->stats;
+                unlock();
+        }
+        return ret;
+}
+
+/**
+ * Copy of the key new tickets are encrypted with.
+ *
+ * @return  false if detached
+ */
+bool
+SessionCache::get_current_key(Key *key)
+{
+        if (!shm_) {
+                return false;
+        }
+        lock();
+        *key = shm_->keys[0];
+        unlock();
+        return true;
+}
+
+/**
+ * Find the ticket key with a given name.
+ *
+ * @param[in]  name     Key name from the ticket
+ * @param[out] key      The key
+ * @param[out] current  false if it's the previous key
+ * @return              false if it's not one of ours (any more), or
+ *                      detached
+ */
+bool
+SessionCache::get_key(const unsigned char *name, Key *key, bool *current)
+{
+        bool found = true;
+        if (!shm_) {
+                return false;
+        }
+        lock();
+        if (!memcmp(name, shm_->keys[0].name, sizeof(key->name))) {
+                *key = shm_->keys[0];
+                *current = true;
+        } else if (shm_->have_previous
+                   && !memcmp(name, shm_->keys[1].name, sizeof(key->name))) {
+                *key = shm_->keys[1];
+                *current = false;
+        } else {
+                found = false;
+        }
+        if (found) {
+                shm_->stats.ticket_hits++;
+        } else {
+                shm_->stats.ticket_misses++;
+        }
+        unlock();
+        return found;
+}
+
+/**
+ * Set up resumption on a server context.
+ *
+ * The callbacks can't carry a pointer, so there can be only one
+ * installed SessionCache per process.
+ *
+ * @param[in] ctx  Built server context
+ */
+void
+SessionCache::install(SSL_CTX *ctx)
+{
+        static const unsigned char sid_ctx[] = "tlsshd";
+
+        installed_ = this;
+        SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+        SSL_CTX_set_timeout(ctx, lifetime_);
+        if (shm_ && shm_->slots) {
+                SSL_CTX_set_session_cache_mode(ctx,
+                                               SSL_SESS_CACHE_SERVER
+                                               | SSL_SESS_CACHE_NO_INTERNAL);
+                SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+                SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+                SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+        } else {
+                SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        }
+        if (shm_ && tickets_) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+                SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+                SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+        } else {
+                SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        if (shm_ && shm_->single_use) {
+                // each ticket takes a slot, and only the last is used
+                SSL_CTX_set_num_tickets(ctx, 1);
+
+                // lookup() is the replay protection. OpenSSL's own
+                // only works with its internal cache, and would turn
+                // down every session from this one.
+                SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+        }
+#endif
+}
+
+/**
+ * OpenSSL callback: new session to cache.
+ *
+ * @return 0, OpenSSL keeps its reference
+ */
+int
+SessionCache::new_session_cb(SSL *, SSL_SESSION *sess)
+{
+        unsigned int idlen;
+        const unsigned char *id = SSL_SESSION_get_id(sess, &idlen);
+        int len = i2d_SSL_SESSION(sess, NULL);
+        if (len <= 0 || (size_t)len > SLOT_DER) {
+                return 0;
+        }
+        std::string der(len, 0);
+        unsigned char *p = (unsigned char*)&der[0];
+        i2d_SSL_SESSION(sess, &p);
+        installed_->store(std::string((const char*)id, idlen), der,
+                          SSL_SESSION_get_time(sess)
+                          + SSL_SESSION_get_timeout(sess));
+        return 0;
+}
+
+/**
+ * OpenSSL callback: client wants to resume this session ID.
+ *
+ * @return New session object for OpenSSL to own, or NULL
+ */
+SSL_SESSION *
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+SessionCache::get_session_cb(SSL *, const unsigned char *id, int idlen,
+                             int *copy)
+#else
+SessionCache::get_session_cb(SSL *, unsigned char *id, int idlen,
+                             int *copy)
+#endif
+{
+        std::string der;
+
+        *copy = 0;
+        if (!installed_->lookup(std::string((const char*)id, idlen),
+                                time(0), &der)) {
+                return NULL;
+        }
+        const unsigned char *p = (const unsigned char*)der.data();
+        return d2i_SSL_SESSION(NULL, &p, der.size());
+}
+
+/**
+ * OpenSSL callback: session is bad or expired.
+ */
+void
+SessionCache::remove_session_cb(SSL_CTX *, SSL_SESSION *sess)
+{
+        unsigned int idlen;
+        const unsigned char *id = SSL_SESSION_get_id(sess, &idlen);
+        installed_->remove(std::string((const char*)id, idlen));
+}
+
+/**
+ * Key the ticket HMAC (SHA-256). With OpenSSL 3.0 and up that's an
+ * EVP_MAC_CTX, before that the deprecated HMAC_CTX.
+ */
+bool
+SessionCache::init_ticket_mac(TicketMAC *mctx, const Key &key)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        OSSL_PARAM params[2];
+        params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                     (char*)"SHA256", 0);
+        params[1] = OSSL_PARAM_construct_end();
+        return EVP_MAC_CTX_set_params(mctx, params)
+                && EVP_MAC_init(mctx, key.hmac, sizeof(key.hmac), NULL);
+#else
+        return HMAC_Init_ex(mctx, key.hmac, sizeof(key.hmac),
+                            EVP_sha256(), NULL);
+#endif
+}
+
+/**
+ * OpenSSL callback: ticket key for encrypting (enc=1) or decrypting
+ * (enc=0) a session ticket.
+ *
+ * @return 1 ok, 2 ok but issue a new ticket, 0 unknown key (full
+ *         handshake) or no key to issue one with, -1 error
+ */
+int
+SessionCache::ticket_key_cb(SSL *, unsigned char *name, unsigned char *iv,
+                            EVP_CIPHER_CTX *ectx, TicketMAC *mctx, int enc)
+{
+        Key key;
+        bool current = true;
+        int ret = 1;
+
+        if (enc) {
+                if (!installed_->get_current_key(&key)) {
+                        ret = 0;
+                } else if (1 != RAND_bytes(iv, EVP_CIPHER_iv_length(
+                                                   EVP_aes_256_cbc()))) {
+                        ret = -1;
+                } else {
+                        memcpy(name, key.name, sizeof(key.name));
+                        if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+                                                key.aes, iv)
+                            || !init_ticket_mac(mctx, key)) {
+                                ret = -1;
+                        }
+                }
+        } else if (!installed_->get_key(name, &key, &current)) {
+                ret = 0;
+        } else if (!init_ticket_mac(mctx, key)
+                   || !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+                                          key.aes, iv)) {
+                ret = -1;
+        } else {
+                ret = current ? 1 : 2;
+        }
+        memset(&key, 0, sizeof(key));
+        return ret;
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
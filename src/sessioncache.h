@@ -0,0 +1,124 @@
+// -*- c++ -*-
+/**
+ * @file src/sessioncache.h
+ * TLS session cache and ticket keys shared between processes
+ */
+#ifndef __INCLUDE_SESSIONCACHE_H__
+#define __INCLUDE_SESSIONCACHE_H__
+
+#include<time.h>
+
+#include<string>
+
+#include<openssl/ssl.h>
+
+#include"sharedsegment.h"
+
+/**
+ * Server side TLS session resumption across fork()ed processes.
+ *
+ * Every sslproc handles one connection and then exits, so OpenSSL's
+ * own per-process cache never gets a second use. This keeps what has
+ * to outlive a connection in one shared memory segment, created by
+ * the listener before it starts any children:
+ *
+ *  - A session cache with a fixed number of slots. The slot is picked
+ *    from the session ID, and a new session just replaces whatever
+ *    was there. OpenSSL uses it through the external cache callbacks.
+ *  - Session ticket keys. New tickets are encrypted with the current
+ *    key and the previous key is still accepted, so rotate_keys() can
+ *    replace them without breaking tickets that were just handed out.
+ *  - Hit and miss counters, for all processes together.
+ *
+ * For TLS 1.3 early data the cache can be made single use, so that a
+ * replayed ClientHello can't resume (and so can't get its early data
+ * accepted) a second time.
+ *
+ * Access is serialised by a process shared mutex in the segment. If
+ * the segment is backed by an fd it can also be attach()ed by a
+ * process that was exec()ed instead of fork()ed.
+ *
+ @code
+ SessionCache cache;
+ cache.create(1024, 600, true, 3600);
+ ...
+ cache.install(ctx->get());   // in every process that accepts
+ @endcode
+ */
+class SessionCache {
+public:
+        /** Counters since create(). */
+        struct Stats {
+                unsigned long hits;
+                unsigned long misses;
+                unsigned long stores;
+                unsigned long ticket_hits;
+                unsigned long ticket_misses;
+        };
+
+        SessionCache();
+        ~SessionCache();
+
+        void create(unsigned slots, unsigned lifetime, bool tickets,
+                    unsigned key_lifetime, bool single_use = false);
+        void attach(int fd);
+        void detach();
+        bool valid() const { return shm_ != NULL; }
+        int get_fd() const { return seg_.get_fd(); }
+
+        bool store(const std::string &id, const std::string &der,
+                   time_t expire);
+        bool lookup(const std::string &id, time_t now, std::string *der);
+        void remove(const std::string &id);
+        int rotate_keys(time_t now);
+        Stats stats() const;
+
+        void install(SSL_CTX *ctx);
+
+private:
+        struct Shared;
+        struct Slot;
+        struct Key;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        typedef EVP_MAC_CTX TicketMAC;
+#else
+        typedef HMAC_CTX TicketMAC;
+#endif
+
+        SharedSegment seg_;
+        Shared *shm_;
+        unsigned lifetime_;
+        bool tickets_;
+
+        static SessionCache *installed_;
+
+        Slot *slot(const std::string &id) const;
+        void lock() const;
+        void unlock() const;
+        bool get_key(const unsigned char *name, Key *key, bool *current);
+        bool get_current_key(Key *key);
+
+        static int new_session_cb(SSL *ssl, SSL_SESSION *sess);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        static SSL_SESSION *get_session_cb(SSL *ssl, const unsigned char *id,
+                                           int idlen, int *copy);
+#else
+        static SSL_SESSION *get_session_cb(SSL *ssl, unsigned char *id,
+                                           int idlen, int *copy);
+#endif
+        static void remove_session_cb(SSL_CTX *ctx, SSL_SESSION *sess);
+        static int ticket_key_cb(SSL *ssl, unsigned char *name,
+                                 unsigned char *iv, EVP_CIPHER_CTX *ectx,
+                                 TicketMAC *mctx, int enc);
+        static bool init_ticket_mac(TicketMAC *mctx, const Key &key);
+
+        SessionCache(const SessionCache&);
+        SessionCache &operator=(const SessionCache&);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,143 @@
+#include<sys/types.h>
+#include<sys/wait.h>
+#include<unistd.h>
+#include<fcntl.h>
+
+#include<gtest/gtest.h>
+
+#include"sessioncache.h"
+
+TEST(SessionCache, Disabled)
+{
+  SessionCache sc;
+  sc.create(0, 300, false, 0);
+  EXPECT_FALSE(sc.valid());
+  EXPECT_FALSE(sc.store("id", "der", 1000));
+  std::string der;
+  EXPECT_FALSE(sc.lookup("id", 1, &der));
+  EXPECT_EQ(-1, sc.rotate_keys(1));
+}
+
+TEST(SessionCache, StoreLookup)
+{
+  SessionCache sc;
+  sc.create(16, 300, false, 0);
+  ASSERT_TRUE(sc.valid());
+
+  std::string der;
+  EXPECT_FALSE(sc.lookup("id1", 100, &der));
+  EXPECT_TRUE(sc.store("id1", "session one", 200));
+  EXPECT_TRUE(sc.lookup("id1", 100, &der));
+  EXPECT_EQ("session one", der);
+
+  // expired
+  EXPECT_FALSE(sc.lookup("id1", 200, &der));
+
+  sc.remove("id1");
+  EXPECT_FALSE(sc.lookup("id1", 100, &der));
+
+  SessionCache::Stats st(sc.stats());
+  EXPECT_EQ(1U, st.hits);
+  EXPECT_EQ(3U, st.misses);
+  EXPECT_EQ(1U, st.stores);
+}
+
+TEST(SessionCache, SingleUse)
+{
+  SessionCache sc;
+  sc.create(16, 300, true, 3600, true);
+  ASSERT_TRUE(sc.valid());
+
+  std::string der;
+  EXPECT_TRUE(sc.store("id1", "session one", 200));
+  EXPECT_TRUE(sc.lookup("id1", 100, &der));
+  EXPECT_EQ("session one", der);
+  EXPECT_FALSE(sc.lookup("id1", 100, &der));
+}
+
+TEST(SessionCache, TooBig)
+{
+  SessionCache sc;
+  sc.create(16, 300, false, 0);
+  EXPECT_FALSE(sc.store("id", std::string(100000, 'x'), 200));
+  EXPECT_FALSE(sc.store(std::string(33, 'i'), "der", 200));
+  EXPECT_FALSE(sc.store("", "der", 200));
+}
+
+TEST(SessionCache, SharedAcrossFork)
+{
+  SessionCache sc;
+  sc.create(16, 300, false, 0);
+
+  pid_t pid = fork();
+  ASSERT_LE(0, pid);
+  if (!pid) {
+    _exit(sc.store("child", "from child", 200) ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, status);
+
+  std::string der;
+  EXPECT_TRUE(sc.lookup("child", 100, &der));
+  EXPECT_EQ("from child", der);
+}
+
+TEST(SessionCache, Attach)
+{
+  SessionCache sc;
+  sc.create(16, 300, true, 0);
+  if (0 > sc.get_fd()) {
+    return;  // no memfd_create()
+  }
+  EXPECT_TRUE(sc.store("id", "der", 200));
+
+  SessionCache other;
+  other.attach(dup(sc.get_fd()));
+  std::string der;
+  EXPECT_TRUE(other.lookup("id", 100, &der));
+  EXPECT_EQ("der", der);
+}
+
+TEST(SessionCache, Detach)
+{
+  SessionCache sc;
+  sc.create(16, 300, true, 60);
+
+  pid_t pid = fork();
+  ASSERT_LE(0, pid);
+  if (!pid) {
+    sc.detach();
+    _exit(!sc.valid() && 0 > sc.get_fd()
+          && !sc.store("child", "from child", 200)
+          && -1 == sc.rotate_keys(time(0)) ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, status);
+
+  std::string der;
+  EXPECT_TRUE(sc.valid());
+  EXPECT_FALSE(sc.lookup("child", 100, &der));
+}
+
+TEST(SessionCache, RotateKeys)
+{
+  SessionCache sc;
+  sc.create(0, 300, true, 60);
+  ASSERT_TRUE(sc.valid());
+
+  time_t now = time(0);
+  int left = sc.rotate_keys(now);
+  EXPECT_LE(59, left);
+  EXPECT_GE(60, left);
+
+  EXPECT_EQ(60, sc.rotate_keys(now + 60));
+  EXPECT_EQ(30, sc.rotate_keys(now + 90));
+  EXPECT_EQ(60, sc.rotate_keys(now + 120));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
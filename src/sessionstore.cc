@@ -0,0 +1,210 @@
+/**
+ * @file src/sessionstore.cc
+ * Client side TLS sessions saved between runs
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<stdio.h>
+#include<ctype.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+
+#include<vector>
+
+#include"sessionstore.h"
+#include"fdwrap.h"
+#include"errbase.h"
+
+/** No session file is anywhere near this big. */
+static const size_t MAX_FILE = 65536;
+
+/**
+ * @param[in] dir  Directory to keep the sessions in. Created on first
+ *                 save() if it doesn't exist.
+ */
+SessionStore::SessionStore(const std::string &dir)
+        :dir_(dir)
+{
+}
+
+/**
+ * File name for host and port. Anything that's not obviously safe in a
+ * file name is %-escaped.
+ */
+std::string
+SessionStore::filename(const std::string &host,
+                       const std::string &port) const
+{
+        std::string ret(dir_ + "/");
+        const std::string in(host + " " + port);
+
+        for (std::string::const_iterator itr = in.begin();
+             itr != in.end();
+             ++itr) {
+                const unsigned char ch = *itr;
+                if (isalnum(ch) || ch == '.' || ch == '-' || ch == ':') {
+                        ret += ch;
+                } else if (ch == ' ' && itr != in.begin()) {
+                        ret += '_';
+                } else {
+                        char buf[4];
+                        snprintf(buf, sizeof(buf), "%%%.2x", ch);
+                        ret += buf;
+                }
+        }
+        return ret;
+}
+
+/**
+ * True if the directory is ours and nobody else can get at it.
+ */
+bool
+SessionStore::dir_ok() const
+{
+        struct stat st;
+        if (lstat(dir_.c_str(), &st)) {
+                return false;
+        }
+        return S_ISDIR(st.st_mode)
+                && st.st_uid == geteuid()
+                && !(st.st_mode & 077);
+}
+
+/**
+ * Get the saved session for host and port, if there is one that
+ * hasn't expired.
+ *
+ * @param[in]  host         Host name as given by the user
+ * @param[in]  port         Port as given by the user
+ * @param[in]  now          Current time
+ * @param[out] fingerprint  Fingerprint of the server cert
+ * @param[out] pem          PEM encoded session
+ *
+ * @return true if found
+ */
+bool
+SessionStore::load(const std::string &host, const std::string &port,
+                   time_t now, std::string *fingerprint, std::string *pem)
+{
+        if (!dir_ok()) {
+                return false;
+        }
+
+        FDWrap fd(open(filename(host, port).c_str(),
+                       O_RDONLY | O_NOFOLLOW | O_NOCTTY));
+        if (!fd.valid()) {
+                return false;
+        }
+
+        struct stat st;
+        if (fstat(fd.get(), &st)
+            || !S_ISREG(st.st_mode)
+            || st.st_uid != geteuid()
+            || (st.st_mode & 077)
+            || st.st_size > (off_t)MAX_FILE) {
+                return false;
+        }
+
+        std::string data;
+        for (;;) {
+                char buf[4096];
+                ssize_t n = read(fd.get(), buf, sizeof(buf));
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (n < 0) {
+                        return false;
+                }
+                if (!n) {
+                        break;
+                }
+                data.append(buf, n);
+                if (data.size() > MAX_FILE) {
+                        return false;
+                }
+        }
+
+        // "<fingerprint> <expire>\n<pem>"
+        const size_t eol = data.find('\n');
+        const size_t sp = data.find(' ');
+        if (eol == std::string::npos || sp == std::string::npos
+            || sp == 0 || sp > eol) {
+                return false;
+        }
+        const std::string exp(data.substr(sp + 1, eol - sp - 1));
+        char *end;
+        const long long expire = strtoll(exp.c_str(), &end, 10);
+        if (exp.empty() || *end || expire <= now) {
+                return false;
+        }
+
+        *fingerprint = data.substr(0, sp);
+        *pem = data.substr(eol + 1);
+        return true;
+}
+
+/**
+ * Save the session for host and port, replacing any older one.
+ *
+ * Written to a temp file that's then renamed, so a concurrent load()
+ * sees either the old or the new session.
+ */
+void
+SessionStore::save(const std::string &host, const std::string &port,
+                   const std::string &fingerprint, const std::string &pem,
+                   time_t expire)
+{
+        if (mkdir(dir_.c_str(), 0700) && errno != EEXIST) {
+                THROW(Err::ErrSys, "mkdir(" + dir_ + ")");
+        }
+        if (!dir_ok()) {
+                THROW(Err::ErrBase, "Not saving TLS session: " + dir_
+                      + " is not a directory only accessible by its owner");
+        }
+
+        std::string tmpl(dir_ + "/.tmpXXXXXX");
+        std::vector<char> tmp(tmpl.begin(), tmpl.end());
+        tmp.push_back(0);
+        FDWrap fd(mkstemp(&tmp[0]));
+        if (!fd.valid()) {
+                THROW(Err::ErrSys, "mkstemp(" + tmpl + ")");
+        }
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %lld\n", (long long)expire);
+        const std::string data(fingerprint + buf + pem);
+        try {
+                fd.full_write(data);
+                fd.close();
+                if (rename(&tmp[0], filename(host, port).c_str())) {
+                        THROW(Err::ErrSys, "rename()");
+                }
+        } catch (...) {
+                unlink(&tmp[0]);
+                throw;
+        }
+}
+
+/**
+ * Forget the session for host and port, e.g. because the server
+ * didn't accept it.
+ */
+void
+SessionStore::remove(const std::string &host, const std::string &port)
+{
+        if (!dir_ok()) {
+                return;
+        }
+        unlink(filename(host, port).c_str());
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,54 @@
+// -*- c++ -*-
+/**
+ * @file src/sessionstore.h
+ * Client side TLS sessions saved between runs
+ */
+#ifndef __INCLUDE_SESSIONSTORE_H__
+#define __INCLUDE_SESSIONSTORE_H__
+
+#include<time.h>
+
+#include<string>
+
+/**
+ * Directory of resumable TLS sessions, one file per host and port.
+ *
+ * Each file holds the fingerprint of the server cert the session was
+ * made with, when the session expires, and the session itself (PEM).
+ * What's in a session is enough to impersonate the client to that
+ * server until it expires, so the directory and the files must be
+ * owned by the user and not be accessible to anyone else. Anything
+ * that doesn't look right is ignored, and never overwritten.
+ *
+ @code
+ SessionStore store("/home/user/.tlssh/sessions");
+ std::string fp, pem;
+ if (store.load("host", "232", time(0), &fp, &pem)) {
+         ...
+ }
+ store.save("host", "232", fp, pem, time(0) + 3600);
+ @endcode
+ */
+class SessionStore {
+        const std::string dir_;
+
+        std::string filename(const std::string &host,
+                             const std::string &port) const;
+        bool dir_ok() const;
+public:
+        SessionStore(const std::string &dir);
+
+        bool load(const std::string &host, const std::string &port,
+                  time_t now, std::string *fingerprint, std::string *pem);
+        void save(const std::string &host, const std::string &port,
+                  const std::string &fingerprint, const std::string &pem,
+                  time_t expire);
+        void remove(const std::string &host, const std::string &port);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,129 @@
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+
+#include<gtest/gtest.h>
+
+#include"sessionstore.h"
+
+class SessionStoreTest: public ::testing::Test {
+protected:
+  std::string dir_;
+
+  void SetUp()
+  {
+    char tmpl[] = "/tmp/sessionstore_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+    dir_ = tmpl;
+  }
+  void TearDown()
+  {
+    system(("rm -rf " + dir_).c_str());
+  }
+};
+
+TEST_F(SessionStoreTest, SaveLoad)
+{
+  SessionStore store(dir_ + "/sessions");
+  std::string fp, pem;
+
+  EXPECT_FALSE(store.load("host", "232", 100, &fp, &pem));
+
+  store.save("host", "232", "AA:BB", "pem\ndata\n", 200);
+  EXPECT_TRUE(store.load("host", "232", 100, &fp, &pem));
+  EXPECT_EQ("AA:BB", fp);
+  EXPECT_EQ("pem\ndata\n", pem);
+
+  // other host or port
+  EXPECT_FALSE(store.load("host2", "232", 100, &fp, &pem));
+  EXPECT_FALSE(store.load("host", "233", 100, &fp, &pem));
+
+  // expired
+  EXPECT_FALSE(store.load("host", "232", 200, &fp, &pem));
+
+  // replace
+  store.save("host", "232", "CC:DD", "new", 300);
+  EXPECT_TRUE(store.load("host", "232", 100, &fp, &pem));
+  EXPECT_EQ("CC:DD", fp);
+  EXPECT_EQ("new", pem);
+
+  store.remove("host", "232");
+  EXPECT_FALSE(store.load("host", "232", 100, &fp, &pem));
+}
+
+TEST_F(SessionStoreTest, OddHostnames)
+{
+  SessionStore store(dir_);
+  std::string fp, pem;
+
+  chmod(dir_.c_str(), 0700);
+  store.save("../../etc/passwd", "232", "AA", "one", 200);
+  store.save("::1", "232", "BB", "two", 200);
+  EXPECT_TRUE(store.load("../../etc/passwd", "232", 100, &fp, &pem));
+  EXPECT_EQ("one", pem);
+  EXPECT_TRUE(store.load("::1", "232", 100, &fp, &pem));
+  EXPECT_EQ("two", pem);
+  EXPECT_FALSE(store.load("..", "%2f..%2f..%2fetc%2fpasswd_232",
+                          100, &fp, &pem));
+}
+
+TEST_F(SessionStoreTest, Permissions)
+{
+  const std::string dir(dir_ + "/sessions");
+  SessionStore store(dir);
+  std::string fp, pem;
+
+  store.save("host", "232", "AA", "pem", 200);
+  struct stat st;
+  ASSERT_EQ(0, stat(dir.c_str(), &st));
+  EXPECT_EQ(0700, st.st_mode & 0777);
+
+  // file readable by others
+  ASSERT_EQ(0, chmod((dir + "/host_232").c_str(), 0644));
+  EXPECT_FALSE(store.load("host", "232", 100, &fp, &pem));
+  ASSERT_EQ(0, chmod((dir + "/host_232").c_str(), 0600));
+  EXPECT_TRUE(store.load("host", "232", 100, &fp, &pem));
+
+  // directory readable by others
+  ASSERT_EQ(0, chmod(dir.c_str(), 0755));
+  EXPECT_FALSE(store.load("host", "232", 100, &fp, &pem));
+  EXPECT_ANY_THROW(store.save("host", "232", "AA", "pem", 200));
+  ASSERT_EQ(0, chmod(dir.c_str(), 0700));
+
+  // symlink
+  ASSERT_EQ(0, rename((dir + "/host_232").c_str(),
+                      (dir + "/real").c_str()));
+  ASSERT_EQ(0, symlink("real", (dir + "/host_232").c_str()));
+  EXPECT_FALSE(store.load("host", "232", 100, &fp, &pem));
+}
+
+TEST_F(SessionStoreTest, Garbage)
+{
+  SessionStore store(dir_);
+  std::string fp, pem;
+
+  chmod(dir_.c_str(), 0700);
+  const char *bad[] = {
+    "",
+    "no newline",
+    "AA\n",
+    " 200\npem",
+    "AA notanumber\npem",
+    NULL,
+  };
+  for (int c = 0; bad[c]; c++) {
+    int fd = open((dir_ + "/host_232").c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ((ssize_t)strlen(bad[c]), write(fd, bad[c], strlen(bad[c])));
+    close(fd);
+    EXPECT_FALSE(store.load("host", "232", 100, &fp, &pem)) << bad[c];
+  }
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
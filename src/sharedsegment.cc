@@ -0,0 +1,201 @@
+/**
+ * @file src/sharedsegment.cc
+ * Shared memory segment, inherited by fork() or passed as an fd
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+#include<algorithm>
+
+#include"sharedsegment.h"
+#include"errbase.h"
+
+/**
+ *
+ */
+SharedSegment::SharedSegment()
+        :ptr_(NULL),
+         size_(0),
+         fd_(-1)
+{
+}
+
+/**
+ * Only unmaps. The segment lives on in other processes.
+ */
+SharedSegment::~SharedSegment()
+{
+        detach();
+}
+
+/**
+ * Map a new zero filled segment, replacing the current one.
+ *
+ * @param[in] name  memfd name, shows up in /proc/<pid>/maps
+ * @param[in] size  Bytes
+ * @return          Start of the segment
+ */
+void *
+SharedSegment::create(const char *name, size_t size)
+{
+        detach();
+        void *p;
+#ifdef HAVE_MEMFD_CREATE
+        fd_ = memfd_create(name, MFD_CLOEXEC);
+        if (0 > fd_) {
+                THROW(Err::ErrSys, "memfd_create()");
+        }
+        if (ftruncate(fd_, size)) {
+                detach();
+                THROW(Err::ErrSys, "ftruncate()");
+        }
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+#else
+        (void)name;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+                detach();
+                THROW(Err::ErrSys, "mmap()");
+        }
+        ptr_ = p;
+        size_ = size;
+        return ptr_;
+}
+
+/**
+ * Map a segment set up by create() in another process, replacing the
+ * current one.
+ *
+ * @param[in] fd        From get_fd() of the creator. Taken over.
+ * @param[in] min_size  Fail if the segment is smaller than this
+ * @param[in] writable  Map read-write, not just read-only
+ * @return              Start of the segment
+ */
+void *
+SharedSegment::attach(int fd, size_t min_size, bool writable)
+{
+        struct stat st;
+
+        detach();
+        fd_ = fd;
+        if (fstat(fd_, &st)) {
+                detach();
+                THROW(Err::ErrSys, "fstat()");
+        }
+        if ((size_t)st.st_size < min_size) {
+                detach();
+                THROW(Err::ErrBase, "shared segment too small");
+        }
+        void *p = mmap(NULL, st.st_size,
+                       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) {
+                detach();
+                THROW(Err::ErrSys, "mmap()");
+        }
+        ptr_ = p;
+        size_ = st.st_size;
+        return ptr_;
+}
+
+/**
+ * Unmap and close.
+ */
+void
+SharedSegment::detach()
+{
+        if (ptr_) {
+                munmap(ptr_, size_);
+                ptr_ = NULL;
+                size_ = 0;
+        }
+        if (fd_ >= 0) {
+                close(fd_);
+                fd_ = -1;
+        }
+}
+
+/**
+ * Make this mapping read-only, once it's filled in. Children inherit
+ * that, and attach() maps it read-only if asked to.
+ */
+void
+SharedSegment::protect()
+{
+        if (ptr_) {
+                mprotect(ptr_, size_, PROT_READ);
+        }
+}
+
+/**
+ *
+ */
+void
+SharedSegment::swap(SharedSegment &other)
+{
+        std::swap(ptr_, other.ptr_);
+        std::swap(size_, other.size_);
+        std::swap(fd_, other.fd_);
+}
+
+/**
+ * Set up a process shared, and where possible robust, mutex in a
+ * segment.
+ */
+void
+SharedSegment::init_mutex(pthread_mutex_t *mutex)
+{
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+        errno = pthread_mutex_init(mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (errno) {
+                THROW(Err::ErrSys, "pthread_mutex_init()");
+        }
+}
+
+/**
+ * Take a mutex from init_mutex(). If the last owner died holding it,
+ * take it anyway. It's up to the caller's layout to make a half done
+ * write harmless.
+ */
+void
+SharedSegment::lock(pthread_mutex_t *mutex)
+{
+        int err = pthread_mutex_lock(mutex);
+#ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+        if (err == EOWNERDEAD) {
+                pthread_mutex_consistent(mutex);
+        }
+#else
+        (void)err;
+#endif
+}
+
+/**
+ *
+ */
+void
+SharedSegment::unlock(pthread_mutex_t *mutex)
+{
+        pthread_mutex_unlock(mutex);
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
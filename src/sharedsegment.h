@@ -0,0 +1,62 @@
+// -*- c++ -*-
+/**
+ * @file src/sharedsegment.h
+ * Shared memory segment, inherited by fork() or passed as an fd
+ */
+#ifndef __INCLUDE_SHAREDSEGMENT_H__
+#define __INCLUDE_SHAREDSEGMENT_H__
+
+#include<stddef.h>
+#include<pthread.h>
+
+/**
+ * One MAP_SHARED mapping, for tables that the listener sets up once
+ * and every child process uses.
+ *
+ * Where memfd_create() is available the mapping is backed by a memfd,
+ * so a process that was exec()ed instead of fork()ed can attach() it
+ * given the fd. Otherwise it's anonymous memory, and get_fd() is -1.
+ *
+ * Also has the process shared mutex that writable segments keep at
+ * their start. It's robust where the system supports that, so a
+ * process that dies holding it doesn't lock out the rest.
+ *
+ @code
+ SharedSegment seg;
+ Table *t = (Table*)seg.create("tlsshd-table", size);
+ SharedSegment::init_mutex(&t->lock);
+ @endcode
+ */
+class SharedSegment {
+public:
+        SharedSegment();
+        ~SharedSegment();
+
+        void *create(const char *name, size_t size);
+        void *attach(int fd, size_t min_size, bool writable);
+        void detach();
+        void protect();
+        void swap(SharedSegment &other);
+        void *get() const { return ptr_; }
+        size_t size() const { return size_; }
+        int get_fd() const { return fd_; }
+
+        static void init_mutex(pthread_mutex_t *mutex);
+        static void lock(pthread_mutex_t *mutex);
+        static void unlock(pthread_mutex_t *mutex);
+
+private:
+        void *ptr_;
+        size_t size_;
+        int fd_;
+
+        SharedSegment(const SharedSegment&);
+        SharedSegment &operator=(const SharedSegment&);
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,101 @@
+#include<string.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+#include<unistd.h>
+
+#include<gtest/gtest.h>
+
+#include"sharedsegment.h"
+#include"errbase.h"
+
+TEST(SharedSegment, Create)
+{
+  SharedSegment seg;
+  EXPECT_EQ(NULL, seg.get());
+  char *p = (char*)seg.create("test", 4096);
+  ASSERT_TRUE(p != NULL);
+  EXPECT_EQ(p, seg.get());
+  EXPECT_EQ(4096U, seg.size());
+  EXPECT_EQ(0, p[0]);
+  EXPECT_EQ(0, p[4095]);
+
+  seg.detach();
+  EXPECT_EQ(NULL, seg.get());
+  EXPECT_EQ(0U, seg.size());
+  EXPECT_GT(0, seg.get_fd());
+}
+
+TEST(SharedSegment, SharedAcrossFork)
+{
+  SharedSegment seg;
+  char *p = (char*)seg.create("test", 4096);
+
+  pid_t pid = fork();
+  ASSERT_LE(0, pid);
+  if (!pid) {
+    strcpy(p, "from child");
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, status);
+  EXPECT_STREQ("from child", p);
+}
+
+TEST(SharedSegment, Attach)
+{
+  SharedSegment seg;
+  char *p = (char*)seg.create("test", 4096);
+  if (0 > seg.get_fd()) {
+    return;  // no memfd_create()
+  }
+  strcpy(p, "hello");
+
+  SharedSegment other;
+  char *q = (char*)other.attach(dup(seg.get_fd()), 4096, true);
+  EXPECT_EQ(4096U, other.size());
+  EXPECT_STREQ("hello", q);
+  strcpy(q, "world");
+  EXPECT_STREQ("world", p);
+
+  SharedSegment small;
+  EXPECT_THROW(small.attach(dup(seg.get_fd()), 8192, false),
+               Err::ErrBase);
+  EXPECT_EQ(NULL, small.get());
+  EXPECT_GT(0, small.get_fd());
+}
+
+TEST(SharedSegment, Swap)
+{
+  SharedSegment a, b;
+  void *p = a.create("test", 4096);
+  b.swap(a);
+  EXPECT_EQ(NULL, a.get());
+  EXPECT_EQ(p, b.get());
+  EXPECT_EQ(4096U, b.size());
+}
+
+TEST(SharedSegment, Mutex)
+{
+  SharedSegment seg;
+  pthread_mutex_t *m = (pthread_mutex_t*)seg.create("test", 4096);
+  SharedSegment::init_mutex(m);
+
+  pid_t pid = fork();
+  ASSERT_LE(0, pid);
+  if (!pid) {
+    SharedSegment::lock(m);
+    SharedSegment::unlock(m);
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, status);
+  SharedSegment::lock(m);
+  SharedSegment::unlock(m);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
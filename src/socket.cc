@@ -9,6 +9,7 @@
 #include<unistd.h>
 #include<string.h>
 #include<fcntl.h>
+#include<poll.h>
 #include<netinet/in.h>
 #include<netinet/tcp.h>
 #include<sys/types.h>
@@ -29,7 +30,10 @@
  * @param[in] infd File descriptor to use.
  */
 Socket::Socket(int infd)
-	:debug(false)
+	:debug(false),
+         listen_backlog_(5),
+         reuseport_(false),
+         defer_accept_(0)
 {
         connected_af_ = AF_UNSPEC;
         if (infd > 0) {
@@ -94,6 +98,15 @@ Socket::set_close_on_exec(bool onoff)
         fd.set_close_on_exec(onoff);
 }
 
+/**
+ *
+ */
+void
+Socket::set_nonblock(bool onoff)
+{
+        fd.set_nonblock(onoff);
+}
+
 
 /**
  * set/unset socket option SO_REUSEADDR
@@ -168,11 +181,54 @@ Socket::accept()
         return newfd;
 }
 
+/**
+ * accept() on a non-blocking listen socket.
+ *
+ * The new fd is close-on-exec and blocking, no matter what the listen
+ * socket is.
+ *
+ * @param[out] peer  If not NULL, set to the peer address
+ * @return New fd, or -1 if there was nothing to accept (errno is set)
+ */
+int
+Socket::accept_nonblock(struct sockaddr_storage *peer)
+{
+        struct sockaddr_storage sa;
+        socklen_t salen(sizeof(sa));
+        int newfd;
+
+#ifdef HAVE_ACCEPT4
+        newfd = ::accept4(fd.get(), (struct sockaddr*)&sa, &salen,
+                          SOCK_CLOEXEC);
+#else
+        newfd = ::accept(fd.get(), (struct sockaddr*)&sa, &salen);
+        if (-1 != newfd) {
+                // BSD accept() copies O_NONBLOCK from the listen socket
+                int flags;
+                if (-1 == fcntl(newfd, F_SETFD, FD_CLOEXEC)
+                    || -1 == (flags = fcntl(newfd, F_GETFL))
+                    || -1 == fcntl(newfd, F_SETFL, flags & ~O_NONBLOCK)) {
+                        ::close(newfd);
+                        newfd = -1;
+                }
+        }
+#endif
+        if (peer && -1 != newfd) {
+                *peer = sa;
+        }
+        return newfd;
+}
+
 
 /**
  * Listen to port on all interfaces
  *
+ * Backlog, SO_REUSEPORT and TCP_DEFER_ACCEPT are taken from
+ * set_listen_backlog(), set_reuseport() and set_defer_accept().
+ * TCP_DEFER_ACCEPT is silently skipped where it doesn't exist.
+ *
  * @param[in] af Address family (AF_*). Should be AF_UNSPEC.
+ * @param[in] host Address to bind to. Empty string means any.
  * @param[in] port Port name or number.
  */
 void
@@ -192,6 +248,18 @@ Socket::listen(int af, const std::string &host, const std::string &port)
         for (p = gai.get_results(); p; p = p->ai_next) {
                 create_socket(p);
                 set_reuseaddr(true);
+                if (reuseport_) {
+#ifdef SO_REUSEPORT
+                        int on = 1;
+                        if (0 > setsockopt(fd.get(), SOL_SOCKET, SO_REUSEPORT,
+                                           &on, sizeof(on))) {
+                                THROW(ErrSys, "setsockopt(SO_REUSEPORT)");
+                        }
+#else
+                        errno = ENOSYS;
+                        THROW(ErrSys, "setsockopt(SO_REUSEPORT)");
+#endif
+                }
 
                 err = bind(fd.get(), p->ai_addr, p->ai_addrlen);
                 if (!err) {
@@ -202,7 +270,17 @@ Socket::listen(int af, const std::string &host, const std::string &port)
                 THROW(ErrSys, "bind()");
 	}
 
-	if (::listen(fd.get(), 5)) {
+#ifdef TCP_DEFER_ACCEPT
+        // don't wake up accept() until the client has sent something
+        if (defer_accept_ > 0) {
+                if (0 > setsockopt(fd.get(), IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                   &defer_accept_, sizeof(defer_accept_))) {
+                        THROW(ErrSys, "setsockopt(TCP_DEFER_ACCEPT)");
+                }
+        }
+#endif
+
+	if (::listen(fd.get(), listen_backlog_)) {
                 THROW(ErrSys, "listen()");
 	}
 }
@@ -253,7 +331,9 @@ Socket::write(const std::string &data)
 /**
  * Write exactly all of a std::string
  *
- * Can't use fd.full_write() since this->write() may be from a subclass
+ * Can't use fd.full_write() since this->write_from() may be from a
+ * subclass. On a non-blocking socket this waits for it to drain, so
+ * don't use it where that matters.
  *
  * @param[in] data Data to write
  */
@@ -261,11 +341,78 @@ void
 Socket::full_write(const std::string &data)
 {
         size_t n;
-        for (n = 0; n < data.size();) {
-                n += write(data.substr(n));
+        for (size_t pos = 0; pos < data.size(); pos += n) {
+                switch (write_from(data.data() + pos, data.size() - pos, &n)) {
+                case IO_OK:
+                        break;
+                case IO_AGAIN: {
+                        struct pollfd pfd;
+                        pfd.fd = fd.get();
+                        pfd.events = io_events(true);
+                        pfd.revents = 0;
+                        if (0 > poll(&pfd, 1, -1) && errno != EINTR) {
+                                THROW(ErrSys, "poll()");
+                        }
+                        break;
+                }
+                default:
+                        throw_io_error("write()");
+                }
         }
 }
 
+/**
+ * Read into caller's buffer. Doesn't throw, see FDWrap::read_into().
+ */
+IOStatus
+Socket::read_into(char *buf, size_t len, size_t *got)
+{
+        return fd.read_into(buf, len, got);
+}
+
+/**
+ * Write from caller's buffer. Doesn't throw, see FDWrap::write_from().
+ */
+IOStatus
+Socket::write_from(const char *buf, size_t len, size_t *done)
+{
+        return fd.write_from(buf, len, done);
+}
+
+/**
+ * Gather write. Doesn't throw, see FDWrap::writev_from().
+ */
+IOStatus
+Socket::writev_from(const struct iovec *iov, int iovcnt, size_t *done)
+{
+        return fd.writev_from(iov, iovcnt, done);
+}
+
+/**
+ * Throw the exception for the IO_ERROR (or unexpected IO_AGAIN) that
+ * the last read_into() or write_from() returned. Call it right away,
+ * before errno changes.
+ *
+ * @param[in] what  Name of the failed operation, for the message
+ */
+void
+Socket::throw_io_error(const std::string &what)
+{
+        THROW(ErrSys, what);
+}
+
+/**
+ * poll() events to wait for before retrying a read_into() or
+ * write_from() that returned IO_AGAIN.
+ *
+ * @param[in] writing  false for read_into(), true for write_from()
+ */
+int
+Socket::io_events(bool writing) const
+{
+        return writing ? POLLOUT : POLLIN;
+}
+
 /**
  * set/unset TCP_NODELAY
  *
@@ -34,6 +34,9 @@ protected:
         int connected_af_;
 	bool debug;
         std::string tcpmd5;
+        int listen_backlog_;
+        bool reuseport_;
+        int defer_accept_;
 	void create_socket(const struct addrinfo*);
 public:
         /**
@@ -85,6 +88,10 @@ public:
         void set_keepalive(bool);
 	void set_reuseaddr(bool);
         void set_close_on_exec(bool);
+        void set_nonblock(bool);
+        void set_listen_backlog(int n) { listen_backlog_ = n; }
+        void set_reuseport(bool on) { reuseport_ = on; }
+        void set_defer_accept(int seconds) { defer_accept_ = seconds; }
 
         void set_tos(int tos);
 
@@ -94,6 +101,7 @@ public:
         std::string get_peer_addr_string() const;
 
         int accept();
+        int accept_nonblock(struct sockaddr_storage *peer = NULL);
 	void listen(int af, const std::string &host, const std::string &port);
 	void connect(int af, const std::string &host, const std::string &port);
 
@@ -101,6 +109,14 @@ public:
 	virtual size_t write(const std::string &);
 
         void full_write(const std::string &);
+
+        virtual IOStatus read_into(char *buf, size_t len, size_t *got);
+        virtual IOStatus write_from(const char *buf, size_t len,
+                                    size_t *done);
+        virtual IOStatus writev_from(const struct iovec *iov, int iovcnt,
+                                     size_t *done);
+        virtual void throw_io_error(const std::string &what);
+        virtual int io_events(bool writing) const;
 };
 
 /* ---- Emacs Variables ----
@@ -1,5 +1,6 @@
 #include<sys/types.h>
 #include<sys/socket.h>
+#include<signal.h>
 
 #include<iostream>
 
@@ -68,6 +69,20 @@ TEST(Socket, ListenPortBusy)
 	       Socket::ErrSys);
 }
 
+#ifdef SO_REUSEPORT
+TEST(Socket, ListenReusePort)
+{
+  Socket sock1;
+  Socket sock2;
+  sock1.set_reuseport(true);
+  sock2.set_reuseport(true);
+  sock1.set_listen_backlog(128);
+  sock1.listen(AF_UNSPEC, "", listenport);
+  sock2.listen(AF_UNSPEC, "", listenport);
+  EXPECT_LE(0, sock2.getfd());
+}
+#endif
+
 TEST(Socket, ConnectOpen)
 {
   Socket sock;
@@ -124,7 +139,79 @@ TEST(Socket, LoopData)
   EXPECT_EQ("y", serv.read(1));
 }
 
+TEST(Socket, AcceptNonblock)
+{
+  Socket s1;
+  Socket s2;
+  s1.listen(AF_UNSPEC, "", listenport);
+  s1.set_nonblock(true);
+  EXPECT_EQ(-1, s1.accept_nonblock());
+  EXPECT_EQ(EAGAIN, errno);
+
+  s2.connect(AF_UNSPEC, "127.0.0.1", listenport);
+  Socket serv;
+  serv.setfd(s1.accept_nonblock());
+  EXPECT_LE(0, serv.getfd());
+
+  s2.write("x");
+  EXPECT_EQ("x", serv.read(1));
+}
+
+TEST(Socket, IOStatus)
+{
+  Socket s1;
+  Socket s2;
+  s1.listen(AF_UNSPEC, "", listenport);
+  s2.connect(AF_UNSPEC, "127.0.0.1", listenport);
+  Socket serv;
+  serv.setfd(s1.accept());
+  serv.set_nonblock(true);
+
+  char buf[16];
+  size_t n = 1;
+  EXPECT_EQ(IO_AGAIN, serv.read_into(buf, sizeof(buf), &n));
+  EXPECT_EQ(0U, n);
+
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)"ab";
+  iov[0].iov_len = 2;
+  iov[1].iov_base = (void*)"cde";
+  iov[1].iov_len = 3;
+  EXPECT_EQ(IO_OK, s2.writev_from(iov, 2, &n));
+  EXPECT_EQ(5U, n);
+  EXPECT_EQ(IO_OK, s2.write_from("f", 1, &n));
+  EXPECT_EQ(1U, n);
+  s2.close();
+
+  std::string got;
+  IOStatus st;
+  while (IO_EOF != (st = serv.read_into(buf, sizeof(buf), &n))) {
+    if (st == IO_AGAIN) {
+      usleep(10000);
+      continue;
+    }
+    ASSERT_EQ(IO_OK, st);
+    got.append(buf, n);
+  }
+  EXPECT_EQ("abcdef", got);
+  EXPECT_EQ(0U, n);
+}
+
+TEST(Socket, FullWriteError)
+{
+  Socket s1;
+  Socket s2;
+  s1.listen(AF_UNSPEC, "", listenport);
+  s2.connect(AF_UNSPEC, "127.0.0.1", listenport);
+  Socket serv;
+  serv.setfd(s1.accept());
+  serv.close();
+  EXPECT_THROW(s2.full_write(std::string(10000000, 'x')), Socket::ErrSys);
+}
+
 int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }
@@ -6,17 +6,37 @@
 #include "config.h"
 #endif
 
+#include<poll.h>
+#include<fcntl.h>
+#include<string.h>
+#include<errno.h>
+#include<sys/stat.h>
+#include<monotonic_clock.h>
+#ifdef HAVE_CPUID_H
+#include<cpuid.h>
+#endif
+#ifdef HAVE_SYS_AUXV_H
+#include<sys/auxv.h>
+#endif
+#if defined(__aarch64__) && defined(HAVE_GETAUXVAL)
+#include<asm/hwcap.h>
+#endif
+
 #include<iostream>
 #include<sstream>
 #include<vector>
 #include<map>
+#include<algorithm>
 
 #include<openssl/ui.h>
 #include<openssl/err.h>
 #include<openssl/engine.h>
 #include<openssl/crypto.h>
+#include<openssl/pem.h>
+#include<openssl/ocsp.h>
 
 #include"sslsocket.h"
+#include"crlindex.h"
 #include"util2.h"
 #include"tlssh.h"
 
@@ -32,6 +52,9 @@
 	RAND_write_file("random.seed");
 #endif
 
+/** Clock skew allowed when checking a stapled OCSP response. */
+static const long OCSP_MAX_SKEW = 300;
+
 #if 1
 #define SSLCALL(x) x
 #else
@@ -157,7 +180,13 @@ X509Wrap::get_issuer() const
 long
 X509Wrap::get_serial() const
 {
-	return SSLCALL(ASN1_INTEGER_get(X509_get_serialNumber(x509)));
+	long ret = SSLCALL(ASN1_INTEGER_get(X509_get_serialNumber(x509)));
+        if (ret == -1) {
+                // too big for a long. Don't leave that in the error
+                // queue for the next SSL_read() to trip over.
+                ERR_clear_error();
+        }
+        return ret;
 }
 
 /**
@@ -214,13 +243,12 @@ X509Wrap::get_fingerprint() const
                                n, len));
         }
 
-        std::string ret;
+        static const char hex[] = "0123456789ABCDEF";
+        std::string ret(len * 3 - 1, ':');
         unsigned int c;
         for (c = 0; c < len; c++) {
-                if (c) {
-                        ret += ":";
-                }
-                ret += xsprintf("%.2X", buf[c]);
+                ret[c * 3] = hex[buf[c] >> 4];
+                ret[c * 3 + 1] = hex[buf[c] & 0xf];
         }
         return ret;
 }
@@ -280,11 +308,29 @@ SSLSocket::make_thread_safe()
  */
 SSLSocket::SSLSocket(int fd)
                 :Socket(fd),
-                 ctx(NULL),
                  ssl(NULL),
-                 privkey_engine_(std::make_pair(false, ""))
+                 ctx_(NULL),
+                 own_ctx_(NULL),
+                 handshake_timeout_(0),
+                 deadline_(0),
+                 session_(NULL),
+                 early_reading_(false),
+                 peer_cached_(false),
+                 rec_small_(0),
+                 rec_boost_(0),
+                 rec_idle_(0),
+                 rec_size_(SSL3_RT_MAX_PLAIN_LENGTH),
+                 rec_burst_(0),
+                 rec_last_(0),
+                 io_ret_(0),
+                 read_events_(POLLIN),
+                 write_events_(POLLOUT),
+                 write_pending_(0)
 {
+        memset(&rec_stats_, 0, sizeof(rec_stats_));
         global_init();
+        own_ctx_ = new SSLContext();
+        ctx_ = own_ctx_;
 }
 
 /**
@@ -332,6 +378,8 @@ X509Wrap::errstr(int err)
                 return "CRL is not yet valid";
         case X509_V_ERR_CRL_HAS_EXPIRED:
                 return "CRL has expired";
+        case X509_V_ERR_CERT_REVOKED:
+                return "certificate revoked";
         case X509_V_ERR_ERROR_IN_CERT_NOT_BEFORE_FIELD:
                 return "format error in";
         case X509_V_ERR_ERROR_IN_CERT_NOT_AFTER_FIELD:
@@ -394,6 +442,7 @@ SSLSocket::ssl_errstr(int err)
 SSLSocket::~SSLSocket() throw()
 {
         shutdown();
+        delete own_ctx_;
 }
 
 /**
@@ -407,10 +456,6 @@ SSLSocket::shutdown()
                 SSLCALL(SSL_free(ssl));
 		ssl = 0;
 	}
-        if (ctx) {
-                SSLCALL(SSL_CTX_free(ctx));
-                ctx = 0;
-        }
         close();
 }
 
@@ -434,6 +479,21 @@ SSLSocket::ssl_connect(const std::string &inhost)
 	ssl_accept_connect(true);
 }
 
+/**
+ * Run one step of a non-blocking client handshake. See
+ * ssl_accept_step().
+ *
+ * @param[in] inhost  Server name, checked against its cert when done
+ *
+ * @return 0 when done, otherwise POLLIN or POLLOUT to wait for
+ */
+int
+SSLSocket::ssl_connect_step(const std::string &inhost)
+{
+	host = inhost;
+        return handshake_step(true);
+}
+
 /**
  * start handshake as SSL server
  */
@@ -444,30 +504,96 @@ SSLSocket::ssl_accept()
 }
 
 /**
- * setup Diffie-Hellman parameters
+ * Set up key exchange.
+ *
+ * ECDHE using the configured groups, in order of preference. On the
+ * server also finite field DHE, but only with parameters loaded from
+ * DHParamsFile (or OpenSSL's built-in RFC7919 groups if it has them).
+ * Parameters are never generated here; that used to be done for every
+ * connection and cost more than the rest of the handshake.
  */
-DH*
-SSLSocket::ssl_setup_dh()
+void
+SSLContext::setup_key_exchange()
 {
-        DH* dh = DH_new();
-        if (!dh) {
-                THROW(ErrSSL, "DH_new()");
+        if (!groups_.empty()) {
+                logger->debug("setting up ECDHE groups %s", groups_.c_str());
+#if defined(SSL_CTX_set1_groups_list)
+                if (!SSLCALL(SSL_CTX_set1_groups_list(ctx_,
+                                                      groups_.c_str()))) {
+                        THROW(SSLSocket::ErrSSL,
+                              "SSL_CTX_set1_groups_list(" + groups_ + ")");
+                }
+#elif defined(SSL_CTX_set1_curves_list)
+                if (!SSLCALL(SSL_CTX_set1_curves_list(ctx_,
+                                                      groups_.c_str()))) {
+                        THROW(SSLSocket::ErrSSL,
+                              "SSL_CTX_set1_curves_list(" + groups_ + ")");
+                }
+#else
+                logger->warning("OpenSSL too old for Groups, using P-256");
+#endif
         }
-
-        if (!DH_generate_parameters_ex(dh, 2, DH_GENERATOR_2, 0)) {
-                THROW(ErrSSL, "DH_generate_parameters_ex()");
+#if defined(SSL_CTX_set_ecdh_auto)
+        SSLCALL(SSL_CTX_set_ecdh_auto(ctx_, 1));
+#elif !defined(SSL_CTX_set1_groups_list) && !defined(SSL_CTX_set1_curves_list)
+        EC_KEY *ecdh = SSLCALL(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+        if (!ecdh) {
+                THROW(SSLSocket::ErrSSL, "EC_KEY_new_by_curve_name()");
         }
+        SSLCALL(SSL_CTX_set_tmp_ecdh(ctx_, ecdh));
+        EC_KEY_free(ecdh);
+#endif
 
-        int codes = 0;
-        if (!DH_check(dh, &codes) && !codes) {
-                THROW(ErrSSL, "DH_check()");
+        if (!server_) {
+                return;
         }
 
-        if (!DH_generate_key(dh)) {
-                THROW(ErrSSL, "DH_generate_key()");
+        if (!dhparams_file_.empty()) {
+                logger->debug("loading DH parameters from %s",
+                              dhparams_file_.c_str());
+                BIO *bio = SSLCALL(BIO_new_file(dhparams_file_.c_str(),
+                                                "r"));
+                if (!bio) {
+                        THROW(SSLSocket::ErrSSL,
+                              "Load DH params " + dhparams_file_);
+                }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+                EVP_PKEY *dh = SSLCALL(PEM_read_bio_Parameters(bio, NULL));
+                BIO_free(bio);
+                if (!dh || !EVP_PKEY_is_a(dh, "DH")) {
+                        EVP_PKEY_free(dh);
+                        THROW(SSLSocket::ErrSSL,
+                              "PEM_read_bio_Parameters(" + dhparams_file_
+                              + ")");
+                }
+                // takes over dh if it works
+                if (!SSLCALL(SSL_CTX_set0_tmp_dh_pkey(ctx_, dh))) {
+                        EVP_PKEY_free(dh);
+                        THROW(SSLSocket::ErrSSL,
+                              "SSL_CTX_set0_tmp_dh_pkey()");
+                }
+#else
+                DH *dh = SSLCALL(PEM_read_bio_DHparams(bio, NULL, NULL,
+                                                       NULL));
+                BIO_free(bio);
+                if (!dh) {
+                        THROW(SSLSocket::ErrSSL,
+                              "PEM_read_bio_DHparams(" + dhparams_file_
+                              + ")");
+                }
+                int ok = SSLCALL(SSL_CTX_set_tmp_dh(ctx_, dh));
+                DH_free(dh);
+                if (!ok) {
+                        THROW(SSLSocket::ErrSSL, "SSL_CTX_set_tmp_dh()");
+                }
+#endif
+        } else {
+#if defined(SSL_CTX_set_dh_auto)
+                SSLCALL(SSL_CTX_set_dh_auto(ctx_, 1));
+#else
+                logger->debug("No DHParamsFile, only ECDHE key exchange");
+#endif
         }
-
-        return dh;
 }
 
 
@@ -522,66 +648,377 @@ SSLSocket::Engine::LoadPrivKey(const std::string &fn)
         return pkey;
 }
 /**
- * combinded server and client handshake code.
- *
- * @param[in] isconnect  true if we are client, false if we are server
+ * Create an empty context. Set it up with the set_*() functions and
+ * then build() it.
  */
-void
-SSLSocket::ssl_accept_connect(bool isconnect)
+SSLContext::SSLContext()
+        :ctx_(NULL),
+         server_(false),
+         server_preference_(false),
+         primary_cert_(NULL),
+         privkey_engine_(std::make_pair(false, "")),
+         engine_(NULL),
+         cert_on_demand_(false),
+         max_early_data_(0),
+         ktls_(false),
+         crl_index_(NULL),
+         own_crl_index_(NULL),
+         peer_cache_(NULL),
+         ocsp_mode_(OCSP_OFF),
+         ocsp_staple_mtime_(0)
 {
-	int err;
+        SSLSocket::global_init();
+}
 
-        // create CTX
-        ctx = SSLCALL(SSL_CTX_new(isconnect
-                                  ? SSLCALL(TLSv1_client_method())
-                                  : SSLCALL(TLSv1_server_method())));
-        if (!ctx) {
-                THROW(ErrSSL, "SSL_CTX_new()");
-	}
+/**
+ * Check if this CPU has instructions for AES-GCM: AES rounds and
+ * carryless multiply (for GHASH). Without them ChaCha20-Poly1305 is a
+ * lot faster, and not open to cache timing attacks.
+ */
+bool
+SSLContext::have_aes_hw()
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(HAVE_CPUID_H)
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                return false;
+        }
+        return (ecx & bit_AES) && (ecx & bit_PCLMUL);
+#elif defined(__aarch64__) && defined(HAVE_GETAUXVAL)
+        const unsigned long hwcap = getauxval(AT_HWCAP);
+        return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+        return false;
+#endif
+}
 
-        // load cert & key
-        if (1 !=SSLCALL(SSL_CTX_use_certificate_chain_file(ctx,
-                                                           certfile.c_str()))){
-                THROW(ErrSSL, "Load certfile " + certfile);
-	}
+/**
+ * Cipher list for "auto", for TLS 1.2 and older: AEAD first, fastest
+ * one on this CPU first.
+ */
+std::string
+SSLContext::auto_cipher_list()
+{
+        if (have_aes_hw()) {
+                return "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:DHE+CHACHA20"
+                        ":HIGH:!aNULL:!LOW:!MD5";
+        }
+        return "ECDHE+CHACHA20:ECDHE+AESGCM:DHE+CHACHA20:DHE+AESGCM"
+                ":HIGH:!aNULL:!LOW:!MD5";
+}
+
+/**
+ * TLS 1.3 ciphersuites for "auto", fastest one on this CPU first.
+ */
+std::string
+SSLContext::auto_ciphersuites()
+{
+        if (have_aes_hw()) {
+                return "TLS_AES_256_GCM_SHA384:TLS_AES_128_GCM_SHA256"
+                        ":TLS_CHACHA20_POLY1305_SHA256";
+        }
+        return "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_256_GCM_SHA384"
+                ":TLS_AES_128_GCM_SHA256";
+}
+
+/**
+ *
+ */
+SSLContext::~SSLContext() throw()
+{
+        if (ctx_) {
+                SSLCALL(SSL_CTX_free(ctx_));
+                ctx_ = NULL;
+        }
+        delete engine_;
+        delete own_crl_index_;
+}
 
+/**
+ * Load private key, either from file or through an engine (TPM)
+ *
+ * @param[in] ssl      Connection to load it into, or NULL for the context
+ * @param[in] keyfile  File, or key ID for the engine
+ */
+void
+SSLContext::load_privkey(SSL *ssl, const std::string &keyfile)
+{
         if (privkey_engine_.first) {
                 // Start TPM engine.
                 SSLCALL(ENGINE_load_builtin_engines());
 
                 logger->debug("Loading private key using engine %s",
                               privkey_engine_.second.c_str());
-                Engine *engine(new Engine(privkey_engine_.second));
-                EVP_PKEY *pkey;
-                for (EngineConf::const_iterator
-                             itr = privkey_engine_pre_.begin();
-                     itr != privkey_engine_pre_.end();
-                     ++itr) {
-                        engine->ctrl_cmd(itr->first, itr->second);
+                if (!engine_) {
+                        engine_ = new SSLSocket::Engine(
+                                privkey_engine_.second);
+                        for (SSLSocket::EngineConf::const_iterator
+                                     itr = privkey_engine_pre_.begin();
+                             itr != privkey_engine_pre_.end();
+                             ++itr) {
+                                engine_->ctrl_cmd(itr->first, itr->second);
+                        }
+                        engine_->Init();
+                        for (SSLSocket::EngineConf::const_iterator
+                                     itr = privkey_engine_post_.begin();
+                             itr != privkey_engine_post_.end();
+                             ++itr) {
+                                engine_->ctrl_cmd(itr->first, itr->second);
+                        }
                 }
-                engine->Init();
-                for (EngineConf::const_iterator
-                             itr = privkey_engine_post_.begin();
-                     itr != privkey_engine_post_.end();
-                     ++itr) {
-                        engine->ctrl_cmd(itr->first, itr->second);
-                }
-                pkey = engine->LoadPrivKey(keyfile);
-                if (0 > SSLCALL(SSL_CTX_use_PrivateKey(ctx, pkey))) {
-                        THROW(ErrSSL, "SSL_CTX_use_PrivateKey()");
+                EVP_PKEY *pkey = engine_->LoadPrivKey(keyfile);
+                if (0 >= (ssl
+                          ? SSLCALL(SSL_use_PrivateKey(ssl, pkey))
+                          : SSLCALL(SSL_CTX_use_PrivateKey(ctx_, pkey)))) {
+                        EVP_PKEY_free(pkey);
+                        THROW(SSLSocket::ErrSSL, "SSL_CTX_use_PrivateKey()");
                 }
+                EVP_PKEY_free(pkey);
         } else {
                 logger->debug("Loading private key");
-                if (1!=SSLCALL(SSL_CTX_use_PrivateKey_file(ctx,
-                                                           keyfile.c_str(),
-                                                           SSL_FILETYPE_PEM))){
-                        THROW(ErrSSL, "Load keyfile " + keyfile);
+                if (1 != (ssl
+                          ? SSLCALL(SSL_use_PrivateKey_file(ssl,
+                                                        keyfile.c_str(),
+                                                        SSL_FILETYPE_PEM))
+                          : SSLCALL(SSL_CTX_use_PrivateKey_file(ctx_,
+                                                        keyfile.c_str(),
+                                                        SSL_FILETYPE_PEM)))){
+                        THROW(SSLSocket::ErrSSL, "Load keyfile " + keyfile);
+                }
+        }
+}
+
+/**
+ * Load cert (chain) and private key, and any more from add_cert().
+ *
+ * OpenSSL keeps one cert per key type, and for each handshake picks
+ * one that the peer can verify, going by the signature algorithms it
+ * sent. So e.g. an ECDSA cert next to an RSA one is used by all
+ * clients that can do ECDSA, and is much cheaper to sign with.
+ *
+ * @param[in] ssl  Connection to load them into, or NULL for the context
+ */
+void
+SSLContext::load_cert(SSL *ssl)
+{
+        load_cert(ssl, certfile_, keyfile_);
+        if (!ssl) {
+                primary_cert_ = SSLCALL(SSL_CTX_get0_certificate(ctx_));
+        }
+        for (size_t c = 0; c < more_certs_.size(); c++) {
+                load_cert(ssl, more_certs_[c].first, more_certs_[c].second);
+        }
+}
+
+/**
+ * Load one cert (chain) and its private key.
+ *
+ * @param[in] ssl       Connection to load them into, or NULL for the
+ *                      context
+ * @param[in] certfile  Cert, followed by any intermediate CA certs
+ * @param[in] keyfile   File, or key ID for the engine
+ */
+void
+SSLContext::load_cert(SSL *ssl, const std::string &certfile,
+                      const std::string &keyfile)
+{
+        int err;
+        if (!ssl) {
+                err = SSLCALL(SSL_CTX_use_certificate_chain_file(
+                                      ctx_, certfile.c_str()));
+        } else {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                err = SSLCALL(SSL_use_certificate_chain_file(
+                                      ssl, certfile.c_str()));
+#else
+                err = SSLCALL(SSL_use_certificate_file(ssl, certfile.c_str(),
+                                                       SSL_FILETYPE_PEM));
+#endif
+        }
+        if (1 != err) {
+                THROW(SSLSocket::ErrSSL, "Load certfile " + certfile);
+	}
+        load_privkey(ssl, keyfile);
+}
+
+/**
+ * Client cert callback for set_cert_on_demand(). Called by OpenSSL
+ * only if the server asks for a cert, i.e. not when a session is
+ * resumed.
+ */
+int
+SSLContext::cert_cb(SSL *ssl, void *arg)
+{
+        SSLContext *self = static_cast<SSLContext*>(arg);
+
+        if (SSL_get_certificate(ssl)) {
+                return 1;
+        }
+        try {
+                self->load_cert(ssl);
+                return 1;
+        } catch (const SSLSocket::ErrSSL &e) {
+                logger->err("%s", e.what_verbose().c_str());
+        } catch (const std::exception &e) {
+                logger->err("%s", e.what());
+        }
+        return 0;
+}
+
+/**
+ * Reload the OCSP response to staple, if the file has changed.
+ *
+ * The file is a DER OCSP response for our own cert, fetched out of
+ * band (e.g. by tlsshd-ocsp-refresh) and renamed into place. A file
+ * that is missing or doesn't parse only gets a warning, and the
+ * response already loaded (if any) is kept.
+ *
+ * @return true if a new response was loaded
+ */
+bool
+SSLContext::load_ocsp_staple()
+{
+        if (ocsp_staple_file_.empty()) {
+                return false;
+        }
+        struct stat st;
+        if (stat(ocsp_staple_file_.c_str(), &st)) {
+                if (ocsp_staple_mtime_ != -1) {
+                        logger->warning("OCSPStapleFile %s: %s",
+                                        ocsp_staple_file_.c_str(),
+                                        strerror(errno));
+                        ocsp_staple_mtime_ = -1;
                 }
+                return false;
+        }
+        if (st.st_mtime == ocsp_staple_mtime_) {
+                return false;
+        }
+        ocsp_staple_mtime_ = st.st_mtime;
+
+        BIO *bio = SSLCALL(BIO_new_file(ocsp_staple_file_.c_str(), "r"));
+        if (!bio) {
+                logger->warning("OCSPStapleFile %s: can't open",
+                                ocsp_staple_file_.c_str());
+                return false;
+        }
+        OCSP_RESPONSE *resp = SSLCALL(d2i_OCSP_RESPONSE_bio(bio, NULL));
+        SSLCALL(BIO_free(bio));
+        SSLCALL(ERR_clear_error());
+        if (!resp) {
+                logger->warning("OCSPStapleFile %s: not a DER OCSP response",
+                                ocsp_staple_file_.c_str());
+                return false;
+        }
+        const int status = SSLCALL(OCSP_response_status(resp));
+        unsigned char *der = NULL;
+        const int len = SSLCALL(i2d_OCSP_RESPONSE(resp, &der));
+        SSLCALL(OCSP_RESPONSE_free(resp));
+        if (len <= 0) {
+                logger->warning("OCSPStapleFile %s: i2d_OCSP_RESPONSE()",
+                                ocsp_staple_file_.c_str());
+                return false;
+        }
+        std::string data(reinterpret_cast<char*>(der), len);
+        OPENSSL_free(der);
+        if (status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+                logger->warning("OCSPStapleFile %s: response status %s",
+                                ocsp_staple_file_.c_str(),
+                                OCSP_response_status_str(status));
+                return false;
+        }
+        logger->info("Loaded OCSP response from %s",
+                     ocsp_staple_file_.c_str());
+        ocsp_staple_.swap(data);
+        return true;
+}
+
+/**
+ * Server callback for the status_request extension: staple the
+ * response loaded by load_ocsp_staple(), if there is one. It's for the
+ * main cert only, so nothing is stapled if one from add_cert() was
+ * picked for this handshake.
+ */
+int
+SSLContext::ocsp_status_cb(SSL *ssl, void *arg)
+{
+        const SSLContext *self = static_cast<const SSLContext*>(arg);
+
+        if (self->ocsp_staple_.empty()
+            || SSLCALL(SSL_get_certificate(ssl)) != self->primary_cert_) {
+                return SSL_TLSEXT_ERR_NOACK;
+        }
+        // OpenSSL takes ownership, so every handshake gets its own copy
+        const size_t len = self->ocsp_staple_.size();
+        unsigned char *buf
+                = static_cast<unsigned char*>(OPENSSL_malloc(len));
+        if (!buf) {
+                return SSL_TLSEXT_ERR_NOACK;
+        }
+        memcpy(buf, self->ocsp_staple_.data(), len);
+        if (!SSLCALL(SSL_set_tlsext_status_ocsp_resp(ssl, buf, len))) {
+                OPENSSL_free(buf);
+                return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Create the SSL_CTX and load everything into it.
+ *
+ * Engines that talk to a daemon (like the TPM one) must be OK with the
+ * key then being used from fork()ed children.
+ *
+ * @param[in] server  true if this context is for accepting connections
+ */
+void
+SSLContext::build(bool server)
+{
+        if (ctx_) {
+                THROW(SSLSocket::ErrSSL, "SSL context already built");
+        }
+        server_ = server;
+
+        // create CTX. Highest protocol version both ends support.
+#ifdef HAVE_TLS_SERVER_METHOD
+        ctx_ = SSLCALL(SSL_CTX_new(server
+                                   ? SSLCALL(TLS_server_method())
+                                   : SSLCALL(TLS_client_method())));
+#else
+        ctx_ = SSLCALL(SSL_CTX_new(server
+                                   ? SSLCALL(SSLv23_server_method())
+                                   : SSLCALL(SSLv23_client_method())));
+#endif
+        if (!ctx_) {
+                THROW(SSLSocket::ErrSSL, "SSL_CTX_new()");
+	}
+        SSLCALL(SSL_CTX_set_options(ctx_, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3));
+
+        try {
+                configure();
+        } catch (...) {
+                SSLCALL(SSL_CTX_free(ctx_));
+                ctx_ = NULL;
+                throw;
+        }
+}
+
+/**
+ * Load cert, key, CAs and ciphers into the newly created SSL_CTX.
+ */
+void
+SSLContext::configure()
+{
+        // load cert & key, or wait until the server asks for them
+        if (cert_on_demand_ && !server_) {
+                SSLCALL(SSL_CTX_set_cert_cb(ctx_, cert_cb, this));
+        } else {
+                load_cert(NULL);
         }
 
         // set CAPath & CAFile for cert verification
-	const char *ccapath = capath.c_str();
-	const char *ccafile = cafile.c_str();
+	const char *ccapath = capath_.c_str();
+	const char *ccafile = cafile_.c_str();
 	if (!*ccafile) {
 		ccafile = NULL;
 	}
@@ -590,299 +1027,750 @@ SSLSocket::ssl_accept_connect(bool isconnect)
 	}
 	if (ccafile || ccapath) {
                 logger->debug("CAFile: %s", ccafile ? ccafile : "<null>");
-                if (!SSLCALL(SSL_CTX_load_verify_locations(ctx,
+                if (!SSLCALL(SSL_CTX_load_verify_locations(ctx_,
                                                            ccafile,
                                                            ccapath))) {
-                        THROW(ErrSSL, "SSL_CTX_load_verify_locations()");
+                        THROW(SSLSocket::ErrSSL,
+                              "SSL_CTX_load_verify_locations()");
 		}
-                SSLCALL(SSL_CTX_set_verify_depth(ctx, 5));
-                SSLCALL(SSL_CTX_set_verify(ctx,
+                SSLCALL(SSL_CTX_set_verify_depth(ctx_, 5));
+                SSLCALL(SSL_CTX_set_verify(ctx_,
                                            SSL_VERIFY_PEER
-                                           |(isconnect
-                                             ? 0
-                                             :SSL_VERIFY_FAIL_IF_NO_PEER_CERT),
+                                           |(server_
+                                             ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT
+                                             : 0),
                                            NULL));
         } else {
                 logger->debug("WARNING: No CA loaded.");
         }
 
         // set approved cipher list
+        std::string cipher_list(cipher_list_);
+        if (cipher_list_ == "auto") {
+                cipher_list = auto_cipher_list();
+#ifdef HAVE_SSL_CTX_SET_CIPHERSUITES
+                const std::string suites(auto_ciphersuites());
+                logger->debug("setting up TLS 1.3 ciphersuites %s",
+                              suites.c_str());
+                if (!SSLCALL(SSL_CTX_set_ciphersuites(ctx_,
+                                                      suites.c_str()))) {
+                        THROW(SSLSocket::ErrSSL,
+                              "SSL_CTX_set_ciphersuites()");
+                }
+#endif
+        }
         logger->debug("setting up cipher list %s", cipher_list.c_str());
 	if (!cipher_list.empty()) {
-                if (!SSLCALL(SSL_CTX_set_cipher_list(ctx,
+                if (!SSLCALL(SSL_CTX_set_cipher_list(ctx_,
                                                      cipher_list.c_str()))) {
-                        THROW(ErrSSL, "SSL_CTX_set_cipher_list()");
+                        THROW(SSLSocket::ErrSSL, "SSL_CTX_set_cipher_list()");
                 }
         }
-
-        // if server, set up DH
-        logger->debug("setting up DH");
-        if (!isconnect) {
-                if (!SSLCALL(SSL_CTX_set_tmp_dh(ctx, ssl_setup_dh()))) {
-                        THROW(ErrSSL, "SSL_CTX_set_tmp_dh()");
+        if (server_ && server_preference_) {
+                SSLCALL(SSL_CTX_set_options(ctx_,
+                                            SSL_OP_CIPHER_SERVER_PREFERENCE));
+#ifdef SSL_OP_PRIORITIZE_CHACHA
+                // a client that put ChaCha20 first probably has no AES
+                // instructions, so give it that even if we do
+                if (cipher_list_ == "auto") {
+                        SSLCALL(SSL_CTX_set_options(ctx_,
+                                                    SSL_OP_PRIORITIZE_CHACHA));
                 }
+#endif
+        }
+        if (server_) {
+                // a handshake after the session is up would verify the
+                // client again, with what the sslproc no longer has
+#ifdef SSL_OP_NO_RENEGOTIATION
+                SSLCALL(SSL_CTX_set_options(ctx_, SSL_OP_NO_RENEGOTIATION));
+#endif
         }
 
-        // set up CRL check.
-        // DISABLED: while this works, it gives the error message
-        // SSL_accept()[...]no certificate returned.
-        // so check is made after connection is made, at the end of this
-        // function
-        if (0 && !crlfile.empty()) {
-                // http://bugs.unrealircd.org/view.php?id=2043
-                X509_STORE *store = SSLCALL(SSL_CTX_get_cert_store(ctx));
-                X509_LOOKUP *lookup;
-                lookup = SSLCALL(X509_STORE_add_lookup(store,
-                                                       X509_LOOKUP_file()));
-
-                if (!SSLCALL(X509_load_crl_file(lookup,
-                                                crlfile.c_str(),
-                                                X509_FILETYPE_PEM))) {
-                        THROW(ErrSSL, "X509_load_crl_file()");
-                }
+        setup_key_exchange();
 
-                if (!SSLCALL(X509_STORE_set_flags(store,
-                                                  X509_V_FLAG_CRL_CHECK
-                                                  | X509_V_FLAG_CRL_CHECK_ALL
-                                                  ))) {
-                        THROW(ErrSSL, "X509_STORE_set_flags()");
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        if (server_ && max_early_data_) {
+                if (!SSLCALL(SSL_CTX_set_max_early_data(ctx_,
+                                                        max_early_data_))) {
+                        THROW(SSLSocket::ErrSSL,
+                              "SSL_CTX_set_max_early_data()");
                 }
         }
+#endif
 
-        // create ssl object
-        if (!(ssl = SSLCALL(SSL_new(ctx)))) {
-                THROW(ErrSSL, "SSL_new()");
-	}
-
-        // attach fd to ssl object
-        if (!SSLCALL(SSL_set_fd(ssl, fd.get()))) {
-                THROW(ErrSSL, "SSL_set_fd()", ssl, err);
+        // records are encrypted by the kernel once the handshake is
+        // done, if it can. See SSLSocket::ssl_ktls_send().
+        if (ktls_) {
+#ifdef SSL_OP_ENABLE_KTLS
+                SSLCALL(SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS));
+#else
+                logger->debug("Kernel TLS not supported by OpenSSL");
+#endif
         }
 
-        // do handshake
-        logger->debug("doing SSL handshake");
-	if (isconnect) {
-                err = SSLCALL(SSL_connect(ssl));
-		if (err == -1) {
-                        THROW(ErrSSL, "SSL_connect()", ssl, err);
-		}
-
-                err = SSLCALL(SSL_get_verify_result(ssl));
-                if (err != X509_V_OK) {
-                        THROW(ErrSSL, "SSL_get_verify_result() != X509_V_OK:\n"
-                              + ssl_errstr(err));
-		}
+        // CRL is checked after the handshake, in SSLSocket::check_crl(),
+        // against a table built here unless a shared one was given.
+        if (!crlfile_.empty() && !crl_index_) {
+                own_crl_index_ = new CRLIndex();
+                own_crl_index_->create(crlfile_, cafile_, capath_);
+                crl_index_ = own_crl_index_;
+        }
 
-                X509Wrap x(SSLCALL(SSL_get_peer_certificate(ssl)));
-		if (!x.check_hostname(host)) {
-                        THROW(ErrSSLHostname, host, x.get_subject());
-		}
-	} else {
-                err = SSLCALL(SSL_accept(ssl));
-		if (err == -1) {
-                        THROW(ErrSSL, "SSL_accept()", ssl, err);
-		}
-	}
+        // OCSP stapling. The response is reloaded by whoever owns the
+        // context calling load_ocsp_staple() now and then.
+        if (server_ && !ocsp_staple_file_.empty()) {
+                load_ocsp_staple();
+                SSLCALL(SSL_CTX_set_tlsext_status_cb(ctx_, ocsp_status_cb));
+                SSLCALL(SSL_CTX_set_tlsext_status_arg(ctx_, this));
+        }
 
-        // if debug, show cert info
-	X509Wrap x(SSL_get_peer_certificate(ssl));
-        logger->debug("Issuer: %s\nSubject: %s\n"
-                      "Cipher: %s (Version %d bits) %s\n"
-                      "Serial number: %ld\n"
-                      "Fingerprint: %s",
-                      x.get_issuer().c_str(),
-                      x.get_subject().c_str(),
-                      SSLCALL(SSL_get_cipher_name(ssl)),
-                      SSLCALL(SSL_get_cipher_bits(ssl, 0)),
-                      SSLCALL(SSL_get_cipher_version(ssl)),
-                      x.get_serial(),
-                      x.get_fingerprint().c_str());
-
-        check_crl();
-        if (isconnect) {
-                check_ocsp();
+        // client certs seen before skip chain verification
+        if (server_ && peer_cache_) {
+                SSLCALL(SSL_CTX_set_cert_verify_callback(ctx_,
+                                                         SSLSocket::verify_cb,
+                                                         NULL));
         }
 }
 
 /**
- * http://etutorials.org/Programming/secure+programming/Chapter+10.+Public+Key+Infrastructure/10.12+Checking+Revocation+Status+via+OCSP+with+OpenSSL/
+ * combinded server and client handshake code.
+ *
+ * Builds the context first if ssl_set_context() wasn't given an
+ * already built one.
  *
- * @todo Implement OSCP
+ * @param[in] isconnect  true if we are client, false if we are server
  */
 void
-SSLSocket::check_ocsp()
+SSLSocket::ssl_accept_connect(bool isconnect)
 {
-#if 0
-        const char *url = "http://ocsp.cacert.org/";
-        char *host = 0;
-        char *port = 0;
-        SSL_CTX               *ctx2 = 0;
-        X509_STORE            *store = 0;
-        OCSP_CERTID           *id;
-        OCSP_REQUEST          *req = 0;
-        OCSP_RESPONSE         *resp = 0;
-        OCSP_BASICRESP        *basic = 0;
-        ASN1_GENERALIZEDTIME  *producedAt, *thisUpdate, *nextUpdate;
-
-        FINALLY(
-#if 0
-        // indent right in emacs
-                );
-#endif
-
-        if (!OCSP_parse_url(url, &host, &port, &path, &ssl)) {
-                THROW(ErrSSL, "OCSP_parse_url");
+        if (!ssl) {
+                ssl_setup(isconnect);
+                logger->debug("doing SSL handshake");
         }
+        ssl_handshake(isconnect);
+        ssl_finish(isconnect);
+}
 
-        if (!(req = OCSP_REQUEST_new(  ))) {
-                THROW(ErrSSL, "OCSP_REQUEST_new");
-        }
+/**
+ * Run one step of a non-blocking server handshake.
+ *
+ * For callers that run many handshakes from one event loop. The socket
+ * must already be non-blocking. Call again when the fd is ready for
+ * what was asked for. Once the handshake is done the peer cert and CRL
+ * are checked just like in ssl_accept().
+ *
+ * @return 0 when done, otherwise POLLIN or POLLOUT to wait for
+ */
+int
+SSLSocket::ssl_accept_step()
+{
+        return handshake_step(false);
+}
 
-        id = OCSP_cert_to_id(0, data->cert, data->issuer);
-        if (!id || !OCSP_request_add0_id(req, id)) {
-                THROW(ErrSSL, "OCSP_request_add0_id");
-        }
+/**
+ * One step of ssl_connect_step() or ssl_accept_step(). A client sends
+ * any early data first.
+ *
+ * @param[in] isconnect  true if client
+ *
+ * @return 0 when done, otherwise POLLIN or POLLOUT to wait for
+ */
+int
+SSLSocket::handshake_step(bool isconnect)
+{
+        int err;
 
-        OCSP_request_add1_nonce(req, 0, -1);
-        /* sign the request */
-#if 0
-        if (data->sign_cert && data->sign_key &&
-            !OCSP_request_sign(req, data->sign_cert, data->sign_key, EVP_sha1(  ), 0, 0)) {
-                THROW(ErrSSL, "OCSP_request_sign");
+        if (!ssl) {
+                ssl_setup(isconnect);
+                logger->debug("doing SSL handshake");
         }
-#endif
-        /* establish a connection to the OCSP responder */
-        if (!(bio = spc_connect(host, atoi(port), ssl, data->store, &ctx))) {
-                THROW(ErrSSL, "OSCP connect");
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        while (!early_out_.empty()) {
+                size_t n;
+                err = SSLCALL(SSL_write_early_data(ssl, early_out_.data(),
+                                                   early_out_.size(), &n));
+                if (err != 1) {
+                        return handshake_events("SSL_write_early_data()",
+                                                err);
+                }
+                early_out_.erase(0, n);
         }
-
-        /* send the request and get a response */
-        resp = OCSP_sendreq_bio(bio, path, req);
-        if ((rc = OCSP_response_status(resp)) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
-                THROW(ErrSSL, "OCSP_response_status");
+#endif
+        err = isconnect
+                ? SSLCALL(SSL_connect(ssl))
+                : SSLCALL(SSL_accept(ssl));
+        if (err == 1) {
+                ssl_finish(isconnect);
+                return 0;
         }
+        return handshake_events(isconnect ? "SSL_connect()" : "SSL_accept()",
+                                err);
+}
 
-        /* verify the response */
-        if (!(basic = OCSP_response_get1_basic(resp))) {
-                THROW(ErrSSL, "OCSP_response_get1_basic");
-        }
-        if (OCSP_check_nonce(req, basic) <= 0) {
-                THROW(ErrSSL, "OCSP_check_nonce");
-        }
-        if (data->store && !(store = spc_create_x509store(data->store))) {
-                THROW(ErrSSL, "spc_create_x509store");
-        }
-        if ((rc = OCSP_basic_verify(basic, 0, store, 0)) <= 0) {
-                THROW(ErrSSL, "OCSP_basic_verify");
-        }
-        if (!OCSP_resp_find_status(basic, id, &status, &reason, &producedAt,
-                                   &thisUpdate, &nextUpdate)) {
-                THROW(ErrSSL, "OCSP_resp_find_status");
-        }
-        if (!OCSP_check_validity(thisUpdate,
-                                 nextUpdate, data->skew, data->maxage)) {
-                THROW(ErrSSL, "OCSP_check_validity");
-        }
-        /* All done.  Set the return code based on the status from the
-           response. */
-        if (status =  = V_OCSP_CERTSTATUS_REVOKED) {
-                result = SPC_OCSPRESULT_CERTIFICATE_REVOKED;
-        } else {
-                result = SPC_OCSPRESULT_CERTIFICATE_VALID;
+/**
+ * What a handshake call that didn't finish is waiting for.
+ *
+ * @param[in] fname  Function that returned err, for the exception
+ * @param[in] err    Its return value
+ *
+ * @return POLLIN or POLLOUT. Anything else is thrown as ErrSSL.
+ */
+int
+SSLSocket::handshake_events(const char *fname, int err)
+{
+        switch (SSL_get_error(ssl, err)) {
+        case SSL_ERROR_WANT_READ:
+                return POLLIN;
+        case SSL_ERROR_WANT_WRITE:
+                return POLLOUT;
+        default:
+                THROW(ErrSSL, fname, ssl, err);
         }
-
-        ,    /*  FINALLY */;
-
-        if (bio) BIO_free_all(bio);
-        if (host) OPENSSL_free(host);
-        if (port) OPENSSL_free(port);
-        if (path) OPENSSL_free(path);
-        if (req) OCSP_REQUEST_free(req);
-        if (resp) OCSP_RESPONSE_free(resp);
-        if (basic) OCSP_BASICRESP_free(basic);
-        if (ctx) SSL_CTX_free(ctx);
-        if (store) X509_STORE_free(store);
-#if 0
-        // indent right in emacs
-        (
-#endif
-        );
-#endif
 }
 
 /**
- * check CRL.
+ * Forget the connection without telling the peer.
  *
- * @todo CRL only works if cafile is used, not capath
- * http://etutorials.org/Programming/secure+programming/Chapter+10.+Public+Key+Infrastructure/10.5+Performing+X.509+Certificate+Verification+with+OpenSSL/
+ * For processes that have a fork()ed copy of a connection that some
+ * other process is handling. Frees the SSL state and closes the fd.
  */
 void
-SSLSocket::check_crl()
+SSLSocket::abandon()
 {
-        int err;
+        if (ssl) {
+                SSLCALL(SSL_free(ssl));
+                ssl = 0;
+        }
+        close();
+}
 
-        if (crlfile.empty()) {
-                return;
+/**
+ * Create the SSL object, building the context first if needed.
+ *
+ * @param[in] isconnect  true if we are client, false if we are server
+ */
+void
+SSLSocket::ssl_setup(bool isconnect)
+{
+	int err = 0;
+
+        if (!ctx_->get()) {
+                ctx_->build(!isconnect);
+        } else if (ctx_->is_server() == isconnect) {
+                THROW(ErrSSL, isconnect
+                      ? "SSL_connect() on a server context"
+                      : "SSL_accept() on a client context");
         }
 
-        X509_STORE_CTX *crlctx = 0;
-        X509_STORE *store = 0;
-        X509_LOOKUP *lookup = 0;
-        X509Wrap cert(SSLCALL(SSL_get_peer_certificate(ssl)));
+        // create ssl object
+        if (!(ssl = SSLCALL(SSL_new(ctx_->get())))) {
+                THROW(ErrSSL, "SSL_new()");
+	}
 
-        FINALLY(
-#if 0
-                );        // indent right in emacs
+        // attach fd to ssl object
+        if (!SSLCALL(SSL_set_fd(ssl, fd.get()))) {
+                THROW(ErrSSL, "SSL_set_fd()", ssl, err);
+        }
+        SSLCALL(SSL_set_app_data(ssl, this));
+
+        // a non-blocking write_from() returns as soon as a record is
+        // out, and the retry after IO_AGAIN may be from a queue that
+        // has since been appended to
+        SSLCALL(SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+                             | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER));
+
+        if (isconnect && session_) {
+                if (!SSLCALL(SSL_set_session(ssl, session_))) {
+                        THROW(ErrSSL, "SSL_set_session()", ssl, err);
+                }
+        }
+
+        // ask for a stapled OCSP response, checked in check_ocsp()
+        if (isconnect && ctx_->get_ocsp_mode() != SSLContext::OCSP_OFF) {
+                if (!SSLCALL(SSL_set_tlsext_status_type(ssl,
+                                                TLSEXT_STATUSTYPE_ocsp))) {
+                        THROW(ErrSSL, "SSL_set_tlsext_status_type()",
+                              ssl, err);
+                }
+        }
+
+        // early data only if the session says the server takes it
+        early_out_.clear();
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        if (isconnect && session_ && !early_data_.empty()
+            && (SSLCALL(SSL_SESSION_get_max_early_data(session_))
+                >= early_data_.size())) {
+                early_out_ = early_data_;
+        }
 #endif
 
-        crlctx = SSLCALL(X509_STORE_CTX_new());
-        if (!crlctx) {
-                THROW(ErrSSL, "X509_STORE_CTX_new()");
+        if (handshake_timeout_) {
+                deadline_ = clock_get_dbl() + handshake_timeout_;
+        }
+}
+
+/**
+ * Check the peer after a finished handshake.
+ *
+ * @param[in] isconnect  true if we are client, false if we are server
+ */
+void
+SSLSocket::ssl_finish(bool isconnect)
+{
+	int err;
+
+	if (isconnect) {
+                err = SSLCALL(SSL_get_verify_result(ssl));
+                if (err != X509_V_OK) {
+                        THROW(ErrSSL, "SSL_get_verify_result() != X509_V_OK:\n"
+                              + ssl_errstr(err));
+		}
+
+                X509Wrap x(SSLCALL(SSL_get_peer_certificate(ssl)));
+		if (!x.check_hostname(host)) {
+                        THROW(ErrSSLHostname, host, x.get_subject());
+		}
+	}
+
+	X509Wrap x(SSL_get_peer_certificate(ssl));
+
+        // a resumed session didn't go through verify_cb()
+        if (!isconnect && ctx_->get_peer_cache() && peer_fp_.empty()) {
+                lookup_peer(x.get());
+        }
+
+        // if debug, show cert info
+        if (logger->get_logmask() & LOG_MASK(LOG_DEBUG)) {
+                logger->debug("Issuer: %s\nSubject: %s\n"
+                              "Cipher: %s (Version %d bits) %s\n"
+                              "Serial number: %ld\n"
+                              "Fingerprint: %s%s",
+                              x.get_issuer().c_str(),
+                              x.get_subject().c_str(),
+                              SSLCALL(SSL_get_cipher_name(ssl)),
+                              SSLCALL(SSL_get_cipher_bits(ssl, 0)),
+                              SSLCALL(SSL_get_cipher_version(ssl)),
+                              x.get_serial(),
+                              x.get_fingerprint().c_str(),
+                              peer_cached_ ? "\nVerified before" : "");
+        }
+
+        if (!peer_cached_) {
+                check_crl();
+        }
+        if (isconnect) {
+                check_ocsp();
+        }
+}
+
+/**
+ * Wait for the peer after a handshake call that didn't finish.
+ *
+ * Without a handshake timeout the socket is blocking, so there's
+ * nothing to wait for and any error is fatal. With one, the socket is
+ * non-blocking and the wait is poll()ed with what's left of the
+ * deadline.
+ *
+ * @param[in] fname  Function that returned err, for the exception
+ * @param[in] err    Its return value
+ */
+void
+SSLSocket::handshake_wait(const char *fname, int err)
+{
+        struct pollfd pfd;
+        int left;
+
+        if (!handshake_timeout_) {
+                THROW(ErrSSL, fname, ssl, err);
+        }
+
+        pfd.fd = fd.get();
+        pfd.revents = 0;
+        pfd.events = handshake_events(fname, err);
+
+        left = (int)((deadline_ - clock_get_dbl()) * 1000);
+        if (left <= 0) {
+                THROW(ErrSSLTimeout, handshake_timeout_);
+        }
+        err = poll(&pfd, 1, left);
+        if (!err) {
+                THROW(ErrSSLTimeout, handshake_timeout_);
+        }
+        if (0 > err && errno != EINTR) {
+                THROW(Socket::ErrSys, "poll()");
+        }
+}
+
+/**
+ * One SSL_read_early_data() call.
+ *
+ * @param[out] out  Early data is appended here
+ * @return          false if handshake_wait() is needed
+ */
+bool
+SSLSocket::early_data_step(std::string *out)
+{
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        char buf[4096];
+        size_t n = 0;
+
+        switch (SSLCALL(SSL_read_early_data(ssl, buf, sizeof(buf), &n))) {
+        case SSL_READ_EARLY_DATA_ERROR:
+                return false;
+        case SSL_READ_EARLY_DATA_FINISH:
+                early_reading_ = false;
+                break;
         }
+        out->append(buf, n);
+#else
+        early_reading_ = false;
+#endif
+        return true;
+}
+
+/**
+ * Run SSL_connect() or SSL_accept() until the handshake is done.
+ *
+ * With a handshake timeout the socket is non-blocking during the
+ * handshake, and every wait for the peer is poll()ed with what's left
+ * of the deadline. A peer that connects and then says nothing (or
+ * trickles a byte now and then) can't hold the process forever.
+ *
+ * A client sends any early data first. A server that started reading
+ * early data with ssl_read_early_data() reads the rest of it, to be
+ * returned by read() once the handshake is done.
+ *
+ * @param[in] isconnect  true if client
+ */
+void
+SSLSocket::ssl_handshake(bool isconnect)
+{
+        const char *fname = isconnect ? "SSL_connect()" : "SSL_accept()";
+        int err;
 
-        store = SSLCALL(X509_STORE_new());
-        if (!store) {
-                THROW(ErrSSL, "X509_STORE_new()");
+        if (handshake_timeout_) {
+                fd.set_nonblock(true);
+        }
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        while (!early_out_.empty()) {
+                size_t n;
+                err = SSLCALL(SSL_write_early_data(ssl, early_out_.data(),
+                                                   early_out_.size(), &n));
+                if (err == 1) {
+                        early_out_.erase(0, n);
+                } else {
+                        handshake_wait("SSL_write_early_data()", err);
+                }
+        }
+#endif
+        while (early_reading_) {
+                if (!early_data_step(&early_in_)) {
+                        handshake_wait("SSL_read_early_data()", 0);
+                }
+        }
+        for (;;) {
+                err = isconnect
+                        ? SSLCALL(SSL_connect(ssl))
+                        : SSLCALL(SSL_accept(ssl));
+                if (err == 1) {
+                        break;
+                }
+                handshake_wait(fname, err);
+        }
+        if (handshake_timeout_) {
+                fd.set_nonblock(false);
         }
+}
 
-        lookup = SSLCALL(X509_STORE_add_lookup(store,
-                                               X509_LOOKUP_file()));
+/**
+ * Server: start the handshake and return early data (TLS 1.3 0-RTT)
+ * as it arrives, before the client has finished the handshake.
+ *
+ * Only a resumed session can carry early data, so the peer cert is
+ * known. But anything in it could be a replay: the client hasn't
+ * proven it's there yet. Don't act on it in any way that matters
+ * until ssl_accept() has returned.
+ *
+ * Early data is only accepted if the context allows it
+ * (SSLContext::set_max_early_data()) and this is called before
+ * ssl_accept(). Any early data not returned here is returned by read()
+ * after ssl_accept().
+ *
+ * @return  More early data, or empty string if there is no more
+ */
+std::string
+SSLSocket::ssl_read_early_data()
+{
+        std::string ret;
+
+        if (!ssl) {
+                ssl_setup(false);
+                logger->debug("doing SSL handshake (early data)");
+                early_reading_ = true;
+        }
+        if (handshake_timeout_) {
+                fd.set_nonblock(true);
+        }
+        while (early_reading_ && ret.empty()) {
+                if (!early_data_step(&ret)) {
+                        handshake_wait("SSL_read_early_data()", 0);
+                }
+        }
+        if (handshake_timeout_) {
+                fd.set_nonblock(false);
+        }
+        return ret;
+}
 
-        if (!SSLCALL(X509_load_cert_file(lookup,
-                                         cafile.c_str(),
-                                         X509_FILETYPE_PEM))) {
-                THROW(ErrSSL, "X509_load_cert_file()");
+/**
+ * Check the OCSP response stapled by the server, if any.
+ *
+ * No network access is made: the response must be signed by the
+ * server cert's issuer (or a responder it delegated to) and chain up
+ * to our CAs, be current, and say the cert is good. There is no nonce,
+ * since the server fetched it beforehand. A resumed session was
+ * checked when it was new.
+ */
+void
+SSLSocket::check_ocsp()
+{
+        const SSLContext::OCSPMode mode = ctx_->get_ocsp_mode();
+        if (mode == SSLContext::OCSP_OFF || SSLCALL(SSL_session_reused(ssl))) {
+                return;
         }
 
-        if (!SSLCALL(X509_load_crl_file(lookup,
-                                        crlfile.c_str(),
-                                        X509_FILETYPE_PEM))) {
-                if (!SSLCALL(X509_load_crl_file(lookup,
-                                                crlfile.c_str(),
-                                                X509_FILETYPE_ASN1))) {
-                        THROW(ErrSSL, "X509_load_crl_file()");
+        const unsigned char *der = NULL;
+        const long len = SSLCALL(SSL_get_tlsext_status_ocsp_resp(ssl, &der));
+        if (!der || len <= 0) {
+                if (mode == SSLContext::OCSP_REQUIRE) {
+                        THROW(ErrSSLOCSP, "server sent no OCSP response");
                 }
+                logger->debug("Server sent no OCSP response");
+                return;
+        }
+
+        // the CertID in the response is by issuer name and key
+        X509Wrap cert(SSLCALL(SSL_get_peer_certificate(ssl)));
+        X509 *issuer = NULL;
+        STACK_OF(X509) *chain = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        chain = SSLCALL(SSL_get0_verified_chain(ssl));
+#else
+        chain = SSLCALL(SSL_get_peer_cert_chain(ssl));
+#endif
+        if (chain && sk_X509_num(chain) > 1) {
+                issuer = sk_X509_value(chain, 1);
+        } else if (X509_V_OK == SSLCALL(X509_check_issued(cert.get(),
+                                                          cert.get()))) {
+                issuer = cert.get();
+        } else {
+                THROW(ErrSSLOCSP, "issuer of server cert not known");
         }
 
-        SSLCALL(X509_STORE_set_flags(store,
-                                     X509_V_FLAG_CRL_CHECK
-                                     | X509_V_FLAG_CRL_CHECK_ALL));
+        OCSP_RESPONSE *resp = NULL;
+        OCSP_BASICRESP *basic = NULL;
+        OCSP_CERTID *id = NULL;
+        int status;
+        int reason;
+        ASN1_GENERALIZEDTIME *revtime;
+        ASN1_GENERALIZEDTIME *thisupd;
+        ASN1_GENERALIZEDTIME *nextupd;
+        FINALLY(
+                resp = SSLCALL(d2i_OCSP_RESPONSE(NULL, &der, len));
+                if (!resp) {
+                        THROW(ErrSSLOCSP, "can't parse OCSP response");
+                }
+                status = SSLCALL(OCSP_response_status(resp));
+                if (status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+                        THROW(ErrSSLOCSP,
+                              std::string("response status ")
+                              + OCSP_response_status_str(status));
+                }
+                if (!(basic = SSLCALL(OCSP_response_get1_basic(resp)))) {
+                        THROW(ErrSSLOCSP, "OCSP_response_get1_basic()");
+                }
+                if (0 >= SSLCALL(OCSP_basic_verify(
+                                         basic,
+                                         SSL_get_peer_cert_chain(ssl),
+                                         SSL_CTX_get_cert_store(ctx_->get()),
+                                         0))) {
+                        THROW(ErrSSLOCSP, "bad signature on OCSP response");
+                }
+                if (!(id = SSLCALL(OCSP_cert_to_id(NULL, cert.get(),
+                                                   issuer)))) {
+                        THROW(ErrSSLOCSP, "OCSP_cert_to_id()");
+                }
+                if (!SSLCALL(OCSP_resp_find_status(basic, id,
+                                                   &status, &reason,
+                                                   &revtime,
+                                                   &thisupd, &nextupd))) {
+                        THROW(ErrSSLOCSP,
+                              "OCSP response is not for server cert");
+                }
+                if (!SSLCALL(OCSP_check_validity(thisupd, nextupd,
+                                                 OCSP_MAX_SKEW, -1))) {
+                        THROW(ErrSSLOCSP, "OCSP response is out of date");
+                }
+                ,
+                SSLCALL(OCSP_CERTID_free(id));
+                SSLCALL(OCSP_BASICRESP_free(basic));
+                SSLCALL(OCSP_RESPONSE_free(resp));
+                SSLCALL(ERR_clear_error());
+                );
+
+        if (status == V_OCSP_CERTSTATUS_REVOKED) {
+                THROW(ErrSSLOCSP, "server cert revoked");
+        }
+        if (status != V_OCSP_CERTSTATUS_GOOD) {
+                THROW(ErrSSLOCSP, "server cert status unknown");
+        }
+        logger->debug("OCSP response: server cert good");
+}
 
-        SSLCALL(X509_STORE_CTX_init(crlctx, store, cert.get(), 0));
-        if (1 != SSLCALL(X509_verify_cert(crlctx))) {
-                err = SSLCALL(X509_STORE_CTX_get_error(crlctx));
-                THROW(ErrSSLCRL,
-                      X509Wrap::errstr(err) + ": " + cert.get_subject());
+/**
+ * Certificate verification callback of a server context with a peer
+ * cache.
+ *
+ * A client cert that's in the cache was verified (chain and CRL) not
+ * long ago, and still would be, so that's skipped. The handshake still
+ * proves that the client has the key. Anything else gets the usual
+ * X509_verify_cert().
+ */
+int
+SSLSocket::verify_cb(X509_STORE_CTX *xs, void *)
+{
+        SSL *ssl = (SSL*)SSLCALL(X509_STORE_CTX_get_ex_data(
+                                   xs, SSL_get_ex_data_X509_STORE_CTX_idx()));
+        SSLSocket *sock = ssl ? (SSLSocket*)SSLCALL(SSL_get_app_data(ssl))
+                : NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        X509 *cert = SSLCALL(X509_STORE_CTX_get0_cert(xs));
+#else
+        X509 *cert = xs->cert;
+#endif
+        if (sock && cert && sock->lookup_peer(cert)) {
+                SSLCALL(X509_STORE_CTX_set_error(xs, X509_V_OK));
+                return 1;
         }
+        return SSLCALL(X509_verify_cert(xs));
+}
 
-        ,    /*  FINALLY */;
+/**
+ * Look the peer cert up in the peer cache.
+ *
+ * @param[in] cert  Peer cert
+ * @return          true if it was verified before
+ */
+bool
+SSLSocket::lookup_peer(X509 *cert)
+{
+        peer_fp_ = PeerCache::fingerprint(cert);
+        peer_cached_ = ctx_->get_peer_cache()->lookup(peer_fp_, time(0),
+                                                      &peer_);
+        return peer_cached_;
+}
 
-        if (crlctx) { SSLCALL(X509_STORE_CTX_free(crlctx)); }
-        if (store) { SSLCALL(X509_STORE_free(store)); } // need this? 
-#if 0
-        (        // indent right in emacs
+/**
+ * What the peer cache knows about the client cert.
+ *
+ * @return  Cached CN and its parts, or NULL if the cert was verified
+ *          in this handshake
+ */
+const PeerCache::Peer *
+SSLSocket::ssl_cached_peer() const
+{
+        return peer_cached_ ? &peer_ : NULL;
+}
+
+/**
+ * Remember an accepted client cert in the peer cache.
+ *
+ * Only after a full verification. The entry expires when the first
+ * cert in the chain does, or when a CRL it was checked against needs
+ * to be updated.
+ *
+ * @param[in] peer  CN and its parts. expire is filled in here.
+ * @return          true if stored
+ */
+bool
+SSLSocket::ssl_cache_peer(const PeerCache::Peer &peer)
+{
+        PeerCache *cache = ctx_->get_peer_cache();
+        if (!cache || peer_cached_ || peer_fp_.empty()) {
+                return false;
+        }
+        STACK_OF(X509) *chain = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        chain = SSLCALL(SSL_get0_verified_chain(ssl));
 #endif
-         );
+        if (!chain) {
+                return false;
+        }
+
+        const time_t now = time(0);
+        const CRLIndex *crl = ctx_->get_crl_index();
+        PeerCache::Peer p(peer);
+        p.expire = 0;
+        for (int c = 0; c < sk_X509_num(chain); c++) {
+                X509 *x = sk_X509_value(chain, c);
+                int day, sec;
+                if (!SSLCALL(ASN1_TIME_diff(&day, &sec, NULL,
+                                            X509_get_notAfter(x)))) {
+                        return false;
+                }
+                time_t t = now + (time_t)day * 86400 + sec;
+                if (!p.expire || t < p.expire) {
+                        p.expire = t;
+                }
+                // trusted root isn't checked, see check_crl()
+                const bool root = c && X509_V_OK == SSLCALL(
+                        X509_check_issued(x, x));
+                if (crl && !root) {
+                        t = crl->next_update(x);
+                        if (t && t < p.expire) {
+                                p.expire = t;
+                        }
+                }
+        }
+        return cache->store(peer_fp_, p);
+}
+
+/**
+ * check CRL.
+ *
+ * The peer cert, and the CA certs in the chain up to (not including)
+ * the trusted root, must each have been issued by a CA with a current
+ * CRL, and not be on it. A resumed session has no verified chain, and
+ * only the peer cert is checked.
+ */
+void
+SSLSocket::check_crl()
+{
+        const CRLIndex *crl = ctx_->get_crl_index();
+        if (!crl) {
+                return;
+        }
+
+        X509Wrap cert(SSLCALL(SSL_get_peer_certificate(ssl)));
+        STACK_OF(X509) *chain = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        chain = SSLCALL(SSL_get0_verified_chain(ssl));
+#endif
+        const time_t now = time(0);
+        const int n = chain ? sk_X509_num(chain) : 0;
+        for (int c = 0; c == 0 || c < n; c++) {
+                X509 *x = chain ? sk_X509_value(chain, c) : cert.get();
+                if (c && X509_V_OK == SSLCALL(X509_check_issued(x, x))) {
+                        continue;
+                }
+                const int err = crl->check(x, now);
+                if (err != X509_V_OK) {
+                        char buf[1024];
+                        SSLCALL(X509_NAME_oneline(X509_get_subject_name(x),
+                                                  buf, sizeof(buf)));
+                        THROW(ErrSSLCRL, X509Wrap::errstr(err) + ": " + buf);
+                }
+        }
 }
 
 /**
@@ -898,13 +1786,201 @@ SSLSocket::write(const std::string &buf)
         if (!ssl) {
                 THROW(ErrSSL, "SSL write when not connected");
         }
-        int ret;
-        ret = SSLCALL(SSL_write(ssl, buf.data(), buf.length()));
-        if (ret < 0) {
-                THROW(ErrSSL, "SSL_write()", ssl,
-                      SSLCALL(SSL_get_error(ssl, ret)));
+        size_t n;
+        if (IO_ERROR == write_from(buf.data(), buf.length(), &n)) {
+                THROW(ErrSSL, "SSL_write()", ssl, io_ret_);
+        }
+	return n;
+}
+
+/**
+ * Status for an SSL_read() or SSL_write() that returned <= 0. The
+ * return value is kept for throw_io_error().
+ *
+ * Either call can need the other direction: SSL_read() may have to
+ * answer a renegotiation or key update, and SSL_write() may have to
+ * read the peer's part of one.
+ *
+ * @param[in]  ret     What SSL_read() or SSL_write() returned
+ * @param[out] events  For IO_AGAIN, what to poll() for before the retry
+ */
+IOStatus
+SSLSocket::ssl_status(int ret, int *events)
+{
+        io_ret_ = ret;
+        switch (SSLCALL(SSL_get_error(ssl, ret))) {
+        case SSL_ERROR_ZERO_RETURN:
+                return IO_EOF;
+        case SSL_ERROR_WANT_READ:
+                *events = POLLIN;
+                return IO_AGAIN;
+        case SSL_ERROR_WANT_WRITE:
+                *events = POLLOUT;
+                return IO_AGAIN;
+        default:
+                return IO_ERROR;
+        }
+}
+
+/**
+ * write from caller's buffer, as one or more records sized by
+ * ssl_set_record_sizing(). Doesn't throw.
+ *
+ * On a non-blocking socket this writes until the socket is full. After
+ * IO_AGAIN the next call must start with the same data, but may be
+ * longer or from somewhere else (see ssl_setup()). Wait for
+ * io_events(true) before it.
+ *
+ * @param[in]  buf   Data to write
+ * @param[in]  len   Bytes in buf
+ * @param[out] done  Bytes written. 0 unless IO_OK.
+ *
+ * @return IO_OK, IO_AGAIN or IO_ERROR
+ */
+IOStatus
+SSLSocket::write_from(const char *buf, size_t len, size_t *done)
+{
+        *done = 0;
+        if (!ssl) {
+                io_ret_ = 0;
+                return IO_ERROR;
+        }
+        while (*done < len) {
+                // a retry must be for what OpenSSL already has buffered
+                const size_t n = write_pending_
+                        ? std::min(len - *done, write_pending_)
+                        : std::min(record_sizing(len - *done),
+                                   (size_t)INT_MAX);
+                const int ret = SSLCALL(SSL_write(ssl, buf + *done, n));
+                if (ret <= 0) {
+                        IOStatus st = ssl_status(ret, &write_events_);
+                        if (st == IO_AGAIN) {
+                                write_pending_ = n;
+                        } else if (st == IO_EOF) {
+                                st = IO_ERROR;
+                        }
+                        // report the error on the next call
+                        return *done ? IO_OK : st;
+                }
+                write_pending_ = 0;
+                write_events_ = POLLOUT;
+
+                const unsigned long records = (ret + rec_size_ - 1)
+                        / rec_size_;
+                if (rec_size_ < SSL3_RT_MAX_PLAIN_LENGTH) {
+                        rec_stats_.small += records;
+                } else {
+                        rec_stats_.full += records;
+                }
+                rec_stats_.bytes += ret;
+                rec_burst_ += ret;
+                *done += ret;
+        }
+	return IO_OK;
+}
+
+/**
+ * Gather write. TLS has no writev(), so small buffers are copied
+ * together first, to go out in one record instead of one each. A
+ * large first buffer is written by itself, without copying.
+ *
+ * @param[in]  iov     Buffers
+ * @param[in]  iovcnt  Number of buffers
+ * @param[out] done    Bytes written, counting from the first buffer.
+ *                     0 unless IO_OK.
+ *
+ * @return IO_OK, IO_AGAIN or IO_ERROR
+ */
+IOStatus
+SSLSocket::writev_from(const struct iovec *iov, int iovcnt, size_t *done)
+{
+        char buf[SSL3_RT_MAX_PLAIN_LENGTH];
+        size_t len = 0;
+
+        if (iovcnt == 1 || (iovcnt > 1 && iov[0].iov_len >= sizeof(buf))) {
+                return write_from((const char*)iov[0].iov_base,
+                                  iov[0].iov_len, done);
+        }
+        for (int c = 0; c < iovcnt && len < sizeof(buf); c++) {
+                const size_t n = std::min(iov[c].iov_len, sizeof(buf) - len);
+                memcpy(buf + len, iov[c].iov_base, n);
+                len += n;
+        }
+        return write_from(buf, len, done);
+}
+
+/**
+ * poll() events to wait for before retrying a read_into() or
+ * write_from() that returned IO_AGAIN. Not always the obvious ones,
+ * see ssl_status().
+ *
+ * @param[in] writing  false for read_into(), true for write_from()
+ */
+int
+SSLSocket::io_events(bool writing) const
+{
+        return writing ? write_events_ : read_events_;
+}
+
+/**
+ * Throw ErrSSL for the last failed read_into() or write_from().
+ */
+void
+SSLSocket::throw_io_error(const std::string &what)
+{
+        THROW(ErrSSL, what, ssl, io_ret_);
+}
+
+/**
+ * Set the record size for the next write, as set up by
+ * ssl_set_record_sizing().
+ *
+ * While records are small, a write is cut off where the burst reaches
+ * the boost threshold, so the rest of it goes out in full records.
+ *
+ * Doesn't throw. If OpenSSL won't take the new size, records stay the
+ * size they were and sizing is off for the rest of the connection.
+ *
+ * @param[in] len  Bytes about to be written
+ *
+ * @return How many of them to write now
+ */
+size_t
+SSLSocket::record_sizing(size_t len)
+{
+        if (!rec_small_) {
+                return len;
+        }
+        const double now = clock_get_dbl();
+        if (now - rec_last_ > rec_idle_) {
+                rec_burst_ = 0;
+        }
+        rec_last_ = now;
+
+        size_t size = SSL3_RT_MAX_PLAIN_LENGTH;
+        if (rec_burst_ < rec_boost_) {
+                size = rec_small_;
+                len = std::min(len, rec_boost_ - rec_burst_);
+        }
+        if (size != rec_size_) {
+                if (!SSLCALL(SSL_set_max_send_fragment(ssl, size))) {
+                        logger->warning("SSL_set_max_send_fragment(%u) "
+                                        "failed, not sizing records",
+                                        (unsigned)size);
+                        ERR_clear_error();
+                        rec_small_ = 0;
+                        return len;
+                }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+                // lowering the max also lowered this, raise it again
+                SSLCALL(SSL_set_split_send_fragment(ssl, size));
+#endif
+                if (size > rec_size_) {
+                        rec_stats_.boosts++;
+                }
+                rec_size_ = size;
         }
-	return ret;
+        return len;
 }
 
 /**
@@ -922,36 +1998,137 @@ SSLSocket::read(size_t m)
         if (!ssl) {
                 THROW(ErrSSL, "SSL read when not connected");
         }
-	int err, sslerr;
-	std::vector<char> buf(m);
-		
-        err = SSLCALL(SSL_read(ssl, &buf[0], m));
-	if (err > 0) {
-		return std::string(&buf[0], &buf[err]);
-	}
-        sslerr = SSLCALL(SSL_get_error(ssl, err));
-	if (err == 0 && sslerr == SSL_ERROR_ZERO_RETURN) {
+	std::string buf(m, 0);
+        size_t n;
+        switch (read_into(&buf[0], m, &n)) {
+        case IO_OK:
+                break;
+        case IO_EOF:
                 THROW0(ErrPeerClosed);
-	}
-        THROW(ErrSSL, "SSL_read()", ssl, err);
+        default:
+                THROW(ErrSSL, "SSL_read()", ssl, io_ret_);
+        }
+        buf.resize(n);
+        return buf;
+}
+
+/**
+ * read at most 'len' bytes into caller's buffer. At most one record
+ * is decrypted. Doesn't throw.
+ *
+ * @param[out] buf  Where to put it
+ * @param[in]  len  Size of buf
+ * @param[out] got  Bytes read. 0 unless IO_OK.
+ *
+ * @return IO_OK, IO_EOF (peer sent close_notify), IO_AGAIN or IO_ERROR
+ */
+IOStatus
+SSLSocket::read_into(char *buf, size_t len, size_t *got)
+{
+        *got = 0;
+        if (!ssl) {
+                io_ret_ = 0;
+                return IO_ERROR;
+        }
+        if (!early_in_.empty()) {
+                *got = std::min(len, early_in_.size());
+                memcpy(buf, early_in_.data(), *got);
+                early_in_.erase(0, *got);
+                return IO_OK;
+        }
+        const int ret = SSLCALL(SSL_read(ssl, buf,
+                                         std::min(len, (size_t)INT_MAX)));
+        if (ret <= 0) {
+                return ssl_status(ret, &read_events_);
+        }
+        read_events_ = POLLIN;
+        *got = ret;
+        return IO_OK;
 }
 	
+/**
+ * Check if records sent on this connection are encrypted by the kernel
+ * (kTLS). Only then is ssl_splice() allowed.
+ *
+ * Needs SSLContext::set_ktls(), an OpenSSL built with kTLS, and a
+ * kernel with the tls module and support for the cipher.
+ */
+bool
+SSLSocket::ssl_ktls_send()
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+        return ssl && SSLCALL(BIO_get_ktls_send(SSL_get_wbio(ssl)));
+#else
+        return false;
+#endif
+}
+
+/**
+ * Send data from a pipe without copying it to user space.
+ *
+ * The kernel moves it to the socket and encrypts it, so this must
+ * never be done without kTLS, or it'd go out in the clear.
+ *
+ * @param[in] pipefd  Read end of a pipe
+ * @param[in] len     Send at most this many bytes
+ *
+ * @return Bytes sent. Can be less than len.
+ */
+size_t
+SSLSocket::ssl_splice(int pipefd, size_t len)
+{
+        if (!ssl_ktls_send()) {
+                THROW(ErrSSL, "splice() to socket without kernel TLS");
+        }
+#ifdef HAVE_SPLICE
+        ssize_t n = splice(pipefd, NULL, fd.get(), NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EAGAIN) {
+                return 0;
+        }
+        if (n < 0) {
+                THROW(Socket::ErrSys, "splice()");
+        }
+        return n;
+#else
+        (void)pipefd;
+        (void)len;
+        THROW(ErrSSL, "splice() not supported");
+#endif
+}
+
 /**
  * @return true if there is any data waiting to be read
  */
 bool
 SSLSocket::ssl_pending()
 {
+        if (!early_in_.empty()) {
+                return true;
+        }
         return SSLCALL(SSL_pending(ssl));
 }
 
+/**
+ * Use a shared, possibly already built, context instead of this
+ * socket's own one. The ssl_set_*() setters below only affect the
+ * socket's own context.
+ *
+ * @param[in] ctx  Context that outlives this socket, or NULL to go back
+ *                 to the socket's own context.
+ */
+void
+SSLSocket::ssl_set_context(SSLContext *ctx)
+{
+        ctx_ = ctx ? ctx : own_ctx_;
+}
+
 /**
  * Set list of ciphers that are acceptable. See ciphers(1SSL)
  */
 void
 SSLSocket::ssl_set_cipher_list(const std::string &lst)
 {
-	cipher_list = lst;
+	own_ctx_->set_cipher_list(lst);
 }
 
 /**
@@ -960,7 +2137,125 @@ SSLSocket::ssl_set_cipher_list(const std::string &lst)
 void
 SSLSocket::ssl_set_privkey_engine(const std::string &engine)
 {
-        privkey_engine_ = std::make_pair(true, engine);
+        own_ctx_->set_privkey_engine(engine);
+}
+
+/**
+ * Set engine config to be set before and after ENGINE_init
+ */
+void
+SSLSocket::ssl_set_privkey_engine_conf(const EngineConf &pre,
+                                       const EngineConf &post)
+{
+        own_ctx_->set_privkey_engine_conf(pre, post);
+}
+
+/**
+ * Give up on the handshake if it hasn't finished after this many
+ * seconds. 0 (the default) means wait forever.
+ */
+void
+SSLSocket::ssl_set_handshake_timeout(unsigned seconds)
+{
+        handshake_timeout_ = seconds;
+}
+
+/**
+ * Adapt the size of records written to the traffic.
+ *
+ * Keystroke echoes and prompts go out in small records, about one TCP
+ * segment each, so the other end can decrypt them as soon as they
+ * arrive instead of waiting for the rest of a 16 kB record. Once
+ * 'boost' bytes have been written without a pause of 'idle' seconds
+ * records go up to full size, which is cheaper per byte for bulk
+ * output. After such a pause they're small again.
+ *
+ * Records spliced with kTLS are sized by the kernel.
+ *
+ * @param[in] small  Small record size. Raised to 512 if less, which is
+ *                   the least OpenSSL allows. 0 turns this off, and
+ *                   leaves the size to OpenSSL.
+ * @param[in] boost  Bytes written before going to full size
+ * @param[in] idle   Seconds without writes before going back to small
+ */
+void
+SSLSocket::ssl_set_record_sizing(size_t small, size_t boost, double idle)
+{
+        if (small >= SSL3_RT_MAX_PLAIN_LENGTH) {
+                small = 0;
+        } else if (small && small < 512) {
+                small = 512;
+        }
+        rec_small_ = small;
+        rec_boost_ = boost;
+        rec_idle_ = idle;
+}
+
+/**
+ * Offer this session for resumption on ssl_connect(). The caller keeps
+ * ownership; SSL_set_session() takes its own reference.
+ */
+void
+SSLSocket::ssl_set_session(SSL_SESSION *sess)
+{
+        session_ = sess;
+}
+
+/**
+ * Get the current session, for offering to a later connection. Caller
+ * must SSL_SESSION_free() it.
+ *
+ * With TLS 1.3 the server sends sessions after the handshake, so data
+ * must have been read for there to be one worth keeping.
+ */
+SSL_SESSION *
+SSLSocket::ssl_get1_session()
+{
+        return ssl ? SSLCALL(SSL_get1_session(ssl)) : NULL;
+}
+
+/**
+ * Client: send this (TLS 1.3 0-RTT) as early data on ssl_connect(), if
+ * the session given to ssl_set_session() allows it. Check
+ * ssl_early_data_accepted() afterwards, and if it wasn't, send it
+ * again.
+ */
+void
+SSLSocket::ssl_set_early_data(const std::string &data)
+{
+        early_data_ = data;
+}
+
+/**
+ * True if the early data was sent and the server took it.
+ */
+bool
+SSLSocket::ssl_early_data_accepted()
+{
+#ifdef HAVE_SSL_READ_EARLY_DATA
+        return ssl && (SSLCALL(SSL_get_early_data_status(ssl))
+                       == SSL_EARLY_DATA_ACCEPTED);
+#else
+        return false;
+#endif
+}
+
+/**
+ * True if the handshake resumed a session instead of doing a full one.
+ */
+bool
+SSLSocket::ssl_session_reused()
+{
+        return ssl && SSLCALL(SSL_session_reused(ssl));
+}
+
+/**
+ * Set ECDHE groups, in order of preference. E.g. "X25519:P-256"
+ */
+void
+SSLSocket::ssl_set_groups(const std::string &s)
+{
+	own_ctx_->set_groups(s);
 }
 
 /**
@@ -969,7 +2264,7 @@ SSLSocket::ssl_set_privkey_engine(const std::string &engine)
 void
 SSLSocket::ssl_set_capath(const std::string &s)
 {
-	capath = s;
+	own_ctx_->set_capath(s);
 }
 
 /**
@@ -978,7 +2273,7 @@ SSLSocket::ssl_set_capath(const std::string &s)
 void
 SSLSocket::ssl_set_crlfile(const std::string &s)
 {
-	crlfile = s;
+	own_ctx_->set_crlfile(s);
 }
 
 /**
@@ -987,7 +2282,7 @@ SSLSocket::ssl_set_crlfile(const std::string &s)
 void
 SSLSocket::ssl_set_cafile(const std::string &s)
 {
-	cafile = s;
+	own_ctx_->set_cafile(s);
 }
 
 /**
@@ -997,7 +2292,7 @@ SSLSocket::ssl_set_cafile(const std::string &s)
 void
 SSLSocket::ssl_set_certfile(const std::string &s)
 {
-	certfile = s;
+	own_ctx_->set_certfile(s);
 }
 
 /**
@@ -1007,7 +2302,7 @@ SSLSocket::ssl_set_certfile(const std::string &s)
 void
 SSLSocket::ssl_set_keyfile(const std::string &s)
 {
-	keyfile = s;
+	own_ctx_->set_keyfile(s);
 }
 
 /**
@@ -1097,6 +2392,28 @@ SSLSocket::ErrSSLCRL::ErrSSLCRL(const Err::ErrData &errdata,
         msg += ": " + subject;
 }
 
+/**
+ *
+ */
+SSLSocket::ErrSSLOCSP::ErrSSLOCSP(const Err::ErrData &errdata,
+                                  const std::string &why)
+        :ErrSSL(errdata, "OCSP check failed")
+{
+        msg += ": " + why;
+}
+
+/**
+ *
+ */
+SSLSocket::ErrSSLTimeout::ErrSSLTimeout(const Err::ErrData &errdata,
+                                        unsigned seconds)
+        :ErrSSL(errdata, "SSL handshake timed out")
+{
+        char buf[64];
+        snprintf(buf, sizeof(buf), " after %u seconds", seconds);
+        msg += buf;
+}
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
@@ -7,6 +7,7 @@
 #include<list>
 #include<exception>
 #include<memory>
+#include<vector>
 
 #include<openssl/bio.h>
 #include<openssl/x509v3.h>
@@ -15,6 +16,9 @@
 
 #include"socket.h"
 #include"errbase.h"
+#include"peercache.h"
+
+class CRLIndex;
 
 /**
  * OpenSSL X509 structure wrapper.
@@ -66,34 +70,67 @@ public:
 	~X509Wrap() throw();
 };
 
+class SSLContext;
+
 /**
  * SSL Socket
  */
 class SSLSocket: public Socket {
-	SSL_CTX *ctx;
+public:
+        /**
+         * Records written, by size. See ssl_set_record_sizing().
+         */
+        struct RecordStats {
+                unsigned long small;    ///< Written while traffic was small
+                unsigned long full;     ///< Written at full size
+                unsigned long boosts;   ///< Times it went from small to full
+                unsigned long long bytes;
+        };
+private:
 	SSL *ssl;
-	std::string cipher_list;
-	std::string certfile;
-	std::string keyfile;
-	std::string capath;
-	std::string cafile;
 	std::string host;
-	std::string crlfile;
-
-        typedef std::pair<bool, std::string> Optional;
-        Optional privkey_engine_;
+        SSLContext *ctx_;
+        SSLContext *own_ctx_;
+        unsigned handshake_timeout_;
+        double deadline_;
+        SSL_SESSION *session_;
+        std::string early_data_;
+        std::string early_out_;
+        std::string early_in_;
+        bool early_reading_;
+        PeerCache::Peer peer_;
+        bool peer_cached_;
+        std::string peer_fp_;
+        size_t rec_small_;
+        size_t rec_boost_;
+        double rec_idle_;
+        size_t rec_size_;
+        size_t rec_burst_;
+        double rec_last_;
+        RecordStats rec_stats_;
+        int io_ret_;
+        int read_events_;
+        int write_events_;
+        size_t write_pending_;
 
 	SSLSocket &operator=(const SSLSocket&);
 	SSLSocket(const SSLSocket&);
 
 	void ssl_accept_connect(bool);
+        int handshake_step(bool);
+        int handshake_events(const char *fname, int err);
+        void ssl_setup(bool);
+        void ssl_handshake(bool);
+        void ssl_finish(bool);
+        void handshake_wait(const char *fname, int err);
+        bool early_data_step(std::string *out);
         void check_crl();
         void check_ocsp();
-        DH *ssl_setup_dh();
+        bool lookup_peer(X509 *cert);
+        size_t record_sizing(size_t len);
+        IOStatus ssl_status(int ret, int *events);
 public:
         typedef std::vector<std::pair<std::string, std::string> > EngineConf;
-        EngineConf privkey_engine_pre_;
-        EngineConf privkey_engine_post_;
 
         class Engine {
                 ENGINE *engine_;
@@ -143,6 +180,16 @@ public:
 		virtual ~ErrSSLCRL() throw() {};
 	};
 
+        /**
+         * Stapled OCSP response missing, bad, or says revoked
+         */
+	class ErrSSLOCSP: public ErrSSL {
+	public:
+		ErrSSLOCSP(const Err::ErrData &errdata,
+                           const std::string &why);
+		virtual ~ErrSSLOCSP() throw() {};
+	};
+
         /**
          * Exception hostname doesn't match subject name
          */
@@ -153,12 +200,21 @@ public:
 			       const std::string &subject);
 	};
 
+        /**
+         * Handshake didn't finish in time
+         */
+	class ErrSSLTimeout: public ErrSSL {
+	public:
+		ErrSSLTimeout(const Err::ErrData &errdata, unsigned seconds);
+	};
+
 	static const std::string ssl_errstr(int err);
 
         static unsigned long threadid_callback();
         static void locking_callback(int, int, const char*, int);
         static void make_thread_safe();
         static void global_init();
+        static int verify_cb(X509_STORE_CTX *xs, void *arg);
 
 	SSLSocket(int fd = -1);
 	virtual ~SSLSocket() throw();
@@ -166,21 +222,166 @@ public:
 	void ssl_attach(Socket&sock);
 
 	bool ssl_pending();
+        void ssl_set_context(SSLContext *ctx);
 	void ssl_set_cipher_list(const std::string &lst);
 	void ssl_set_capath(const std::string &s);
 	void ssl_set_cafile(const std::string &s);
 	void ssl_set_certfile(const std::string &s);
 	void ssl_set_keyfile(const std::string &s);
 	void ssl_set_crlfile(const std::string &s);
+        void ssl_set_groups(const std::string &s);
+        void ssl_set_handshake_timeout(unsigned seconds);
+        void ssl_set_record_sizing(size_t small, size_t boost, double idle);
+        RecordStats ssl_record_stats() const { return rec_stats_; }
+        void ssl_set_session(SSL_SESSION *sess);
+        SSL_SESSION *ssl_get1_session();
+        bool ssl_session_reused();
+        void ssl_set_early_data(const std::string &data);
+        bool ssl_early_data_accepted();
+        std::string ssl_read_early_data();
+        bool ssl_ktls_send();
+        size_t ssl_splice(int pipefd, size_t len);
+        const PeerCache::Peer *ssl_cached_peer() const;
+        bool ssl_cache_peer(const PeerCache::Peer &peer);
         void ssl_set_privkey_engine(const std::string &);
+        void ssl_set_privkey_engine_conf(const EngineConf &pre,
+                                         const EngineConf &post);
 
 	std::auto_ptr<X509Wrap> get_cert();
 
 	void shutdown();
 	void ssl_accept();
+        int ssl_accept_step();
+        void abandon();
 	void ssl_connect(const std::string &s);
+        int ssl_connect_step(const std::string &s);
 	virtual std::string read(size_t m = 4096);
 	virtual size_t write(const std::string &);
+
+        virtual IOStatus read_into(char *buf, size_t len, size_t *got);
+        virtual IOStatus write_from(const char *buf, size_t len,
+                                    size_t *done);
+        virtual IOStatus writev_from(const struct iovec *iov, int iovcnt,
+                                     size_t *done);
+        virtual void throw_io_error(const std::string &what);
+        virtual int io_events(bool writing) const;
+};
+
+/**
+ * SSL context: certificate chain, private key, CA store, cipher list
+ * and key exchange parameters (ECDHE groups and optionally pregenerated
+ * DH parameters).
+ *
+ * All of that is the same for every connection and some of it (like
+ * loading a key through an engine) is expensive, so build() it once and
+ * hand it to any number of SSLSockets with SSLSocket::ssl_set_context().
+ * A context built before fork() is inherited by the child, which then
+ * only needs to SSL_new() and do the handshake.
+ *
+ * The context must outlive all SSLSockets using it.
+ */
+class SSLContext {
+public:
+        /** What a client does about OCSP. */
+        enum OCSPMode {
+                OCSP_OFF,       ///< Don't ask for a stapled response
+                OCSP_CHECK,     ///< Ask, and check it if there is one
+                OCSP_REQUIRE,   ///< Ask, and fail without a good one
+        };
+private:
+        SSL_CTX *ctx_;
+        bool server_;
+	std::string cipher_list_;
+        bool server_preference_;
+	std::string certfile_;
+	std::string keyfile_;
+        std::vector<std::pair<std::string, std::string> > more_certs_;
+        X509 *primary_cert_;
+	std::string capath_;
+	std::string cafile_;
+	std::string crlfile_;
+        std::string groups_;
+        std::string dhparams_file_;
+
+        typedef std::pair<bool, std::string> Optional;
+        Optional privkey_engine_;
+        SSLSocket::EngineConf privkey_engine_pre_;
+        SSLSocket::EngineConf privkey_engine_post_;
+        SSLSocket::Engine *engine_;
+        bool cert_on_demand_;
+        unsigned max_early_data_;
+        bool ktls_;
+        const CRLIndex *crl_index_;
+        CRLIndex *own_crl_index_;
+        PeerCache *peer_cache_;
+        OCSPMode ocsp_mode_;
+        std::string ocsp_staple_file_;
+        std::string ocsp_staple_;
+        time_t ocsp_staple_mtime_;
+
+        SSLContext(const SSLContext&);
+        SSLContext &operator=(const SSLContext&);
+
+        void configure();
+        void load_cert(SSL *ssl);
+        void load_cert(SSL *ssl, const std::string &certfile,
+                       const std::string &keyfile);
+        void load_privkey(SSL *ssl, const std::string &keyfile);
+        static int cert_cb(SSL *ssl, void *arg);
+        static int ocsp_status_cb(SSL *ssl, void *arg);
+        void setup_key_exchange();
+public:
+        SSLContext();
+        ~SSLContext() throw();
+
+	void set_cipher_list(const std::string &lst) { cipher_list_ = lst; }
+        void set_server_preference(bool b) { server_preference_ = b; }
+	void set_capath(const std::string &s) { capath_ = s; }
+	void set_cafile(const std::string &s) { cafile_ = s; }
+	void set_certfile(const std::string &s) { certfile_ = s; }
+	void set_keyfile(const std::string &s) { keyfile_ = s; }
+        void add_cert(const std::string &certfile, const std::string &keyfile)
+        {
+                more_certs_.push_back(std::make_pair(certfile, keyfile));
+        }
+	void set_crlfile(const std::string &s) { crlfile_ = s; }
+        void set_groups(const std::string &s) { groups_ = s; }
+        void set_dhparams_file(const std::string &s) { dhparams_file_ = s; }
+        void set_privkey_engine(const std::string &s)
+        {
+                privkey_engine_ = std::make_pair(true, s);
+        }
+        void set_privkey_engine_conf(const SSLSocket::EngineConf &pre,
+                                     const SSLSocket::EngineConf &post)
+        {
+                privkey_engine_pre_ = pre;
+                privkey_engine_post_ = post;
+        }
+        void set_cert_on_demand(bool b) { cert_on_demand_ = b; }
+        void set_max_early_data(unsigned n) { max_early_data_ = n; }
+        void set_ktls(bool b) { ktls_ = b; }
+        void set_crl_index(const CRLIndex *p) { crl_index_ = p; }
+        void set_peer_cache(PeerCache *p) { peer_cache_ = p; }
+        void set_ocsp_mode(OCSPMode m) { ocsp_mode_ = m; }
+        void set_ocsp_staple_file(const std::string &s)
+        {
+                ocsp_staple_file_ = s;
+        }
+        bool load_ocsp_staple();
+
+        const std::string &get_cafile() const { return cafile_; }
+        const std::string &get_crlfile() const { return crlfile_; }
+        const CRLIndex *get_crl_index() const { return crl_index_; }
+        PeerCache *get_peer_cache() const { return peer_cache_; }
+        OCSPMode get_ocsp_mode() const { return ocsp_mode_; }
+
+        static bool have_aes_hw();
+        static std::string auto_cipher_list();
+        static std::string auto_ciphersuites();
+
+        void build(bool server);
+        bool is_server() const { return server_; }
+        SSL_CTX *get() const { return ctx_; }
 };
 
 /* ---- Emacs Variables ----
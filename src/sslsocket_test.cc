@@ -1,10 +1,13 @@
 #include<sys/types.h>
 #include<sys/socket.h>
+#include<poll.h>
 
+#include<functional>
 #include<iostream>
 #include<thread>
 
 #include<gtest/gtest.h>
+#include<openssl/pem.h>
 
 #include"util2.h"
 #include"sslsocket.h"
@@ -46,6 +49,58 @@ class SSLSocketTest: public ::testing::Test {
     sc_.ssl_set_keyfile("src/testdata/client.key");
   }
 
+  // Same certs as set_certs(), for a shared context. Not built.
+  void server_ctx(SSLContext &ctx)
+  {
+    ctx.set_cafile("src/testdata/client.crt");
+    ctx.set_certfile("src/testdata/server.crt");
+    ctx.set_keyfile("src/testdata/server.key");
+  }
+
+  void client_ctx(SSLContext &ctx)
+  {
+    ctx.set_cafile("src/testdata/server.crt");
+    ctx.set_certfile("src/testdata/client.crt");
+    ctx.set_keyfile("src/testdata/client.key");
+  }
+
+  // Connect sc to sl_, which must be listening, and accept the other
+  // end as ss. Then run client in a thread and server here.
+  void handshake_pair(SSLSocket &sc, SSLContext &cctx,
+                      SSLSocket &ss, SSLContext &sctx,
+                      const std::function<void()> &client,
+                      const std::function<void()> &server)
+  {
+    sc.connect(AF_UNSPEC, "localhost", listenport);
+    sc.ssl_set_context(&cctx);
+    ss.setfd(sl_.accept());
+    ss.ssl_set_context(&sctx);
+
+    std::thread th;
+    AutoJoin aj(&th);
+    th = std::thread(client);
+    server();
+  }
+
+  // Same, with the exchange of client_loopdata()
+  void handshake_pair(SSLSocket &sc, SSLContext &cctx,
+                      SSLSocket &ss, SSLContext &sctx)
+  {
+    handshake_pair(sc, cctx, ss, sctx,
+                   [&sc]{
+                     try {
+                       sc.ssl_connect("localhost");
+                       sc.write("OK " + sc.read());
+                     } catch (...) {
+                     }
+                   },
+                   [&ss]{
+                     ss.ssl_accept();
+                     ss.write("x");
+                     EXPECT_EQ("OK x", ss.read());
+                   });
+  }
+
 
  public:
   SSLSocketTest()
@@ -177,6 +232,440 @@ TEST_F(SSLSocketTest, Handshake)
   }
 }
 
+TEST_F(SSLSocketTest, SharedContext)
+{
+  SSLContext ctx;
+  server_ctx(ctx);
+  ctx.build(true);
+  EXPECT_THROW(ctx.build(true), SSLSocket::ErrSSL);
+
+  connect_tcp();
+
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  ss.ssl_set_context(&ctx);
+
+  set_certs(sc_);
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+
+    th = std::thread(&SSLSocketTest::client_loopdata, this);
+    ss.ssl_accept();
+    ss.write("x");
+    EXPECT_EQ("OK x", ss.read());
+  }
+}
+
+TEST_F(SSLSocketTest, HandshakeTimeout)
+{
+  connect_tcp();
+
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  set_certs(ss);
+  ss.ssl_set_handshake_timeout(1);
+
+  // client connected but never says hello
+  EXPECT_THROW(ss.ssl_accept(), SSLSocket::ErrSSLTimeout);
+}
+
+TEST_F(SSLSocketTest, HandshakeWithTimeout)
+{
+  connect_tcp();
+
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  set_certs(ss);
+  ss.ssl_set_handshake_timeout(10);
+
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+
+    th = std::thread(&SSLSocketTest::client_loopdata, this);
+    ss.ssl_accept();
+    ss.write("x");
+    EXPECT_EQ("OK x", ss.read());
+  }
+}
+
+TEST_F(SSLSocketTest, AcceptStep)
+{
+  connect_tcp();
+
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  set_certs(ss);
+  ss.set_nonblock(true);
+
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+
+    th = std::thread(&SSLSocketTest::client_loopdata, this);
+    int events;
+    while ((events = ss.ssl_accept_step())) {
+      EXPECT_TRUE(events == POLLIN || events == POLLOUT);
+      struct pollfd pfd;
+      pfd.fd = ss.getfd();
+      pfd.events = events;
+      pfd.revents = 0;
+      ASSERT_EQ(1, poll(&pfd, 1, 10000));
+    }
+    ss.set_nonblock(false);
+    ss.write("x");
+    EXPECT_EQ("OK x", ss.read());
+  }
+}
+
+TEST_F(SSLSocketTest, ResumeWithoutClientKey)
+{
+  SSLContext sctx;
+  server_ctx(sctx);
+  sctx.build(true);
+  SSL_CTX_set_session_id_context(sctx.get(),
+                                 (const unsigned char*)"test", 4);
+
+  sl_.listen(AF_UNSPEC, "", listenport);
+  SSL_SESSION *sess;
+  {
+    SSLContext cctx;
+    client_ctx(cctx);
+    SSLSocket sc, ss;
+    handshake_pair(sc, cctx, ss, sctx);
+    EXPECT_FALSE(sc.ssl_session_reused());
+    sess = sc.ssl_get1_session();
+    ASSERT_TRUE(sess != NULL);
+  }
+
+  // Key is never loaded if the session is resumed.
+  SSLContext cctx;
+  client_ctx(cctx);
+  cctx.set_keyfile("src/testdata/nonexistent.key");
+  cctx.set_cert_on_demand(true);
+
+  SSLSocket sc, ss;
+  sc.ssl_set_session(sess);
+  handshake_pair(sc, cctx, ss, sctx);
+  EXPECT_TRUE(sc.ssl_session_reused());
+  SSL_SESSION_free(sess);
+}
+
+TEST_F(SSLSocketTest, EarlyData)
+{
+  SSLContext sctx;
+  server_ctx(sctx);
+  sctx.set_max_early_data(1024);
+  sctx.build(true);
+  SSL_CTX_set_session_id_context(sctx.get(),
+                                 (const unsigned char*)"test", 4);
+
+  SSLContext cctx;
+  client_ctx(cctx);
+
+  sl_.listen(AF_UNSPEC, "", listenport);
+  SSL_SESSION *sess;
+  {
+    SSLSocket sc, ss;
+    handshake_pair(sc, cctx, ss, sctx);
+    sess = sc.ssl_get1_session();
+    ASSERT_TRUE(sess != NULL);
+  }
+
+  // Server reads early data. Then once more, with the server not
+  // asking for it, so it's rejected.
+  for (int c = 0; c < 2; c++) {
+    SSLSocket sc, ss;
+    sc.ssl_set_session(sess);
+    sc.ssl_set_early_data("early");
+    ss.ssl_set_handshake_timeout(10);
+
+    bool accepted = false;
+    handshake_pair(sc, cctx, ss, sctx,
+                   [&sc, &accepted]{
+                     try {
+                       sc.ssl_connect("localhost");
+                       accepted = sc.ssl_early_data_accepted();
+                       if (!accepted) {
+                         sc.write("early");
+                       }
+                       sc.write("late");
+                       sc.read();
+                     } catch (...) {
+                     }
+                   },
+                   [&ss, c]{
+                     std::string early;
+                     if (!c) {
+                       early = ss.ssl_read_early_data();
+                       EXPECT_EQ("early", early);
+                       EXPECT_EQ("", ss.ssl_read_early_data());
+                     }
+                     ss.ssl_accept();
+                     std::string data(early);
+                     while (data.size() < 9) {
+                       data += ss.read();
+                     }
+                     EXPECT_EQ("earlylate", data);
+                     ss.write("bye");
+                   });
+    EXPECT_EQ(!c, accepted);
+    SSL_SESSION_free(sess);
+    sess = sc.ssl_get1_session();
+  }
+  SSL_SESSION_free(sess);
+}
+
+TEST_F(SSLSocketTest, OCSPStapling)
+{
+  const struct {
+    const char *staple;
+    SSLContext::OCSPMode mode;
+    bool ok;
+  } tests[] = {
+    { "src/testdata/ocspgood.der", SSLContext::OCSP_REQUIRE, true },
+    { "src/testdata/ocsprevoked.der", SSLContext::OCSP_CHECK, false },
+    { "src/testdata/ocsprevoked.der", SSLContext::OCSP_OFF, true },
+    { "src/testdata/ocspbadsig.der", SSLContext::OCSP_CHECK, false },
+    { "src/testdata/nonexistent.der", SSLContext::OCSP_CHECK, true },
+    { "src/testdata/nonexistent.der", SSLContext::OCSP_REQUIRE, false },
+    { "src/testdata/server.crt", SSLContext::OCSP_REQUIRE, false },
+  };
+
+  sl_.listen(AF_UNSPEC, "", listenport);
+  for (size_t c = 0; c < sizeof(tests) / sizeof(tests[0]); c++) {
+    SSLContext sctx;
+    sctx.set_cafile("src/testdata/client.crt");
+    sctx.set_certfile("src/testdata/server.crt");
+    sctx.set_keyfile("src/testdata/server.key");
+    sctx.set_ocsp_staple_file(tests[c].staple);
+    sctx.build(true);
+    EXPECT_FALSE(sctx.load_ocsp_staple());
+
+    SSLContext cctx;
+    client_ctx(cctx);
+    cctx.set_ocsp_mode(tests[c].mode);
+
+    SSLSocket sc, ss;
+    std::string result;
+    handshake_pair(sc, cctx, ss, sctx,
+                   [&sc, &result]{
+                     try {
+                       sc.ssl_connect("localhost");
+                       result = "ok";
+                       sc.write("x");
+                     } catch (const SSLSocket::ErrSSLOCSP &e) {
+                       result = "ocsp";
+                     } catch (...) {
+                       result = "other";
+                     }
+                     sc.close();
+                   },
+                   [&ss]{
+                     try {
+                       ss.ssl_accept();
+                       ss.read();
+                     } catch (...) {
+                     }
+                   });
+    EXPECT_EQ(tests[c].ok ? "ok" : "ocsp", result) << tests[c].staple;
+  }
+}
+
+TEST_F(SSLSocketTest, DualCert)
+{
+  SSLContext sctx;
+  server_ctx(sctx);
+  sctx.add_cert("src/testdata/server-ecdsa.crt",
+                "src/testdata/server-ecdsa.key");
+  sctx.build(true);
+
+  // client offering everything gets ECDSA, one without gets RSA
+  const struct {
+    const char *sigalgs;
+    int type;
+  } tests[] = {
+    { NULL, EVP_PKEY_EC },
+    { "RSA-PSS+SHA256:RSA+SHA256", EVP_PKEY_RSA },
+  };
+  sl_.listen(AF_UNSPEC, "", listenport);
+  for (size_t c = 0; c < sizeof(tests) / sizeof(tests[0]); c++) {
+    SSLContext cctx;
+    client_ctx(cctx);
+    cctx.build(false);
+    FILE *f = fopen("src/testdata/server-ecdsa.crt", "r");
+    ASSERT_TRUE(f != NULL);
+    X509 *x = PEM_read_X509(f, NULL, NULL, NULL);
+    fclose(f);
+    ASSERT_TRUE(x != NULL);
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(cctx.get()), x);
+    X509_free(x);
+    if (tests[c].sigalgs) {
+      ASSERT_EQ(1, SSL_CTX_set1_sigalgs_list(cctx.get(), tests[c].sigalgs));
+    }
+
+    SSLSocket sc, ss;
+    handshake_pair(sc, cctx, ss, sctx);
+    EXPECT_EQ(tests[c].type,
+              EVP_PKEY_base_id(X509_get0_pubkey(sc.get_cert()->get()))) << c;
+  }
+}
+
+TEST_F(SSLSocketTest, AutoCipherList)
+{
+  SSLContext sctx;
+  server_ctx(sctx);
+  sctx.set_cipher_list("auto");
+  sctx.set_server_preference(true);
+  sctx.build(true);
+  EXPECT_TRUE(SSL_CTX_get_options(sctx.get())
+              & SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+  // fastest AEAD first, CBC last
+  STACK_OF(SSL_CIPHER) *ciphers = SSL_CTX_get_ciphers(sctx.get());
+  ASSERT_LT(0, sk_SSL_CIPHER_num(ciphers));
+  const std::string first =
+    SSL_CIPHER_get_name(sk_SSL_CIPHER_value(ciphers, 0));
+  EXPECT_EQ(SSLContext::have_aes_hw()
+            ? "TLS_AES_256_GCM_SHA384"
+            : "TLS_CHACHA20_POLY1305_SHA256", first);
+  const std::string last =
+    SSL_CIPHER_get_name(sk_SSL_CIPHER_value(ciphers,
+                                            sk_SSL_CIPHER_num(ciphers) - 1));
+  EXPECT_EQ(std::string::npos, last.find("GCM")) << last;
+
+  connect_tcp();
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  ss.ssl_set_context(&sctx);
+  set_certs(sc_);
+  sc_.ssl_set_cipher_list("auto");
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+    th = std::thread(&SSLSocketTest::client_loopdata, this);
+    ss.ssl_accept();
+    ss.write("x");
+    EXPECT_EQ("OK x", ss.read());
+  }
+}
+
+TEST_F(SSLSocketTest, KernelTLS)
+{
+  SSLContext sctx;
+  server_ctx(sctx);
+  sctx.set_ktls(true);
+  sctx.build(true);
+
+  connect_tcp();
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  ss.ssl_set_context(&sctx);
+  set_certs(sc_);
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  FDWrap r(fds[0]), w(fds[1]);
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+    th = std::thread(&SSLSocketTest::client_loopdata, this);
+    ss.ssl_accept();
+    w.full_write("x");
+    if (ss.ssl_ktls_send()) {
+      EXPECT_EQ(1U, ss.ssl_splice(r.get(), 1));
+    } else {
+      // never in the clear
+      EXPECT_THROW(ss.ssl_splice(r.get(), 1), SSLSocket::ErrSSL);
+      ss.write(r.read());
+    }
+    EXPECT_EQ("OK x", ss.read());
+  }
+}
+
+TEST_F(SSLSocketTest, RecordSizing)
+{
+  connect_tcp();
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  set_certs(ss);
+  ss.ssl_set_record_sizing(100, 2048, 0.5);
+
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+    th = std::thread(&SSLSocketTest::client_handshake, this);
+    ss.ssl_accept();
+  }
+
+  // one SSL_read() never returns more than one record
+  EXPECT_EQ(1000U, ss.write(std::string(1000, 'a')));
+  EXPECT_EQ(512U, sc_.read(20000).size());
+  EXPECT_EQ(488U, sc_.read(20000).size());
+
+  // small records up to the boost threshold, then full ones
+  EXPECT_EQ(20000U, ss.write(std::string(20000, 'b')));
+  EXPECT_EQ(20000U, ss.write(std::string(20000, 'c')));
+  EXPECT_EQ(512U, sc_.read(20000).size());
+  EXPECT_EQ(512U, sc_.read(20000).size());
+  EXPECT_EQ(24U, sc_.read(20000).size());
+  EXPECT_EQ(16384U, sc_.read(20000).size());
+  EXPECT_EQ(2568U, sc_.read(20000).size());
+  EXPECT_EQ(16384U, sc_.read(20000).size());
+  EXPECT_EQ(3616U, sc_.read(20000).size());
+
+  // small again after a pause
+  usleep(600000);
+  EXPECT_EQ(600U, ss.write(std::string(600, 'd')));
+  EXPECT_EQ(512U, sc_.read(20000).size());
+  EXPECT_EQ(88U, sc_.read(20000).size());
+
+  const SSLSocket::RecordStats rs = ss.ssl_record_stats();
+  EXPECT_EQ(7UL, rs.small);
+  EXPECT_EQ(4UL, rs.full);
+  EXPECT_EQ(1UL, rs.boosts);
+  EXPECT_EQ(41600ULL, rs.bytes);
+}
+
+TEST_F(SSLSocketTest, PeerCache)
+{
+  PeerCache cache;
+  cache.create(16);
+  SSLContext sctx;
+  server_ctx(sctx);
+  sctx.set_peer_cache(&cache);
+  sctx.build(true);
+
+  PeerCache::Peer peer;
+  peer.cn = "username.here";
+  peer.username = "username";
+  peer.domain = "here";
+
+  // verified, cached, verified again after flush
+  const bool cached[] = { false, true, false };
+  sl_.listen(AF_UNSPEC, "", listenport);
+  for (size_t c = 0; c < sizeof(cached) / sizeof(cached[0]); c++) {
+    SSLContext cctx;
+    client_ctx(cctx);
+
+    SSLSocket sc, ss;
+    handshake_pair(sc, cctx, ss, sctx);
+    const PeerCache::Peer *p = ss.ssl_cached_peer();
+    if (cached[c]) {
+      ASSERT_TRUE(p != NULL);
+      EXPECT_EQ("username", p->username);
+      EXPECT_LT(time(0), p->expire);
+      EXPECT_FALSE(ss.ssl_cache_peer(peer));
+      cache.flush();
+    } else {
+      EXPECT_TRUE(p == NULL) << c;
+      EXPECT_TRUE(ss.ssl_cache_peer(peer));
+    }
+  }
+  EXPECT_EQ(1U, cache.stats().hits);
+}
+
 TEST_F(SSLSocketTest, LoopData)
 {
   connect_tcp();
@@ -196,6 +685,126 @@ TEST_F(SSLSocketTest, LoopData)
   }
 }
 
+TEST_F(SSLSocketTest, IOStatus)
+{
+  connect_tcp();
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  set_certs(ss);
+
+  char buf[100];
+  size_t n = 1;
+  EXPECT_EQ(IO_ERROR, ss.read_into(buf, sizeof(buf), &n));
+  EXPECT_EQ(0U, n);
+
+  std::thread th;
+  {
+    AutoJoin aj(&th);
+    th = std::thread(&SSLSocketTest::client_handshake, this);
+    ss.ssl_accept();
+  }
+  ss.set_nonblock(true);
+  EXPECT_EQ(IO_AGAIN, ss.read_into(buf, sizeof(buf), &n));
+
+  // small buffers go out as one record
+  struct iovec iov[3];
+  iov[0].iov_base = (void*)"ab";
+  iov[0].iov_len = 2;
+  iov[1].iov_base = (void*)"cde";
+  iov[1].iov_len = 3;
+  iov[2].iov_base = (void*)"f";
+  iov[2].iov_len = 1;
+  EXPECT_EQ(IO_OK, sc_.writev_from(iov, 3, &n));
+  EXPECT_EQ(6U, n);
+  sc_.shutdown();
+
+  std::string got;
+  IOStatus st;
+  while (IO_EOF != (st = ss.read_into(buf, sizeof(buf), &n))) {
+    if (st == IO_AGAIN) {
+      usleep(10000);
+      continue;
+    }
+    ASSERT_EQ(IO_OK, st);
+    EXPECT_EQ("", got);
+    got.append(buf, n);
+  }
+  EXPECT_EQ("abcdef", got);
+}
+
+TEST_F(SSLSocketTest, NonBlocking)
+{
+  connect_tcp();
+  SSLSocket ss;
+  ss.setfd(sl_.accept());
+  set_certs(ss);
+  ss.set_nonblock(true);
+  sc_.set_nonblock(true);
+
+  // both ends in one thread
+  int cev = POLLOUT, sev = POLLIN;
+  while (cev || sev) {
+    struct pollfd pfd[2];
+    pfd[0].fd = sc_.getfd();
+    pfd[0].events = cev;
+    pfd[1].fd = ss.getfd();
+    pfd[1].events = sev;
+    pfd[0].revents = pfd[1].revents = 0;
+    ASSERT_LT(0, poll(pfd, 2, 10000));
+    if (cev && pfd[0].revents) {
+      cev = sc_.ssl_connect_step("localhost");
+    }
+    if (sev && pfd[1].revents) {
+      sev = ss.ssl_accept_step();
+    }
+  }
+
+  // fill the socket, then retry from a moved and longer buffer
+  std::string out(4000000, 'x');
+  size_t n, sent = 0;
+  IOStatus st;
+  while (IO_OK == (st = ss.write_from(out.data() + sent,
+                                      out.size() - sent, &n))) {
+    ASSERT_LT(0U, n);
+    sent += n;
+    ASSERT_GT(out.size(), sent);
+  }
+  ASSERT_EQ(IO_AGAIN, st);
+  EXPECT_EQ(POLLOUT, ss.io_events(true));
+  std::string queue = out.substr(sent) + "end";
+
+  char buf[16384];
+  std::string got;
+  while (!queue.empty() || got.size() < sent) {
+    st = sc_.read_into(buf, sizeof(buf), &n);
+    if (st == IO_OK) {
+      got.append(buf, n);
+    } else {
+      ASSERT_EQ(IO_AGAIN, st);
+      EXPECT_EQ(POLLIN, sc_.io_events(false));
+    }
+    if (!queue.empty()) {
+      st = ss.write_from(queue.data(), queue.size(), &n);
+      ASSERT_TRUE(st == IO_OK || st == IO_AGAIN);
+      queue.erase(0, n);
+      sent += n;
+    }
+  }
+  EXPECT_EQ(out.size() + 3, got.size());
+  EXPECT_EQ("xend", got.substr(got.size() - 4));
+
+  // full_write() waits instead of giving up
+  sc_.full_write("done");
+  while (IO_AGAIN == ss.read_into(buf, sizeof(buf), &n)) {
+    struct pollfd pfd;
+    pfd.fd = ss.getfd();
+    pfd.events = ss.io_events(false);
+    pfd.revents = 0;
+    ASSERT_EQ(1, poll(&pfd, 1, 10000));
+  }
+  EXPECT_EQ("done", std::string(buf, n));
+}
+
 TEST_F(SSLSocketTest, WriteToClosed)
 {
   connect_tcp();
@@ -0,0 +1,103 @@
+/**
+ * @file src/timerqueue.cc
+ * Deadlines for an event loop
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<limits.h>
+#include<math.h>
+
+#include"timerqueue.h"
+
+/**
+ * Arm a timer, or move its deadline if it's already armed.
+ *
+ * @param[in] id    Caller's name for it
+ * @param[in] when  Deadline
+ */
+void
+TimerQueue::set(Id id, double when)
+{
+        cancel(id);
+        ids_[id] = when;
+        queue_.insert(std::make_pair(when, id));
+}
+
+/**
+ * Disarm a timer. Fine if it wasn't armed.
+ */
+void
+TimerQueue::cancel(Id id)
+{
+        std::map<Id, double>::iterator itr = ids_.find(id);
+        if (itr == ids_.end()) {
+                return;
+        }
+        queue_.erase(std::make_pair(itr->second, id));
+        ids_.erase(itr);
+}
+
+/**
+ * @return  Earliest deadline, or -1 if no timer is armed
+ */
+double
+TimerQueue::next() const
+{
+        if (queue_.empty()) {
+                return -1;
+        }
+        return queue_.begin()->first;
+}
+
+/**
+ * Time until the earliest deadline, for poll().
+ *
+ * Rounded up, so that the wait doesn't end just before the deadline
+ * and turn into a busy loop.
+ *
+ * @param[in] now  Current time
+ * @return         Milliseconds, 0 if a timer has already expired, or
+ *                 -1 if none is armed
+ */
+int
+TimerQueue::timeout(double now) const
+{
+        if (queue_.empty()) {
+                return -1;
+        }
+        const double ms = ceil((next() - now) * 1000);
+        if (ms <= 0) {
+                return 0;
+        }
+        if (ms >= INT_MAX) {
+                return INT_MAX;
+        }
+        return (int)ms;
+}
+
+/**
+ * Take the earliest expired timer. It's disarmed.
+ *
+ * @param[in]  now  Current time
+ * @param[out] id   The timer
+ * @return          false if none has expired
+ */
+bool
+TimerQueue::expired(double now, Id *id)
+{
+        if (queue_.empty() || queue_.begin()->first > now) {
+                return false;
+        }
+        *id = queue_.begin()->second;
+        ids_.erase(*id);
+        queue_.erase(queue_.begin());
+        return true;
+}
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
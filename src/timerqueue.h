@@ -0,0 +1,63 @@
+// -*- c++ -*-
+/**
+ * @file src/timerqueue.h
+ * Deadlines for an event loop
+ */
+#ifndef __INCLUDE_TIMERQUEUE_H__
+#define __INCLUDE_TIMERQUEUE_H__
+
+#include<map>
+#include<set>
+#include<utility>
+
+/**
+ * Named deadlines, earliest first.
+ *
+ * Each timer has an id picked by the caller, and is either armed with
+ * a deadline or not. Arming it again moves the deadline. An event loop
+ * sleeps for timeout() and then takes expired() timers until there
+ * are none, so with nothing armed it sleeps until there's I/O.
+ *
+ * The time is passed in by the caller so that any (monotonic) clock
+ * can be used.
+ *
+ @code
+ enum { TIMER_KEEPALIVE };
+ TimerQueue tq;
+ tq.set(TIMER_KEEPALIVE, now + 60);
+ for (;;) {
+         poll(fds, nfds, tq.timeout(now));
+         now = clock_get_dbl();
+         TimerQueue::Id id;
+         while (tq.expired(now, &id)) {
+                 ...
+         }
+ }
+ @endcode
+ */
+class TimerQueue {
+public:
+        typedef unsigned Id;
+
+        void set(Id id, double when);
+        void cancel(Id id);
+        bool armed(Id id) const { return ids_.count(id) != 0; }
+        bool empty() const { return ids_.empty(); }
+        size_t size() const { return ids_.size(); }
+
+        double next() const;
+        int timeout(double now) const;
+        bool expired(double now, Id *id);
+
+private:
+        typedef std::set<std::pair<double, Id> > queue_t;
+        queue_t queue_;
+        std::map<Id, double> ids_;
+};
+#endif
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
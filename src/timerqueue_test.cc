@@ -0,0 +1,83 @@
+#include<limits.h>
+
+#include<gtest/gtest.h>
+
+#include"timerqueue.h"
+
+TEST(TimerQueue, Empty)
+{
+  TimerQueue tq;
+  TimerQueue::Id id;
+  EXPECT_TRUE(tq.empty());
+  EXPECT_EQ(-1, tq.timeout(100.0));
+  EXPECT_EQ(-1, tq.next());
+  EXPECT_FALSE(tq.expired(100.0, &id));
+  tq.cancel(1);
+}
+
+TEST(TimerQueue, Order)
+{
+  TimerQueue tq;
+  tq.set(1, 30.0);
+  tq.set(2, 10.0);
+  tq.set(3, 20.0);
+  EXPECT_EQ(10.0, tq.next());
+
+  TimerQueue::Id id;
+  EXPECT_FALSE(tq.expired(5.0, &id));
+  EXPECT_TRUE(tq.expired(25.0, &id));
+  EXPECT_EQ(2U, id);
+  EXPECT_TRUE(tq.expired(25.0, &id));
+  EXPECT_EQ(3U, id);
+  EXPECT_FALSE(tq.expired(25.0, &id));
+  EXPECT_FALSE(tq.armed(2));
+  EXPECT_TRUE(tq.armed(1));
+  EXPECT_EQ(1U, tq.size());
+}
+
+TEST(TimerQueue, Move)
+{
+  TimerQueue tq;
+  tq.set(1, 10.0);
+  tq.set(2, 15.0);
+  tq.set(1, 20.0);
+  EXPECT_EQ(2U, tq.size());
+  EXPECT_EQ(15.0, tq.next());
+
+  tq.cancel(2);
+  EXPECT_EQ(20.0, tq.next());
+  TimerQueue::Id id;
+  EXPECT_FALSE(tq.expired(15.0, &id));
+  EXPECT_TRUE(tq.expired(20.0, &id));
+  EXPECT_EQ(1U, id);
+  EXPECT_TRUE(tq.empty());
+}
+
+TEST(TimerQueue, SameDeadline)
+{
+  TimerQueue tq;
+  tq.set(1, 10.0);
+  tq.set(2, 10.0);
+  TimerQueue::Id a, b;
+  EXPECT_TRUE(tq.expired(10.0, &a));
+  EXPECT_TRUE(tq.expired(10.0, &b));
+  EXPECT_NE(a, b);
+}
+
+TEST(TimerQueue, Timeout)
+{
+  TimerQueue tq;
+  tq.set(1, 10.0);
+  EXPECT_EQ(5000, tq.timeout(5.0));
+  // rounded up, never 0 before the deadline
+  EXPECT_EQ(1, tq.timeout(9.9999));
+  EXPECT_EQ(0, tq.timeout(10.0));
+  EXPECT_EQ(0, tq.timeout(11.0));
+  tq.set(1, 1e12);
+  EXPECT_EQ(INT_MAX, tq.timeout(0.0));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -52,12 +52,16 @@
 #include<iostream>
 #include<fstream>
 
-#include<monotonic_clock.h>
+#include<openssl/pem.h>
+#include<openssl/err.h>
 
 #include"mywordexp.h"
 #include"util2.h"
 #include"sslsocket.h"
 #include"configparser.h"
+#include"sessionstore.h"
+#include"ringbuffer.h"
+#include"eventloop.h"
 
 using namespace tlssh_common;
 
@@ -71,10 +75,8 @@ Logger *logger;
  */
 BEGIN_LOCAL_NAMESPACE();
 const char *argv0 = NULL;
-volatile sig_atomic_t sigwinch_received = false;
 struct termios old_tio;
 bool old_tio_set = false;
-void sigwinch(int);
 
 /** Get local terminal size
  *
@@ -117,32 +119,27 @@ terminal_type()
         return getenv("TERM");
 }
 
-/** Replace iac byte (255) with two iac bytes.
+/** Append data to a buffer, replacing iac byte (255) with two iac bytes.
  *
- * @param[in] in Input string
- * @return       Escaped string
+ * @param[in]     in   Input data
+ * @param[in]     len  Bytes of input
+ * @param[in,out] out  Escaped data is appended here. Must have room
+ *                     for twice len.
  */
-std::string
-escape_iac(const std::string &in)
+void
+escape_iac(const char *in, size_t len, RingBuffer *out)
 {
-        size_t startpos = 0, endpos;
-        std::string ret;
-        bool first_try = true;
-
+        const char *end = in + len;
         for (;;) {
-                endpos = in.find(255, startpos);
-                if (endpos == std::string::npos) {
+                const char *iac = (const char*)memchr(in, 255, end - in);
+                if (!iac) {
                         break;
                 }
-
-                ret += in.substr(startpos, endpos-startpos) + "\xff\xff";
-                startpos = endpos + 1;
-        }
-        if (first_try) {
-                return in;
+                out->append(in, iac - in);
+                out->append("\xff\xff", 2);
+                in = iac + 1;
         }
-
-        return ret + in.substr(startpos);
+        out->append(in, end - in);
 }
 
 /** Reset the terminal (termios) to what it was before this program was run
@@ -170,10 +167,14 @@ const std::string DEFAULT_SERVERCAFILE = "";
 const std::string DEFAULT_SERVERCRL    = "";
 const std::string DEFAULT_SERVERCAPATH = "";
 const std::string DEFAULT_CONFIG       = "/etc/tlssh/tlssh.conf";
-const std::string DEFAULT_CIPHER_LIST  = "HIGH";
+const std::string DEFAULT_CIPHER_LIST  = "auto";
+const std::string DEFAULT_GROUPS       = "X25519:P-256";
 const std::string DEFAULT_TCP_MD5      = "tlssh";
 const int         DEFAULT_AF           = AF_UNSPEC;
 const uint32_t    DEFAULT_KEEPALIVE    = 60;
+const unsigned    DEFAULT_SESSION_BUFFER = 65536;
+const bool        DEFAULT_SESSION_RESUMPTION = true;
+const SSLContext::OCSPMode DEFAULT_SERVER_OCSP = SSLContext::OCSP_CHECK;
 
 struct Options {
         typedef std::pair<bool, std::string> Optional;
@@ -185,6 +186,7 @@ struct Options {
 	std::string servercrl;
 	std::string config;
 	std::string cipher_list;
+        std::string groups;
 	std::string host;
 	std::string tcp_md5;
 
@@ -199,6 +201,9 @@ struct Options {
         std::string remote_command;
         bool check_certdb;
         uint32_t keepalive;
+        unsigned session_buffer;
+        bool session_resumption;
+        SSLContext::OCSPMode server_ocsp;
         Options()
                 :
                 port(DEFAULT_PORT),
@@ -209,6 +214,7 @@ struct Options {
                 servercrl(DEFAULT_SERVERCRL),
                 config(DEFAULT_CONFIG),
                 cipher_list(DEFAULT_CIPHER_LIST),
+                groups(DEFAULT_GROUPS),
                 host(""),
                 tcp_md5(DEFAULT_TCP_MD5),
                 privkey_engine(std::make_pair(false, "")),
@@ -217,153 +223,357 @@ struct Options {
                 terminal(true),
                 remote_command(""),
                 check_certdb(true),
-                keepalive(DEFAULT_KEEPALIVE)
+                keepalive(DEFAULT_KEEPALIVE),
+                session_buffer(DEFAULT_SESSION_BUFFER),
+                session_resumption(DEFAULT_SESSION_RESUMPTION),
+                server_ocsp(DEFAULT_SERVER_OCSP)
         {
         }
 };
 Options options;
 
+SSLContext ctx;
 SSLSocket sock;
+std::auto_ptr<SessionStore> session_store;
 
 
-/** Main loop reading from terminal and writing to socket, and vice versa.
+/**
+ * Handle what parse_iac() finds in data from the server: answer the
+ * IACs, and queue the rest for the terminal.
  *
- * @return    Unix-style exit code, will be used by main()
+ * @param[in,out] echo_replies  Counts keepalive replies
+ *
+ * @return false if from_sock is empty or only has part of an IAC
  */
-int
-mainloop(FDWrap &terminal)
+bool
+handle_from_server(std::string &from_sock,
+                   RingBuffer &to_terminal,
+                   RingBuffer &to_server,
+                   size_t *echo_replies)
 {
-	struct pollfd fds[2];
-	int err;
-	std::string to_server;
-	std::string to_terminal;
-        std::string buffer_from_sock;
-        double last_keepalive_sent = 0;
-        double now;
-        size_t num_keepalives_sent = 0;
-        size_t num_keepalives_received = 0;
-
-        sigwinch_received = true;
+        parsed_buffer_t pb = parse_iac(from_sock);
+        if (pb.first.empty() && pb.second.empty()) {
+                return false;
+        }
+        for (std::vector<IACCommand>::iterator itr = pb.first.begin();
+             itr != pb.first.end();
+             ++itr) {
+                uint32_t cookie;
+                switch (itr->s.command) {
+                case IAC_LITERAL:
+                        to_terminal.append("\xff", 1);
+                        break;
+                case IAC_ECHO_REQUEST:
+                        cookie = htonl(itr->s.commands.echo_cookie);
+                        logger->debug("Got echo request %u", cookie);
+                        to_server.append(iac_echo_reply(cookie));
+                        break;
+                case IAC_ECHO_REPLY:
+                        cookie = htonl(itr->s.commands.echo_cookie);
+                        logger->debug("Got echo reply %u", cookie);
+                        (*echo_replies)++;
+                        break;
+                default:
+                        THROW(Err::ErrBase, "Invalid IAC!");
+                }
+        }
 
-        {
-                // FIXME: this should not be needed.
-                //
-                // Also it doesn't make any sense that it helps, but
-                // without this read() blocks on Windows even though
-                // select() supposedly said it shouldn't.
-                int lala;
-                fcntl(terminal.get(), F_GETFL, &lala);
-                lala |= O_NONBLOCK;
-                fcntl(terminal.get(), F_SETFL, &lala);
-        }
-
-	for (;;) {
-                if (sigwinch_received) {
-                        sigwinch_received = false;
-                        to_server += iac_window_size();
+        to_terminal.append(pb.second);
+        return true;
+}
+
+/** Timers of the client. */
+enum {
+        TIMER_KEEPALIVE,
+};
+
+/**
+ * Shuffles data between the terminal and the server. The EventLoop
+ * calls it when the socket or the terminal is ready, when the
+ * keepalive is due and when the window size changes.
+ */
+class ClientIO: public EventLoop::Handler {
+public:
+        ClientIO(EventLoop &loop, FDWrap &terminal);
+
+        int wanted(int fd);
+        void ready(int fd, int revents);
+        void expired(TimerQueue::Id id);
+        void signalled(int sig);
+
+private:
+        EventLoop &loop_;
+        FDWrap &terminal_;
+        RingBuffer to_server_;
+        RingBuffer to_terminal_;
+        std::string from_sock_;
+        bool server_closed_;
+        bool window_changed_;   ///< Size not yet sent
+        double last_heard_;     ///< Last data from the server
+        size_t keepalives_sent_;
+        size_t keepalives_received_;
+
+        size_t server_room() const;
+        void from_server();
+        void from_terminal();
+        void send_window_size();
+};
+
+/**
+ * The window size is sent first thing.
+ */
+ClientIO::ClientIO(EventLoop &loop, FDWrap &terminal)
+        :loop_(loop),
+         terminal_(terminal),
+         to_server_(options.session_buffer),
+         to_terminal_(options.session_buffer),
+         server_closed_(false),
+         window_changed_(true),
+         last_heard_(loop.now()),
+         keepalives_sent_(0),
+         keepalives_received_(0)
+{
+        loop_.add_fd(sock.getfd(), this);
+        loop_.add_fd(terminal_.get(), this);
+        if (options.keepalive != 0) {
+                loop_.set_timer(TIMER_KEEPALIVE,
+                                loop_.now() + options.keepalive, this);
+        }
+        send_window_size();
+}
+
+/**
+ * Read from the server only what there's room for, also for echo
+ * replies. from_sock has part of an IAC at most.
+ */
+size_t
+ClientIO::server_room() const
+{
+        size_t room = std::min(to_terminal_.space(), to_server_.space());
+        return room - std::min(room, from_sock_.size());
+}
+
+/**
+ * Only wait for what there's data or room for.
+ */
+int
+ClientIO::wanted(int fd)
+{
+        int events = 0;
+        if (fd == sock.getfd()) {
+                if (server_closed_) {
+                        return 0;
                 }
+                if (server_room()) {
+                        events |= sock.io_events(false);
+                        // already decrypted, so the fd won't say
+                        if (sock.ssl_pending()) {
+                                events |= EventLoop::PENDING;
+                        }
+                }
+                if (!to_server_.empty()) {
+                        events |= sock.io_events(true);
+                }
+                return events;
+        }
 
-                if (options.keepalive != 0) {
-                        now = clock_get_dbl();
-                        if (num_keepalives_sent > num_keepalives_received+2) {
-                                THROW(Err::ErrBase, "Failed keepalive");
+        // escaping can double it
+        if (to_server_.space() >= 2) {
+                events |= POLLIN;
+        }
+        if (!to_terminal_.empty()) {
+                events |= POLLOUT;
+        }
+        return events;
+}
+
+/**
+ *
+ */
+void
+ClientIO::ready(int fd, int revents)
+{
+        size_t n;
+
+        if (fd == sock.getfd()) {
+                // a hangup is found by reading
+                if (revents & (sock.io_events(false) | EventLoop::PENDING
+                               | POLLHUP | POLLERR)) {
+                        from_server();
+                }
+                if ((revents & sock.io_events(true))
+                    && !to_server_.empty()) {
+                        size_t len;
+                        const char *p = to_server_.read_span(&len);
+                        if (IO_ERROR == sock.write_from(p, len, &n)) {
+                                sock.throw_io_error("SSL_write()");
                         }
-                        if (last_keepalive_sent + options.keepalive < now) {
-                                last_keepalive_sent = now;
-                                num_keepalives_sent++;
-                                to_server += iac_echo_request((uint32_t)now);
+                        to_server_.consume(n);
+                        send_window_size();
+                }
+        } else {
+                if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                        from_terminal();
+                }
+                if ((revents & POLLOUT) && !to_terminal_.empty()) {
+                        size_t len;
+                        const char *p = to_terminal_.read_span(&len);
+                        if (IO_ERROR == terminal_.write_from(p, len, &n)) {
+                                THROW(FDWrap::ErrBase, "write()");
                         }
+                        to_terminal_.consume(n);
                 }
+        }
 
-		fds[0].fd = sock.getfd();
-		fds[0].events = POLLIN;
-                fds[0].revents = 0;
-		if (!to_server.empty()) {
-			fds[0].events |= POLLOUT;
-		}
-
-		fds[1].fd = terminal.get();
-		fds[1].events = POLLIN;
-                fds[1].revents = 0;
-		if (!to_terminal.empty()) {
-			fds[1].events |= POLLOUT;
-		}
+        // write out what the server sent before it closed
+        if (server_closed_ && to_terminal_.empty()) {
+                loop_.stop();
+        }
+}
 
-                int timeout = -1;
-                if (options.keepalive != 0) {
-                        timeout = (int)(1000* (options.keepalive
-                                               - (now - last_keepalive_sent)));
-                        // protect against rounding errors
-                        timeout = std::max(timeout, 0);
+/**
+ * Read what there's room for from the server, and act on it.
+ */
+void
+ClientIO::from_server()
+{
+        char buf[16384];
+        size_t n;
+        size_t room = server_room();
+        bool heard = false;
+        while (room) {
+                const IOStatus st = sock.read_into(
+                        buf, std::min(sizeof(buf), room), &n);
+                if (st == IO_EOF) {
+                        server_closed_ = true;
+                        break;
+                } else if (st == IO_AGAIN) {
+                        break;
+                } else if (st == IO_ERROR) {
+                        sock.throw_io_error("SSL_read()");
+                }
+                from_sock_.append(buf, n);
+                heard = true;
+                room -= n;
+                if (!sock.ssl_pending()) {
+                        break;
                 }
+        }
 
-                err = poll(fds, 2, timeout);
-		if (!err) { // timeout
-			continue;
-		}
-		if (0 > err) { // error
-			continue;
-		}
+        // the server is there, no keepalive needed yet
+        if (heard) {
+                last_heard_ = loop_.now();
+                keepalives_received_ = keepalives_sent_;
+        }
 
-                // read from client into buffer
-		if (fds[0].revents & POLLIN) {
-			try {
-				do {
-                                        // FIXME: are we sure this can't block?
-                                        buffer_from_sock += sock.read();
-				} while (sock.ssl_pending());
-			} catch(const Socket::ErrPeerClosed &e) {
-                                // FIXME: return 1?
-				return 0;
-			}
-		}
+        // extract and handle IAC
+        while (handle_from_server(from_sock_,
+                                  to_terminal_,
+                                  to_server_,
+                                  &keepalives_received_)) {
+        }
+}
 
-                // extract and handle IAC
-                parsed_buffer_t pb = parse_iac(buffer_from_sock);
-                for (std::vector<IACCommand>::iterator itr = pb.first.begin();
-                     itr != pb.first.end();
-                     ++itr) {
-                        uint32_t cookie;
-                        switch (itr->s.command) {
-                        case IAC_LITERAL:
-                                to_terminal.append(1, IAC_LITERAL);
-                                break;
-                        case IAC_ECHO_REQUEST:
-                                cookie = htonl(itr->s.commands.echo_cookie);
-                                logger->debug("Got echo request %u", cookie);
-                                to_server += iac_echo_reply(cookie);
-                                break;
-                        case IAC_ECHO_REPLY:
-                                cookie = htonl(itr->s.commands.echo_cookie);
-                                logger->debug("Got echo reply %u", cookie);
-                                num_keepalives_received++;
-                                break;
-                        default:
-                                THROW(Err::ErrBase, "Invalid IAC!");
-                        }
-                }
+/**
+ * Read from the terminal, if echo replies didn't just fill up the
+ * queue to the server.
+ */
+void
+ClientIO::from_terminal()
+{
+        char buf[16384];
+        size_t n;
+        if (to_server_.space() < 2) {
+                return;
+        }
+        // escaping can double it
+        switch (terminal_.read_into(buf,
+                                    std::min(sizeof(buf),
+                                             to_server_.space() / 2),
+                                    &n)) {
+        case IO_OK:
+                escape_iac(buf, n, &to_server_);
+                break;
+        case IO_EOF:
+                THROW0(FDWrap::ErrEOF);
+        case IO_AGAIN:
+                break;
+        case IO_ERROR:
+                THROW(FDWrap::ErrBase, "read()");
+        }
+}
 
-                to_terminal += pb.second;
+/**
+ * Send the window size if it has changed, once there's room.
+ */
+void
+ClientIO::send_window_size()
+{
+        if (!window_changed_) {
+                return;
+        }
+        const std::string ws = iac_window_size();
+        if (to_server_.space() >= ws.size()) {
+                window_changed_ = false;
+                to_server_.append(ws);
+        }
+}
 
-		// from terminal
-		if (fds[1].revents & POLLIN) {
-			to_server += escape_iac(terminal.read());
-		}
+/**
+ * Keepalive. Not sent while the server is being heard from.
+ */
+void
+ClientIO::expired(TimerQueue::Id)
+{
+        const double now = loop_.now();
+        if (keepalives_sent_ > keepalives_received_ + 2) {
+                THROW(Err::ErrBase, "Failed keepalive");
+        }
+        double due = last_heard_ + options.keepalive;
+        if (due <= now) {
+                // with no room the server isn't idle anyway
+                const std::string req = iac_echo_request((uint32_t)now);
+                if (to_server_.space() >= req.size()) {
+                        keepalives_sent_++;
+                        to_server_.append(req);
+                }
+                due = now + options.keepalive;
+        }
+        loop_.set_timer(TIMER_KEEPALIVE, due, this);
+}
 
-		if ((fds[0].revents & POLLOUT)
-		    && !to_server.empty()) {
-			size_t n;
-			n = sock.write(to_server);
-			to_server = to_server.substr(n);
-		}
+/**
+ * SIGWINCH
+ */
+void
+ClientIO::signalled(int)
+{
+        window_changed_ = true;
+        send_window_size();
+}
 
-		if ((fds[1].revents & POLLOUT)
-		    && !to_terminal.empty()) {
-			size_t n;
-			n = terminal.write(to_terminal);
-			to_terminal = to_terminal.substr(n);
-		}
-	}
+/** Main loop reading from terminal and writing to socket, and vice versa.
+ *
+ * @return    Unix-style exit code, will be used by main()
+ */
+int
+mainloop(FDWrap &terminal)
+{
+        // FIXME: this should not be needed.
+        //
+        // Also it doesn't make any sense that it helps, but
+        // without this read() blocks on Windows even though
+        // select() supposedly said it shouldn't.
+        terminal.set_nonblock(true);
+
+        // so a partial record or a key update can't stall SSL_read()
+        sock.set_nonblock(true);
+
+        EventLoop loop;
+        ClientIO io(loop, terminal);
+        loop.add_signal(SIGWINCH, &io);
+        while (loop.run_once()) {
+        }
         return 0;
 }
 
@@ -380,29 +590,40 @@ encode_command(const std::string &cmd)
         return cmd;
 }
 
+/**
+ * Protocol header block, sent first thing on a new connection.
+ */
+std::string
+header_block()
+{
+        std::string ret;
+        ret += "version " + protocol_version + "\n";
+        ret += "env TERM " + terminal_type() + "\n";
+        ret += "env LANG " + std::string(getenv("LANG")) + "\n";
+        if (!options.remote_command.empty()) {
+                ret += "command " + encode_command(options.remote_command)
+                        + "\n";
+        }
+        if (!options.terminal) {
+                ret += "terminal off\n";
+        }
+        return ret + "\n";
+}
+
 /** Set up a new connection.
  *
- * At this point 'sock' is ready to use, but SSL negotiations have not yet
- * started.
+ * At this point 'sock' is ready to use.
+ *
+ * @param[in] headers_sent  Header block already sent as early data
  *
  * @return Normal UNIX-style exit() value. Will be used by main()
  */
 int
-new_connection()
+new_connection(bool headers_sent)
 {
-        sock.full_write("version " + protocol_version + "\n");
-        sock.full_write("env TERM " + terminal_type() + "\n");
-        sock.full_write("env LANG " + std::string(getenv("LANG")) + "\n");
-        if (!options.remote_command.empty()) {
-                sock.full_write("command "
-                                + encode_command(options.remote_command)
-                                + "\n");
-        }
-
-        if (!options.terminal) {
-                sock.full_write("terminal off\n");
+        if (!headers_sent) {
+                sock.full_write(header_block());
         }
-        sock.full_write("\n");
 
 	FDWrap terminal(0, false);
 
@@ -443,6 +664,8 @@ usage(int err)
 	       "\t-s                   Don't check cert database cache.\n"
 	       "\t-V, --version        Print version and exit\n"
 	       "\t--copying            Print license and exit\n"
+	       "\t--cipher-bench       Show cipher speeds on this host and "
+               "exit\n"
 	       , argv0,
 	       DEFAULT_CONFIG.c_str(), DEFAULT_CIPHER_LIST.c_str());
 	exit(err);
@@ -511,6 +734,10 @@ read_config_file(const std::string &fn)
 		} else if (conf->keyword == "KeyFile"
                            && conf->parms.size() == 1) {
 			options.keyfile = xwordexp(conf->parms[0]);
+		} else if (conf->keyword == "SessionBuffer"
+                           && conf->parms.size() == 1) {
+			options.session_buffer = strtoul(conf->parms[0].c_str(),
+                                                         0, 0);
 		} else if (conf->keyword == "Keepalive"
                            && conf->parms.size() == 1) {
 			options.keepalive = strtoul(conf->parms[0].c_str(),
@@ -518,6 +745,24 @@ read_config_file(const std::string &fn)
 		} else if (conf->keyword == "CipherList"
                            && conf->parms.size() == 1) {
 			options.cipher_list = conf->parms[0];
+		} else if (conf->keyword == "Groups"
+                           && conf->parms.size() == 1) {
+			options.groups = conf->parms[0];
+		} else if (conf->keyword == "SessionResumption"
+                           && conf->parms.size() == 1) {
+			options.session_resumption = conf->parms[0] == "on";
+		} else if (conf->keyword == "ServerOCSP"
+                           && conf->parms.size() == 1) {
+                        if (conf->parms[0] == "off") {
+                                options.server_ocsp = SSLContext::OCSP_OFF;
+                        } else if (conf->parms[0] == "on") {
+                                options.server_ocsp = SSLContext::OCSP_CHECK;
+                        } else if (conf->parms[0] == "require") {
+                                options.server_ocsp = SSLContext::OCSP_REQUIRE;
+                        } else {
+                                THROW(Err::ErrBase,
+                                      "ServerOCSP must be off, on or require");
+                        }
 		} else if (conf->keyword == "-include"
                            && conf->parms.size() == 1) {
 			try {
@@ -572,6 +817,9 @@ parse_options(int argc, char * const *argv)
 		} else if (!strcmp(argv[c], "--copying")) {
 			print_copying();
 			exit(0);
+		} else if (!strcmp(argv[c], "--cipher-bench")) {
+			cipher_bench();
+			exit(0);
 		} else if (!strcmp(argv[c], "-c")) {
                         if (c != argc - 1) {
                                 options.config = argv[++c];
@@ -660,10 +908,107 @@ certdb_filename()
         return std::string(home) + "/.tlssh/certdb";
 }
 
+/**
+ * Directory where resumable TLS sessions are saved.
+ */
+std::string
+sessions_dirname()
+{
+        const char *home;
+        home = getenv("HOME");
+        if (!home) {
+                home = "";
+        }
+        return std::string(home) + "/.tlssh/sessions";
+}
+
+/**
+ * Get the saved TLS session for this host and port, if there is one
+ * and it's for the same server cert as when it was saved.
+ *
+ * @param[out] fingerprint  Fingerprint of the server cert
+ * @return                  session to offer (caller frees), or NULL
+ */
+SSL_SESSION *
+load_session(std::string *fingerprint)
+{
+        std::string pem;
+        if (!session_store->load(options.host, options.port, time(0),
+                                 fingerprint, &pem)) {
+                return NULL;
+        }
+
+        BIO *bio = BIO_new_mem_buf((void*)pem.data(), pem.size());
+        if (!bio) {
+                return NULL;
+        }
+        SSL_SESSION *sess = PEM_read_bio_SSL_SESSION(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+        if (!sess) {
+                ERR_clear_error();
+                logger->debug("Bad saved TLS session for %s",
+                              options.host.c_str());
+                return NULL;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        X509 *peer = SSL_SESSION_get0_peer(sess);
+        if (!peer) {
+                SSL_SESSION_free(sess);
+                return NULL;
+        }
+        X509_up_ref(peer);
+        if (X509Wrap(peer).get_fingerprint() != *fingerprint) {
+                logger->debug("Saved TLS session for %s is for another cert",
+                              options.host.c_str());
+                SSL_SESSION_free(sess);
+                return NULL;
+        }
+#endif
+        return sess;
+}
+
+/**
+ * OpenSSL new session callback. With TLS 1.2 called during the
+ * handshake, with TLS 1.3 when a session ticket is read.
+ *
+ * Failing to save is not an error, the next connect will just do a
+ * full handshake.
+ *
+ * @return 0, meaning OpenSSL still owns the session
+ */
+int
+new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+        BIO *bio = NULL;
+        try {
+                X509Wrap x509(SSL_get_peer_certificate(ssl));
+
+                bio = BIO_new(BIO_s_mem());
+                if (!bio || !PEM_write_bio_SSL_SESSION(bio, sess)) {
+                        THROW(Err::ErrBase, "PEM_write_bio_SSL_SESSION()");
+                }
+                char *p;
+                const long len = BIO_get_mem_data(bio, &p);
+                session_store->save(options.host, options.port,
+                                    x509.get_fingerprint(),
+                                    std::string(p, len),
+                                    SSL_SESSION_get_time(sess)
+                                    + SSL_SESSION_get_timeout(sess));
+        } catch (const std::exception &e) {
+                ERR_clear_error();
+                logger->debug("Not saving TLS session: %s", e.what());
+        }
+        BIO_free(bio);
+        return 0;
+}
+
+/**
+ * True if this host has been seen with a cert with this fingerprint.
+ */
 bool
-certdb_check()
+certdb_check(const std::string &fingerprint)
 {
-        std::auto_ptr<X509Wrap> x509(sock.get_cert());
         std::ifstream f(certdb_filename().c_str());
 
         while (f.good()) {
@@ -683,7 +1028,7 @@ certdb_check()
                 }
 
                 // check for wrong cert
-                if (tokens[1] != x509->get_fingerprint()) {
+                if (tokens[1] != fingerprint) {
                         continue;
                 }
 
@@ -699,13 +1044,12 @@ certdb_check()
 void
 do_certdatabase()
 {
-        if (certdb_check()) {
+        std::auto_ptr<X509Wrap> x509(sock.get_cert());
+        if (certdb_check(x509->get_fingerprint())) {
                 // same cert as last time.
                 return;
         }
 
-        std::auto_ptr<X509Wrap> x509(sock.get_cert());
-
         fprintf(stderr,
                 "It appears that you have never logged into this host before"
                 " (when it had\nthis cert):\n    %s\n"
@@ -720,6 +1064,9 @@ do_certdatabase()
         getline(std::cin, ans);
         if (!(ans == "y"
               || ans == "yes")) {
+                if (session_store.get()) {
+                        session_store->remove(options.host, options.port);
+                }
                 THROW(Err::ErrBase, "Unacceptable server certificate");
         }
 
@@ -741,15 +1088,6 @@ do_certdatabase()
 
 
 
-/** SIGWINCH handler
- *
- */
-void
-sigwinch(int)
-{
-        sigwinch_received = true;
-}
-
 /** exception-wrapped version of main()
  *
  */
@@ -758,25 +1096,50 @@ main2(int argc, char * const argv[])
 {
 	parse_options(argc, argv);
 
-        if (SIG_ERR == signal(SIGWINCH, sigwinch)) {
-                THROW(Err::ErrSys, "signal(SIGWINCH)");
-        }
-
         if (SIG_ERR == signal(SIGPIPE, SIG_IGN)) {
                 THROW(Err::ErrSys, "signal(SIGPIPE, SIG_IGN)");
         }
 
-	sock.ssl_set_cipher_list(options.cipher_list);
-	sock.ssl_set_capath(options.servercapath);
-	sock.ssl_set_cafile(options.servercafile);
-	sock.ssl_set_certfile(options.certfile);
-	sock.ssl_set_keyfile(options.keyfile);
-	sock.ssl_set_crlfile(options.servercrl);
+	ctx.set_cipher_list(options.cipher_list);
+        ctx.set_groups(options.groups);
+	ctx.set_capath(options.servercapath);
+	ctx.set_cafile(options.servercafile);
+	ctx.set_certfile(options.certfile);
+	ctx.set_keyfile(options.keyfile);
+	ctx.set_crlfile(options.servercrl);
+        ctx.set_ocsp_mode(options.server_ocsp);
         if (options.privkey_engine.first) {
-                sock.ssl_set_privkey_engine(options.privkey_engine.second);
+                ctx.set_privkey_engine(options.privkey_engine.second);
+        }
+        ctx.set_privkey_engine_conf(options.privkey_engine_pre,
+                                    options.privkey_engine_post);
+
+        // Offer a saved session. If the server takes it, it won't ask
+        // for a cert and the private key is never loaded.
+        SSL_SESSION *sess = NULL;
+        std::string fingerprint;
+        if (options.session_resumption) {
+                session_store.reset(new SessionStore(sessions_dirname()));
+                sess = load_session(&fingerprint);
+        }
+
+        // Send the header block as TLS 1.3 early data, saving a round
+        // trip. Only if the server cert is known, since the command is
+        // sent before its cert can be questioned.
+        if (sess
+            && (!options.check_certdb || certdb_check(fingerprint))) {
+                sock.ssl_set_early_data(header_block());
         }
-        sock.privkey_engine_pre_ = options.privkey_engine_pre;
-        sock.privkey_engine_post_ = options.privkey_engine_post;
+        ctx.set_cert_on_demand(sess != NULL);
+        ctx.build(false);
+        if (session_store.get()) {
+                SSL_CTX_set_session_cache_mode(ctx.get(),
+                                            SSL_SESS_CACHE_CLIENT
+                                            | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+                SSL_CTX_sess_set_new_cb(ctx.get(), new_session_cb);
+        }
+        sock.ssl_set_context(&ctx);
+        sock.ssl_set_session(sess);
 	if (options.verbose) {
 		sock.set_debug(true);
 	}
@@ -795,13 +1158,28 @@ main2(int argc, char * const argv[])
         }
 	sock.ssl_attach(rawsock);
 
-        sock.ssl_connect(options.host);
+        try {
+                sock.ssl_connect(options.host);
+        } catch (...) {
+                SSL_SESSION_free(sess);
+                throw;
+        }
+        if (sess) {
+                logger->debug(sock.ssl_session_reused()
+                              ? "Resumed TLS session"
+                              : "Saved TLS session not accepted");
+                SSL_SESSION_free(sess);
+        }
+        const bool headers_sent = sock.ssl_early_data_accepted();
+        if (headers_sent) {
+                logger->debug("Headers sent as early data");
+        }
 
         if (options.check_certdb) {
                 do_certdatabase();
         }
 
-	return new_connection();
+	return new_connection(headers_sent);
 }
 END_NAMESPACE(tlssh);
 
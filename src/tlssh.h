@@ -9,8 +9,11 @@
 #define END_LOCAL_NAMESPACE() }
 
 #include<vector>
+#include<list>
 #include<string>
 #include<inttypes.h>
+#include<time.h>
+#include<poll.h>
 #include<sys/types.h>
 #include<sys/socket.h>
 
@@ -20,6 +23,11 @@
 
 
 extern Logger *logger;
+class SSLContext;
+class SSLSocket;
+class SessionCache;
+class CRLIndex;
+class PeerCache;
 /***********************************************************************
  * common tlssh client and server part
  */
@@ -57,6 +65,7 @@ typedef std::pair<std::vector<IACCommand>,std::string> parsed_buffer_t;
 
 void print_copying();
 void print_version();
+void cipher_bench();
 std::string iac_echo_reply(uint32_t cookie);
 std::string iac_echo_request(uint32_t cookie);
 parsed_buffer_t parse_iac(std::string &buffer);
@@ -75,18 +84,58 @@ BEGIN_NAMESPACE(tlsshd)
 const std::string DEFAULT_LISTEN       = "::";
 const std::string DEFAULT_CERTFILE     = "/etc/tlssh/tlsshd.crt";
 const std::string DEFAULT_KEYFILE      = "/etc/tlssh/tlsshd.key";
+const std::string DEFAULT_ECDSA_CERTFILE = "";
+const std::string DEFAULT_ECDSA_KEYFILE = "";
 const std::string DEFAULT_CLIENTCAFILE = "/etc/tlssh/ClientCA.crt";
 const std::string DEFAULT_CLIENTCRL    = "";
 const std::string DEFAULT_CLIENTCAPATH = "";
 const std::string DEFAULT_CLIENTDOMAIN = "";
+const std::string DEFAULT_OCSP_STAPLE_FILE = "";
 const std::string DEFAULT_CONFIG       = "/etc/tlssh/tlsshd.conf";
-const std::string DEFAULT_CIPHER_LIST  = "HIGH:!ADH:!LOW:!MD5:@STRENGTH";
+const std::string DEFAULT_CIPHER_LIST  = "auto";
 const std::string DEFAULT_TCP_MD5      = "tlssh";
 const std::string DEFAULT_CHROOT       = "/var/empty";
+const std::string DEFAULT_GROUPS       = "X25519:P-256";
+const std::string DEFAULT_DHPARAMS_FILE = "";
 const unsigned    DEFAULT_VERBOSE      = 0;
 const bool        DEFAULT_DAEMON       = true;
 const int         DEFAULT_AF           = AF_UNSPEC;
 const uint32_t    DEFAULT_KEEPALIVE    = 60;
+const int         DEFAULT_LISTEN_BACKLOG = 128;
+const unsigned    DEFAULT_LISTEN_PROCESSES = 1;
+const double      DEFAULT_SOURCE_RATE  = 5;
+const double      DEFAULT_SOURCE_BURST = 20;
+const unsigned    DEFAULT_SOURCE_PREFIX4 = 32;
+const unsigned    DEFAULT_SOURCE_PREFIX6 = 64;
+const double      DEFAULT_ACCEPT_RATE  = 100;
+const double      DEFAULT_ACCEPT_BURST = 200;
+const unsigned    DEFAULT_MAX_HANDSHAKES = 64;
+const unsigned    DEFAULT_HANDSHAKE_TIMEOUT = 20;
+const unsigned    DEFAULT_PREFORK      = 0;
+const unsigned    DEFAULT_PREFORK_MIN_SPARE = 2;
+const unsigned    DEFAULT_PREFORK_MAX_SPARE = 8;
+const bool        DEFAULT_AUTH_BEFORE_FORK = false;
+const unsigned    DEFAULT_SESSION_CACHE = 1024;
+const unsigned    DEFAULT_SESSION_LIFETIME = 600;
+const bool        DEFAULT_SESSION_TICKETS = true;
+const unsigned    DEFAULT_TICKET_KEY_LIFETIME = 3600;
+const unsigned    DEFAULT_EARLY_DATA   = 0;
+const unsigned    DEFAULT_PEER_CACHE   = 1024;
+const bool        DEFAULT_KERNEL_TLS   = false;
+const bool        DEFAULT_SERVER_CIPHER_PREFERENCE = true;
+const unsigned    DEFAULT_RECORD_SMALL = 1360;
+const unsigned    DEFAULT_RECORD_BOOST = 65536;
+const unsigned    DEFAULT_RECORD_IDLE  = 1000;
+const unsigned    DEFAULT_SESSION_BUFFER = 65536;
+const unsigned    DEFAULT_IDLE_TIMEOUT = 0;
+
+/** Socket type of listener<->sslproc control sockets. Not inherited by
+ * the shell, or by a new listener exec()ed on SIGUSR2. */
+#ifdef SOCK_CLOEXEC
+const int CTL_SOCK_TYPE = SOCK_STREAM | SOCK_CLOEXEC;
+#else
+const int CTL_SOCK_TYPE = SOCK_STREAM;
+#endif
 
 /**
  * TLSSH server options
@@ -94,18 +143,24 @@ const uint32_t    DEFAULT_KEEPALIVE    = 60;
 struct Options {
         typedef std::pair<bool, std::string> Optional;
 
-	std::string listen;
+        std::vector<std::string> listen;
 	std::string port;
 	std::string certfile;
 	std::string keyfile;
+        std::string ecdsa_certfile;
+        std::string ecdsa_keyfile;
 	std::string clientcafile;
 	std::string clientcrl;
 	std::string clientcapath;
 	std::string clientdomain;
+        std::string ocsp_staple_file;
 	std::string config;
 	std::string cipher_list;
+        bool server_cipher_preference;
 	std::string tcp_md5;
 	std::string chroot;
+        std::string groups;
+        std::string dhparams_file;
         Optional privkey_engine;
         typedef std::vector<std::pair<std::string, std::string> > Conf;
         Conf privkey_engine_pre;
@@ -114,25 +169,82 @@ struct Options {
         bool daemon;
         int af;
         uint32_t keepalive;
+        int listen_backlog;
+        unsigned listen_processes;
+        double source_rate;
+        double source_burst;
+        unsigned source_prefix4;
+        unsigned source_prefix6;
+        double accept_rate;
+        double accept_burst;
+        unsigned max_handshakes;
+        unsigned handshake_timeout;
+        unsigned prefork;
+        unsigned prefork_min_spare;
+        unsigned prefork_max_spare;
+        bool auth_before_fork;
+        unsigned session_cache;
+        unsigned session_lifetime;
+        bool session_tickets;
+        unsigned ticket_key_lifetime;
+        unsigned early_data;
+        unsigned peer_cache;
+        bool kernel_tls;
+        unsigned record_small;
+        unsigned record_boost;
+        unsigned record_idle;
+        unsigned session_buffer;
+        unsigned idle_timeout;
 
         Options()
-                : listen(         DEFAULT_LISTEN),
-                  port(           tlssh_common::DEFAULT_PORT),
+                : port(           tlssh_common::DEFAULT_PORT),
                   certfile(       DEFAULT_CERTFILE),
                   keyfile(        DEFAULT_KEYFILE),
+                  ecdsa_certfile( DEFAULT_ECDSA_CERTFILE),
+                  ecdsa_keyfile(  DEFAULT_ECDSA_KEYFILE),
                   clientcafile(   DEFAULT_CLIENTCAFILE),
                   clientcrl(      DEFAULT_CLIENTCRL),
                   clientcapath(   DEFAULT_CLIENTCAPATH),
                   clientdomain(   DEFAULT_CLIENTDOMAIN),
+                  ocsp_staple_file(DEFAULT_OCSP_STAPLE_FILE),
                   config(         DEFAULT_CONFIG),
                   cipher_list(    DEFAULT_CIPHER_LIST),
+                  server_cipher_preference(DEFAULT_SERVER_CIPHER_PREFERENCE),
                   tcp_md5(        DEFAULT_TCP_MD5),
                   chroot(         DEFAULT_CHROOT),
+                  groups(         DEFAULT_GROUPS),
+                  dhparams_file(  DEFAULT_DHPARAMS_FILE),
                   privkey_engine(std::make_pair(false, "")),
                   verbose(        DEFAULT_VERBOSE),
                   daemon(         DEFAULT_DAEMON),
                   af(             DEFAULT_AF),
-                  keepalive(      DEFAULT_KEEPALIVE)
+                  keepalive(      DEFAULT_KEEPALIVE),
+                  listen_backlog( DEFAULT_LISTEN_BACKLOG),
+                  listen_processes(DEFAULT_LISTEN_PROCESSES),
+                  source_rate(    DEFAULT_SOURCE_RATE),
+                  source_burst(   DEFAULT_SOURCE_BURST),
+                  source_prefix4( DEFAULT_SOURCE_PREFIX4),
+                  source_prefix6( DEFAULT_SOURCE_PREFIX6),
+                  accept_rate(    DEFAULT_ACCEPT_RATE),
+                  accept_burst(   DEFAULT_ACCEPT_BURST),
+                  max_handshakes( DEFAULT_MAX_HANDSHAKES),
+                  handshake_timeout(DEFAULT_HANDSHAKE_TIMEOUT),
+                  prefork(        DEFAULT_PREFORK),
+                  prefork_min_spare(DEFAULT_PREFORK_MIN_SPARE),
+                  prefork_max_spare(DEFAULT_PREFORK_MAX_SPARE),
+                  auth_before_fork(DEFAULT_AUTH_BEFORE_FORK),
+                  session_cache(  DEFAULT_SESSION_CACHE),
+                  session_lifetime(DEFAULT_SESSION_LIFETIME),
+                  session_tickets(DEFAULT_SESSION_TICKETS),
+                  ticket_key_lifetime(DEFAULT_TICKET_KEY_LIFETIME),
+                  early_data(     DEFAULT_EARLY_DATA),
+                  peer_cache(     DEFAULT_PEER_CACHE),
+                  kernel_tls(     DEFAULT_KERNEL_TLS),
+                  record_small(   DEFAULT_RECORD_SMALL),
+                  record_boost(   DEFAULT_RECORD_BOOST),
+                  record_idle(    DEFAULT_RECORD_IDLE),
+                  session_buffer( DEFAULT_SESSION_BUFFER),
+                  idle_timeout(   DEFAULT_IDLE_TIMEOUT)
         {
         }
 
@@ -140,6 +252,10 @@ struct Options {
 };
 extern Options options;
 extern std::string protocol_version;
+extern SSLContext *ssl_ctx;
+extern SessionCache session_cache;
+extern CRLIndex crl_index;
+extern PeerCache peer_cache;
 END_NAMESPACE(tlsshd)
 
 BEGIN_NAMESPACE(tlsshd_shellproc)
@@ -147,9 +263,90 @@ int forkmain(const struct passwd *pw, int fd_control);
 END_NAMESPACE(tlsshd_shellproc)
 
 BEGIN_NAMESPACE(tlsshd_sslproc)
-int forkmain(FDWrap&fd);
+int forkmain(FDWrap&fd, int status);
+int worker_main(FDWrap &ctl);
+int authed_main(SSLSocket &sock, const std::string &username);
+std::string check_client_cert(SSLSocket &sock);
+void setup_socket(SSLSocket &sock);
 END_NAMESPACE(tlsshd_sslproc)
 
+BEGIN_NAMESPACE(tlsshd_prefork)
+/**
+ * Pool of pre-forked sslproc workers, owned by the listener.
+ *
+ * Each idle worker is blocked reading its end of a socketpair. The
+ * listener hands it an accept()ed fd with xsend_fd(); from there on it
+ * is an ordinary sslproc and the socketpair is its status channel.
+ */
+class Pool {
+        struct Worker {
+                pid_t pid;
+                int ctl;
+        };
+        typedef std::list<Worker> workers_t;
+        workers_t idle_;
+        bool refilling_;
+        time_t failed_;
+
+        Pool(const Pool&);
+        Pool &operator=(const Pool&);
+public:
+        Pool();
+        ~Pool();
+
+        size_t idle() const { return idle_.size(); }
+        bool needs_refill();
+        pid_t spawn(int *ctl);
+        bool dispatch(int fd, pid_t *pid, int *status);
+        void add_pollfds(std::vector<struct pollfd> &fds) const;
+        void check_pollfds(const std::vector<struct pollfd> &fds,
+                           size_t offset);
+        void close_fds();
+};
+END_NAMESPACE(tlsshd_prefork)
+
+BEGIN_NAMESPACE(tlsshd_frontend)
+/**
+ * TLS handshakes run by the listener itself ("AuthBeforeFork").
+ *
+ * All connections are non-blocking and stepped from the listener's
+ * poll() loop. Connections whose client cert checks out are handed
+ * back to the listener to fork() an sslproc for.
+ */
+class FrontEnd {
+        struct Conn {
+                SSLSocket *sock;
+                double deadline;
+                short events;
+        };
+        typedef std::list<Conn> conns_t;
+        typedef std::list<std::pair<SSLSocket*, std::string> > ready_t;
+        conns_t conns_;
+        ready_t ready_;
+        std::vector<SSLContext*> retired_;
+
+        void step(conns_t::iterator itr);
+        void erase(conns_t::iterator itr);
+        void free_retired();
+
+        FrontEnd(const FrontEnd&);
+        FrontEnd &operator=(const FrontEnd&);
+public:
+        FrontEnd();
+        ~FrontEnd();
+
+        size_t size() const { return conns_.size(); }
+        void add(int fd);
+        void add_pollfds(std::vector<struct pollfd> &fds) const;
+        void check_pollfds(const std::vector<struct pollfd> &fds,
+                           size_t offset);
+        double expire(double now);
+        SSLSocket *pop_ready(std::string *username);
+        void retire(SSLContext *ctx);
+        void abandon_all();
+};
+END_NAMESPACE(tlsshd_frontend)
+
 
 /* ---- Emacs Variables ----
  * Local Variables:
@@ -9,8 +9,19 @@
 #include<stdio.h>
 #include<stdlib.h>
 #include<arpa/inet.h>
+#include<monotonic_clock.h>
+
+#include<vector>
+
+#include<openssl/evp.h>
+#include<openssl/hmac.h>
 
 #include"tlssh.h"
+#include"sslsocket.h"
+
+#ifndef EVP_CTRL_AEAD_GET_TAG
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#endif
 
 BEGIN_NAMESPACE(tlssh_common)
 
@@ -26,6 +37,14 @@ const int iac_len[256] = {
         2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
         2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
         2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
         2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
         2,  // IAC_LITERAL
 };
@@ -125,6 +144,98 @@ parse_iac(std::string &buffer)
         return ret;
 }
 
+/**
+ * Encrypt full size records with one cipher for a while.
+ *
+ * @param[in] cipher   Cipher, or NULL if OpenSSL doesn't have it
+ * @param[in] mac      HMAC digest for CBC ciphers. NULL for AEAD.
+ * @param[in] seconds  How long to keep at it
+ *
+ * @return MB/s, or 0 if the cipher isn't there
+ */
+static double
+bench_cipher(const EVP_CIPHER *cipher, const EVP_MD *mac, double seconds)
+{
+        if (!cipher) {
+                return 0;
+        }
+        const size_t record = 16384;
+        std::vector<unsigned char> key(EVP_CIPHER_key_length(cipher), 'k');
+        std::vector<unsigned char> in(record, 'x');
+        std::vector<unsigned char> out(record + EVP_MAX_BLOCK_LENGTH);
+        unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
+        unsigned char tag[EVP_MAX_MD_SIZE];
+        unsigned int taglen;
+        int len;
+
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        if (!ctx || !EVP_EncryptInit_ex(ctx, cipher, NULL, &key[0], iv)) {
+                EVP_CIPHER_CTX_free(ctx);
+                return 0;
+        }
+        unsigned long long bytes = 0;
+        const double start = clock_get_dbl();
+        double now = start;
+        while (now - start < seconds) {
+                for (int c = 0; c < 16; c++) {
+                        iv[0]++;
+                        EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+                        EVP_EncryptUpdate(ctx, &out[0], &len, &in[0], record);
+                        EVP_EncryptFinal_ex(ctx, &out[len], &len);
+                        if (mac) {
+                                HMAC(mac, &key[0], key.size(), &in[0], record,
+                                     tag, &taglen);
+                        } else {
+                                EVP_CIPHER_CTX_ctrl(ctx,
+                                                    EVP_CTRL_AEAD_GET_TAG,
+                                                    16, tag);
+                        }
+                        bytes += record;
+                }
+                now = clock_get_dbl();
+        }
+        EVP_CIPHER_CTX_free(ctx);
+        return bytes / (now - start) / 1000000;
+}
+
+/**
+ * Show how fast each cipher "CipherList auto" picks from is on this
+ * host (--cipher-bench), and the order "auto" puts them in.
+ */
+void
+cipher_bench()
+{
+        const struct {
+                const char *name;
+                const EVP_CIPHER *cipher;
+                const EVP_MD *mac;
+        } suites[] = {
+                { "TLS_AES_128_GCM_SHA256", EVP_aes_128_gcm(), NULL },
+                { "TLS_AES_256_GCM_SHA384", EVP_aes_256_gcm(), NULL },
+#ifndef OPENSSL_NO_CHACHA
+                { "TLS_CHACHA20_POLY1305_SHA256",
+                  EVP_chacha20_poly1305(), NULL },
+#endif
+                { "AES256-SHA (CBC, TLS 1.2)", EVP_aes_256_cbc(), EVP_sha1() },
+        };
+
+        printf("AES-GCM instructions: %s\n",
+               SSLContext::have_aes_hw() ? "yes" : "no");
+        for (size_t c = 0; c < sizeof(suites) / sizeof(suites[0]); c++) {
+                const double mbps = bench_cipher(suites[c].cipher,
+                                                 suites[c].mac, 0.5);
+                if (mbps > 0) {
+                        printf("  %-30s %8.1f MB/s\n", suites[c].name, mbps);
+                } else {
+                        printf("  %-30s %8s\n", suites[c].name, "n/a");
+                }
+        }
+        printf("CipherList auto, TLS 1.3: %s\n"
+               "CipherList auto, TLS 1.2: %s\n",
+               SSLContext::auto_ciphersuites().c_str(),
+               SSLContext::auto_cipher_list().c_str());
+}
+
 /** Print version info according to GNU coding standards
  *
  */
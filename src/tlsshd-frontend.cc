@@ -0,0 +1,268 @@
+/// tlssh/src/tlsshd-frontend.cc
+/**
+ * @addtogroup TLSSHD
+ * @file src/tlsshd-frontend.cc
+ * TLSSHD handshakes in the listener.
+ *
+ * Normally every connection gets a fork()ed root sslproc before
+ * anyone knows who's on the other end, so port scanners, wrong certs
+ * and revoked clients all cost a process. With "AuthBeforeFork" the
+ * listener runs the TLS handshakes itself, many at a time, and checks
+ * the client cert, the CRL and ClientDomain. Only then does it fork()
+ * the sslproc, which inherits the finished TLS connection. The
+ * listener then forgets its own copy without telling the client.
+ *
+ * Handshakes in the front end count towards MaxHandshakes and are
+ * dropped after HandshakeTimeout.
+ *
+ * All the code in this file runs as root.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<poll.h>
+
+#include<monotonic_clock.h>
+
+#include"tlssh.h"
+#include"sslsocket.h"
+#include"util2.h"
+
+using tlsshd::options;
+
+BEGIN_NAMESPACE(tlsshd_frontend);
+
+/**
+ *
+ */
+FrontEnd::FrontEnd()
+{
+}
+
+/**
+ * Also destroyed on exit() in fork()ed children, so no goodbyes are
+ * sent on connections that belong to the listener.
+ */
+FrontEnd::~FrontEnd()
+{
+        abandon_all();
+}
+
+/**
+ * Start a handshake.
+ *
+ * @param[in] fd  Newly accept()ed connection. Taken over.
+ */
+void
+FrontEnd::add(int fd)
+{
+        Conn conn;
+        conn.sock = new SSLSocket(fd);
+        conn.deadline = 0;
+        conn.events = 0;
+        if (options.handshake_timeout) {
+                conn.deadline = clock_get_dbl() + options.handshake_timeout;
+        }
+        conns_.push_back(conn);
+        try {
+                tlsshd_sslproc::setup_socket(*conn.sock);
+                conn.sock->set_nonblock(true);
+                conn.sock->ssl_set_context(tlsshd::ssl_ctx);
+        } catch (const std::exception &e) {
+                logger->warning("%s", e.what());
+                erase(--conns_.end());
+                return;
+        }
+        step(--conns_.end());
+}
+
+/**
+ * Drop a connection.
+ *
+ * Contexts retired by a reload are freed once no handshake uses them.
+ */
+void
+FrontEnd::erase(conns_t::iterator itr)
+{
+        delete itr->sock;
+        conns_.erase(itr);
+        free_retired();
+}
+
+/**
+ * Free the retired contexts if no socket uses them any more, neither
+ * in a handshake nor waiting in the ready list.
+ *
+ * Sockets taken with pop_ready() are the caller's, and are gone (to
+ * an sslproc) before anything here runs again.
+ */
+void
+FrontEnd::free_retired()
+{
+        if (!conns_.empty() || !ready_.empty()) {
+                return;
+        }
+        std::vector<SSLContext*>::iterator citr;
+        for (citr = retired_.begin(); citr != retired_.end(); ++citr) {
+                delete *citr;
+        }
+        retired_.clear();
+}
+
+/**
+ * Move a handshake forward. Finished and authenticated connections
+ * move to the ready list, failed ones are dropped.
+ */
+void
+FrontEnd::step(conns_t::iterator itr)
+{
+        std::string username;
+        try {
+                itr->events = itr->sock->ssl_accept_step();
+                if (itr->events) {
+                        return;
+                }
+                username = tlsshd_sslproc::check_client_cert(*itr->sock);
+        } catch (const SSLSocket::ErrSSLCRL &e) {
+                logger->warning("%s", e.what());
+                erase(itr);
+                return;
+        } catch (const SSLSocket::ErrSSL &e) {
+                logger->warning("%s", e.what_verbose().c_str());
+                erase(itr);
+                return;
+        } catch (const std::exception &e) {
+                logger->warning("%s", e.what());
+                erase(itr);
+                return;
+        }
+        ready_.push_back(std::make_pair(itr->sock, username));
+        itr->sock = NULL;
+        erase(itr);
+}
+
+/**
+ * Add all handshakes to the poll() set, in order.
+ */
+void
+FrontEnd::add_pollfds(std::vector<struct pollfd> &fds) const
+{
+        conns_t::const_iterator itr;
+        for (itr = conns_.begin(); itr != conns_.end(); ++itr) {
+                struct pollfd pfd;
+                pfd.fd = itr->sock->getfd();
+                pfd.events = itr->events;
+                pfd.revents = 0;
+                fds.push_back(pfd);
+        }
+}
+
+/**
+ * Step the handshakes that poll() found ready.
+ *
+ * @param[in] fds     poll() set
+ * @param[in] offset  Index of first entry added by add_pollfds()
+ */
+void
+FrontEnd::check_pollfds(const std::vector<struct pollfd> &fds,
+                        size_t offset)
+{
+        conns_t::iterator itr = conns_.begin();
+        size_t c;
+
+        // step() may erase, and add_pollfds() order is list order
+        for (c = offset; c < fds.size() && itr != conns_.end(); c++) {
+                conns_t::iterator cur = itr++;
+                if (fds[c].revents) {
+                        step(cur);
+                }
+        }
+}
+
+/**
+ * Drop handshakes that are past HandshakeTimeout.
+ *
+ * @return Seconds until the next deadline, or -1 if there's none.
+ */
+double
+FrontEnd::expire(double now)
+{
+        double next = -1;
+        conns_t::iterator itr = conns_.begin();
+        while (itr != conns_.end()) {
+                conns_t::iterator cur = itr++;
+                if (!cur->deadline) {
+                        continue;
+                }
+                if (cur->deadline <= now) {
+                        logger->info("Handshake timed out after %d seconds",
+                                     options.handshake_timeout);
+                        erase(cur);
+                        continue;
+                }
+                if (next < 0 || cur->deadline - now < next) {
+                        next = cur->deadline - now;
+                }
+        }
+        return next;
+}
+
+/**
+ * Get the next authenticated connection, if any.
+ *
+ * @param[out] username  User from the client cert
+ * @return               Connection, now owned by caller, or NULL
+ */
+SSLSocket *
+FrontEnd::pop_ready(std::string *username)
+{
+        if (ready_.empty()) {
+                return NULL;
+        }
+        SSLSocket *sock = ready_.front().first;
+        *username = ready_.front().second;
+        ready_.pop_front();
+        return sock;
+}
+
+/**
+ * Free an SSL context replaced by a reload once no connection uses it.
+ */
+void
+FrontEnd::retire(SSLContext *ctx)
+{
+        retired_.push_back(ctx);
+        free_retired();
+}
+
+/**
+ * Forget all connections without telling the peers. For fork()ed
+ * children, where they're just copies.
+ */
+void
+FrontEnd::abandon_all()
+{
+        conns_t::iterator itr;
+        for (itr = conns_.begin(); itr != conns_.end(); ++itr) {
+                itr->sock->abandon();
+                delete itr->sock;
+        }
+        conns_.clear();
+
+        ready_t::iterator ritr;
+        for (ritr = ready_.begin(); ritr != ready_.end(); ++ritr) {
+                ritr->first->abandon();
+                delete ritr->first;
+        }
+        ready_.clear();
+        retired_.clear();
+}
+
+END_NAMESPACE(tlsshd_frontend);
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# Test tlsshd-ocsp-refresh against "openssl ocsp" as the responder.
+#
+set -e
+
+OPENSSL=${OPENSSL:-openssl}
+REFRESH="$(cd "${srcdir:-.}" && pwd)/src/tlsshd-ocsp-refresh"
+PORT=$((22000 + $$ % 1000))
+URL="http://127.0.0.1:$PORT"
+
+if ! $OPENSSL version > /dev/null 2>&1; then
+    echo "$0: no openssl binary, skipping"
+    exit 77
+fi
+
+DIR=$(mktemp -d /tmp/tlsshd-ocsp-refresh_test.XXXXXX)
+RESPONDER=
+cleanup()
+{
+    if [ -n "$RESPONDER" ]; then
+        kill $RESPONDER 2>/dev/null || true
+    fi
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# CA, and a server cert pointing at the responder
+cd "$DIR"
+cat > ca.cnf <<EOF
+[req]
+distinguished_name = dn
+[dn]
+[ca]
+basicConstraints = critical,CA:true
+keyUsage = critical,keyCertSign,cRLSign
+[server]
+basicConstraints = CA:false
+authorityInfoAccess = OCSP;URI:$URL
+EOF
+$OPENSSL req -x509 -newkey rsa:2048 -nodes -keyout ca.key -out ca.crt \
+    -subj /CN=ocsp-test-ca -days 1 -config ca.cnf -extensions ca \
+    2>/dev/null
+$OPENSSL req -new -newkey rsa:2048 -nodes -keyout server.key \
+    -out server.csr -subj /CN=localhost -config ca.cnf 2>/dev/null
+$OPENSSL x509 -req -in server.csr -CA ca.crt -CAkey ca.key \
+    -set_serial 2 -days 1 -out server.crt \
+    -extfile ca.cnf -extensions server 2>/dev/null
+EXPIRY=$($OPENSSL x509 -in server.crt -noout -enddate \
+    | sed 's/.*=//' | xargs -I{} date -u -d {} +%y%m%d%H%M%SZ)
+
+# responder answering one request, signing with ca (or $3)
+responder()
+{
+    printf '%s\t%s\t%s\t02\tunknown\t/CN=localhost\n' \
+        "$1" "$EXPIRY" "$2" > index.txt
+    $OPENSSL ocsp -index index.txt -port $PORT -rsigner ${3:-ca}.crt \
+        -rkey ${3:-ca}.key -CA ca.crt -ndays 1 -nrequest 1 \
+        > responder.log 2>&1 &
+    RESPONDER=$!
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        if grep -qi "waiting for OCSP" responder.log; then
+            return
+        fi
+        sleep 0.2
+    done
+}
+
+refresh()
+{
+    "$REFRESH" -c server.crt -i ca.crt -o staple.der -t 5 "$@"
+}
+
+# good: installed
+responder V ""
+refresh || fail "good response not installed"
+[ -s staple.der ] || fail "no staple.der"
+$OPENSSL ocsp -respin staple.der -issuer ca.crt -cert server.crt \
+    -CAfile ca.crt -no_nonce 2>&1 | grep -q "server.crt: good" \
+    || fail "staple.der is not a good response"
+wait $RESPONDER || true
+cp staple.der good.der
+
+# revoked: old one kept
+responder R "$(date -u +%y%m%d%H%M%SZ)"
+if refresh 2>/dev/null; then
+    fail "revoked response installed"
+fi
+cmp -s staple.der good.der || fail "old response not kept"
+wait $RESPONDER || true
+
+# signed by someone else: old one kept
+$OPENSSL req -x509 -newkey rsa:2048 -nodes -keyout other.key \
+    -out other.crt -subj /CN=other -days 1 -config ca.cnf \
+    -extensions ca 2>/dev/null
+responder V "" other
+if refresh 2>/dev/null; then
+    fail "response not signed by issuer installed"
+fi
+cmp -s staple.der good.der || fail "old response not kept"
+wait $RESPONDER || true
+
+# no responder: old one kept
+if refresh -u http://127.0.0.1:1 2>/dev/null; then
+    fail "refresh without responder succeeded"
+fi
+cmp -s staple.der good.der || fail "old response not kept"
+ls staple.der.* 2>/dev/null && fail "temp files left behind"
+
+echo OK
@@ -0,0 +1,226 @@
+/// tlssh/src/tlsshd-prefork.cc
+/**
+ * @addtogroup TLSSHD
+ * @file src/tlsshd-prefork.cc
+ * TLSSHD pool of pre-forked sslproc workers.
+ *
+ * Without a pool the listener fork()s after every accept(), so process
+ * creation sits between the TCP handshake and the TLS handshake. With
+ * "Prefork" set the listener keeps a number of idle, already
+ * initialised workers around and just passes the new fd to one of
+ * them. The pool is refilled when the listener has nothing better to do.
+ *
+ * Workers are single use. Once handed a connection a worker becomes
+ * an ordinary sslproc and drops privileges, so it can never come
+ * back to the pool.
+ *
+ * All the code in this file runs as root.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include<time.h>
+#include<unistd.h>
+#include<signal.h>
+#include<poll.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+
+#include"tlssh.h"
+#include"util2.h"
+
+using tlsshd::options;
+
+BEGIN_NAMESPACE(tlsshd_prefork);
+
+/**
+ *
+ */
+Pool::Pool()
+        :refilling_(false),
+         failed_(0)
+{
+}
+
+/**
+ * Closing the control sockets makes all idle workers exit.
+ */
+Pool::~Pool()
+{
+        close_fds();
+}
+
+/**
+ * Should the listener spawn another worker when it's idle?
+ *
+ * Refilling starts when there are fewer than PreforkMinSpare idle
+ * workers and goes on until there are PreforkMaxSpare of them.
+ */
+bool
+Pool::needs_refill()
+{
+        if (!options.prefork) {
+                return false;
+        }
+        // back off until something else wakes the listener up
+        if (failed_ == time(0)) {
+                return false;
+        }
+        if (idle_.size() < options.prefork_min_spare) {
+                refilling_ = true;
+        }
+        if (idle_.size() >= options.prefork_max_spare) {
+                refilling_ = false;
+        }
+        return refilling_;
+}
+
+/**
+ * fork() a new idle worker.
+ *
+ * Works like fork(): returns the pid in the listener and 0 in the
+ * worker. In the worker all control sockets except its own have been
+ * closed and its own is returned in *ctl.
+ *
+ * @param[out] ctl  Worker end of the control socket (only set in worker)
+ * @return          pid of new worker, or 0 if in worker
+ */
+pid_t
+Pool::spawn(int *ctl)
+{
+        int sv[2];
+        pid_t pid;
+
+        if (socketpair(AF_UNIX, tlsshd::CTL_SOCK_TYPE, 0, sv)) {
+                failed_ = time(0);
+                THROW(Err::ErrSys, "socketpair()");
+        }
+
+        pid = fork();
+        if (0 > pid) {
+                failed_ = time(0);
+                close(sv[0]);
+                close(sv[1]);
+                THROW(Err::ErrSys, "fork()");
+        }
+
+        if (!pid) {
+                close(sv[0]);
+                close_fds();
+                *ctl = sv[1];
+                return 0;
+        }
+
+        close(sv[1]);
+        Worker w;
+        w.pid = pid;
+        w.ctl = sv[0];
+        idle_.push_back(w);
+        logger->debug("prefork: spawned worker %d, %d idle",
+                      pid, (int)idle_.size());
+        return pid;
+}
+
+/**
+ * Hand a newly accept()ed connection to an idle worker.
+ *
+ * Workers that turn out to be dead are discarded.
+ *
+ * @param[in]  fd      Connected socket. Caller still owns (and should
+ *                     close) it.
+ * @param[out] pid     pid of the worker that took it
+ * @param[out] status  Control socket of that worker, now its status
+ *                     channel. Owned by caller.
+ * @return             true if a worker took the connection
+ */
+bool
+Pool::dispatch(int fd, pid_t *pid, int *status)
+{
+        while (!idle_.empty()) {
+                Worker w = idle_.front();
+                idle_.pop_front();
+                try {
+                        xsend_fd(w.ctl, fd);
+                        *pid = w.pid;
+                        *status = w.ctl;
+                        return true;
+                } catch (const Err::ErrBase &e) {
+                        logger->debug("prefork: worker %d gone: %s",
+                                      w.pid, e.what());
+                }
+                close(w.ctl);
+        }
+        return false;
+}
+
+/**
+ * Add the control sockets of idle workers to a poll() set so that
+ * workers that die while idle are noticed.
+ */
+void
+Pool::add_pollfds(std::vector<struct pollfd> &fds) const
+{
+        for (workers_t::const_iterator itr = idle_.begin();
+             itr != idle_.end();
+             ++itr) {
+                struct pollfd pfd;
+                pfd.fd = itr->ctl;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                fds.push_back(pfd);
+        }
+}
+
+/**
+ * Drop workers whose control socket was flagged by poll(). Idle workers
+ * never write to it, so any event means the worker is gone.
+ *
+ * @param[in] fds     poll() set as filled in by add_pollfds()
+ * @param[in] offset  Index in fds of the first worker entry
+ */
+void
+Pool::check_pollfds(const std::vector<struct pollfd> &fds, size_t offset)
+{
+        size_t c;
+        for (c = offset; c < fds.size(); c++) {
+                if (!fds[c].revents) {
+                        continue;
+                }
+                for (workers_t::iterator itr = idle_.begin();
+                     itr != idle_.end();
+                     ++itr) {
+                        if (itr->ctl == fds[c].fd) {
+                                logger->debug("prefork: idle worker %d died",
+                                              itr->pid);
+                                close(itr->ctl);
+                                idle_.erase(itr);
+                                break;
+                        }
+                }
+        }
+}
+
+/**
+ * Close all control sockets and forget about the workers. Used in
+ * every newly forked child so that it doesn't keep other workers alive.
+ */
+void
+Pool::close_fds()
+{
+        for (workers_t::iterator itr = idle_.begin();
+             itr != idle_.end();
+             ++itr) {
+                close(itr->ctl);
+        }
+        idle_.clear();
+        refilling_ = false;
+}
+
+END_NAMESPACE(tlsshd_prefork);
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
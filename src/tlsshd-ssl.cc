@@ -29,7 +29,10 @@
 #include<time.h>
 #include<utmp.h>
 #include<unistd.h>
+#include<string.h>
+#include<errno.h>
 #include<limits.h>
+#include<stdio.h>
 #include<stdlib.h>
 #include<grp.h>
 #include<poll.h>
@@ -41,6 +44,7 @@
 #include<sys/types.h>
 #include<sys/stat.h>
 #include<sys/ioctl.h>
+#include<sys/wait.h>
 #include<fcntl.h>
 #include<termios.h>
 #include<signal.h>
@@ -66,6 +70,11 @@
 #include"xgetpwnam.h"
 #include"configparser.h"
 #include"util2.h"
+#include"ringbuffer.h"
+#include"eventloop.h"
+#include"sessioncache.h"
+#include"crlindex.h"
+#include"peercache.h"
 
 // OpenBSD
 #ifndef WTMP_FILE
@@ -80,114 +89,160 @@ BEGIN_NAMESPACE(tlsshd_sslproc);
 FDWrap fd_wtmp;
 std::string short_ttyname;  // ttyname excl "/dev/"
 std::string base_ttyname;   // basename part of ttyname
+FDWrap status_channel;      // to listener, open until client is authenticated
+FDWrap fd_smaps;            // /proc/self/smaps_rollup, opened before chroot
+
+/**
+ * Run as: root
+ *
+ * Tell the listener that the client is authenticated, so this process
+ * no longer counts towards MaxHandshakes.
+ */
+void
+handshake_done()
+{
+        status_channel.close();
+}
+
+/**
+ * Shell output on its way from the pty to a kTLS socket, through a
+ * pipe so that it never gets copied to user space.
+ */
+struct SplicePipe {
+        FDWrap r;
+        FDWrap w;
+        size_t pending;  // in the pipe, not yet sent
+
+        SplicePipe(): pending(0) {}
+};
 
 /**
  * Run as: user
  *
- * @return true if all done
+ * Move shell output to the socket with splice() if possible.
+ *
+ * @return true if done, false if this has to be read() instead
  */
 bool
-connect_fd_sock(FDWrap &fd,
-		SSLSocket &sock,
-		std::string &to_fd,
-		std::string &from_sock,
-		std::string &to_sock)
+splice_from_shell(FDWrap &fd, SSLSocket &sock, SplicePipe *sp)
 {
-	struct pollfd fds[2];
-	bool active[2] = {true, true}; // terminal, client
-	int err;
-        double now;
-        static double last_keepalive_sent = 0;
-
-        if (options.keepalive != 0) {
-                now = clock_get_dbl();
-                if (last_keepalive_sent + options.keepalive < now) {
-                        last_keepalive_sent = now;
-                        to_sock += iac_echo_request((uint32_t)now);
+#ifdef HAVE_SPLICE
+        ssize_t n = splice(fd.get(), NULL, sp->w.get(), NULL, 65536,
+                           SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (n == 0) {
+                THROW0(FDWrap::ErrEOF);
+        }
+        if (n < 0) {
+                if (errno == EAGAIN) {
+                        return true;
+                }
+                // EIO is the shell having exited, and read() says so
+                if (errno != EIO) {
+                        logger->debug("splice() from shell: %s, "
+                                      "falling back to read()",
+                                      strerror(errno));
+                        sp->r.close();
+                        sp->w.close();
                 }
+                return false;
         }
+        sp->pending = n;
+        sp->pending -= sock.ssl_splice(sp->r.get(), sp->pending);
+        return true;
+#else
+        (void)fd;
+        (void)sock;
+        (void)sp;
+        return false;
+#endif
+}
 
-	fds[0].fd = sock.getfd();
-	fds[0].events = POLLIN;
-	fds[0].revents = 0;
-	if (!to_sock.empty()) {
-		fds[0].events |= POLLOUT;
-	}
-	if (fds[0].fd < 0) {
-		active[0] = false;
-	}
-
-	fds[1].fd = fd.get();
-	fds[1].events = POLLIN;
-	fds[1].revents = 0;
-	if (!to_fd.empty()) {
-		fds[1].events |= POLLOUT;
-	}
-	if (fds[1].fd < 0) {
-		active[1] = false;
-	}
-
-	// if both sockets closed, return done
-	if (!active[0]
-	    && !active[1]) {
-		return true;
-	}
+/** Timers of a session. */
+enum {
+        TIMER_KEEPALIVE,
+        TIMER_IDLE,
+        TIMER_MEMORY,
+};
 
-	// if shell has exited and there's nothing more to write to socket
-	if (!active[1] && to_sock.empty()) {
-		return true;
-	}
+/** Seconds without user data before the sslproc's memory is logged. */
+const double MEMORY_LOG_IDLE = 10;
 
-        int timeout = -1;
-        if (options.keepalive != 0) {
-                timeout = (int)(1000 * (options.keepalive
-                                        - (now - last_keepalive_sent)));
-                // protect against rounding errors
-                timeout = std::max(timeout, 0);
+/**
+ * Run as: user
+ *
+ * Log what this sslproc costs, from /proc/self/smaps_rollup: its PSS
+ * (shared pages split between the processes sharing them) and its
+ * private pages. Nothing is logged where there's no such file.
+ */
+void
+log_memory()
+{
+        if (!fd_smaps.valid() || lseek(fd_smaps.get(), 0, SEEK_SET)) {
+                return;
         }
-
-        // FIXME: why do we wait at most 1s?
-        if (timeout < 0 || timeout > 1000) {
-                timeout = 1000;
+        std::string text;
+        for (;;) {
+                char buf[1024];
+                const ssize_t n = read(fd_smaps.get(), buf, sizeof(buf));
+                if (0 >= n) {
+                        break;
+                }
+                text.append(buf, n);
         }
+        unsigned long pss = 0, priv = 0;
+        bool found = false;
+        size_t pos = 0, eol;
+        while (std::string::npos != (eol = text.find('\n', pos))) {
+                char key[64];
+                unsigned long kb;
+                if (2 == sscanf(text.substr(pos, eol - pos).c_str(),
+                                "%63[^:]: %lu", key, &kb)) {
+                        if (!strcmp(key, "Pss")) {
+                                pss = kb;
+                                found = true;
+                        } else if (!strcmp(key, "Private_Clean")
+                                   || !strcmp(key, "Private_Dirty")) {
+                                priv += kb;
+                        }
+                }
+                pos = eol + 1;
+        }
+        if (found) {
+                logger->info("Session idle, sslproc PSS %lu kB, "
+                             "private %lu kB", pss, priv);
+        }
+}
 
-	if (!active[0]) {
-		err = poll(&fds[1], 1, timeout);
-	} if (!active[1]) {
-		err = poll(fds, 1, timeout);
-	} else {
-		err = poll(fds, 2, timeout);
-	}
-
-	if (!err) { // timeout
-		return false;
-	}
-	if (0 > err) { // error
-		return false;
-	}
-
-	// from client
-	if (fds[0].revents & POLLIN) {
-		do {
-                        // FIXME: are we sure this can't block?
-			from_sock += sock.read();
-		} while (sock.ssl_pending());
-	}
-
-        // handle IAC
+/**
+ * Run as: user
+ *
+ * Handle what parse_iac() finds in data from the client: answer or act
+ * on the IACs, and queue the rest for the shell.
+ *
+ * @return false if from_sock is empty or only has part of an IAC
+ */
+bool
+handle_from_client(FDWrap &fd,
+                   std::string &from_sock,
+                   RingBuffer &to_fd,
+                   RingBuffer &to_sock)
+{
         parsed_buffer_t pb = parse_iac(from_sock);
+        if (pb.first.empty() && pb.second.empty()) {
+                return false;
+        }
         for (std::vector<IACCommand>::iterator itr = pb.first.begin();
              itr != pb.first.end();
              ++itr) {
                 uint32_t cookie;
                 switch (itr->s.command) {
                 case IAC_LITERAL:
-                        to_fd.append(1, IAC_LITERAL);
+                        to_fd.append("\xff", 1);
                         break;
                 case IAC_ECHO_REQUEST:
                         cookie = htonl(itr->s.commands.echo_cookie);
                         logger->debug("Got echo request %u", cookie);
-                        to_sock += iac_echo_reply(cookie);
+                        to_sock.append(iac_echo_reply(cookie));
                         break;
                 case IAC_ECHO_REPLY:
                         cookie = htonl(itr->s.commands.echo_cookie);
@@ -210,61 +265,355 @@ connect_fd_sock(FDWrap &fd,
         }
 
         // add user data to output queue
-        to_fd += pb.second;
-
-	// from shell
-	if (fds[1].revents & POLLIN) {
-                std::string s(fd.read());
-                logger->debug("Got %d bytes from shell (had %d)",
-                              s.size(), to_sock.size());
-                /**
-                 * FIXME: Why does this concat sometimes sometimes try
-                 * to allocate a bajillion bytes?
-                 */
-		to_sock += s;
-	}
+        to_fd.append(pb.second);
+        return true;
+}
 
-	// shell exited
-	if (fds[1].revents & POLLHUP) {
-		fd.close();
-		fds[1].revents = 0;
-		active[1] = false;
-	}
+/**
+ * Run as: user
+ *
+ * Shuffles data between the client and the shell. The EventLoop calls
+ * it when the socket or the pty is ready, when a timer expires and
+ * when the shell exits.
+ */
+class SessionIO: public EventLoop::Handler {
+public:
+        SessionIO(EventLoop &loop, FDWrap &fd, SSLSocket &sock,
+                  SplicePipe &sp, pid_t shell);
+
+        int wanted(int fd);
+        void ready(int fd, int revents);
+        void expired(TimerQueue::Id id);
+        void signalled(int sig);
+
+private:
+        EventLoop &loop_;
+        FDWrap &fd_;            ///< Shell pty
+        SSLSocket &sock_;
+        SplicePipe &sp_;
+        pid_t shell_;
+        RingBuffer to_fd_;
+        RingBuffer to_sock_;
+        std::string from_sock_;
+        int fd_events_;         ///< What the pty was last waited for
+        double last_heard_;     ///< Last data from the client
+        double last_active_;    ///< Last user data either way
+
+        size_t client_room() const;
+        void from_client();
+        void from_shell(int revents);
+};
+
+/**
+ * Run as: user
+ *
+ * @param[in] shell  Reaped when it exits
+ */
+SessionIO::SessionIO(EventLoop &loop, FDWrap &fd, SSLSocket &sock,
+                     SplicePipe &sp, pid_t shell)
+        :loop_(loop),
+         fd_(fd),
+         sock_(sock),
+         sp_(sp),
+         shell_(shell),
+         to_fd_(options.session_buffer),
+         to_sock_(options.session_buffer),
+         fd_events_(0),
+         last_heard_(loop.now()),
+         last_active_(loop.now())
+{
+        loop_.add_fd(sock_.getfd(), this);
+        loop_.add_fd(fd_.get(), this);
+        if (options.keepalive) {
+                loop_.set_timer(TIMER_KEEPALIVE,
+                                loop_.now() + options.keepalive, this);
+        }
+        if (options.idle_timeout) {
+                loop_.set_timer(TIMER_IDLE,
+                                loop_.now() + options.idle_timeout, this);
+        }
+        loop_.set_timer(TIMER_MEMORY, loop_.now() + MEMORY_LOG_IDLE, this);
+}
 
-	// output
+/**
+ * Run as: user
+ *
+ * Read from the client only what there's room for, also for echo
+ * replies, which are as long as the requests. Anything left in
+ * from_sock is part of an IAC, and counts too.
+ */
+size_t
+SessionIO::client_room() const
+{
+        size_t room = std::min(to_fd_.space(), to_sock_.space());
+        return room - std::min(room, from_sock_.size());
+}
 
-        // to client
-	if ((fds[0].revents & POLLOUT)
-	    && !to_sock.empty()) {
-		size_t n;
-		n = sock.write(to_sock);
-		to_sock = to_sock.substr(n);
+/**
+ * Run as: user
+ *
+ * Only wait for what there's data or room for. An fd that's waited
+ * for but not handled would make the loop spin.
+ */
+int
+SessionIO::wanted(int fd)
+{
+        int events = 0;
+        if (fd == sock_.getfd()) {
+                if (client_room()) {
+                        events |= sock_.io_events(false);
+                        // already decrypted, so the fd won't say
+                        if (sock_.ssl_pending()) {
+                                events |= EventLoop::PENDING;
+                        }
+                }
+                if (!to_sock_.empty()) {
+                        events |= sock_.io_events(true);
+                } else if (sp_.pending) {
+                        events |= POLLOUT;
+                }
+                return events;
+        }
+
+        // shell output waits for room, and for the splice pipe to empty
+        if (!sp_.pending && to_sock_.space()) {
+                events |= POLLIN;
+        }
+        if (!to_fd_.empty()) {
+                events |= POLLOUT;
+        }
+        fd_events_ = events;
+        return events;
+}
+
+/**
+ * Run as: user
+ */
+void
+SessionIO::ready(int fd, int revents)
+{
+        size_t n;
+
+        if (fd == fd_.get()) {
+                from_shell(revents);
+        } else {
+                // a hangup is found by reading
+                if (revents & (sock_.io_events(false) | EventLoop::PENDING
+                               | POLLHUP | POLLERR)) {
+                        from_client();
+                        if (loop_.stopped()) {
+                                return;
+                        }
+                }
+                if ((revents & sock_.io_events(true)) && !to_sock_.empty()) {
+                        size_t len;
+                        const char *p = to_sock_.read_span(&len);
+                        if (IO_ERROR == sock_.write_from(p, len, &n)) {
+                                sock_.throw_io_error("SSL_write()");
+                        }
+                        to_sock_.consume(n);
+                } else if ((revents & POLLOUT) && sp_.pending) {
+                        sp_.pending -= sock_.ssl_splice(sp_.r.get(),
+                                                        sp_.pending);
+                }
+        }
+
+        // shell exited, and everything it wrote has been sent
+        if (!fd_.valid() && to_sock_.empty() && !sp_.pending) {
+                loop_.stop();
+        }
+}
+
+/**
+ * Run as: user
+ *
+ * Read what there's room for from the client, and act on it.
+ */
+void
+SessionIO::from_client()
+{
+        char buf[16384];
+        size_t n;
+        size_t room = client_room();
+        while (room) {
+                const IOStatus st = sock_.read_into(
+                        buf, std::min(sizeof(buf), room), &n);
+                if (st == IO_EOF) {
+                        logger->debug("Client closed connection");
+                        loop_.stop();
+                        return;
+                } else if (st == IO_AGAIN) {
+                        break;
+                } else if (st == IO_ERROR) {
+                        sock_.throw_io_error("SSL_read()");
+                }
+                from_sock_.append(buf, n);
+                last_heard_ = loop_.now();
+                room -= n;
+                if (!sock_.ssl_pending()) {
+                        break;
+                }
+        }
+
+        // handle IAC
+        const size_t queued = to_fd_.size();
+        while (handle_from_client(fd_, from_sock_, to_fd_, to_sock_)) {
+        }
+        if (to_fd_.size() != queued) {
+                last_active_ = loop_.now();
+        }
+}
+
+/**
+ * Run as: user
+ *
+ * Shell output goes straight to the client if there's nothing queued
+ * before it. Echo replies may have taken the room waited for.
+ */
+void
+SessionIO::from_shell(int revents)
+{
+        bool shell_done = false;
+        size_t n;
+
+        if (revents & POLLIN) {
+                last_active_ = loop_.now();
+        }
+	if ((revents & POLLIN) && to_sock_.space()
+            && !(sp_.w.valid() && to_sock_.empty()
+                 && splice_from_shell(fd_, sock_, &sp_))) {
+                size_t len;
+                char *p = to_sock_.write_span(&len);
+                switch (fd_.read_into(p, len, &n)) {
+                case IO_OK:
+                        logger->debug("Got %d bytes from shell (had %d)",
+                                      (int)n, (int)to_sock_.size());
+                        to_sock_.commit(n);
+                        break;
+                case IO_AGAIN:
+                        break;
+                case IO_ERROR:
+                        // what a pty says once the shell is gone
+                        if (errno != EIO) {
+                                THROW(FDWrap::ErrBase, "read()");
+                        }
+                        // fallthrough
+                case IO_EOF:
+                        shell_done = true;
+                        break;
+                }
 	}
 
-        // to terminal
-	if ((fds[1].revents & POLLOUT)
-	    && !to_fd.empty()) {
-		size_t n;
-		n = fd.write(to_fd);
-		to_fd = to_fd.substr(n);
+	// shell exited, and everything it wrote has been read
+	if (shell_done
+            || ((revents & POLLHUP) && (fd_events_ & POLLIN)
+                && !(revents & POLLIN))) {
+                loop_.remove_fd(fd_.get());
+		fd_.close();
+                return;
+	}
+
+	if ((revents & POLLOUT) && !to_fd_.empty()) {
+                size_t len;
+                const char *p = to_fd_.read_span(&len);
+		if (IO_ERROR == fd_.write_from(p, len, &n)) {
+                        THROW(FDWrap::ErrBase, "write()");
+                }
+		to_fd_.consume(n);
 	}
+}
 
-	return false;
+/**
+ * Run as: user
+ *
+ * A keepalive isn't sent if the client has been heard from since the
+ * last one was due, and the idle timer only counts user data, not
+ * keepalives. The memory is logged once, the first time the session
+ * is idle.
+ */
+void
+SessionIO::expired(TimerQueue::Id id)
+{
+        const double now = loop_.now();
+        double due;
+        switch (id) {
+        case TIMER_KEEPALIVE:
+                due = last_heard_ + options.keepalive;
+                if (due <= now) {
+                        // with no room the client isn't idle anyway
+                        const std::string req
+                                = iac_echo_request((uint32_t)now);
+                        if (to_sock_.space() >= req.size()) {
+                                to_sock_.append(req);
+                        }
+                        due = now + options.keepalive;
+                }
+                loop_.set_timer(TIMER_KEEPALIVE, due, this);
+                break;
+        case TIMER_IDLE:
+                due = last_active_ + options.idle_timeout;
+                if (due <= now) {
+                        logger->info("Session idle for %u seconds, closing",
+                                     options.idle_timeout);
+                        loop_.stop();
+                        break;
+                }
+                loop_.set_timer(TIMER_IDLE, due, this);
+                break;
+        case TIMER_MEMORY:
+                due = last_active_ + MEMORY_LOG_IDLE;
+                if (due <= now) {
+                        log_memory();
+                        break;
+                }
+                loop_.set_timer(TIMER_MEMORY, due, this);
+                break;
+        }
+}
+
+/**
+ * Run as: user
+ *
+ * SIGCHLD. The session goes on until the pty closes, which can be
+ * after the shell exits if something it started still has the pty.
+ */
+void
+SessionIO::signalled(int)
+{
+        int status;
+        pid_t pid;
+        while (0 < (pid = waitpid(-1, &status, WNOHANG))) {
+                if (pid != shell_) {
+                        continue;
+                }
+                if (WIFEXITED(status)) {
+                        logger->debug("Shell exited with status %d",
+                                      WEXITSTATUS(status));
+                } else if (WIFSIGNALED(status)) {
+                        logger->debug("Shell killed by signal %d",
+                                      WTERMSIG(status));
+                }
+        }
 }
 
 /**
  * Run as: logged in user
+ *
+ * @param[in,out] terminal  Shell pty
+ * @param[in,out] sock      SSL socket to client
+ * @param[in,out] control   Header channel to shellproc. If already
+ *                          closed, the headers were sent from early data.
+ * @param[in]     shell     Shell process
+ * @param[in,out] loop      Runs the session
  */
 void
-user_loop(FDWrap &terminal, SSLSocket &sock, FDWrap &control)
+user_loop(FDWrap &terminal, SSLSocket &sock, FDWrap &control,
+          pid_t shell, EventLoop &loop)
 {
         logger->debug("sslproc::user_loop");
-	std::string to_client;
-	std::string to_terminal;
-        std::string from_sock;
 
 	int newlines = 0;
-        for (;;) {
+        while (control.valid()) {
                 std::string ch;
 		ch = sock.read(1);
                 if (ch == "\n") {
@@ -279,14 +628,35 @@ user_loop(FDWrap &terminal, SSLSocket &sock, FDWrap &control)
         }
         control.close();
 
+        // so a partial record or a key update can't stall SSL_read()
+        sock.set_nonblock(true);
+
+        SplicePipe sp;
+        if (options.kernel_tls) {
+                int fds[2];
+                if (!sock.ssl_ktls_send()) {
+                        logger->debug("Kernel TLS not in use");
+                } else if (pipe(fds)) {
+                        logger->warning("pipe(): %s", strerror(errno));
+                } else {
+                        logger->debug("Kernel TLS in use, "
+                                      "splicing shell output");
+                        sp.r.set(fds[0]);
+                        sp.w.set(fds[1]);
+                }
+        }
+
+        // SIG_IGN from the listener would reap the shell unseen
+        if (SIG_ERR == signal(SIGCHLD, SIG_DFL)) {
+                THROW(Err::ErrSys, "signal(SIGCHLD, SIG_DFL)");
+        }
+        SessionIO io(loop, terminal, sock, sp, shell);
+        loop.add_signal(SIGCHLD, &io);
+
         // main loop
 	for (;;) {
                 try {
-                        if (connect_fd_sock(terminal,
-                                            sock,
-                                            to_client,
-                                            from_sock,
-                                            to_terminal)) {
+                        if (!loop.run_once()) {
                                 break;
                         }
                 } catch(const FDWrap::ErrEOF &e) {
@@ -514,7 +884,48 @@ do_forkpty2(pid_t *pid, int *fdm)
 }
 
 /**
- * fork()s tlsshd_shellproc and drops privileges on both it and self.
+ * Unmap the segments shared with the listener and close their fds.
+ *
+ * Run as: root
+ *
+ * A process running as the user mustn't be able to write sessions or
+ * verified peers that log in someone else, or unrevoke a cert.
+ */
+void
+detach_shared()
+{
+        tlsshd::session_cache.detach();
+        tlsshd::peer_cache.detach();
+        tlsshd::crl_index.detach();
+}
+
+/**
+ * Drop privs in the sslproc, for the rest of the session
+ *
+ * Run as: root
+ *
+ * Done once the handshake is complete, since the shared segments are
+ * detached first. The peer cache was written by check_client_cert()
+ * before this, and later CRL checks fail without the table.
+ */
+void
+drop_sslproc_privs(const struct passwd *pw)
+{
+        if (!options.chroot.empty()) {
+                if (chroot(options.chroot.c_str())) {
+                        THROW(Err::ErrSys, "chroot("+options.chroot+")");
+                }
+                if (chdir("/")) {
+                        THROW(Err::ErrSys, "chdir(/)");
+                }
+        }
+        detach_shared();
+	drop_privs(pw);
+}
+
+/**
+ * fork()s tlsshd_shellproc and drops privileges on it. The sslproc
+ * drops its own with drop_sslproc_privs().
  *
  * Run as: root
  */
@@ -551,23 +962,14 @@ spawn_child(const struct passwd *pw,
                 close(fd_control[1]);
 
                 log_login(pw, peer_addr);
+                detach_shared();
                 drop_privs(pw);
                 exit(tlsshd_shellproc::forkmain(pw, fd_control[0]));
 	}
 
-        fd_wtmp.set(open(WTMP_FILE, O_WRONLY | O_APPEND));
-
         // parent
-        if (!options.chroot.empty()) {
-                if (chroot(options.chroot.c_str())) {
-                        THROW(Err::ErrSys, "chroot("+options.chroot+")");
-                }
-                if (chdir("/")) {
-                        THROW(Err::ErrSys, "chdir(/)");
-                }
-        }
-
-	drop_privs(pw);
+        fd_wtmp.set(open(WTMP_FILE, O_WRONLY | O_APPEND));
+        fd_smaps.set(open("/proc/self/smaps_rollup", O_RDONLY));
         close(fd_control[0]);
         *fdm_control = fd_control[1];
 }
@@ -575,59 +977,195 @@ spawn_child(const struct passwd *pw,
 /**
  * Run as: root
  *
- * 1) verify client cert information
- * 2) start up tlsshd_shellproc
- * 3) run I/O loop for whole session
- * 4) shut down session
+ * Check who the client is.
  *
  * At this point the cert is guaranteed to be signed by the ClientCA.
- * We now check who the client subject is.
+ * We now check who the client subject is. Also used by the listener
+ * with "AuthBeforeFork".
  *
- * @param[in,out] sock   SSL socket. Handshake complete, ready to use.
+ * A cert that was verified before comes with its CN already split up
+ * from the peer cache. Otherwise it's parsed here, and remembered if
+ * accepted.
+ *
+ * @param[in,out] sock   SSL socket. Handshake complete.
+ * @return               Username from the cert
  */
-void
-new_ssl_connection(SSLSocket &sock)
+std::string
+check_client_cert(SSLSocket &sock)
 {
-        logger->debug("tlsshd-ssl::new_ssl_connection()");
-	std::auto_ptr<X509Wrap> cert = sock.get_cert();
-	if (!cert.get()) {
-		sock.full_write("You are the no-cert client. Goodbye.");
-                THROW(Err::ErrBase, "client provided no cert");
-	}
+        PeerCache::Peer peer;
+        if (const PeerCache::Peer *cached = sock.ssl_cached_peer()) {
+                peer = *cached;
+                logger->debug("Client cert verified before: %s",
+                              peer.cn.c_str());
+        } else {
+                std::auto_ptr<X509Wrap> cert = sock.get_cert();
+                if (!cert.get()) {
+                        sock.full_write("You are the no-cert client. "
+                                        "Goodbye.");
+                        THROW(Err::ErrBase, "client provided no cert");
+                }
 
-        logger->debug("Client cert: %s", cert->get_subject().c_str());
+                logger->debug("Client cert: %s", cert->get_subject().c_str());
 
-	std::string certname = cert->get_common_name();
-        size_t dotpos = certname.find('.');
-        if (dotpos == std::string::npos) {
-                THROW(Err::ErrBase, "cert CN had no dot");
+                peer.cn = cert->get_common_name();
+                size_t dotpos = peer.cn.find('.');
+                if (dotpos == std::string::npos) {
+                        THROW(Err::ErrBase, "cert CN had no dot");
+                }
+                peer.username = peer.cn.substr(0, dotpos);
+                peer.domain = peer.cn.substr(dotpos+1);
         }
-	std::string username = certname.substr(0, dotpos);
-        std::string domain = certname.substr(dotpos+1);
-        if (domain != options.clientdomain) {
+        if (peer.domain != options.clientdomain) {
                 logger->warning("User domain mismatch: %s != %s",
-                                domain.c_str(), options.clientdomain.c_str());
+                                peer.domain.c_str(),
+                                options.clientdomain.c_str());
                 THROW(Err::ErrBase, "client is in wrong domain");
         }
+        sock.ssl_cache_peer(peer);
 
         logger->info("Logged in using cert: user=<%s>, domain=<%s>",
-                    username.c_str(), domain.c_str());
+                    peer.username.c_str(), peer.domain.c_str());
+        return peer.username;
+}
+
+/**
+ * Run as: root
+ *
+ * Read the protocol header block from TLS 1.3 early data.
+ *
+ * @param[in,out] sock  SSL socket. Handshake not yet started.
+ * @return              The whole header block, or empty string if the
+ *                      client sent no early data
+ */
+std::string
+read_early_headers(SSLSocket &sock)
+{
+        std::string ret;
+        for (;;) {
+                size_t end = ret.find("\n\n");
+                if (ret == "\n") {
+                        end = 1;
+                } else if (end != std::string::npos) {
+                        end += 2;
+                }
+                if (end != std::string::npos) {
+                        if (end != ret.size()) {
+                                THROW(Err::ErrBase, "early data continues "
+                                      "after header block");
+                        }
+                        return ret;
+                }
+                // stop reading as soon as the block is complete. The
+                // end of early data only comes a round trip later.
+                const std::string s(sock.ssl_read_early_data());
+                if (s.empty()) {
+                        break;
+                }
+                ret += s;
+        }
+        if (!ret.empty()) {
+                THROW(Err::ErrBase, "early data is not a header block");
+        }
+        return ret;
+}
 
+/**
+ * Run as: root
+ *
+ * 1) start up tlsshd_shellproc
+ * 2) run I/O loop for whole session
+ * 3) shut down session
+ *
+ * Headers from early data are passed on to the shellproc in one go,
+ * since they came before the client could send anything else.
+ *
+ * @param[in,out] sock      SSL socket. Handshake done, client cert
+ *                          checked.
+ * @param[in]     username  User to log in as
+ * @param[in]     early     Header block from early data, if any
+ */
+void
+run_session(SSLSocket &sock, const std::string &username,
+            const std::string &early)
+{
 	std::vector<char> pwbuf;
 	struct passwd pw = xgetpwnam(username, pwbuf);
+        handshake_done();
 
 	pid_t pid;
 	int termfd;
         int fd_control;
 	spawn_child(&pw, &pid, &termfd, &fd_control,
                     sock.get_peer_addr_string());
-	FDWrap terminal(termfd);
 	FDWrap control(fd_control);
-	user_loop(terminal, sock, control);
+        drop_sslproc_privs(&pw);
+
+        if (!early.empty()) {
+                logger->debug("Early data header block, %d bytes",
+                              (int)early.size());
+                control.full_write(early);
+                control.close();
+        }
+
+	FDWrap terminal(termfd);
+        EventLoop loop;
+        const double start = loop.now();
+	user_loop(terminal, sock, control, pid, loop);
+
+        const SSLSocket::RecordStats rs = sock.ssl_record_stats();
+        const double secs = std::max(loop.now() - start, 1.0);
+        logger->info("Session for <%s> done, sent %llu bytes in %lu small "
+                     "and %lu full records, %lu boosts, "
+                     "%lu wakeups in %.0fs (%.2f/s)",
+                     username.c_str(), rs.bytes, rs.small, rs.full,
+                     rs.boosts, loop.wakeups(), loop.now() - start,
+                     loop.wakeups() / secs);
 
         log_logout();
 }
 
+/**
+ * Run as: root
+ *
+ * 1) verify client cert information
+ * 2) run session
+ *
+ * @param[in,out] sock   SSL socket. Handshake complete, ready to use.
+ */
+void
+new_ssl_connection(SSLSocket &sock)
+{
+        logger->debug("tlsshd-ssl::new_ssl_connection()");
+        run_session(sock, check_client_cert(sock), "");
+}
+
+/**
+ * Run as: root
+ *
+ * Socket options for a new client connection.
+ *
+ * @param[in,out] sock  Newly accept()ed socket
+ */
+void
+setup_socket(SSLSocket &sock)
+{
+        sock.set_close_on_exec(true);
+        sock.set_debug(options.verbose > 1);
+        sock.set_nodelay(true);
+        sock.set_keepalive(true);
+        sock.set_tcp_md5(options.tcp_md5);
+        sock.set_tcp_md5_sock();
+        sock.ssl_set_record_sizing(options.record_small,
+                                   options.record_boost,
+                                   options.record_idle / 1000.0);
+        try {
+                sock.set_tos(IPTOS_LOWDELAY);
+        } catch (const std::exception &e) {
+                // FIXME: log error.
+        }
+}
+
 /** SIGINT handler for tlssh-sslproc
  *
  * only the listener gets killed by pkill -INT tlsshd, not existing
@@ -648,47 +1186,47 @@ sigint(int)
  * it's been accept(2)ed. This function will SSL-wrap the socket and call
  * new_ssl_connection().
  *
+ * The SSL context was built by the listener before fork(), so all
+ * that's left to do here is the handshake.
+ *
+ * The listener counts this process as an unauthenticated handshake
+ * until the status channel is closed (see handshake_done()).
+ *
  * input: newly connected fd, and newly forked process
  * output: calls new_ssl_connection() with up-and-running SSL connection
+ *
+ * @param[in] fd      Newly connected socket
+ * @param[in] status  Status channel to listener. Taken over.
  */
 int
-forkmain(FDWrap&fd)
+forkmain(FDWrap&fd, int status)
 {
         logger->debug("tlsshd-ssl:forkmain()");
+        status_channel.set(status);
 	try {
                 if (SIG_ERR == signal(SIGINT, sigint)) {
                         THROW(Err::ErrBase, "signal(SIGINT, sigint)");
                 }
 
                 SSLSocket sock(fd.forget());
-
-                sock.set_close_on_exec(true);
-                sock.set_debug(options.verbose > 1);
-                sock.set_nodelay(true);
-                sock.set_keepalive(true);
-                sock.set_tcp_md5(options.tcp_md5);
-                sock.set_tcp_md5_sock();
-                try {
-                        sock.set_tos(IPTOS_LOWDELAY);
-                } catch (const std::exception &e) {
-                        // FIXME: log error.
+                setup_socket(sock);
+                sock.ssl_set_context(tlsshd::ssl_ctx);
+                sock.ssl_set_handshake_timeout(options.handshake_timeout);
+                std::string early;
+                if (options.early_data) {
+                        early = read_early_headers(sock);
                 }
-
-                sock.ssl_set_crlfile(options.clientcrl);
-		sock.ssl_set_cipher_list(options.cipher_list);
-		sock.ssl_set_capath(options.clientcapath);
-		sock.ssl_set_cafile(options.clientcafile);
-		sock.ssl_set_certfile(options.certfile);
-		sock.ssl_set_keyfile(options.keyfile);
-
-                if (options.privkey_engine.first) {
-                        sock.ssl_set_privkey_engine(options.privkey_engine.second);
+                if (!early.empty()) {
+                        // nothing is acted on until the client has
+                        // shown that this isn't a replay
+                        sock.ssl_accept();
+                        run_session(sock, check_client_cert(sock), early);
+                } else {
+                        sock.ssl_accept();
+                        new_ssl_connection(sock);
                 }
-                sock.privkey_engine_pre_ = options.privkey_engine_pre;
-                sock.privkey_engine_post_ = options.privkey_engine_post;
-
-		sock.ssl_accept();
-		new_ssl_connection(sock);
+	} catch (const SSLSocket::ErrSSLTimeout &e) {
+		logger->info("%s", e.what());
 	} catch (const SSLSocket::ErrSSLHostname &e) {
 		logger->warning("%s", e.what());
 	} catch (const SSLSocket::ErrSSLCRL &e) {
@@ -705,6 +1243,65 @@ forkmain(FDWrap&fd)
 	return 0;
 }
 
+/**
+ * Run as: root
+ *
+ * Main function of an sslproc fork()ed by the listener after it did
+ * the handshake and checked the client cert itself ("AuthBeforeFork").
+ *
+ * @param[in,out] sock      SSL socket. Client cert checked.
+ * @param[in]     username  User to log in as
+ */
+int
+authed_main(SSLSocket &sock, const std::string &username)
+{
+        logger->debug("tlsshd-ssl:authed_main()");
+	try {
+                if (SIG_ERR == signal(SIGINT, sigint)) {
+                        THROW(Err::ErrBase, "signal(SIGINT, sigint)");
+                }
+                sock.set_nonblock(false);
+                run_session(sock, username, "");
+	} catch (const SSLSocket::ErrSSL &e) {
+		logger->warning("%s", e.what_verbose().c_str());
+	} catch (const std::exception &e) {
+                logger->err("%s",
+                            (std::string("sslproc: std::exception: ")
+                             + e.what() + "\n").c_str());
+	} catch (...) {
+		logger->err("Unknown exception happened");
+	}
+	return 0;
+}
+
+/**
+ * Run as: root
+ *
+ * Main function of a pre-forked worker. The SSL context is inherited
+ * from the listener, so all that's left is to wait for the listener
+ * to hand over a connection.
+ *
+ * @param[in] ctl  Control socket to the listener
+ */
+int
+worker_main(FDWrap &ctl)
+{
+        FDWrap fd;
+
+        try {
+                fd.set(xrecv_fd(ctl.get()));
+        } catch (const std::exception &e) {
+                logger->err("prefork worker: %s", e.what());
+                return 1;
+        }
+        if (!fd.valid()) {
+                // listener exited or shrunk the pool
+                return 0;
+        }
+        // control socket lives on as the status channel
+        return forkmain(fd, ctl.forget());
+}
+
 END_NAMESPACE(tlsshd_sslproc);
 /* ---- Emacs Variables ----
  * Local Variables:
@@ -20,6 +20,40 @@
  * This process sets up the daemon, listens to the port and runs the
  * accept()-loop.
  *
+ * With "ListenProcesses" there are several listener processes, each
+ * with its own SO_REUSEPORT sockets so that the kernel spreads new
+ * connections over them.
+ *
+ * Connections are admission controlled before anything is fork()ed:
+ * each source prefix has a token bucket ("SourceRate") and connections
+ * over budget are closed right away. There is also a budget for all
+ * accept()s ("AcceptRate"); when it's spent the listener stops
+ * accepting and leaves connections in the backlog until it has refilled.
+ *
+ * Every child that has a connection but hasn't authenticated the client
+ * yet has a status channel to the listener. Those are counted against
+ * "MaxHandshakes", and children that blow way past "HandshakeTimeout"
+ * are killed.
+ *
+ * With "AuthBeforeFork" the listener does the TLS handshakes itself
+ * (tlsshd-frontend.cc) and only fork()s an sslproc for clients that
+ * have been authenticated.
+ *
+ * TLS sessions can be resumed by any sslproc: the session cache and
+ * the session ticket keys are in shared memory set up by the listener,
+ * which also rotates the ticket keys (sessioncache.cc).
+ *
+ * On SIGHUP the listener re-reads the config file, re-applies the
+ * command line and builds a new SSL context for new connections.
+ * Running sessions keep whatever they started with.
+ *
+ * On SIGUSR2 the listener starts whatever binary is now installed as
+ * tlsshd and hands it the listen sockets, which are inherited across
+ * exec() and named in $TLSSHD_LISTEN_FDS. The port is never closed.
+ * The new listener says it's up by writing to the pipe in
+ * $TLSSHD_READY_FD, and then the old one exits. If the new one doesn't
+ * come up the old one keeps going.
+ *
  * All the code in this file runs as root.
  */
 #ifdef HAVE_CONFIG_H
@@ -27,6 +61,8 @@
 #endif
 
 #include<pwd.h>
+#include<limits.h>
+#include<stdlib.h>
 #include<unistd.h>
 #include<grp.h>
 #include<poll.h>
@@ -44,16 +80,27 @@
 #include<sys/socket.h>
 #include<sys/mman.h>
 
+#ifdef HAVE_EPOLL_CREATE1
+#include<sys/epoll.h>
+#endif
+
+#include<monotonic_clock.h>
+
 #include<memory>
 #include<iostream>
 #include<fstream>
 #include<vector>
+#include<list>
 
 #include"tlssh.h"
 #include"sslsocket.h"
 #include"xgetpwnam.h"
 #include"configparser.h"
 #include"util2.h"
+#include"ratelimit.h"
+#include"sessioncache.h"
+#include"crlindex.h"
+#include"peercache.h"
 
 using namespace tlssh_common;
 using namespace Err;
@@ -65,13 +112,77 @@ BEGIN_NAMESPACE(tlsshd);
 /* constants */
 const char *argv0 = NULL;
 
+/** Max connections to accept() from one listen socket per wakeup. Keeps
+ * one busy address from starving the others and the pre-fork pool. */
+const int ACCEPT_BATCH = 64;
+
+/** sslprocs enforce HandshakeTimeout themselves. The listener kills
+ * them if they're still not done this many seconds after that. */
+const double HANDSHAKE_KILL_SLACK = 10;
+
+/** Seconds between checks for a changed ClientCRL or OCSPStapleFile. */
+const double FILE_CHECK_INTERVAL = 10;
+
+/** Environment of a new binary started on SIGUSR2. */
+const char *ENV_LISTEN_FDS = "TLSSHD_LISTEN_FDS";
+const char *ENV_READY_FD = "TLSSHD_READY_FD";
+
+/** Seconds to wait for a new binary to say it's listening. */
+const int UPGRADE_TIMEOUT = 30;
+
 
 /* Process-wide variables */
 
-Socket listen;
+std::vector<Socket*> listen_socks;
+FDWrap listen_epoll;
+std::vector<pid_t> listen_procs;  // only set in the first listener
 std::string protocol_version; // should be "tlssh.1"
 
 Options options;
+SSLContext *ssl_ctx = NULL;
+tlsshd_prefork::Pool pool;
+tlsshd_frontend::FrontEnd frontend;
+SessionCache session_cache;
+CRLIndex crl_index;
+PeerCache peer_cache;
+
+TokenBucket accept_budget;
+SourceLimiter source_limiter;
+volatile sig_atomic_t dump_stats = 0;
+volatile sig_atomic_t reload_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+int saved_argc;
+char * const *saved_argv;
+std::string exe_path;
+int ready_fd = -1;  // if we were started on SIGUSR2, tell the old one here
+FDWrap upgrade_ready;  // ready pipe of a new binary that's starting up
+pid_t upgrade_pid;
+double upgrade_deadline;
+
+/**
+ * A child that has a connection but hasn't authenticated the client
+ * yet. It closes its end of 'status' when it's done, or dies.
+ */
+struct Handshake {
+        pid_t pid;
+        int status;
+        double deadline;
+};
+typedef std::list<Handshake> handshakes_t;
+handshakes_t handshakes;
+unsigned max_handshakes;
+
+/**
+ * Listener counters, logged on SIGUSR1.
+ */
+struct Counters {
+        unsigned long accepted;
+        unsigned long rejected_source;
+        unsigned long budget_exhausted;
+        unsigned long handshakes_full;
+        unsigned long handshakes_killed;
+};
+Counters counters = { 0, 0, 0, 0, 0 };
 
 /** SIGINT handler
  *
@@ -80,63 +191,829 @@ Options options;
  * that it will not cause you to shoot down the connection you are
  * using.
  *
+ * The first listener takes the other listener processes with it.
+ *
  * @todo Find a clean way to always log a message here
  */
 void
 sigint(int)
 {
+        size_t c;
+        for (c = 0; c < listen_procs.size(); c++) {
+                kill(listen_procs[c], SIGINT);
+        }
         _exit(1);
 }
 
+/** SIGUSR1 handler
+ *
+ * Listener logs its counters.
+ */
+void
+sigusr1(int)
+{
+        dump_stats = 1;
+}
+
+void reload();
+
+/** SIGHUP handler
+ *
+ * Listener reloads config at the top of the next loop iteration.
+ * Inherited by sslprocs, where it does nothing.
+ */
+void
+sighup(int)
+{
+        reload_requested = 1;
+}
+
+void upgrade();
+void check_upgrade(bool readable, double now);
+
+/** SIGUSR2 handler
+ *
+ * Listener hands its sockets over to a new binary at the top of the
+ * next loop iteration.
+ */
+void
+sigusr2(int)
+{
+        upgrade_requested = 1;
+}
+
+/** Log listener counters
+ *
+ * Run as: root
+ */
+void
+log_stats()
+{
+        logger->info("Listener %d: %lu connections accepted, "
+                     "%lu rejected by SourceRate, "
+                     "AcceptRate budget exhausted %lu times, "
+                     "MaxHandshakes reached %lu times, "
+                     "%lu handshakes killed, "
+                     "%u handshakes in progress, "
+                     "%u sources over budget or recently seen",
+                     getpid(),
+                     counters.accepted,
+                     counters.rejected_source,
+                     counters.budget_exhausted,
+                     counters.handshakes_full,
+                     counters.handshakes_killed,
+                     (unsigned)(handshakes.size() + frontend.size()),
+                     (unsigned)source_limiter.size());
+        if (session_cache.valid()) {
+                const SessionCache::Stats st(session_cache.stats());
+                logger->info("Session cache (all processes): %lu hits, "
+                             "%lu misses, %lu stored. Session tickets: "
+                             "%lu with known key, %lu with unknown key",
+                             st.hits, st.misses, st.stores,
+                             st.ticket_hits, st.ticket_misses);
+        }
+        if (crl_index.valid()) {
+                logger->info("ClientCRL: %lu revoked certs from %u CAs",
+                             crl_index.size(), crl_index.issuers());
+        }
+        if (peer_cache.valid()) {
+                const PeerCache::Stats st(peer_cache.stats());
+                logger->info("Peer cache (all processes): %lu hits, "
+                             "%lu misses, %lu stored, %lu flushes",
+                             st.hits, st.misses, st.stores, st.flushes);
+        }
+}
+
+/** Set up connection rate limits
+ *
+ * Run as: root
+ *
+ * Budgets are per listener process, so the configured rates and
+ * MaxHandshakes are split between them.
+ *
+ * On reload the token buckets are only rebuilt if their options
+ * changed, since that refills them and forgets every source.
+ *
+ * @param[in] old  Options before the reload, or NULL at startup
+ */
+void
+setup_ratelimit(const Options *old)
+{
+        const double n = options.listen_processes;
+        max_handshakes = options.max_handshakes / options.listen_processes;
+        if (!options.max_handshakes) {
+                max_handshakes = UINT_MAX;
+        } else if (!max_handshakes) {
+                max_handshakes = 1;
+        }
+        if (!old
+            || options.accept_rate != old->accept_rate
+            || options.accept_burst != old->accept_burst) {
+                accept_budget = TokenBucket(options.accept_rate / n,
+                                            options.accept_burst / n);
+        }
+        if (old
+            && options.source_rate == old->source_rate
+            && options.source_burst == old->source_burst
+            && options.source_prefix4 == old->source_prefix4
+            && options.source_prefix6 == old->source_prefix6) {
+                return;
+        }
+        source_limiter.configure(options.source_rate / n,
+                                 options.source_burst / n,
+                                 options.source_prefix4,
+                                 options.source_prefix6);
+}
+
+/** Take over listen sockets from the listener that exec()ed us.
+ *
+ * Run as: root
+ *
+ * @param[in] list  Comma separated fd numbers from $TLSSHD_LISTEN_FDS.
+ */
+void
+adopt_listen_fds(const std::string &list)
+{
+        const char *p = list.c_str();
+        while (*p) {
+                char *end;
+                long fd = strtol(p, &end, 10);
+                if (end == p || (*end && *end != ',') || fd < 0) {
+                        THROW(Err::ErrBase, "Bad " + std::string(ENV_LISTEN_FDS)
+                              + ": " + list);
+                }
+                p = *end ? end + 1 : end;
+                std::auto_ptr<Socket> sock(new Socket(fd));
+                sock->set_nonblock(true);
+                sock->set_close_on_exec(true);
+                logger->debug("Took over listen socket %ld", fd);
+                listen_socks.push_back(sock.release());
+        }
+}
+
+/** Bind and listen to all configured addresses.
+ *
+ * Run as: root
+ *
+ * If started by an old listener on SIGUSR2 its sockets are used
+ * instead, and Listen, Port and ListenBacklog are whatever they were.
+ */
+void
+listen_all()
+{
+        const char *inherited = getenv(ENV_LISTEN_FDS);
+        if (inherited) {
+                const std::string list(inherited);
+                unsetenv(ENV_LISTEN_FDS);
+                adopt_listen_fds(list);
+                return;
+        }
+
+        std::vector<std::string>::const_iterator itr;
+        for (itr = options.listen.begin();
+             itr != options.listen.end();
+             ++itr) {
+                std::auto_ptr<Socket> sock(new Socket());
+                sock->set_listen_backlog(options.listen_backlog);
+                sock->set_reuseport(options.listen_processes > 1);
+                sock->set_defer_accept(options.handshake_timeout);
+                sock->listen(options.af, *itr, options.port);
+                sock->set_nonblock(true);
+                sock->set_close_on_exec(true);
+                logger->debug("Listening to [%s]:%s",
+                              itr->c_str(), options.port.c_str());
+                listen_socks.push_back(sock.release());
+        }
+}
+
+/** Close listen sockets and forget listener-only state.
+ *
+ * Run as: root
+ *
+ * Called in every process fork()ed from a listener.
+ */
+void
+close_listen()
+{
+        std::vector<Socket*>::iterator itr;
+        for (itr = listen_socks.begin(); itr != listen_socks.end(); ++itr) {
+                delete *itr;
+        }
+        listen_socks.clear();
+        listen_epoll.close();
+        listen_procs.clear();
+        frontend.abandon_all();
+
+        handshakes_t::iterator hitr;
+        for (hitr = handshakes.begin(); hitr != handshakes.end(); ++hitr) {
+                close(hitr->status);
+        }
+        handshakes.clear();
+}
+
+/** Start counting a child as an unauthenticated handshake
+ *
+ * Run as: root
+ *
+ * @param[in] pid     The child
+ * @param[in] status  Listener end of its status channel. Taken over.
+ */
+void
+track_handshake(pid_t pid, int status)
+{
+        Handshake hs;
+        hs.pid = pid;
+        hs.status = status;
+        hs.deadline = 0;
+        if (options.handshake_timeout) {
+                hs.deadline = clock_get_dbl() + options.handshake_timeout
+                        + HANDSHAKE_KILL_SLACK;
+        }
+        handshakes.push_back(hs);
+}
+
+/** Add status channels of handshaking children to poll() set
+ *
+ * Run as: root
+ */
+void
+add_handshake_pollfds(std::vector<struct pollfd> &fds)
+{
+        handshakes_t::const_iterator itr;
+        for (itr = handshakes.begin(); itr != handshakes.end(); ++itr) {
+                struct pollfd pfd;
+                pfd.fd = itr->status;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                fds.push_back(pfd);
+        }
+}
+
+/** Forget about children that closed their status channel
+ *
+ * Run as: root
+ *
+ * @param[in] fds    poll() set
+ * @param[in] begin  Index of first entry added by add_handshake_pollfds()
+ * @param[in] end    One past the last such entry
+ */
+void
+check_handshake_pollfds(const std::vector<struct pollfd> &fds,
+                        size_t begin, size_t end)
+{
+        size_t c;
+        for (c = begin; c < end; c++) {
+                char buf[128];
+                ssize_t n;
+
+                if (!fds[c].revents) {
+                        continue;
+                }
+                n = read(fds[c].fd, buf, sizeof(buf));
+                if (0 < n || (0 > n && errno == EINTR)) {
+                        continue;
+                }
+                handshakes_t::iterator itr;
+                for (itr = handshakes.begin(); itr != handshakes.end(); ++itr) {
+                        if (itr->status == fds[c].fd) {
+                                close(itr->status);
+                                handshakes.erase(itr);
+                                break;
+                        }
+                }
+        }
+}
+
+/** Number of connections not yet authenticated
+ *
+ * Run as: root
+ *
+ * Both children still handshaking and handshakes in the front end.
+ */
+size_t
+in_handshake()
+{
+        return handshakes.size() + frontend.size();
+}
+
+/** Check if a child has closed its status channel
+ *
+ * Run as: root
+ *
+ * @return true if it has, by exiting or by being done handshaking
+ */
+bool
+status_closed(int fd)
+{
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (0 >= poll(&pfd, 1, 0)) {
+                return false;
+        }
+        char buf[128];
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        return !n || (0 > n && errno != EINTR && errno != EAGAIN);
+}
+
+/** Kill children that are way past HandshakeTimeout
+ *
+ * Run as: root
+ *
+ * SIGCHLD is ignored, so a child that has exited is already reaped
+ * and its pid may belong to someone else. Only a child that still
+ * has its status channel open is known to be alive.
+ *
+ * @return Seconds until the next deadline, or -1 if there's none.
+ */
+double
+expire_handshakes(double now)
+{
+        double next = -1;
+        handshakes_t::iterator itr = handshakes.begin();
+        while (itr != handshakes.end()) {
+                if (!itr->deadline) {
+                        ++itr;
+                        continue;
+                }
+                if (itr->deadline <= now && status_closed(itr->status)) {
+                        close(itr->status);
+                        handshakes.erase(itr++);
+                        continue;
+                }
+                if (itr->deadline <= now) {
+                        logger->warning("sslproc %d still not done after "
+                                        "HandshakeTimeout, killing it",
+                                        itr->pid);
+                        kill(itr->pid, SIGKILL);
+                        counters.handshakes_killed++;
+                        close(itr->status);
+                        handshakes.erase(itr++);
+                        continue;
+                }
+                if (next < 0 || itr->deadline - now < next) {
+                        next = itr->deadline - now;
+                }
+                ++itr;
+        }
+        return next;
+}
+
+/** Start the other ListenProcesses - 1 listener processes.
+ *
+ * Run as: root
+ *
+ * Each new listener binds its own sockets instead of sharing the
+ * inherited ones, since the kernel only load balances between
+ * separate SO_REUSEPORT sockets. Returns in all listener processes.
+ */
+void
+fork_listeners()
+{
+        unsigned c;
+
+        // sigint() reads this, so no reallocation while it's in use
+        listen_procs.reserve(options.listen_processes);
+        for (c = 1; c < options.listen_processes; c++) {
+                pid_t pid = fork();
+                if (0 > pid) {
+                        logger->err("fork() of listener failed: %s",
+                                    strerror(errno));
+                        return;
+                }
+                if (!pid) {
+                        close_listen();
+                        listen_all();
+                        return;
+                }
+                listen_procs.push_back(pid);
+        }
+}
+
+/** Start a fork()ed sslproc for a new connection
+ *
+ * Run as: root
+ *
+ * Used when there's no pre-forked worker to hand the connection to.
+ *
+ * @param[in] clifd  Newly accept()ed connection. Still owned by caller.
+ */
+void
+fork_sslproc(FDWrap &clifd)
+{
+        pid_t pid;
+        int sv[2];
+
+        if (socketpair(AF_UNIX, CTL_SOCK_TYPE, 0, sv)) {
+                logger->err("accept()-loop socketpair() failed: %s",
+                            strerror(errno));
+                return;
+        }
+
+        pid = fork();
+
+        if (0 > pid) {          // error
+                logger->err("accept()-loop fork() failed");
+                close(sv[0]);
+                close(sv[1]);
+        } else if (pid > 0) {   // parent
+                close(sv[1]);
+                track_handshake(pid, sv[0]);
+        } else {                // child
+#if 0
+                /**
+                 * Temporarily disabled until I find out why
+                 * it's trying to allocate heaps and heaps to
+                 * concat 8k in tlsshd-ssl.cc:218.
+                 */
+                if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+                        logger->err("mlockall(MCL_CURRENT "
+                                    "| MCL_FUTURE) failed: %s\n",
+                                    strerror(errno));
+                        exit(1);
+                }
+#endif
+
+                close(sv[0]);
+                close_listen();
+                pool.close_fds();
+                exit(tlsshd_sslproc::forkmain(clifd, sv[1]));
+        }
+}
+
+/** Start an sslproc for a connection authenticated by the front end
+ *
+ * Run as: root
+ *
+ * The child inherits the finished TLS connection. The listener frees
+ * its copy without telling the client.
+ *
+ * @param[in] sock      Connection. Taken over.
+ * @param[in] username  User from the client cert
+ */
+void
+fork_authed(SSLSocket *sock, const std::string &username)
+{
+        pid_t pid = fork();
+        if (0 > pid) {
+                logger->err("accept()-loop fork() failed");
+                delete sock;
+                return;
+        }
+        if (pid) {
+                sock->abandon();
+                delete sock;
+                return;
+        }
+        close_listen();
+        pool.close_fds();
+        int ret = tlsshd_sslproc::authed_main(*sock, username);
+        delete sock;
+        exit(ret);
+}
+
+/** Rebuild the CRL table if ClientCRL has changed
+ *
+ * Run as: root
+ *
+ * Idle pre-forked workers still have the old table, so they are
+ * retired and the pool refills with new ones. Certs in the peer cache
+ * were checked against the old CRL, so it's flushed. If the new CRL
+ * can't be used (e.g. it's only half written) the old table is kept,
+ * and it's tried again next time.
+ */
+void
+refresh_crl()
+{
+        if (!crl_index.valid()) {
+                return;
+        }
+        try {
+                if (crl_index.refresh()) {
+                        logger->info("ClientCRL changed, reloaded: %lu "
+                                     "revoked certs from %u CAs",
+                                     crl_index.size(), crl_index.issuers());
+                        peer_cache.flush();
+                        pool.close_fds();
+                }
+        } catch (const Err::ErrBase &e) {
+                logger->err("Reloading ClientCRL failed, keeping old: %s",
+                            e.what_verbose().c_str());
+        }
+}
+
+/** Reload the OCSP response to staple if OCSPStapleFile has changed
+ *
+ * Run as: root
+ *
+ * Like with the CRL, idle pre-forked workers are retired so that they
+ * don't staple the old response.
+ */
+void
+refresh_ocsp()
+{
+        if (ssl_ctx->load_ocsp_staple()) {
+                pool.close_fds();
+        }
+}
+
+/** Add one worker to the pre-fork pool
+ *
+ * Run as: root
+ */
+void
+spawn_worker()
+{
+        int ctl;
+        try {
+                if (pool.spawn(&ctl)) {
+                        return;
+                }
+        } catch (const Err::ErrSys &e) {
+                logger->err("prefork: %s", e.what());
+                return;
+        }
+
+        // worker
+        close_listen();
+        FDWrap fd(ctl);
+        exit(tlsshd_sslproc::worker_main(fd));
+}
+
+/** Accept a batch of connections from one listen socket.
+ *
+ * Run as: root
+ *
+ * Stops when the backlog is empty, after ACCEPT_BATCH connections,
+ * when the AcceptRate budget is spent or when MaxHandshakes is
+ * reached. Connections from sources over their SourceRate budget are
+ * closed without fork()ing anything.
+ */
+void
+accept_batch(Socket *sock)
+{
+        int c;
+
+        for (c = 0; c < ACCEPT_BATCH; c++) {
+                struct sockaddr_storage sa;
+                std::string source;
+                double now = clock_get_dbl();
+
+                if (!accept_budget.available(now)
+                    || in_handshake() >= max_handshakes) {
+                        return;
+                }
+
+                FDWrap clifd(sock->accept_nonblock(&sa));
+                if (0 > clifd.get()) {
+                        switch (errno) {
+                        case ECONNABORTED:
+                        case EINTR:
+                                continue;
+                        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+                        case EWOULDBLOCK:
+#endif
+                                break;
+                        default:
+                                logger->warning("accept(): %s",
+                                                strerror(errno));
+                                break;
+                        }
+                        return;
+                }
+
+                switch (source_limiter.admit((struct sockaddr*)&sa, now,
+                                             &source)) {
+                case SourceLimiter::ADMIT:
+                        break;
+                case SourceLimiter::REJECT_FIRST:
+                        logger->warning("SourceRate exceeded by %s, "
+                                        "rejecting connections",
+                                        source.c_str());
+                        // fallthrough
+                case SourceLimiter::REJECT:
+                        counters.rejected_source++;
+                        continue;
+                }
+
+                accept_budget.take(now);
+                counters.accepted++;
+
+                if (options.auth_before_fork) {
+                        frontend.add(clifd.forget());
+                        continue;
+                }
+
+                pid_t pid;
+                int status;
+                if (pool.dispatch(clifd.get(), &pid, &status)) {
+                        track_handshake(pid, status);
+                } else {
+                        fork_sslproc(clifd);
+                }
+        }
+}
+
 /** Listen-loop.
  *
  * Run as: root
  *
  * Run accept() in a loop. Do not read or write to the socket.
+ * Hands the connection to a pre-forked worker if there is one, or
  * spawns a newly fork()ed sslproc handler. (tlsshd-ssl.cc::forkmain())
  *
+ * The listen sockets are in an epoll set (when available), which is
+ * poll()ed together with the control sockets of idle pre-forked
+ * workers. Every wakeup drains the backlog of each ready listen
+ * socket in batches. While the AcceptRate budget is spent, or
+ * MaxHandshakes children are busy handshaking, the listen sockets are
+ * left out of the poll() set.
+ *
+ * With "AuthBeforeFork" handshakes in the front end are poll()ed too,
+ * after the status channels.
+ *
+ * When there are no connections waiting the pre-fork pool is topped
+ * up, one worker at a time, so that refilling never delays an accept().
+ *
  * @return Never returns, but if it did it would be the process exit value.
  */
 int
 listen_loop()
 {
-        struct sockaddr_storage sa; // never read from
+        std::vector<struct pollfd> fds;
+        size_t nlisten, nhandshakes, nfrontend, npool;
+        bool paused = false;
+        bool full = false;
+        double next_check = clock_get_dbl() + FILE_CHECK_INTERVAL;
+        unsigned c;
+
         logger->debug("Entering listen loop");
-	for (;;) {
-		FDWrap clifd;
-                pid_t pid;
-		socklen_t salen = sizeof(sa); 
 
-		clifd.set(::accept(listen.getfd(),
-                                   (struct sockaddr*)&sa,
-                                   &salen));
-		if (0 > clifd.get()) {
-			continue;
-		}
+#ifdef HAVE_EPOLL_CREATE1
+        listen_epoll.set(epoll_create1(EPOLL_CLOEXEC));
+        if (0 > listen_epoll.get()) {
+                THROW(Err::ErrSys, "epoll_create1()");
+        }
+        for (c = 0; c < listen_socks.size(); c++) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u32 = c;
+                if (epoll_ctl(listen_epoll.get(), EPOLL_CTL_ADD,
+                              listen_socks[c]->getfd(), &ev)) {
+                        THROW(Err::ErrSys, "epoll_ctl(EPOLL_CTL_ADD)");
+                }
+        }
+#endif
 
-                pid = fork();
+        for (c = 0; c < options.prefork; c++) {
+                spawn_worker();
+        }
 
-                if (0 > pid) {          // error
-                        logger->err("accept()-loop fork() failed");
-                } else if (pid == 0) {  // child
-#if 0
-                        /**
-                         * Temporarily disabled until I find out why
-                         * it's trying to allocate heaps and heaps to
-                         * concat 8k in tlsshd-ssl.cc:218.
-                         */
-                        if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
-                                logger->err("mlockall(MCL_CURRENT "
-                                            "| MCL_FUTURE) failed: %s\n",
-                                            strerror(errno));
-                                exit(1);
+	for (;;) {
+                struct pollfd pfd;
+                double now, wait, next_kill, next_drop;
+                int timeout = -1;
+                int err;
+
+                if (dump_stats) {
+                        dump_stats = 0;
+                        log_stats();
+                }
+                if (reload_requested) {
+                        reload_requested = 0;
+                        reload();
+                }
+                if (upgrade_requested) {
+                        upgrade_requested = 0;
+                        upgrade();
+                }
+
+                fds.clear();
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                now = clock_get_dbl();
+                next_kill = expire_handshakes(now);
+                next_drop = session_cache.rotate_keys(time(0));
+                if (next_drop >= 0
+                    && (next_kill < 0 || next_drop < next_kill)) {
+                        next_kill = next_drop;
+                }
+                next_drop = frontend.expire(now);
+                if (next_drop >= 0
+                    && (next_kill < 0 || next_drop < next_kill)) {
+                        next_kill = next_drop;
+                }
+                if (upgrade_ready.valid()) {
+                        next_drop = upgrade_deadline - now;
+                        if (next_drop < 0) {
+                                next_drop = 0;
+                        }
+                        if (next_kill < 0 || next_drop < next_kill) {
+                                next_kill = next_drop;
+                        }
+                }
+                if (crl_index.valid() || !options.ocsp_staple_file.empty()) {
+                        if (now >= next_check) {
+                                refresh_crl();
+                                refresh_ocsp();
+                                next_check = now + FILE_CHECK_INTERVAL;
+                        }
+                        next_drop = next_check - now;
+                        if (next_kill < 0 || next_drop < next_kill) {
+                                next_kill = next_drop;
+                        }
+                }
+                if (next_kill >= 0) {
+                        timeout = (int)(next_kill * 1000) + 1;
+                }
+                wait = accept_budget.wait_time(now);
+                if (in_handshake() >= max_handshakes) {
+                        if (!full) {
+                                full = true;
+                                counters.handshakes_full++;
+                                logger->debug("MaxHandshakes reached, "
+                                              "pausing accept()");
+                        }
+                } else if (wait > 0) {
+                        full = false;
+                        if (!paused) {
+                                paused = true;
+                                counters.budget_exhausted++;
+                                logger->debug("AcceptRate budget spent, "
+                                              "pausing accept()");
+                        }
+                        if (timeout < 0 || wait * 1000 < timeout) {
+                                timeout = (int)(wait * 1000) + 1;
+                        }
+                } else {
+                        full = false;
+                        paused = false;
+#ifdef HAVE_EPOLL_CREATE1
+                        pfd.fd = listen_epoll.get();
+                        fds.push_back(pfd);
+#else
+                        for (c = 0; c < listen_socks.size(); c++) {
+                                pfd.fd = listen_socks[c]->getfd();
+                                fds.push_back(pfd);
                         }
 #endif
+                }
+                nlisten = fds.size();
+                add_handshake_pollfds(fds);
+                nhandshakes = fds.size();
+                frontend.add_pollfds(fds);
+                nfrontend = fds.size();
+                pool.add_pollfds(fds);
+                npool = fds.size();
+                if (upgrade_ready.valid()) {
+                        pfd.fd = upgrade_ready.get();
+                        fds.push_back(pfd);
+                }
+                if (pool.needs_refill()) {
+                        timeout = 0;
+                }
 
-                        listen.close();
-			exit(tlsshd_sslproc::forkmain(clifd));
-		} else {
-                        ;
+                err = poll(fds.empty() ? NULL : &fds[0], fds.size(),
+                           timeout);
+                if (0 > err) {
+                        continue;
+                }
+                check_upgrade(npool < fds.size() && fds[npool].revents,
+                              clock_get_dbl());
+                if (!err) {
+                        if (pool.needs_refill()) {
+                                spawn_worker();
+                        }
+                        continue;
+                }
+                check_handshake_pollfds(fds, nlisten, nhandshakes);
+                pool.check_pollfds(fds, nfrontend);
+                frontend.check_pollfds(fds, nhandshakes);
+
+#ifdef HAVE_EPOLL_CREATE1
+                if (nlisten && (fds[0].revents & POLLIN)) {
+                        struct epoll_event evs[16];
+                        int n, i;
+                        n = epoll_wait(listen_epoll.get(), evs,
+                                       sizeof(evs) / sizeof(evs[0]), 0);
+                        for (i = 0; i < n; i++) {
+                                accept_batch(listen_socks[evs[i].data.u32]);
+                        }
+                }
+#else
+                for (c = 0; c < nlisten; c++) {
+                        if (fds[c].revents & POLLIN) {
+                                accept_batch(listen_socks[c]);
+                        }
+                }
+#endif
+                SSLSocket *authed;
+                std::string username;
+                while ((authed = frontend.pop_ready(&username))) {
+                        fork_authed(authed, username);
                 }
 	}
 }
@@ -165,6 +1042,8 @@ usage(int err)
                "\t-v                   Increase verbosity\n"
 	       "\t-V, --version        Print version and exit\n"
 	       "\t-p <cert+keyfile>    Load login cert+key from file\n"
+	       "\t--cipher-bench       Show cipher speeds on this host and "
+               "exit\n"
 	       , argv0,
                DEFAULT_CONFIG.c_str(),
                DEFAULT_CIPHER_LIST.c_str());
@@ -187,7 +1066,47 @@ read_config_file(const std::string &fn)
 			// comment
 		} else if (conf->keyword == "Listen"
                            && conf->parms.size() == 1) {
-			options.listen = conf->parms[0];
+			options.listen.push_back(conf->parms[0]);
+		} else if (conf->keyword == "ListenBacklog"
+                           && conf->parms.size() == 1) {
+			options.listen_backlog = strtoul(conf->parms[0].c_str(),
+                                                         0, 0);
+		} else if (conf->keyword == "SourceRate"
+                           && (conf->parms.size() == 1
+                               || conf->parms.size() == 2)) {
+			options.source_rate = strtod(conf->parms[0].c_str(), 0);
+                        options.source_burst = options.source_rate;
+                        if (conf->parms.size() == 2) {
+                                options.source_burst =
+                                        strtod(conf->parms[1].c_str(), 0);
+                        }
+		} else if (conf->keyword == "SourcePrefix"
+                           && conf->parms.size() == 2) {
+			options.source_prefix4 =
+                                strtoul(conf->parms[0].c_str(), 0, 0);
+			options.source_prefix6 =
+                                strtoul(conf->parms[1].c_str(), 0, 0);
+		} else if (conf->keyword == "AcceptRate"
+                           && (conf->parms.size() == 1
+                               || conf->parms.size() == 2)) {
+			options.accept_rate = strtod(conf->parms[0].c_str(), 0);
+                        options.accept_burst = options.accept_rate;
+                        if (conf->parms.size() == 2) {
+                                options.accept_burst =
+                                        strtod(conf->parms[1].c_str(), 0);
+                        }
+		} else if (conf->keyword == "MaxHandshakes"
+                           && conf->parms.size() == 1) {
+			options.max_handshakes =
+                                strtoul(conf->parms[0].c_str(), 0, 0);
+		} else if (conf->keyword == "HandshakeTimeout"
+                           && conf->parms.size() == 1) {
+			options.handshake_timeout =
+                                strtoul(conf->parms[0].c_str(), 0, 0);
+		} else if (conf->keyword == "ListenProcesses"
+                           && conf->parms.size() == 1) {
+			options.listen_processes =
+                                strtoul(conf->parms[0].c_str(), 0, 0);
 		} else if (conf->keyword == "ClientCAFile"
                            && conf->parms.size() == 1) {
 			options.clientcafile = conf->parms[0];
@@ -197,6 +1116,9 @@ read_config_file(const std::string &fn)
 		} else if (conf->keyword == "ClientCRL"
                            && conf->parms.size() == 1) {
 			options.clientcrl = conf->parms[0];
+		} else if (conf->keyword == "OCSPStapleFile"
+                           && conf->parms.size() == 1) {
+			options.ocsp_staple_file = conf->parms[0];
 		} else if (conf->keyword == "ClientDomain"
                            && conf->parms.size() == 1) {
 			options.clientdomain = conf->parms[0];
@@ -232,12 +1154,88 @@ read_config_file(const std::string &fn)
                            && conf->parms.size() == 1) {
 			options.keepalive = strtoul(conf->parms[0].c_str(),
                                                     0, 0);
+		} else if (conf->keyword == "Prefork"
+                           && conf->parms.size() == 1) {
+			options.prefork = strtoul(conf->parms[0].c_str(),
+                                                  0, 0);
+		} else if (conf->keyword == "PreforkMinSpare"
+                           && conf->parms.size() == 1) {
+			options.prefork_min_spare =
+                                strtoul(conf->parms[0].c_str(), 0, 0);
+		} else if (conf->keyword == "AuthBeforeFork"
+                           && conf->parms.size() == 1) {
+			options.auth_before_fork = conf->parms[0] == "on";
+		} else if (conf->keyword == "SessionCache"
+                           && conf->parms.size() == 1) {
+			options.session_cache = strtoul(conf->parms[0].c_str(),
+                                                        NULL, 0);
+		} else if (conf->keyword == "SessionLifetime"
+                           && conf->parms.size() == 1) {
+			options.session_lifetime =
+                                strtoul(conf->parms[0].c_str(), NULL, 0);
+		} else if (conf->keyword == "SessionTickets"
+                           && conf->parms.size() == 1) {
+			options.session_tickets = conf->parms[0] == "on";
+		} else if (conf->keyword == "TicketKeyLifetime"
+                           && conf->parms.size() == 1) {
+			options.ticket_key_lifetime =
+                                strtoul(conf->parms[0].c_str(), NULL, 0);
+		} else if (conf->keyword == "EarlyData"
+                           && conf->parms.size() == 1) {
+			options.early_data = strtoul(conf->parms[0].c_str(),
+                                                     NULL, 0);
+		} else if (conf->keyword == "PeerCache"
+                           && conf->parms.size() == 1) {
+			options.peer_cache = strtoul(conf->parms[0].c_str(),
+                                                     NULL, 0);
+		} else if (conf->keyword == "KernelTLS"
+                           && conf->parms.size() == 1) {
+			options.kernel_tls = conf->parms[0] == "on";
+		} else if (conf->keyword == "SmallRecordSize"
+                           && conf->parms.size() == 1) {
+			options.record_small = strtoul(conf->parms[0].c_str(),
+                                                       NULL, 0);
+		} else if (conf->keyword == "RecordBoost"
+                           && conf->parms.size() == 1) {
+			options.record_boost = strtoul(conf->parms[0].c_str(),
+                                                       NULL, 0);
+		} else if (conf->keyword == "RecordIdle"
+                           && conf->parms.size() == 1) {
+			options.record_idle = strtoul(conf->parms[0].c_str(),
+                                                      NULL, 0);
+		} else if (conf->keyword == "IdleTimeout"
+                           && conf->parms.size() == 1) {
+			options.idle_timeout = strtoul(conf->parms[0].c_str(),
+                                                       NULL, 0);
+		} else if (conf->keyword == "SessionBuffer"
+                           && conf->parms.size() == 1) {
+			options.session_buffer = strtoul(conf->parms[0].c_str(),
+                                                         NULL, 0);
+		} else if (conf->keyword == "PreforkMaxSpare"
+                           && conf->parms.size() == 1) {
+			options.prefork_max_spare =
+                                strtoul(conf->parms[0].c_str(), 0, 0);
 		} else if (conf->keyword == "CertFile"
                            && conf->parms.size() == 1) {
 			options.certfile = conf->parms[0];
+		} else if (conf->keyword == "EcdsaCertFile"
+                           && conf->parms.size() == 1) {
+			options.ecdsa_certfile = conf->parms[0];
+		} else if (conf->keyword == "EcdsaKeyFile"
+                           && conf->parms.size() == 1) {
+			options.ecdsa_keyfile = conf->parms[0];
 		} else if (conf->keyword == "CipherList"
                            && conf->parms.size() == 1) {
 			options.cipher_list = conf->parms[0];
+		} else if (conf->keyword == "ServerCipherPreference"
+                           && conf->parms.size() == 1) {
+			options.server_cipher_preference = conf->parms[0] == "on";
+		} else if (conf->keyword == "Groups"
+                           && conf->parms.size() == 1) {
+			options.groups = conf->parms[0];
+		} else if (conf->keyword == "DHParamsFile"
+                           && conf->parms.size() == 1) {
+			options.dhparams_file = conf->parms[0];
 		} else if (conf->keyword == "-include"
                            && conf->parms.size() == 1) {
 			try {
@@ -285,6 +1283,9 @@ parse_options(int argc, char * const *argv)
 		} else if (!strcmp(argv[c], "--copying")) {
 			print_copying();
 			exit(0);
+		} else if (!strcmp(argv[c], "--cipher-bench")) {
+			cipher_bench();
+			exit(0);
 		} else if (!strcmp(argv[c], "-c")) {
                         if (c + 1 != argc) {
                                 options.config = argv[++c];
@@ -293,8 +1294,10 @@ parse_options(int argc, char * const *argv)
                         options.daemon = false;
 		}
 	}
-        if (!options.daemon) {
+        static bool tty_attached = false;
+        if (!options.daemon && !tty_attached) {
                 logger->attach(new FileLogger("/dev/tty"), true);
+                tty_attached = true;
         }
 
 	try {
@@ -307,6 +1310,7 @@ parse_options(int argc, char * const *argv)
 	}
 
 	int opt;
+        optind = 1;  // may be called again on SIGHUP
 	while ((opt = getopt(argc, argv, "c:fhvV")) != -1) {
 		switch (opt) {
 		case 'c':
@@ -329,6 +1333,350 @@ parse_options(int argc, char * const *argv)
 	}
 }
 
+/**
+ * Create and build the SSL context that all connections will use.
+ *
+ * Run as: root
+ *
+ * Loads the cert and key (possibly through an engine) and the ECDSA
+ * ones if configured, the client CAs, the cipher list and the key
+ * exchange parameters. Called once at startup so that sslprocs only
+ * have to do the handshake.
+ *
+ * @return Newly built context
+ */
+SSLContext*
+new_ssl_context()
+{
+        std::auto_ptr<SSLContext> ctx(new SSLContext());
+
+        ctx->set_crlfile(options.clientcrl);
+        if (!options.clientcrl.empty()) {
+                ctx->set_crl_index(&crl_index);
+        }
+        ctx->set_cipher_list(options.cipher_list);
+        ctx->set_server_preference(options.server_cipher_preference);
+        ctx->set_groups(options.groups);
+        ctx->set_dhparams_file(options.dhparams_file);
+        ctx->set_capath(options.clientcapath);
+        ctx->set_cafile(options.clientcafile);
+        ctx->set_certfile(options.certfile);
+        ctx->set_keyfile(options.keyfile);
+        if (!options.ecdsa_certfile.empty()) {
+                ctx->add_cert(options.ecdsa_certfile, options.ecdsa_keyfile);
+        }
+        ctx->set_ocsp_staple_file(options.ocsp_staple_file);
+        if (options.privkey_engine.first) {
+                ctx->set_privkey_engine(options.privkey_engine.second);
+        }
+        ctx->set_privkey_engine_conf(options.privkey_engine_pre,
+                                     options.privkey_engine_post);
+        ctx->set_max_early_data(options.early_data);
+        ctx->set_ktls(options.kernel_tls);
+        if (peer_cache.valid()) {
+                ctx->set_peer_cache(&peer_cache);
+        }
+        ctx->build(true);
+        session_cache.install(ctx->get());
+        return ctx.release();
+}
+
+/**
+ * Run as: root
+ *
+ * Fill in defaults that depend on other options.
+ */
+void
+fixup_options()
+{
+        if (options.listen.empty()) {
+                options.listen.push_back(DEFAULT_LISTEN);
+        }
+        if (!options.listen_processes) {
+                options.listen_processes = 1;
+        }
+#ifndef SO_REUSEPORT
+        if (options.listen_processes > 1) {
+                logger->warning("ListenProcesses needs SO_REUSEPORT, "
+                                "running only one listener");
+                options.listen_processes = 1;
+        }
+#endif
+}
+
+/**
+ * Run as: root
+ *
+ * Set log level from options.verbose
+ */
+void
+apply_verbose()
+{
+        if (options.verbose) {
+                logger->set_logmask(logger->get_logmask()
+                                    | LOG_MASK(LOG_DEBUG));
+        } else {
+                logger->set_logmask(logger->get_logmask()
+                                    & ~LOG_MASK(LOG_DEBUG));
+        }
+}
+
+/**
+ * Run as: root
+ *
+ * Reload config on SIGHUP.
+ *
+ * Re-reads the config file and re-applies the original command line,
+ * then builds a new SSL context (cert, key, CAs) and CRL table. Only if all of
+ * that worked are the new options and context swapped in. Otherwise
+ * the old ones are kept.
+ *
+ * Idle pre-forked workers were forked with the old config, so they are
+ * retired and the pool refills with new ones. Client certs in the peer
+ * cache were verified against the old CAs and CRLs, so it's flushed.
+ * sslprocs that already have a connection are not touched.
+ *
+ * Options about the listen sockets themselves can't change without a
+ * restart and keep their old value.
+ */
+void
+reload()
+{
+        size_t c;
+
+        // other listener processes do their own reload
+        for (c = 0; c < listen_procs.size(); c++) {
+                kill(listen_procs[c], SIGHUP);
+        }
+
+        logger->info("SIGHUP: reloading config");
+        const Options old(options);
+        SSLContext *newctx;
+        CRLIndex crl;
+        try {
+                options = Options();
+                parse_options(saved_argc, saved_argv);
+                fixup_options();
+                if (!options.clientcrl.empty()) {
+                        crl.create(options.clientcrl, options.clientcafile,
+                                   options.clientcapath);
+                }
+                newctx = new_ssl_context();
+        } catch (const Err::ErrBase &e) {
+                options = old;
+                logger->err("Reload failed, keeping old config: %s",
+                            e.what_verbose().c_str());
+                return;
+        } catch (const std::exception &e) {
+                options = old;
+                logger->err("Reload failed, keeping old config: %s",
+                            e.what());
+                return;
+        }
+
+        if (options.listen != old.listen
+            || options.port != old.port
+            || options.af != old.af
+            || options.listen_backlog != old.listen_backlog
+            || options.listen_processes != old.listen_processes) {
+                logger->warning("Listen, Port, ListenBacklog and "
+                                "ListenProcesses changes need a restart");
+        }
+        if (options.session_cache != old.session_cache
+            || options.session_lifetime != old.session_lifetime
+            || options.session_tickets != old.session_tickets
+            || options.ticket_key_lifetime != old.ticket_key_lifetime
+            || options.early_data != old.early_data
+            || options.peer_cache != old.peer_cache) {
+                logger->warning("SessionCache, SessionLifetime, "
+                                "SessionTickets, TicketKeyLifetime, "
+                                "EarlyData and PeerCache changes need a "
+                                "restart");
+        }
+        options.session_cache = old.session_cache;
+        options.session_lifetime = old.session_lifetime;
+        options.session_tickets = old.session_tickets;
+        options.ticket_key_lifetime = old.ticket_key_lifetime;
+        options.early_data = old.early_data;
+        options.peer_cache = old.peer_cache;
+        options.listen = old.listen;
+        options.port = old.port;
+        options.af = old.af;
+        options.listen_backlog = old.listen_backlog;
+        options.listen_processes = old.listen_processes;
+        options.daemon = old.daemon;
+
+        frontend.retire(ssl_ctx);
+        ssl_ctx = newctx;
+        crl_index.swap(crl);
+        peer_cache.flush();
+
+        apply_verbose();
+        setup_ratelimit(&old);
+        pool.close_fds();
+        logger->info("Reloaded config %s", options.config.c_str());
+}
+
+/**
+ * Run as: root
+ *
+ * Hand the listen sockets over to a new binary on SIGUSR2.
+ *
+ * The new binary is started with the original command line and
+ * inherits the listen sockets. Connections keep queueing in their
+ * backlog while it starts up. Once it writes to the ready pipe this
+ * listener exits, together with its other listener processes. Their
+ * SO_REUSEPORT sockets are not handed over, so with ListenProcesses
+ * connections in their backlog at that moment are lost.
+ *
+ * This only starts the new binary. The listener keeps serving while
+ * it starts up, and check_upgrade() waits for the ready pipe from the
+ * listen loop. If the new binary exits or doesn't say it's ready
+ * within UPGRADE_TIMEOUT seconds the old listener keeps running.
+ */
+void
+upgrade()
+{
+        std::string fds;
+        int ready[2];
+        pid_t pid;
+        size_t c;
+
+        if (upgrade_ready.valid()) {
+                logger->warning("SIGUSR2: already waiting for pid %d",
+                                upgrade_pid);
+                return;
+        }
+        logger->info("SIGUSR2: handing listen sockets to %s",
+                     exe_path.c_str());
+        for (c = 0; c < listen_socks.size(); c++) {
+                fds += xsprintf("%s%d", c ? "," : "",
+                                listen_socks[c]->getfd());
+        }
+        if (pipe(ready)) {
+                logger->err("pipe(): %s", strerror(errno));
+                return;
+        }
+
+        pid = fork();
+        if (0 > pid) {
+                logger->err("fork(): %s", strerror(errno));
+                close(ready[0]);
+                close(ready[1]);
+                return;
+        }
+        if (!pid) {
+                close(ready[0]);
+                pool.close_fds();
+                handshakes_t::iterator hitr;
+                for (hitr = handshakes.begin();
+                     hitr != handshakes.end();
+                     ++hitr) {
+                        close(hitr->status);
+                }
+                try {
+                        for (c = 0; c < listen_socks.size(); c++) {
+                                listen_socks[c]->set_close_on_exec(false);
+                        }
+                } catch (const Err::ErrBase &e) {
+                        logger->err("%s", e.what());
+                        _exit(1);
+                }
+                setenv(ENV_LISTEN_FDS, fds.c_str(), 1);
+                setenv(ENV_READY_FD, xsprintf("%d", ready[1]).c_str(), 1);
+                execv(exe_path.c_str(), saved_argv);
+                logger->err("execv(%s): %s",
+                            exe_path.c_str(), strerror(errno));
+                _exit(1);
+        }
+        close(ready[1]);
+        upgrade_ready.set(ready[0]);
+        upgrade_ready.set_close_on_exec(true);
+        upgrade_pid = pid;
+        upgrade_deadline = clock_get_dbl() + UPGRADE_TIMEOUT;
+}
+
+/**
+ * Run as: root
+ *
+ * Finish or give up an upgrade() once the new binary has written to
+ * the ready pipe, closed it or run out of time. The new binary doesn't
+ * daemon(), so upgrade_pid is still the new listener.
+ *
+ * @param[in] readable  The ready pipe polled readable
+ * @param[in] now       clock_get_dbl()
+ */
+void
+check_upgrade(bool readable, double now)
+{
+        if (!upgrade_ready.valid()) {
+                return;
+        }
+        if (readable) {
+                char ch;
+                if (1 == read(upgrade_ready.get(), &ch, 1)) {
+                        logger->info("New listener %d is up, old listener "
+                                     "%d exiting", upgrade_pid, getpid());
+                        for (size_t c = 0; c < listen_procs.size(); c++) {
+                                kill(listen_procs[c], SIGINT);
+                        }
+                        pool.close_fds();
+                        exit(0);
+                }
+                // EOF: it exited without getting that far
+        } else if (now < upgrade_deadline) {
+                return;
+        } else {
+                kill(upgrade_pid, SIGTERM);
+        }
+        upgrade_ready.close();
+        logger->err("New binary %s didn't start listening, "
+                    "old listener keeps running", exe_path.c_str());
+}
+
+/**
+ * Run as: root
+ *
+ * Tell the listener that started us on SIGUSR2 that we're listening.
+ */
+void
+signal_ready()
+{
+        if (0 > ready_fd) {
+                return;
+        }
+        if (1 != write(ready_fd, "1", 1)) {
+                logger->warning("Writing to ready pipe: %s",
+                                strerror(errno));
+        }
+        close(ready_fd);
+        ready_fd = -1;
+}
+
+/**
+ * Run as: root
+ *
+ * Absolute path of our own binary, to be exec()ed on SIGUSR2. Looked
+ * up at startup since we chdir("/") and the file may be replaced.
+ */
+std::string
+find_exe_path(const char *arg0)
+{
+        char buf[PATH_MAX];
+        if (strchr(arg0, '/')) {
+                if (realpath(arg0, buf)) {
+                        return buf;
+                }
+        } else {
+                ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+                if (0 < n) {
+                        buf[n] = 0;
+                        return buf;
+                }
+        }
+        return arg0;
+}
+
 END_NAMESPACE(tlsshd);
 
 BEGIN_LOCAL_NAMESPACE()
@@ -336,8 +1684,6 @@ BEGIN_LOCAL_NAMESPACE()
 using namespace tlsshd;
 /**
  * wrapped main() so that we don't have to handle exceptions in this main()
- *
- * @todo Only listen to options.listen
  */
 int
 main2(int argc, char * const argv[])
@@ -354,19 +1700,53 @@ main2(int argc, char * const argv[])
                 THROW(Err::ErrBase, "signal(SIGINT, sigint)");
         }
 
+        if (SIG_ERR == signal(SIGUSR1, sigusr1)) {
+                THROW(Err::ErrBase, "signal(SIGUSR1, sigusr1)");
+        }
+
+        if (SIG_ERR == signal(SIGHUP, sighup)) {
+                THROW(Err::ErrBase, "signal(SIGHUP, sighup)");
+        }
+
+        if (SIG_ERR == signal(SIGUSR2, sigusr2)) {
+                THROW(Err::ErrBase, "signal(SIGUSR2, sigusr2)");
+        }
+
+        saved_argc = argc;
+        saved_argv = argv;
+        exe_path = find_exe_path(argv[0]);
+        if (const char *rfd = getenv(ENV_READY_FD)) {
+                ready_fd = atoi(rfd);
+                unsetenv(ENV_READY_FD);
+        }
 	parse_options(argc, argv);
-        if (options.verbose) {
-                logger->set_logmask(logger->get_logmask()
-                                    | LOG_MASK(LOG_DEBUG));
+        apply_verbose();
+        fixup_options();
+	listen_all();
+        // early data needs single use sessions, or it could be replayed
+        session_cache.create(options.session_cache,
+                             options.session_lifetime,
+                             options.session_tickets,
+                             options.ticket_key_lifetime,
+                             options.early_data > 0);
+        if (!options.clientcrl.empty()) {
+                crl_index.create(options.clientcrl, options.clientcafile,
+                                 options.clientcapath);
         }
-        //tlsshd::listen.set_tcp_md5(options.tcp_md5);
-	tlsshd::listen.listen(options.af, options.listen, options.port);
+        peer_cache.create(options.peer_cache);
+
+        ssl_ctx = new_ssl_context();
 
-        if (options.daemon) {
+        // a new binary started on SIGUSR2 is already detached, and the
+        // old listener needs its pid to be the one it started
+        if (options.daemon && 0 > ready_fd) {
                 if (daemon(0, 0)) {
                         THROW(Err::ErrSys, "daemon(0, 0)");
                 }
         }
+        signal_ready();
+        fork_listeners();
+        setup_ratelimit(NULL);
 	return listen_loop();
 }
 END_LOCAL_NAMESPACE()
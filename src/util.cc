@@ -9,6 +9,10 @@
 #include<cstdio>
 #include<utility>
 
+#include<sys/types.h>
+#include<sys/socket.h>
+#include<sys/uio.h>
+
 #include"mywordexp.h"
 #include"util2.h"
 #include"xgetpwnam.h"
@@ -334,6 +338,89 @@ gnustyle_basename(const char *fn)
         return p ? p + 1 : (char *)fn;
 }
 
+/** Pass a file descriptor to another process over a unix socket
+ *
+ * @param[in] sock  Connected AF_UNIX socket
+ * @param[in] fd    File descriptor to pass. Caller still owns it.
+ */
+void
+xsend_fd(int sock, int fd)
+{
+        struct msghdr msg;
+        struct iovec iov;
+        struct cmsghdr *cmsg;
+        char byte = 0;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+        if (1 != sendmsg(sock, &msg, 0)) {
+                THROW(Err::ErrSys, "sendmsg(SCM_RIGHTS)");
+        }
+}
+
+/** Receive a file descriptor sent with xsend_fd()
+ *
+ * @param[in] sock  Connected AF_UNIX socket
+ * @return          Received file descriptor, or -1 if the peer closed the
+ *                  socket without sending one.
+ */
+int
+xrecv_fd(int sock)
+{
+        struct msghdr msg;
+        struct iovec iov;
+        struct cmsghdr *cmsg;
+        char byte;
+        ssize_t n;
+        int fd = -1;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        do {
+                n = recvmsg(sock, &msg, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+                THROW(Err::ErrSys, "recvmsg(SCM_RIGHTS)");
+        }
+        if (n == 0) {
+                return -1;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET
+                    && cmsg->cmsg_type == SCM_RIGHTS) {
+                        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+                }
+        }
+        return fd;
+}
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
@@ -135,6 +135,9 @@ std::string xvsprintf(const char *fmt, va_list ap);
 
 char *gnustyle_basename(const char *filename);
 
+void xsend_fd(int sock, int fd);
+int xrecv_fd(int sock);
+
 extern "C" {
 #ifndef HAVE_CFMAKERAW
         void cfmakeraw(struct termios *termios_p);